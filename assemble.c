@@ -0,0 +1,138 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "assemble.h"
+#include "parser.h"
+
+int assemble_chunk(char *pos, char *end, emitter *em, const char *input_file, long *line, FILE *log) {
+	do {
+		em->line = *line;
+		char *err = parse_line(&pos, em);
+		if (err) {
+			fprintf(log, "%s:%ld: %s\n", input_file, *line, err);
+			return 1;
+		}
+		(*line)++;
+		pos++;
+	} while (pos < end);
+	return 0;
+}
+
+static void release_input(void *in) {
+	input_close(in);
+}
+
+int assemble_file(char *input_file, emitter *em, enum input_strategy strategy, input_stream *stream, FILE *log) {
+	// "-" reads from stdin, so the assembler can sit at the end of a pipe
+	int input_fd;
+	if (strcmp(input_file, "-") == 0) {
+		input_file = "<stdin>";
+		input_fd = STDIN_FILENO;
+	} else {
+		input_fd = open(input_file, O_RDONLY);
+		if (input_fd == -1) {
+			fprintf(log, "Failed to open %s: %s\n", input_file, strerror(errno));
+			return 1;
+		}
+	}
+	struct stat sb;
+	if (fstat(input_fd, &sb)) {
+		fprintf(log, "Failed to stat %s: %s\n", input_file, strerror(errno));
+		close(input_fd);
+		return 1;
+	}
+	if (S_ISREG(sb.st_mode) && sb.st_size == 0) {
+		fprintf(log, "%s is completely empty!\n", input_file);
+		close(input_fd);
+		return 1;
+	}
+	input in;
+	int failed = 0;
+	char *in_err = input_open(&in, input_fd, &sb, strategy, stream);
+	emitter_hold(em, release_input, &in);
+	if (in_err) {
+		fprintf(log, "Failed to read %s: %s\n", input_file, in_err);
+		failed = 1;
+	}
+	long line = 1;
+	while (!failed) {
+		char *begin, *end;
+		char *err = input_next(&in, &begin, &end);
+		if (err) {
+			fprintf(log, "Failed to read %s: %s\n", input_file, err);
+			failed = 1;
+		} else if (!begin) {
+			break;
+		} else {
+			failed = assemble_chunk(begin, end, em, input_file, &line, log);
+		}
+	}
+	emitter_let_go(em, &in);
+	input_close(&in);
+	return failed;
+}
+
+int layout_and_finish(emitter *em, const layout_options *lo, const char *input_name, FILE *log) {
+	const uint64_t pagesize = 0x1000;
+	if (!em->relocatable) {
+		// .text's vaddr is where its first byte ends up, which in an
+		// ELF is after the headers mapped in front of it
+		// flat formats put .text there too, so addresses are the same
+		// across formats
+		em->section[SECT_TEXT].vaddr = lo->text_vaddr + elf_headers_size(em, &lo->elf);
+		em->section[SECT_DATA].vaddr = lo->data_vaddr;
+		// with an automatic layout, .data goes on the page after .text
+		// ends, at the same offset into the page as it has in the file,
+		// so the file isn't padded out to a page boundary, and a small
+		// program is a single page on disk
+		if (lo->auto_layout) {
+			uint64_t text_end = lo->text_vaddr + elf_text_segment_size(em, &lo->elf);
+			em->section[SECT_DATA].vaddr = roundup(text_end, pagesize) + (roundup(text_end, 16) & (pagesize - 1));
+		}
+	}
+	return finish_and_report(em, input_name, log);
+}
+
+int finish_and_report(emitter *em, const char *input_name, FILE *log) {
+	string name;
+	switch (emitter_finish(em, &name)) {
+	case FINISH_UNDEFINED:
+		fprintf(log, "%s: undefined label %.*s\n", input_name, (int) name.len, name.begin);
+		return 1;
+	case FINISH_RANGE:
+		// labels local to one of several inputs have no name by now
+		if (name.len == 0)
+			name = (string) { .begin = "a local label", .len = 13 };
+		fprintf(log, "%s: a .word, branch or jump can't reach %.*s\n", input_name, (int) name.len, name.begin);
+		return 1;
+	}
+	return 0;
+}
+
+const char *const output_format_names[N_OUT_FORMATS] = {
+	[OUT_ELF] = "elf",
+	[OUT_BIN] = "bin",
+	[OUT_IHEX] = "ihex",
+	[OUT_SREC] = "srec",
+};
+
+int write_format(enum output_format format, emitter *em, output *out, const elf_options *elf, uint8_t gap_fill) {
+	switch (format) {
+	case OUT_ELF:
+		return emitter_output_elf(em, out, elf);
+	case OUT_BIN:
+		return emitter_output_bin(em, out, gap_fill);
+	case OUT_IHEX:
+		return emitter_output_ihex(em, out);
+	case OUT_SREC:
+		return emitter_output_srec(em, out);
+	default:
+		assert(0);
+	}
+}
+
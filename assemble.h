@@ -0,0 +1,53 @@
+#ifndef ASSEMBLE_H
+#define ASSEMBLE_H
+
+#include <stdio.h>
+
+#include "emitter.h"
+#include "input.h"
+
+// what the CLI and libasm share of taking a program from source to an image
+
+// parses every line in [pos, end), where end[-1] is a '\n'
+// returns 0 on success, otherwise prints the error to log and returns 1
+extern int assemble_chunk(char *pos, char *end, emitter *em, const char *input_file, long *line, FILE *log);
+
+// assembles all of input_file into em
+// stream is passed on to input_open
+// returns 0 on success, otherwise prints the error to log and returns 1
+extern int assemble_file(char *input_file, emitter *em, enum input_strategy strategy, input_stream *stream, FILE *log);
+
+// where sections go once everything is assembled
+typedef struct {
+	uint64_t text_vaddr;
+	uint64_t data_vaddr;
+	int auto_layout;
+	elf_options elf;
+} layout_options;
+
+// gives em's sections their final vaddrs, unless it's an object, then patches
+// everything that was waiting on them
+// returns 0 on success, otherwise prints the error to log and returns 1
+extern int layout_and_finish(emitter *em, const layout_options *lo, const char *input_name, FILE *log);
+
+// emitter_finish, for sections that already have their vaddrs
+// returns like layout_and_finish
+extern int finish_and_report(emitter *em, const char *input_name, FILE *log);
+
+enum output_format {
+	OUT_ELF,
+	OUT_BIN,
+	OUT_IHEX,
+	OUT_SREC,
+
+	N_OUT_FORMATS,
+};
+
+// what each format is called, in the cache and by libasm
+extern const char *const output_format_names[N_OUT_FORMATS];
+
+// writes em to out in format
+// returns 0 on success, otherwise returns nonzero and sets errno
+extern int write_format(enum output_format format, emitter *em, output *out, const elf_options *elf, uint8_t gap_fill);
+
+#endif
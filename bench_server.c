@@ -0,0 +1,131 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server.h"
+
+// compares how long one small input takes to assemble with asm run directly,
+// with asmc and a server, and with just a request to the server, which is
+// what's left once asmc's own start is taken out
+// usage: ./bench_server [input] [runs]
+// run from the directory asm and asmc were built in
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// runs argv to completion, with its output thrown away
+static void spawn(char **argv) {
+	pid_t pid = fork();
+	if (pid == -1) {
+		printf("Failed to fork: %s\n", strerror(errno));
+		exit(1);
+	}
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		printf("%s failed\n", argv[0]);
+		exit(1);
+	}
+}
+
+// microseconds per run of argv
+static double time_spawn(char **argv, long runs) {
+	double start = now();
+	for (long i = 0; i < runs; i++)
+		spawn(argv);
+	return (now() - start) * 1e6 / runs;
+}
+
+// microseconds per request to the server at path, from this process
+static double time_requests(const char *path, char **argv, long runs) {
+	int argc = 0;
+	while (argv[argc])
+		argc++;
+	// the server prints to whatever stdout it's sent
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	int null = open("/dev/null", O_WRONLY);
+	dup2(null, STDOUT_FILENO);
+	close(null);
+	double start = now();
+	for (long i = 0; i < runs; i++) {
+		int sock = server_connect(path);
+		int status;
+		if (sock == -1 || server_send(sock, argc, argv, &status) || status) {
+			dup2(saved, STDOUT_FILENO);
+			printf("The request to %s failed\n", path);
+			exit(1);
+		}
+		close(sock);
+	}
+	double us = (now() - start) * 1e6 / runs;
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	return us;
+}
+
+int main(int argc, char **argv) {
+	char *input = argc > 1 ? argv[1] : "examples/hello.s";
+	long runs = argc > 2 ? atol(argv[2]) : 1000;
+	if (runs <= 0) {
+		printf("Runs must be positive.\n");
+		return 1;
+	}
+	char path[64], output[64];
+	snprintf(path, sizeof path, "/tmp/bench_server.%d.sock", getpid());
+	snprintf(output, sizeof output, "/tmp/bench_server.%d.out", getpid());
+	setenv("ASM_SERVER", path, 1);
+
+	pid_t server = fork();
+	if (server == -1) {
+		printf("Failed to fork: %s\n", strerror(errno));
+		return 1;
+	}
+	if (server == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		execl("./asm", "./asm", "--server", path, (char *) NULL);
+		_exit(127);
+	}
+	int sock = -1;
+	for (int tries = 0; tries < 1000 && sock == -1; tries++) {
+		sock = server_connect(path);
+		if (sock == -1)
+			usleep(1000);
+	}
+	if (sock == -1) {
+		printf("The server never started listening on %s\n", path);
+		kill(server, SIGTERM);
+		return 1;
+	}
+	close(sock);
+
+	char *direct[] = {"./asm", input, "-o", output, NULL};
+	char *client[] = {"./asmc", input, "-o", output, NULL};
+	double direct_us = time_spawn(direct, runs);
+	double client_us = time_spawn(client, runs);
+	double request_us = time_requests(path, client, runs);
+	printf("%s, %ld runs each, per file:\n", input, runs);
+	printf("  asm         %8.1fus\n", direct_us);
+	printf("  asmc        %8.1fus  %.1fx\n", client_us, direct_us / client_us);
+	printf("  request     %8.1fus  %.1fx\n", request_us, direct_us / request_us);
+
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	unlink(output);
+	return 0;
+}
@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "hash.h"
+#include "output.h"
+
+// the key is two hashes of everything, with different seeds, since a
+// collision means handing out the wrong program
+static const uint64_t seeds[2] = { 0, 0x9e3779b97f4a7c15 };
+
+// once the cache is past its size, entries are evicted until it's down to
+// this fraction of it, so eviction isn't needed again right away
+#define CACHE_EVICT_TO 0.9
+
+void cache_key(cache *c, const void *data, size_t len) {
+	for (int i = 0; i < 2; i++)
+		c->key[i] = hash_combine(c->key[i], xxh64(data, len, seeds[i]));
+}
+
+int cache_key_file(cache *c, const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat sb;
+	if (fd == -1 || fstat(fd, &sb)) {
+		int err = errno;
+		if (fd != -1)
+			close(fd);
+		errno = err;
+		return -1;
+	}
+	void *data = NULL;
+	if (sb.st_size > 0) {
+		data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			int err = errno;
+			close(fd);
+			errno = err;
+			return -1;
+		}
+	}
+	close(fd);
+	cache_key(c, data, sb.st_size);
+	if (data)
+		munmap(data, sb.st_size);
+	return 0;
+}
+
+int cache_init(cache *c, const char *dir, uint64_t max_size) {
+	// a new build of the assembler may assemble the same input
+	// differently, so its own bytes are part of the key
+	// they're only hashed once, for a server's sake
+	static uint64_t exe[2];
+	static int exe_hashed;
+	c->dir = dir;
+	c->max_size = max_size;
+	if (!exe_hashed) {
+		cache self = {0};
+		if (cache_key_file(&self, "/proc/self/exe"))
+			return -1;
+		exe[0] = self.key[0];
+		exe[1] = self.key[1];
+		exe_hashed = 1;
+	}
+	c->key[0] = exe[0];
+	c->key[1] = exe[1];
+	return 0;
+}
+
+static int cache_entry_path(cache *c, const char *format, char *path) {
+	int len = snprintf(
+		path, PATH_MAX, "%s/%02x/%016lx%016lx.%s",
+		c->dir, (unsigned) (c->key[0] >> 56), c->key[0], c->key[1], format
+	);
+	if (len >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+// copies all of src into dst, which is empty
+static int cache_copy(int src, int dst) {
+	struct stat sb;
+	if (fstat(src, &sb))
+		return -1;
+	// a reflink shares src's blocks rather than copying them
+	if (ioctl(dst, FICLONE, src) == 0)
+		return 0;
+	if (copy_sparse(src, 0, dst, sb.st_size))
+		return -1;
+	// a hole at the end isn't copied, so the size is set explicitly
+	return ftruncate(dst, sb.st_size);
+}
+
+typedef struct {
+	char *path;
+	struct timespec used;
+	uint64_t size;
+} cache_entry;
+
+static int cache_compare_used(const void *a, const void *b) {
+	const struct timespec *x = &((const cache_entry *) a)->used, *y = &((const cache_entry *) b)->used;
+	if (x->tv_sec != y->tv_sec)
+		return (x->tv_sec > y->tv_sec) - (x->tv_sec < y->tv_sec);
+	return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+static void cache_free_entries(cache_entry *entries, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		free(entries[i].path);
+	free(entries);
+}
+
+// removes the least recently used entries until what's left fits, and sets
+// *left to the size of what's left, which is counted from scratch so anything
+// lost track of is corrected
+// an entry's mtime is when it was last stored or hit
+static int cache_evict(const char *dir, uint64_t max_size, uint64_t *left) {
+	cache_entry *entries = NULL;
+	size_t n = 0, cap = 0;
+	uint64_t total = 0;
+	for (int sub = 0; sub < 256; sub++) {
+		char sub_path[PATH_MAX];
+		snprintf(sub_path, sizeof sub_path, "%s/%02x", dir, sub);
+		DIR *d = opendir(sub_path);
+		if (!d)
+			continue;
+		struct dirent *ent;
+		while ((ent = readdir(d))) {
+			struct stat sb;
+			// temporary files left by a store that never finished
+			// are counted too, and as the oldest they go first
+			if (fstatat(dirfd(d), ent->d_name, &sb, 0) || !S_ISREG(sb.st_mode))
+				continue;
+			cache_entry *more = entries;
+			if (n == cap) {
+				cap = cap ? 2 * cap : 256;
+				more = realloc(entries, cap * sizeof *entries);
+			}
+			if (!more || asprintf(&more[n].path, "%s/%s", sub_path, ent->d_name) < 0) {
+				closedir(d);
+				cache_free_entries(more ? more : entries, n);
+				errno = ENOMEM;
+				return -1;
+			}
+			entries = more;
+			entries[n].used = sb.st_mtim;
+			// what the entry takes on disk, so holes aren't counted
+			entries[n].size = sb.st_blocks * 512;
+			total += entries[n].size;
+			n++;
+		}
+		closedir(d);
+	}
+	qsort(entries, n, sizeof *entries, cache_compare_used);
+	uint64_t target = max_size * CACHE_EVICT_TO;
+	for (size_t i = 0; i < n; i++) {
+		if (total > target && unlink(entries[i].path) == 0)
+			total -= entries[i].size;
+	}
+	cache_free_entries(entries, n);
+	*left = total;
+	return 0;
+}
+
+typedef struct {
+	uint64_t hits, misses;
+	uint64_t size; // of every entry, as far as this has kept track
+} cache_stats;
+
+// opens dir/stats, creating it and dir if need be, and locks it
+static int cache_stats_open(const char *dir, int lock, cache_stats *s) {
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof path, "%s/stats", dir) >= (int) sizeof path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (mkdir(dir, 0777) && errno != EEXIST)
+		return -1;
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -1;
+	if (flock(fd, lock)) {
+		close(fd);
+		return -1;
+	}
+	char buf[128];
+	ssize_t got = pread(fd, buf, sizeof buf - 1, 0);
+	buf[got > 0 ? got : 0] = '\0';
+	memset(s, 0, sizeof *s);
+	sscanf(buf, "hits %lu\nmisses %lu\nsize %lu\n", &s->hits, &s->misses, &s->size);
+	return fd;
+}
+
+// adds to the stats, under a lock so that runs at the same time don't lose
+// counts, and evicts if the cache has grown past its size
+static int cache_update(cache *c, int hits, int misses, uint64_t added) {
+	cache_stats s;
+	int fd = cache_stats_open(c->dir, LOCK_EX, &s);
+	if (fd == -1)
+		return -1;
+	s.hits += hits;
+	s.misses += misses;
+	s.size += added;
+	if (s.size > c->max_size && cache_evict(c->dir, c->max_size, &s.size)) {
+		close(fd);
+		return -1;
+	}
+	char buf[128];
+	int len = snprintf(buf, sizeof buf, "hits %lu\nmisses %lu\nsize %lu\n", s.hits, s.misses, s.size);
+	int err = pwrite(fd, buf, len, 0) != len || ftruncate(fd, len);
+	close(fd);
+	return err ? -1 : 0;
+}
+
+int cache_fetch(cache *c, const char *const *formats, char *const *paths, size_t n, int if_changed) {
+	int *fds = malloc(n * sizeof *fds);
+	if (!fds)
+		return -1;
+	int hit = 1;
+	for (size_t i = 0; i < n; i++) {
+		char path[PATH_MAX];
+		fds[i] = -1;
+		if (!paths[i] || !hit)
+			continue;
+		if (cache_entry_path(c, formats[i], path))
+			hit = 0;
+		else if ((fds[i] = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+			hit = 0;
+	}
+	int err = 0;
+	for (size_t i = 0; i < n && hit && !err; i++) {
+		if (fds[i] == -1)
+			continue;
+		if (if_changed) {
+			output out;
+			struct stat sb;
+			int changed;
+			if (fstat(fds[i], &sb) || output_open(&out, paths[i], 1)) {
+				err = 1;
+			} else if (output_copy(&out, fds[i], 0, sb.st_size) || output_close(&out, &changed)) {
+				output_abort(&out);
+				err = 1;
+			}
+		} else {
+			int dst = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+			err = dst == -1 || cache_copy(fds[i], dst);
+			if (dst != -1)
+				close(dst);
+		}
+		// a hit makes the entry the most recently used
+		futimens(fds[i], NULL);
+	}
+	int errno_was = errno;
+	for (size_t i = 0; i < n; i++) {
+		if (fds[i] != -1)
+			close(fds[i]);
+	}
+	free(fds);
+	// failing to count is no reason to fail the run
+	cache_update(c, hit, !hit, 0);
+	errno = errno_was;
+	if (err)
+		return -1;
+	return !hit;
+}
+
+int cache_store(cache *c, const char *const *formats, char *const *paths, size_t n) {
+	uint64_t added = 0;
+	int err = 0;
+	for (size_t i = 0; i < n && !err; i++) {
+		if (!paths[i])
+			continue;
+		char path[PATH_MAX], temp[PATH_MAX + 16];
+		if (cache_entry_path(c, formats[i], path))
+			return -1;
+		// entries go in place whole, by renaming a finished temporary
+		// file over them, so a concurrent fetch never sees one half
+		// written
+		char *slash = strrchr(path, '/');
+		*slash = '\0';
+		if ((mkdir(c->dir, 0777) && errno != EEXIST) || (mkdir(path, 0777) && errno != EEXIST))
+			return -1;
+		snprintf(temp, sizeof temp, "%s/.tmp.XXXXXX", path);
+		*slash = '/';
+		int src = open(paths[i], O_RDONLY | O_CLOEXEC);
+		int dst = src == -1 ? -1 : mkostemp(temp, O_CLOEXEC);
+		struct stat sb;
+		err = (
+			dst == -1
+			|| cache_copy(src, dst)
+			|| fchmod(dst, 0644)
+			|| fstat(dst, &sb)
+			|| rename(temp, path)
+		);
+		if (err && dst != -1)
+			unlink(temp);
+		if (!err)
+			added += sb.st_blocks * 512;
+		if (src != -1)
+			close(src);
+		if (dst != -1)
+			close(dst);
+	}
+	int errno_was = errno;
+	if (cache_update(c, 0, 0, added) && !err)
+		return -1;
+	errno = errno_was;
+	return err ? -1 : 0;
+}
+
+int cache_print_stats(const char *dir, uint64_t max_size) {
+	cache_stats s;
+	int fd = cache_stats_open(dir, LOCK_SH, &s);
+	if (fd == -1)
+		return -1;
+	close(fd);
+	uint64_t lookups = s.hits + s.misses;
+	printf(
+		"%s: %lu hits, %lu misses, %.1f%% hit rate, %.1f of %.1f MiB used\n",
+		dir, s.hits, s.misses, lookups ? 100.0 * s.hits / lookups : 0.0,
+		s.size / 1048576.0, max_size / 1048576.0
+	);
+	return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// --cache keeps finished images in a directory, keyed by a hash of the
+// assembler itself, the options and every input's bytes, so an input that
+// was assembled before with the same options is copied out of the cache
+// rather than assembled again
+// an entry is a file per output format, at dir/xx/<key>.<format>, and hits
+// share the entry's blocks with the output where the file system allows
+// entries are evicted least recently used first once the cache grows past its
+// size, and dir/stats counts hits and misses
+typedef struct {
+	const char *dir;
+	uint64_t max_size;
+	uint64_t key[2];
+} cache;
+
+// the following return 0 on success, otherwise they return nonzero and set
+// errno
+
+// starts a key, from a hash of the assembler's own executable
+extern int cache_init(cache *c, const char *dir, uint64_t max_size);
+
+// hashes data, then the whole of the file at path, into the key
+extern void cache_key(cache *c, const void *data, size_t len);
+extern int cache_key_file(cache *c, const char *path);
+
+// writes the entry for each of the n formats whose path isn't NULL to its
+// path, which is only written if changed when if_changed is set
+// returns 1 without writing anything if any of them isn't cached, and counts
+// the hit or miss
+extern int cache_fetch(cache *c, const char *const *formats, char *const *paths, size_t n, int if_changed);
+
+// adds the file at each path that isn't NULL as the entry for its format,
+// then evicts entries until the cache fits
+extern int cache_store(cache *c, const char *const *formats, char *const *paths, size_t n);
+
+// prints how many lookups hit and how big the cache is
+extern int cache_print_stats(const char *dir, uint64_t max_size);
+
+#endif
@@ -0,0 +1,39 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "remote.h"
+
+// a stand-in for a bazel-remote style store, for trying --remote-cache out
+// with nothing but the loopback interface
+// usage: ./cache_server port dir
+// then: asm --remote-cache http://127.0.0.1:port ...
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		printf("usage: %s port dir\n", argv[0]);
+		return 1;
+	}
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int yes = 1;
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(atoi(argv[1])),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	if (
+		sock == -1
+		|| setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes)
+		|| bind(sock, (struct sockaddr *) &addr, sizeof addr)
+		|| listen(sock, SOMAXCONN)
+	) {
+		printf("Failed to listen on port %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	remote_serve(sock, argv[2]);
+	printf("Failed to serve %s: %s\n", argv[2], strerror(errno));
+	return 1;
+}
@@ -0,0 +1,30 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "server.h"
+
+// asmc takes the same arguments as asm, but has the server at $ASM_SERVER,
+// started with asm --server, do the work
+// it's kept small, since starting it is most of what a small input costs
+int main(int argc, char **argv) {
+	const char *path = getenv("ASM_SERVER");
+	if (!path) {
+		printf("ASM_SERVER must name the socket asm --server listens on.\n");
+		return 1;
+	}
+	int sock = server_connect(path);
+	if (sock == -1) {
+		printf("Failed to connect to %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	int status;
+	if (server_send(sock, argc, argv, &status)) {
+		printf("Lost the server at %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	close(sock);
+	return status;
+}
@@ -13,6 +13,9 @@ enum directive {
 	K_SPACE,
 	K_TEXT,
 	K_DATA,
+	K_SIZE,
+	K_TYPE,
+	K_GLOBL,
 
 	N_DIRECTIVES,
 };
@@ -0,0 +1,55 @@
+#ifndef DWARF_H
+#define DWARF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the few DWARF 5 constants needed for .debug_line and the compile unit
+// pointing at it, since there's no system header for them
+
+#define DW_UT_compile 0x01
+
+#define DW_TAG_compile_unit 0x11
+#define DW_CHILDREN_no 0x00
+
+#define DW_AT_stmt_list 0x10
+#define DW_AT_low_pc 0x11
+#define DW_AT_high_pc 0x12
+#define DW_AT_language 0x13
+#define DW_AT_name 0x03
+#define DW_AT_comp_dir 0x1b
+#define DW_AT_producer 0x25
+
+#define DW_FORM_addr 0x01
+#define DW_FORM_data2 0x05
+#define DW_FORM_data8 0x07
+#define DW_FORM_string 0x08
+#define DW_FORM_udata 0x0f
+#define DW_FORM_sec_offset 0x17
+
+#define DW_LANG_Mips_Assembler 0x8001
+
+#define DW_LNCT_path 0x1
+#define DW_LNCT_directory_index 0x2
+
+#define DW_LNS_copy 0x01
+#define DW_LNS_advance_pc 0x02
+#define DW_LNS_advance_line 0x03
+
+#define DW_LNE_end_sequence 0x01
+#define DW_LNE_set_address 0x02
+
+// line program parameters
+// addresses advance in bytes rather than instructions, since .byte and
+// .space can leave .text unaligned
+#define LINE_MIN_INST 1
+#define LINE_BASE (-5)
+#define LINE_RANGE 14
+#define LINE_OPCODE_BASE 13
+
+// both return the number of bytes written to dst, which is at most 10
+extern size_t uleb128(uint8_t *dst, uint64_t v);
+
+extern size_t sleb128(uint8_t *dst, int64_t v);
+
+#endif
@@ -0,0 +1,792 @@
+#include <elf.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "dwarf.h"
+#include "emitter.h"
+#include "hash.h"
+#include "output.h"
+#include "rebase.h"
+
+#define BYTESIZE(x) (sizeof(x) * (CHAR_BIT / 8))
+
+// section headers, in the order they're written
+// the ones that aren't always there come last, so the others' indices never
+// change
+enum {
+	SH_NULL,
+	SH_TEXT,
+	SH_DATA,
+	SH_SYMTAB,
+	SH_STRTAB,
+	SH_SHSTRTAB,
+	SH_BUILD_ID, // unless it's turned off
+	// only with -c, for sections with relocations
+	SH_RELA_TEXT,
+	SH_RELA_DATA,
+	// only with -g
+	SH_DEBUG_ABBREV,
+	SH_DEBUG_INFO,
+	SH_DEBUG_LINE,
+
+	N_SH,
+};
+
+static const char *const sh_names[N_SH] = {
+	[SH_NULL] = "",
+	[SH_TEXT] = ".text",
+	[SH_DATA] = ".data",
+	[SH_SYMTAB] = ".symtab",
+	[SH_STRTAB] = ".strtab",
+	[SH_SHSTRTAB] = ".shstrtab",
+	[SH_BUILD_ID] = ".note.gnu.build-id",
+	[SH_RELA_TEXT] = ".rela.text",
+	[SH_RELA_DATA] = ".rela.data",
+	[SH_DEBUG_ABBREV] = ".debug_abbrev",
+	[SH_DEBUG_INFO] = ".debug_info",
+	[SH_DEBUG_LINE] = ".debug_line",
+};
+
+// the one abbreviation, for the compile unit
+static const uint8_t debug_abbrev[] = {
+	1, DW_TAG_compile_unit, DW_CHILDREN_no,
+	DW_AT_name, DW_FORM_string,
+	DW_AT_comp_dir, DW_FORM_string,
+	DW_AT_producer, DW_FORM_string,
+	DW_AT_language, DW_FORM_data2,
+	DW_AT_stmt_list, DW_FORM_sec_offset,
+	DW_AT_low_pc, DW_FORM_addr,
+	DW_AT_high_pc, DW_FORM_data8,
+	0, 0,
+	0,
+};
+
+static const char producer[] = "riscv-assembler";
+
+// NT_GNU_BUILD_ID, which is what perf, gdb and debuginfod look up
+typedef struct {
+	Elf64_Nhdr nhdr;
+	char name[4];
+	uint8_t id[BUILD_ID_SIZE];
+} build_id_note;
+
+static const int sect_sh[N_SECTIONS] = {
+	[SECT_TEXT] = SH_TEXT,
+	[SECT_DATA] = SH_DATA,
+};
+
+static const int sect_rela_sh[N_SECTIONS] = {
+	[SECT_TEXT] = SH_RELA_TEXT,
+	[SECT_DATA] = SH_RELA_DATA,
+};
+
+static const uint32_t reloc_types[] = {
+	[ASSIGN_BTYPE] = R_RISCV_BRANCH,
+	[ASSIGN_JTYPE] = R_RISCV_JAL,
+	[ASSIGN_ABS32] = R_RISCV_32,
+	[ASSIGN_ABS64] = R_RISCV_64,
+};
+
+// where things go in the file after the loaded segments, when not stripped
+typedef struct {
+	int n_sh;
+	int shndx[N_SH]; // -1 for those that aren't there
+	uint64_t symtab, strtab, shstrtab, shdrs; // file offsets
+	uint64_t n_syms; // including the null symbol
+	uint64_t n_locals; // also including the null symbol, since locals come first
+	uint64_t strtab_size, shstrtab_size;
+	// .debug_line is its header, then the rows recorded while
+	// assembling, then tail, which ends the sequence at the end of .text
+	uint64_t debug_abbrev, debug_info, debug_line; // file offsets
+	cc_vec(uint8_t) info;
+	cc_vec(uint8_t) line_head;
+	uint8_t line_tail[1 + 10 + 3];
+	size_t line_tail_len;
+	uint64_t line_size;
+	// where low_pc is in .debug_info and .debug_line, for --rebase-table
+	size_t info_low_pc, line_low_pc;
+	uint64_t rela[N_SECTIONS]; // file offsets
+	uint64_t n_relas[N_SECTIONS];
+} elf_tables;
+
+static void put(emitter *em, cc_vec(uint8_t) *v, const void *src, size_t n) {
+	if (!cc_push_n(v, (uint8_t *) src, n))
+		emitter_panic(em, no_mem);
+}
+
+static void put_str(emitter *em, cc_vec(uint8_t) *v, const char *str) {
+	put(em, v, str, strlen(str) + 1);
+}
+
+static void elf_debug_release(void *arg) {
+	elf_tables *t = arg;
+	cc_cleanup(&t->info);
+	cc_cleanup(&t->line_head);
+}
+
+// build everything in .debug_info and .debug_line besides the rows
+// low_pc is where .text ends up
+static void elf_debug_build(emitter *em, elf_tables *t, uint64_t low_pc) {
+	uint64_t text_size = em->section[SECT_TEXT].pos;
+
+	cc_init(&t->info);
+	cc_init(&t->line_head);
+	emitter_hold(em, elf_debug_release, t);
+	uint32_t u32 = 0; // unit_length, filled in last
+	uint16_t u16 = 5;
+	uint8_t u8;
+	put(em, &t->info, &u32, 4);
+	put(em, &t->info, &u16, 2);
+	u8 = DW_UT_compile;
+	put(em, &t->info, &u8, 1);
+	u8 = 8; // address size
+	put(em, &t->info, &u8, 1);
+	put(em, &t->info, &u32, 4); // abbreviations start at 0
+	u8 = 1; // the compile unit abbreviation
+	put(em, &t->info, &u8, 1);
+	put_str(em, &t->info, em->lines.file);
+	put_str(em, &t->info, em->lines.dir);
+	put_str(em, &t->info, producer);
+	u16 = DW_LANG_Mips_Assembler;
+	put(em, &t->info, &u16, 2);
+	put(em, &t->info, &u32, 4); // the line program starts at 0
+	t->info_low_pc = cc_size(&t->info);
+	put(em, &t->info, &low_pc, 8);
+	put(em, &t->info, &text_size, 8);
+	u32 = cc_size(&t->info) - 4;
+	memcpy(cc_first(&t->info), &u32, 4);
+
+	static const uint8_t params[] = {
+		8, // address size
+		0, // segment selector size
+	};
+	static const uint8_t params2[] = {
+		LINE_MIN_INST,
+		1, // maximum operations per instruction
+		1, // default is_stmt
+		(uint8_t) LINE_BASE,
+		LINE_RANGE,
+		LINE_OPCODE_BASE,
+		// standard opcode lengths
+		0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1,
+		// directory entry format
+		1, DW_LNCT_path, DW_FORM_string,
+		1, // one directory
+	};
+	static const uint8_t file_format[] = {
+		2, DW_LNCT_path, DW_FORM_string, DW_LNCT_directory_index, DW_FORM_udata,
+		2, // file 0 is the primary source file, but the line program
+		// starts out referring to file 1, so it's listed twice
+	};
+	u32 = 0;
+	u16 = 5;
+	put(em, &t->line_head, &u32, 4); // unit_length
+	put(em, &t->line_head, &u16, 2);
+	put(em, &t->line_head, params, sizeof params);
+	put(em, &t->line_head, &u32, 4); // header_length
+	size_t header_start = cc_size(&t->line_head);
+	put(em, &t->line_head, params2, sizeof params2);
+	put_str(em, &t->line_head, em->lines.dir);
+	put(em, &t->line_head, file_format, sizeof file_format);
+	for (int i = 0; i < 2; i++) {
+		put_str(em, &t->line_head, em->lines.file);
+		u8 = 0; // directory
+		put(em, &t->line_head, &u8, 1);
+	}
+	u32 = cc_size(&t->line_head) - header_start;
+	memcpy(cc_get(&t->line_head, header_start - 4), &u32, 4);
+	uint8_t set_address[] = {0, 9, DW_LNE_set_address};
+	put(em, &t->line_head, set_address, sizeof set_address);
+	t->line_low_pc = cc_size(&t->line_head);
+	put(em, &t->line_head, &low_pc, 8);
+
+	size_t n = 0;
+	t->line_tail[n++] = DW_LNS_advance_pc;
+	n += uleb128(&t->line_tail[n], text_size - em->lines.idx);
+	t->line_tail[n++] = 0;
+	t->line_tail[n++] = 1;
+	t->line_tail[n++] = DW_LNE_end_sequence;
+	t->line_tail_len = n;
+
+	t->line_size = cc_size(&t->line_head) + em->lines.len + n;
+	u32 = t->line_size - 4;
+	memcpy(cc_first(&t->line_head), &u32, 4);
+}
+
+static void elf_debug_cleanup(emitter *em, elf_tables *t) {
+	if (t->shndx[SH_DEBUG_LINE] < 0)
+		return;
+	emitter_let_go(em, t);
+	elf_debug_release(t);
+}
+
+// only labels that were defined get symbols, besides the external ones an
+// object refers to
+static int has_symbol(emitter *em, label *l) {
+	return l->val >= 0 || (em->relocatable && l->global);
+}
+
+// lay out the symbol and section header tables starting at off
+static void elf_tables_layout(emitter *em, elf_tables *t, uint64_t off, int build_id) {
+	t->n_sh = 0;
+	t->shstrtab_size = 0;
+	for (int i = 0; i < N_SECTIONS; i++)
+		t->n_relas[i] = 0;
+	if (em->relocatable) {
+		cc_for_each(&em->relocs, reloc)
+			t->n_relas[reloc->waiter.section]++;
+	}
+	for (int i = 0; i < N_SH; i++) {
+		if (
+			(i == SH_BUILD_ID && !build_id)
+			|| (i == SH_RELA_TEXT && !t->n_relas[SECT_TEXT])
+			|| (i == SH_RELA_DATA && !t->n_relas[SECT_DATA])
+			|| (i >= SH_DEBUG_ABBREV && !em->debug)
+		) {
+			t->shndx[i] = -1;
+			continue;
+		}
+		t->shndx[i] = t->n_sh++;
+		t->shstrtab_size += strlen(sh_names[i]) + 1;
+	}
+	// the symbol table lists every local symbol before the global ones
+	t->n_syms = 1;
+	t->strtab_size = 1;
+	for (int global = 0; global < 2; global++) {
+		cc_for_each(&em->labels, name, l) {
+			if (!has_symbol(em, l) || l->global != global)
+				continue;
+			l->sym = t->n_syms++;
+			t->strtab_size += name->len + 1;
+		}
+		if (!global)
+			t->n_locals = t->n_syms;
+	}
+	t->symtab = roundup(off, 8);
+	t->strtab = t->symtab + t->n_syms * sizeof(Elf64_Sym);
+	t->shstrtab = t->strtab + t->strtab_size;
+	off = t->shstrtab + t->shstrtab_size;
+	if (em->debug) {
+		elf_debug_build(em, t, em->section[SECT_TEXT].vaddr);
+		t->debug_abbrev = off;
+		t->debug_info = t->debug_abbrev + sizeof debug_abbrev;
+		t->debug_line = t->debug_info + cc_size(&t->info);
+		off = t->debug_line + t->line_size;
+	}
+	for (int i = 0; i < N_SECTIONS; i++) {
+		t->rela[i] = roundup(off, 8);
+		off = t->rela[i] + t->n_relas[i] * sizeof(Elf64_Rela);
+	}
+	t->shdrs = roundup(off, 8);
+}
+
+// the symbol table and string table are streamed straight from the labels
+// map, walking it twice for the symbols, locals then globals, and twice more
+// for their names, so the names are never copied
+static int elf_write_symbols(emitter *em, output *dst) {
+	Elf64_Sym syms[256];
+	size_t n = 1;
+	bzero(&syms[0], sizeof syms[0]);
+	uint32_t name_off = 1;
+	for (int global = 0; global < 2; global++) {
+		cc_for_each(&em->labels, name, l) {
+			if (!has_symbol(em, l) || l->global != global)
+				continue;
+			Elf64_Sym *sym = &syms[n++];
+			sym->st_name = name_off;
+			sym->st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, l->type);
+			sym->st_other = STV_DEFAULT;
+			if (l->val < 0) {
+				sym->st_shndx = SHN_UNDEF;
+				sym->st_value = 0;
+			} else {
+				sym->st_shndx = sect_sh[l->section];
+				sym->st_value = em->section[l->section].vaddr + l->val;
+			}
+			sym->st_size = l->size;
+			name_off += name->len + 1;
+			if (n == sizeof syms / sizeof *syms) {
+				if (output_write(dst, syms, sizeof syms))
+					return 1;
+				n = 0;
+			}
+		}
+	}
+	if (
+		output_write(dst, syms, n * sizeof *syms)
+		|| output_write(dst, "", 1)
+	)
+		return 1;
+	for (int global = 0; global < 2; global++) {
+		cc_for_each(&em->labels, name, l) {
+			if (!has_symbol(em, l) || l->global != global)
+				continue;
+			// names are allocated with a terminating '\0'
+			if (output_write(dst, name->begin, name->len + 1))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+// the relocations against sect, which are all against symbols with an
+// addend of 0, since the instructions and words they patch hold nothing yet
+static int elf_write_relas(emitter *em, output *dst, int sect) {
+	cc_for_each(&em->relocs, reloc) {
+		if (reloc->waiter.section != sect)
+			continue;
+		label *l = cc_get(&em->labels, reloc->name);
+		Elf64_Rela rela = {
+			.r_offset = reloc->waiter.fix_idx,
+			.r_info = ELF64_R_INFO(l->sym, reloc_types[reloc->waiter.assign]),
+			.r_addend = 0,
+		};
+		if (output_write(dst, &rela, sizeof rela))
+			return 1;
+	}
+	return 0;
+}
+
+// text_at and data_at are the file offsets of .text and .data
+static int elf_write_tables(emitter *em, output *dst, const elf_tables *t, uint64_t text_at, uint64_t data_at, const Elf64_Phdr *note) {
+	if (
+		output_seek(dst, t->symtab)
+		|| elf_write_symbols(em, dst)
+	)
+		return 1;
+	for (int i = 0; i < N_SH; i++) {
+		if (t->shndx[i] >= 0 && output_write(dst, sh_names[i], strlen(sh_names[i]) + 1))
+			return 1;
+	}
+	if (t->shndx[SH_DEBUG_LINE] >= 0) {
+		if (
+			output_write(dst, debug_abbrev, sizeof debug_abbrev)
+			|| output_write(dst, cc_first(&t->info), cc_size(&t->info))
+			|| output_write(dst, cc_first(&t->line_head), cc_size(&t->line_head))
+			|| output_write(dst, em->lines.program, em->lines.len)
+			|| output_write(dst, t->line_tail, t->line_tail_len)
+		)
+			return 1;
+	}
+	for (int i = 0; i < N_SECTIONS; i++) {
+		if (
+			t->n_relas[i]
+			&& (
+				output_seek(dst, t->rela[i])
+				|| elf_write_relas(em, dst, i)
+			)
+		)
+			return 1;
+	}
+
+	Elf64_Shdr shdrs[N_SH];
+	bzero(shdrs, sizeof shdrs);
+	uint32_t name_off = 0;
+	for (int i = 0; i < N_SH; i++) {
+		if (t->shndx[i] < 0)
+			continue;
+		shdrs[i].sh_name = name_off;
+		name_off += strlen(sh_names[i]) + 1;
+	}
+	shdrs[SH_TEXT].sh_type = SHT_PROGBITS;
+	shdrs[SH_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+	shdrs[SH_TEXT].sh_addr = em->section[SECT_TEXT].vaddr;
+	shdrs[SH_TEXT].sh_offset = text_at;
+	shdrs[SH_TEXT].sh_size = em->section[SECT_TEXT].pos;
+	shdrs[SH_TEXT].sh_addralign = 4;
+	shdrs[SH_DATA].sh_type = SHT_PROGBITS;
+	shdrs[SH_DATA].sh_flags = SHF_ALLOC | SHF_WRITE;
+	shdrs[SH_DATA].sh_addr = em->section[SECT_DATA].vaddr;
+	// an empty .data has no segment, but still gets a header so labels
+	// defined in it have somewhere to point
+	shdrs[SH_DATA].sh_offset = data_at;
+	shdrs[SH_DATA].sh_size = em->section[SECT_DATA].pos;
+	shdrs[SH_DATA].sh_addralign = 4;
+	shdrs[SH_SYMTAB].sh_type = SHT_SYMTAB;
+	shdrs[SH_SYMTAB].sh_offset = t->symtab;
+	shdrs[SH_SYMTAB].sh_size = t->n_syms * sizeof(Elf64_Sym);
+	shdrs[SH_SYMTAB].sh_link = SH_STRTAB;
+	shdrs[SH_SYMTAB].sh_info = t->n_locals; // the first global
+	shdrs[SH_SYMTAB].sh_addralign = 8;
+	shdrs[SH_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+	shdrs[SH_STRTAB].sh_type = SHT_STRTAB;
+	shdrs[SH_STRTAB].sh_offset = t->strtab;
+	shdrs[SH_STRTAB].sh_size = t->strtab_size;
+	shdrs[SH_STRTAB].sh_addralign = 1;
+	shdrs[SH_SHSTRTAB].sh_type = SHT_STRTAB;
+	shdrs[SH_SHSTRTAB].sh_offset = t->shstrtab;
+	shdrs[SH_SHSTRTAB].sh_size = t->shstrtab_size;
+	shdrs[SH_SHSTRTAB].sh_addralign = 1;
+	if (note) {
+		shdrs[SH_BUILD_ID].sh_type = SHT_NOTE;
+		shdrs[SH_BUILD_ID].sh_flags = SHF_ALLOC;
+		shdrs[SH_BUILD_ID].sh_addr = note->p_vaddr;
+		shdrs[SH_BUILD_ID].sh_offset = note->p_offset;
+		shdrs[SH_BUILD_ID].sh_size = note->p_filesz;
+		shdrs[SH_BUILD_ID].sh_addralign = note->p_align;
+	}
+	for (int i = 0; i < N_SECTIONS; i++) {
+		Elf64_Shdr *sh = &shdrs[sect_rela_sh[i]];
+		sh->sh_type = SHT_RELA;
+		sh->sh_flags = SHF_INFO_LINK;
+		sh->sh_offset = t->rela[i];
+		sh->sh_size = t->n_relas[i] * sizeof(Elf64_Rela);
+		sh->sh_link = SH_SYMTAB;
+		sh->sh_info = sect_sh[i];
+		sh->sh_addralign = 8;
+		sh->sh_entsize = sizeof(Elf64_Rela);
+	}
+	if (t->shndx[SH_DEBUG_LINE] >= 0) {
+		for (int i = SH_DEBUG_ABBREV; i < N_SH; i++) {
+			shdrs[i].sh_type = SHT_PROGBITS;
+			shdrs[i].sh_addralign = 1;
+		}
+		shdrs[SH_DEBUG_ABBREV].sh_offset = t->debug_abbrev;
+		shdrs[SH_DEBUG_ABBREV].sh_size = sizeof debug_abbrev;
+		shdrs[SH_DEBUG_INFO].sh_offset = t->debug_info;
+		shdrs[SH_DEBUG_INFO].sh_size = cc_size(&t->info);
+		shdrs[SH_DEBUG_LINE].sh_offset = t->debug_line;
+		shdrs[SH_DEBUG_LINE].sh_size = t->line_size;
+	}
+	if (output_seek(dst, t->shdrs))
+		return 1;
+	for (int i = 0; i < N_SH; i++) {
+		if (t->shndx[i] >= 0 && output_write(dst, &shdrs[i], sizeof shdrs[i]))
+			return 1;
+	}
+	return 0;
+}
+
+uint64_t elf_headers_size(emitter *em, const elf_options *opts) {
+	uint64_t phnum = 1;
+	if (em->section[SECT_DATA].pos > 0)
+		phnum++;
+	if (opts->build_id)
+		phnum++;
+	return sizeof(Elf64_Ehdr) + phnum * sizeof(Elf64_Phdr) + (opts->build_id ? sizeof(build_id_note) : 0);
+}
+
+uint64_t elf_text_segment_size(emitter *em, const elf_options *opts) {
+	uint64_t size = elf_headers_size(em, opts) + em->section[SECT_TEXT].pos;
+	// the kernel only backs whole aligned huge pages of a file with huge
+	// pages, so with a bigger alignment than a page the segment is padded
+	// out to it, or the last part of the code would miss out
+	// the padding is a hole, so it costs nothing on disk
+	if (opts->text_align > 0x1000)
+		size = roundup(size, opts->text_align);
+	return size;
+}
+
+// where .data goes in the file, which is the first offset after .text's
+// segment that's as far into a page as .data's vaddr
+static uint64_t elf_data_offset(emitter *em, const elf_options *opts) {
+	const uint64_t pagesize = 0x1000;
+	uint64_t text_end = elf_text_segment_size(em, opts);
+	return text_end + ((em->section[SECT_DATA].vaddr - text_end) & (pagesize - 1));
+}
+
+// with -c, a relocatable object, which is just the ELF header, the sections,
+// and the tables, with every section at address 0
+static int elf_output_object(emitter *em, output *dst, const elf_options *opts) {
+	Elf64_Ehdr ehdr;
+	bzero(&ehdr, sizeof ehdr);
+	uint64_t text_at = sizeof ehdr;
+	uint64_t data_at = roundup(text_at + em->section[SECT_TEXT].pos, 4);
+	elf_tables tables;
+	elf_tables_layout(em, &tables, data_at + em->section[SECT_DATA].pos, 0);
+
+	ehdr.e_ident[EI_MAG0] = 0x7f;
+	ehdr.e_ident[EI_MAG1] = 'E';
+	ehdr.e_ident[EI_MAG2] = 'L';
+	ehdr.e_ident[EI_MAG3] = 'F';
+	ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+	ehdr.e_type = ET_REL;
+	ehdr.e_machine = EM_RISCV;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_shoff = tables.shdrs;
+	// a linker won't mix objects with different float ABIs
+	ehdr.e_flags = opts->float_abi;
+	ehdr.e_ehsize = sizeof ehdr;
+	ehdr.e_shentsize = sizeof(Elf64_Shdr);
+	ehdr.e_shnum = tables.n_sh;
+	ehdr.e_shstrndx = SH_SHSTRTAB;
+
+	int err = (
+		output_write(dst, &ehdr, sizeof ehdr)
+		|| emit_section(em, dst, SECT_TEXT)
+		|| output_seek(dst, data_at)
+		|| emit_section(em, dst, SECT_DATA)
+		|| elf_write_tables(em, dst, &tables, text_at, data_at, NULL)
+	);
+	elf_debug_cleanup(em, &tables);
+	return err;
+}
+
+uint64_t elf_section_offset(emitter *em, const elf_options *opts, int sect) {
+	return sect == SECT_TEXT ? elf_headers_size(em, opts) : elf_data_offset(em, opts);
+}
+
+// an executable, with id in the build id note if there is one
+static int elf_write(emitter *em, output *dst, const elf_options *opts, const uint8_t *id) {
+	// TODO: this does not work on a big endian machine
+	// (it should emit a little-endian executable, but it should still work)
+	// TODO: this probably relies on CHAR_BIT being 8 despite the effort
+	// to be independent of this
+	// NOTE: actually, it definitely does rely on this, since the
+	// emitter increments its pos and len by sizeof but relies on
+	// this being in bytes
+	// the program headers are .text, then .data and the build id note if
+	// there are any, and the note itself follows them
+	struct {
+		Elf64_Ehdr ehdr;
+		Elf64_Phdr phdrs[3];
+		build_id_note note;
+	} header;
+	bzero(&header, sizeof header);
+	Elf64_Phdr *text = &header.phdrs[0];
+	Elf64_Phdr *data = NULL;
+	Elf64_Phdr *note = NULL;
+	header.ehdr.e_phnum = 1;
+	if (em->section[SECT_DATA].pos > 0)
+		data = &header.phdrs[header.ehdr.e_phnum++];
+	if (opts->build_id)
+		note = &header.phdrs[header.ehdr.e_phnum++];
+
+	const size_t pagesize = 0x1000;
+	// the headers are mapped along with .text, so they must all be counted
+	// before .text's size is known
+	size_t note_at = BYTESIZE(header.ehdr) + header.ehdr.e_phnum * BYTESIZE(header.phdrs[0]);
+	size_t after = note_at;
+	if (note)
+		after += BYTESIZE(header.note);
+
+	text->p_type = PT_LOAD;
+	text->p_flags = PF_X | PF_R;
+	// map from 0 because it's page aligned
+	// this wraps in the elf/program headers, so the segment starts that
+	// far before .text's vaddr, which is where its first byte ends up
+	text->p_offset = 0;
+	text->p_vaddr = em->section[SECT_TEXT].vaddr - after;
+	text->p_paddr = em->section[SECT_TEXT].vaddr - after;
+	text->p_filesz = elf_text_segment_size(em, opts);
+	text->p_memsz = text->p_filesz;
+	text->p_align = opts->text_align;
+
+	if (data) {
+		// the file offset has to match the vaddr modulo the page size,
+		// so take the first offset after .text that does
+		// with a page aligned vaddr that's the next page, but an
+		// automatic layout picks a vaddr that lets .data share the
+		// last file page of .text
+		data->p_type = PT_LOAD;
+		data->p_flags = PF_R | PF_W;
+		data->p_offset = elf_data_offset(em, opts);
+		data->p_vaddr = em->section[SECT_DATA].vaddr;
+		data->p_paddr = em->section[SECT_DATA].vaddr;
+		data->p_filesz = em->section[SECT_DATA].pos;
+		data->p_memsz = em->section[SECT_DATA].pos;
+		data->p_align = pagesize;
+	}
+
+	elf_tables tables;
+	if (!opts->strip) {
+		uint64_t end = text->p_offset + text->p_filesz;
+		if (data)
+			end = data->p_offset + data->p_filesz;
+		elf_tables_layout(em, &tables, end, opts->build_id);
+	}
+
+	if (note) {
+		// the note sits in the .text segment, just after the headers
+		note->p_type = PT_NOTE;
+		note->p_flags = PF_R;
+		note->p_offset = note_at;
+		note->p_vaddr = text->p_vaddr + note_at;
+		note->p_paddr = text->p_vaddr + note_at;
+		note->p_filesz = sizeof header.note;
+		note->p_memsz = sizeof header.note;
+		note->p_align = 4;
+		header.note.nhdr.n_namesz = sizeof header.note.name;
+		header.note.nhdr.n_descsz = sizeof header.note.id;
+		header.note.nhdr.n_type = NT_GNU_BUILD_ID;
+		memcpy(header.note.name, "GNU", sizeof header.note.name);
+		memcpy(header.note.id, id, sizeof header.note.id);
+	}
+
+	header.ehdr.e_ident[EI_MAG0] = 0x7f;
+	header.ehdr.e_ident[EI_MAG1] = 'E';
+	header.ehdr.e_ident[EI_MAG2] = 'L';
+	header.ehdr.e_ident[EI_MAG3] = 'F';
+	header.ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+	header.ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	header.ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	header.ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+	header.ehdr.e_ident[EI_ABIVERSION] = 0;
+	header.ehdr.e_ident[EI_PAD] = 0;
+	header.ehdr.e_type = ET_EXEC;
+	header.ehdr.e_machine = EM_RISCV;
+	header.ehdr.e_version = EV_CURRENT;
+	header.ehdr.e_entry = emitter_entry(em);
+	header.ehdr.e_phoff = 0x40; // program headers come after the elf header
+	header.ehdr.e_shoff = 0;
+	header.ehdr.e_flags = opts->float_abi;
+	header.ehdr.e_ehsize = 64;
+	header.ehdr.e_phentsize = 0x38;
+	//header.ehdr.e_phnum set earlier
+	header.ehdr.e_shentsize = 0;
+	header.ehdr.e_shnum = 0;
+	header.ehdr.e_shstrndx = 0;
+	if (!opts->strip) {
+		header.ehdr.e_shoff = tables.shdrs;
+		header.ehdr.e_shentsize = sizeof(Elf64_Shdr);
+		header.ehdr.e_shnum = tables.n_sh;
+		header.ehdr.e_shstrndx = SH_SHSTRTAB;
+	}
+
+	int err = (
+		output_write(dst, &header, note_at)
+		|| (note && output_write(dst, &header.note, sizeof header.note))
+		|| emit_section(em, dst, SECT_TEXT)
+		|| output_seek(dst, text->p_offset + text->p_filesz) // padding
+	);
+	if (!err && data) {
+		err = (
+			output_seek(dst, data->p_offset)
+			|| emit_section(em, dst, SECT_DATA)
+		);
+	}
+	if (opts->strip)
+		return err;
+	if (!err)
+		err = elf_write_tables(em, dst, &tables, after, data ? data->p_offset : text->p_offset + text->p_filesz, note);
+	elf_debug_cleanup(em, &tables);
+	return err;
+}
+
+int elf_build_id(emitter *em, const elf_options *opts, uint8_t *id, uint64_t *at) {
+	*at = elf_headers_size(em, opts) - sizeof(build_id_note) + offsetof(build_id_note, id);
+	// the image is written once more with the id left as zeros, into a
+	// hash rather than a file
+	static const uint8_t no_id[BUILD_ID_SIZE];
+	image_hash h;
+	image_hash_init(&h);
+	output out;
+	output_init_hash(&out, &h);
+	if (elf_write(em, &out, opts, no_id))
+		return 1;
+	uint8_t digest[32];
+	image_hash_final(&h, digest);
+	memcpy(id, digest, BUILD_ID_SIZE);
+	return 0;
+}
+
+int emitter_output_elf(emitter *em, output *dst, const elf_options *opts) {
+	if (em->relocatable)
+		return elf_output_object(em, dst, opts);
+	uint8_t id[BUILD_ID_SIZE];
+	uint64_t at;
+	if (opts->build_id && elf_build_id(em, opts, id, &at))
+		return 1;
+	return elf_write(em, dst, opts, id);
+}
+
+static void rebase_add(emitter *em, cc_vec(rebase_entry) *v, uint64_t at, int assign, int sect, int from) {
+	rebase_entry e = {
+		.at = at,
+		.assign = assign,
+		.sect = sect,
+		.from = from,
+	};
+	if (!cc_push(v, e))
+		emitter_panic(em, no_mem);
+}
+
+static void rebase_release(void *v) {
+	cc_cleanup((cc_vec(rebase_entry) *) v);
+}
+
+int emitter_output_rebase_table(emitter *em, output *dst, const elf_options *opts, uint64_t image_size) {
+	if (em->relocatable) {
+		errno = EINVAL;
+		return 1;
+	}
+	// the same layout emitter_output_elf works out
+	int has_data = em->section[SECT_DATA].pos > 0;
+	uint64_t after = elf_headers_size(em, opts);
+	uint64_t text_size = elf_text_segment_size(em, opts);
+	uint64_t data_at = has_data ? elf_data_offset(em, opts) : text_size;
+	int phnum = 1 + has_data + (opts->build_id != 0);
+	elf_tables t;
+	if (!opts->strip)
+		elf_tables_layout(em, &t, has_data ? data_at + em->section[SECT_DATA].pos : text_size, opts->build_id);
+
+	cc_vec(rebase_entry) v;
+	cc_init(&v);
+	emitter_hold(em, rebase_release, &v);
+	const string start_label = {
+		.begin = "_start",
+		.len = 6
+	};
+	label *start = cc_get(&em->labels, start_label);
+	int entry_sect = start && start->val >= 0 ? start->section : SECT_TEXT;
+	rebase_add(em, &v, offsetof(Elf64_Ehdr, e_entry), ASSIGN_ABS64, entry_sect, entry_sect);
+	for (int i = 0; i < phnum; i++) {
+		// .data's segment is the second if there is one, and the build
+		// id's moves with .text
+		int sect = i == 1 && has_data ? SECT_DATA : SECT_TEXT;
+		uint64_t phdr = sizeof(Elf64_Ehdr) + i * sizeof(Elf64_Phdr);
+		rebase_add(em, &v, phdr + offsetof(Elf64_Phdr, p_vaddr), ASSIGN_ABS64, sect, sect);
+		rebase_add(em, &v, phdr + offsetof(Elf64_Phdr, p_paddr), ASSIGN_ABS64, sect, sect);
+	}
+	if (!opts->strip) {
+		static const int sh_sect[][2] = {
+			{ SH_TEXT, SECT_TEXT },
+			{ SH_DATA, SECT_DATA },
+			{ SH_BUILD_ID, SECT_TEXT },
+		};
+		for (size_t i = 0; i < sizeof sh_sect / sizeof *sh_sect; i++) {
+			int sh = t.shndx[sh_sect[i][0]];
+			if (sh >= 0)
+				rebase_add(em, &v, t.shdrs + sh * sizeof(Elf64_Shdr) + offsetof(Elf64_Shdr, sh_addr), ASSIGN_ABS64, sh_sect[i][1], sh_sect[i][1]);
+		}
+		cc_for_each(&em->labels, l) {
+			if (l->val >= 0)
+				rebase_add(em, &v, t.symtab + l->sym * sizeof(Elf64_Sym) + offsetof(Elf64_Sym, st_value), ASSIGN_ABS64, l->section, l->section);
+		}
+		if (t.shndx[SH_DEBUG_LINE] >= 0) {
+			rebase_add(em, &v, t.debug_info + t.info_low_pc, ASSIGN_ABS64, SECT_TEXT, SECT_TEXT);
+			rebase_add(em, &v, t.debug_line + t.line_low_pc, ASSIGN_ABS64, SECT_TEXT, SECT_TEXT);
+		}
+		elf_debug_cleanup(em, &t);
+	}
+	// and everything emitter_finish patched in the sections themselves
+	cc_for_each(&em->resolved, fixup) {
+		uint64_t at = fixup->waiter.section == SECT_TEXT ? after : data_at;
+		rebase_add(em, &v, at + fixup->waiter.fix_idx, fixup->waiter.assign, fixup->section, fixup->waiter.section);
+	}
+
+	rebase_header h = {
+		.magic = REBASE_MAGIC,
+		.size = image_size,
+		.text_vaddr = em->section[SECT_TEXT].vaddr - after,
+		.data_vaddr = em->section[SECT_DATA].vaddr,
+		.text_segment_size = text_size,
+		.text_align = opts->text_align,
+		.data_size = em->section[SECT_DATA].pos,
+		.build_id = opts->build_id ? after - sizeof(build_id_note) + offsetof(build_id_note, id) : 0,
+		.n = cc_size(&v),
+	};
+	int err = (
+		output_write(dst, &h, sizeof h)
+		|| output_write(dst, cc_first(&v), cc_size(&v) * sizeof(rebase_entry))
+	);
+	emitter_let_go(em, &v);
+	cc_cleanup(&v);
+	return err;
+}
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <elf.h>
-#include <limits.h>
+#include <errno.h>
+#include <setjmp.h>
 #include <string.h>
 #include <sys/param.h>
 #define _GNU_SOURCE
@@ -8,9 +9,13 @@
 // man pages say I get that with just _GNU_SOURCE and the file offset thing
 #define __USE_GNU
 #define _FILE_OFFSET_BITS 64
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include "dwarf.h"
 #include "emitter.h"
+#include "output.h"
 #include "parser.h"
 
 const char *const no_mem = "memory allocation failed";
@@ -20,11 +25,80 @@ const char *const no_mem = "memory allocation failed";
 	exit(-1);
 }
 
+[[noreturn]] void emitter_panic(emitter *em, const char *const msg) {
+	if (em->recover) {
+		while (em->n_held > 0) {
+			emitter_held *h = &em->held[--em->n_held];
+			h->release(h->arg);
+		}
+		em->panicked = msg;
+		longjmp(*em->recover, 1);
+	}
+	panic(msg);
+}
+
+void emitter_hold(emitter *em, void (*release)(void *arg), void *arg) {
+	assert(em->n_held < EMITTER_HELD);
+	em->held[em->n_held++] = (emitter_held) {
+		.release = release,
+		.arg = arg,
+	};
+}
+
+void emitter_let_go(emitter *em, void *arg) {
+	// usually the newest, but not always
+	int i = em->n_held - 1;
+	while (i >= 0 && em->held[i].arg != arg)
+		i--;
+	assert(i >= 0);
+	memmove(&em->held[i], &em->held[i + 1], (em->n_held - i - 1) * sizeof *em->held);
+	em->n_held--;
+}
+
+emitter *emitter_new(const char *swap_dir) {
+	emitter *em = calloc(1, sizeof *em);
+	if (!em)
+		return NULL;
+	for (int i = 0; i < N_SECTIONS; i++) {
+		if (swap_dir)
+			em->section[i].swap = open(swap_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+		else
+			em->section[i].swap = memfd_create(i == SECT_TEXT ? "asm .text" : "asm .data", MFD_CLOEXEC);
+		if (em->section[i].swap == -1) {
+			int err = errno;
+			for (int j = 0; j < i; j++)
+				close(em->section[j].swap);
+			free(em);
+			errno = err;
+			return NULL;
+		}
+	}
+	em->current_section = SECT_TEXT;
+	cc_init(&em->labels);
+	cc_init(&em->cross_fixups);
+	cc_init(&em->relocs);
+	cc_init(&em->resolved);
+	return em;
+}
+
+void emitter_free(emitter *em) {
+	for (int i = 0; i < N_SECTIONS; i++)
+		close(em->section[i].swap);
+	cc_cleanup(&em->labels);
+	cc_cleanup(&em->cross_fixups);
+	cc_cleanup(&em->relocs);
+	cc_cleanup(&em->resolved);
+	free(em->lines.program);
+	free(em);
+}
+
 // write the contents of a buffer to a file to make room for more stuff
 void emitter_clear_buffer(emitter *em, int sect) {
-	ssize_t written = write(em->section[sect].swap, em->section_buf[sect], em->section[sect].len);
-	if (written < 0 || (uint64_t) written != em->section[sect].len)
-		panic("write call failed");
+	uint64_t len = em->section[sect].len;
+	if (len == 0)
+		return;
+	if (write_all(em->section[sect].swap, em->section_buf[sect], len))
+		emitter_panic(em, "write call failed");
 	em->section[sect].len = 0;
 }
 
@@ -37,6 +111,8 @@ void emitter_buffer(emitter *em, void *data, size_t len) {
 	while (pos + len >= sizeof em->section_buf[0]) {
 		size_t copy = sizeof(em->section_buf[0]) - pos;
 		memcpy(&em->section_buf[sect][pos], data, copy);
+		em->section[sect].len += copy;
+		em->section[sect].pos += copy;
 		emitter_clear_buffer(em, sect);
 		data = (uint8_t *) data + copy;
 		len -= copy;
@@ -47,194 +123,541 @@ void emitter_buffer(emitter *em, void *data, size_t len) {
 	em->section[sect].pos += len;
 }
 
-void emitter_advance(emitter *em, size_t len) {
-	// TODO validate this
+// bytes a restore left in the file buffer where a hole now goes are zeroed
+// by punching a hole over them, or if the file system can't, by cutting the
+// file off there, which loses the rest of them too
+static void emitter_clear_stale(emitter *em, int sect, uint64_t at, uint64_t len) {
+	uint64_t stale = em->section[sect].stale;
+	if (at >= stale)
+		return;
+	int swap = em->section[sect].swap;
+	if (fallocate(swap, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, at, MIN(len, stale - at)) == 0)
+		return;
+	if (ftruncate(swap, at))
+		emitter_panic(em, "couldn't cut back a file buffer");
+	em->section[sect].stale = at;
+}
+
+void emitter_advance(emitter *em, uint64_t len) {
 	int sect = em->current_section;
-	size_t pos = em->section[sect].len;
-	em->section[sect].pos += len;
+	uint64_t pos = em->section[sect].len;
 	if (pos + len >= sizeof em->section_buf[0]) {
+		// leave a hole in the file buffer, which reads back as zeros
+		// and takes no space on disk
 		emitter_clear_buffer(em, sect);
+		uint64_t at = em->section[sect].pos;
+		emitter_clear_stale(em, sect, at, len);
 		if (lseek(em->section[sect].swap, len, SEEK_CUR) == -1)
-			panic("lseek call failed");
+			emitter_panic(em, "lseek call failed");
 	} else {
 		bzero(&em->section_buf[sect][pos], len);
 		em->section[sect].len += len;
 	}
+	em->section[sect].pos += len;
+}
+
+size_t uleb128(uint8_t *dst, uint64_t v) {
+	size_t n = 0;
+	do {
+		uint8_t b = v & 0x7f;
+		v >>= 7;
+		if (v)
+			b |= 0x80;
+		dst[n++] = b;
+	} while (v);
+	return n;
+}
+
+size_t sleb128(uint8_t *dst, int64_t v) {
+	size_t n = 0;
+	for (;;) {
+		uint8_t b = v & 0x7f;
+		v >>= 7; // arithmetic shift, which every compiler we care about does
+		if ((v == 0 && !(b & 0x40)) || (v == -1 && (b & 0x40))) {
+			dst[n++] = b;
+			return n;
+		}
+		dst[n++] = b | 0x80;
+	}
+}
+
+void emitter_line(emitter *em, uint64_t idx) {
+	// a row is at most 23 bytes, so the check for space is done once up
+	// front rather than for each byte
+	if (em->lines.cap - em->lines.len < 32) {
+		size_t cap = em->lines.cap ? 2 * em->lines.cap : 4096;
+		uint8_t *program = realloc(em->lines.program, cap);
+		if (!program)
+			emitter_panic(em, no_mem);
+		em->lines.program = program;
+		em->lines.cap = cap;
+	}
+	uint8_t *op = &em->lines.program[em->lines.len];
+	uint64_t addr = idx - em->lines.idx;
+	int64_t line = em->line - em->lines.line;
+	em->lines.idx = idx;
+	em->lines.line = em->line;
+	// almost every row is the next line and one instruction along, which
+	// fits in a single special opcode
+	uint64_t special = (line - LINE_BASE) + LINE_RANGE * addr + LINE_OPCODE_BASE;
+	if ((uint64_t) (line - LINE_BASE) < LINE_RANGE && addr < 256 / LINE_RANGE && special < 256) {
+		*op++ = special;
+	} else {
+		if (line < LINE_BASE || line >= LINE_BASE + LINE_RANGE) {
+			*op++ = DW_LNS_advance_line;
+			op += sleb128(op, line);
+			line = 0;
+		}
+		if (LINE_RANGE * addr + (line - LINE_BASE) + LINE_OPCODE_BASE >= 256 || addr >= 256 / LINE_RANGE) {
+			*op++ = DW_LNS_advance_pc;
+			op += uleb128(op, addr);
+			addr = 0;
+		}
+		*op++ = (line - LINE_BASE) + LINE_RANGE * addr + LINE_OPCODE_BASE;
+	}
+	em->lines.len = op - em->lines.program;
+}
+
+// read n bytes at offset idx of section sect, wherever they currently live
+// the bytes may straddle the file buffer and the section buffer, since
+// sections aren't always padded to 4 bytes and holes can be any size
+void emitter_read(emitter *em, int sect, uint64_t idx, void *dst, size_t n) {
+	uint64_t flushed = em->section[sect].pos - em->section[sect].len;
+	assert(idx + n <= em->section[sect].pos);
+	size_t in_file = 0;
+	if (idx < flushed) {
+		in_file = MIN(n, flushed - idx);
+		ssize_t got = pread(em->section[sect].swap, dst, in_file, idx);
+		if (got < 0)
+			emitter_panic(em, "pread call failed");
+		// anything past the end of the file is a hole left by
+		// emitter_advance that has yet to be filled in
+		bzero((uint8_t *) dst + got, in_file - got);
+	}
+	if (in_file < n)
+		memcpy((uint8_t *) dst + in_file, &em->section_buf[sect][idx + in_file - flushed], n - in_file);
+}
+
+// adds a write that's about to change bytes to em->patches
+// a write of more than a patch's 8 bytes is added without comparing
+static void emitter_note_patch(emitter *em, int sect, uint64_t idx, const void *src, size_t n) {
+	uint8_t old[8];
+	if (n <= sizeof old) {
+		emitter_read(em, sect, idx, old, n);
+		if (memcmp(old, src, n) == 0)
+			return;
+	}
+	emitter_patch patch = {
+		.idx = idx,
+		.section = sect,
+		.n = n,
+	};
+	if (!cc_push(em->patches, patch))
+		emitter_panic(em, no_mem);
+}
+
+// overwrite n bytes at offset idx of section sect, wherever they currently live
+void emitter_write(emitter *em, int sect, uint64_t idx, const void *src, size_t n) {
+	uint64_t flushed = em->section[sect].pos - em->section[sect].len;
+	assert(idx + n <= em->section[sect].pos);
+	if (em->patches)
+		emitter_note_patch(em, sect, idx, src, n);
+	size_t in_file = 0;
+	if (idx < flushed) {
+		in_file = MIN(n, flushed - idx);
+		if (pwrite(em->section[sect].swap, src, in_file, idx) != (ssize_t) in_file)
+			emitter_panic(em, "pwrite call failed");
+	}
+	if (in_file < n)
+		memcpy(&em->section_buf[sect][idx + in_file - flushed], (const uint8_t *) src + in_file, n - in_file);
+}
+
+// inserts a label under a copy of key, which usually points into the input
+label *emitter_label_insert(emitter *em, string key, label nu) {
+	char *name = malloc(key.len + 1);
+	if (!name)
+		emitter_panic(em, no_mem);
+	memcpy(name, key.begin, key.len);
+	name[key.len] = '\0';
+	key.begin = name;
+	label *e = cc_insert(&em->labels, key, nu);
+	if (!e) {
+		free(name);
+		emitter_panic(em, no_mem);
+	}
+	return e;
+}
+
+label *emitter_label_get(emitter *em, string key) {
+	label *e = cc_get(&em->labels, key);
+	if (!e) {
+		label nu = {
+			.val = -1,
+			.section = em->current_section,
+			.type = STT_NOTYPE,
+			.size = 0,
+			.added = cc_size(&em->labels),
+		};
+		cc_init(&nu.waiters);
+		e = emitter_label_insert(em, key, nu);
+	}
+	return e;
+}
+
+// patch the instruction or address waiting on a label at val in section sect
+// returns nonzero, leaving it alone, if an absolute address doesn't fit or a
+// branch or jump doesn't reach
+int emitter_resolve(emitter *em, label_waiter *waiter, int sect, int64_t val) {
+	uint64_t addr = val + em->section[sect].vaddr;
+	int64_t offset = addr - (waiter->fix_idx + em->section[waiter->section].vaddr);
+	uint32_t instr;
+	uint64_t abs;
+	switch (waiter->assign) {
+	case ASSIGN_BTYPE:
+		if (offset < -4096 || offset >= 4096)
+			return 1;
+		emitter_read(em, waiter->section, waiter->fix_idx, &instr, sizeof instr);
+		set_btype_imm(&instr, offset);
+		emitter_write(em, waiter->section, waiter->fix_idx, &instr, sizeof instr);
+		break;
+	case ASSIGN_JTYPE:
+		if (offset < -(1 << 20) || offset >= 1 << 20)
+			return 1;
+		emitter_read(em, waiter->section, waiter->fix_idx, &instr, sizeof instr);
+		set_jtype_imm(&instr, offset);
+		emitter_write(em, waiter->section, waiter->fix_idx, &instr, sizeof instr);
+		break;
+	case ASSIGN_ABS32:
+		if (addr > UINT32_MAX)
+			return 1;
+		abs = htole64(addr);
+		emitter_write(em, waiter->section, waiter->fix_idx, &abs, 4);
+		break;
+	case ASSIGN_ABS64:
+		abs = htole64(addr);
+		emitter_write(em, waiter->section, waiter->fix_idx, &abs, 8);
+		break;
+	default:
+		// should never occur
+		assert(0);
+	}
+	return 0;
+}
+
+// references from one section to another have to wait until every section
+// has its final vaddr, which with automatic layout isn't until the end
+void emitter_defer(emitter *em, label_waiter waiter, string name) {
+	cross_fixup fixup = {
+		.waiter = waiter,
+		.name = name,
+	};
+	if (!cc_push(&em->cross_fixups, fixup))
+		emitter_panic(em, no_mem);
 }
 
 int emitter_label_add(emitter *em, string key) {
-	size_t old_sz = cc_size(&em->labels);
-	label nu;
-	nu.val = em->section[em->current_section].pos + em->section[em->current_section].vaddr;
-	label *e = cc_get_or_insert(&em->labels, key, nu);
-	if (!e)
-		panic(no_mem);
-	if (cc_size(&em->labels) != old_sz)
-		return 0; // inserted new label with val
+	int sect = em->current_section;
+	int64_t val = em->section[sect].pos;
+	label *e = emitter_label_get(em, key);
+	int err = 0;
 	if (e->val >= 0)
 		return -1; // that's a duplicate label
 	// resolve each waiter
 	cc_for_each(&e->waiters, waiter) {
-		int64_t offset = nu.val - (waiter->fix_idx + em->section[waiter->section].vaddr);
-		int64_t len = em->section[waiter->section].len;
-		int64_t pos = em->section[waiter->section].pos;
-		if (pos - len > waiter->fix_idx) {
-			// TODO TODO TODO
-			//read();
-			//write();
-			panic("unimplimented");
-		} else {
-			uint32_t instr;
-			assert((int64_t) sizeof instr + len - (pos - waiter->fix_idx) <= len);
-			uint8_t *target = &em->section_buf[waiter->section][len - (pos - waiter->fix_idx)];
-			memcpy(&instr, target, sizeof instr);
-			switch (waiter->assign) {
-			case ASSIGN_BTYPE:
-				// TODO: verify the immediate fits in b-type
-				// immediate field, but take care to allow
-				// negative values
-				set_btype_imm(&instr, offset);
-				break;
-			case ASSIGN_JTYPE:
-				// TODO: verify the immediate fits in j-type
-				// immediate field, but take care to allow
-				// negative values
-				set_jtype_imm(&instr, offset);
-				break;
-			default:
-				// should never occur
-				assert(0);
-			}
-			memcpy(target, &instr, sizeof instr);
-		}
+		if (waiter->section != sect)
+			emitter_defer(em, *waiter, *cc_key_for(&em->labels, e));
+		else if (emitter_resolve(em, waiter, sect, val))
+			err = 1;
 	}
 	cc_cleanup(&e->waiters);
-	return 0;
+	e->val = val;
+	e->section = sect;
+	return err;
 }
 
-// returns the label's value if known, otherwise returns -1 and adds a waiter
-// for that label
 int64_t emitter_label_get_or_add_waiter(emitter *em, string key, enum assign_type wait_assign) {
-	label nu;
-	nu.val = -1;
-	cc_init(&nu.waiters);
-	label *e = cc_get_or_insert(&em->labels, key, nu);
-	if (!e)
-		panic(no_mem);
+	label *e = emitter_label_get(em, key);
+	label_waiter waiter = {
+		.fix_idx = em->section[em->current_section].pos,
+		.section = em->current_section,
+		.assign = wait_assign,
+	};
+	// absolute addresses aren't known until the end, and with -c whether
+	// a reference becomes a relocation depends on .globl, which may come
+	// after it
+	if (em->relocatable || wait_assign == ASSIGN_ABS32 || wait_assign == ASSIGN_ABS64) {
+		emitter_defer(em, waiter, *cc_key_for(&em->labels, e));
+		return -1;
+	}
 	if (e->val < 0) {
-		label_waiter waiter = {
-			.fix_idx = em->section[em->current_section].pos,
-			.section = em->current_section,
-			.assign = wait_assign,
-		};
 		if (!cc_push(&e->waiters, waiter))
-			panic(no_mem);
+			emitter_panic(em, no_mem);
+		return -1;
+	}
+	if (e->section != em->current_section) {
+		emitter_defer(em, waiter, *cc_key_for(&em->labels, e));
 		return -1;
 	}
 	return e->val;
 }
 
-int emit_section(emitter *em, int dst, int sect) {
-	int l = em->section[sect].len;
-	int m = em->section[sect].pos - l;
-	off_t zero = 0;
+// with -c, only branches and jumps to a local label in their own section
+// are resolved, and everything else is left for the linker
+// an input to emitter_link resolves those to global labels too
+static int needs_reloc(emitter *em, label *l, label_waiter *waiter) {
 	return (
-		copy_file_range(em->section[sect].swap, &zero, dst, NULL, m, 0) != m
-		|| write(dst, em->section_buf[sect], l) != l
+		l->val < 0
+		|| (l->global && !em->link_input)
+		|| l->section != waiter->section
+		|| waiter->assign == ASSIGN_ABS32
+		|| waiter->assign == ASSIGN_ABS64
 	);
 }
 
-#define BYTESIZE(x) (sizeof(x) * (CHAR_BIT / 8))
-
-int emitter_output_elf(emitter *em, int dst) {
-	// TODO: this does not work on a big endian machine
-	// (it should emit a little-endian executable, but it should still work)
-	// TODO: this probably relies on CHAR_BIT being 8 despite the effort
-	// to be independent of this
-	// NOTE: actually, it definitely does rely on this, since the
-	// emitter increments its pos and len by sizeof but relies on
-	// this being in bytes
-	struct {
-		Elf64_Ehdr ehdr;
-		Elf64_Phdr text;
-		Elf64_Phdr data;
-	} header;
-	bzero(&header, sizeof header);
-
-	const size_t pagesize = 0x1000;
-	ssize_t after = BYTESIZE(header.ehdr) + BYTESIZE(header.text);
-
-	header.ehdr.e_phnum = 1;
-	header.text.p_type = PT_LOAD;
-	header.text.p_flags = PF_X | PF_R;
-	// map from 0 because it's page aligned
-	// this wraps in the elf/program headers
-	// so adjust the entry point to compensate
-	header.text.p_offset = 0;
-	header.text.p_vaddr = em->section[SECT_TEXT].vaddr;
-	header.text.p_paddr = em->section[SECT_TEXT].vaddr;
-	header.text.p_filesz = em->section[SECT_TEXT].pos;
-	header.text.p_memsz = em->section[SECT_TEXT].pos;
-	header.text.p_align = pagesize;
-
-	if (em->section[SECT_DATA].pos > 0) {
-		after += BYTESIZE(header.data);
-		header.ehdr.e_phnum++;
-		header.data.p_type = PT_LOAD;
-		header.data.p_flags = PF_R | PF_W;
-		header.data.p_offset = roundup(header.text.p_filesz + header.text.p_offset, pagesize);
-		header.data.p_vaddr = em->section[SECT_DATA].vaddr;
-		header.data.p_paddr = em->section[SECT_DATA].vaddr;
-		header.data.p_filesz = em->section[SECT_DATA].pos;
-		header.data.p_memsz = em->section[SECT_DATA].pos;
-		header.data.p_align = pagesize;
-	}
-
-	header.ehdr.e_ident[EI_MAG0] = 0x7f;
-	header.ehdr.e_ident[EI_MAG1] = 'E';
-	header.ehdr.e_ident[EI_MAG2] = 'L';
-	header.ehdr.e_ident[EI_MAG3] = 'F';
-	header.ehdr.e_ident[EI_CLASS] = ELFCLASS64;
-	header.ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
-	header.ehdr.e_ident[EI_VERSION] = EV_CURRENT;
-	header.ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
-	header.ehdr.e_ident[EI_ABIVERSION] = 0;
-	header.ehdr.e_ident[EI_PAD] = 0;
-	header.ehdr.e_type = ET_EXEC;
-	header.ehdr.e_machine = EM_RISCV;
-	header.ehdr.e_version = EV_CURRENT;
+// resolves waiter, and keeps it in em->resolved
+static int emitter_resolve_kept(emitter *em, label_waiter *waiter, int sect, int64_t val) {
+	cross_fixup kept = {
+		.waiter = *waiter,
+		.section = sect,
+		.val = val,
+	};
+	if (!cc_push(&em->resolved, kept))
+		emitter_panic(em, no_mem);
+	return emitter_resolve(em, waiter, sect, val);
+}
+
+int emitter_finish(emitter *em, string *name) {
+	cc_clear(&em->resolved);
+	cc_for_each(&em->labels, key, l) {
+		if (l->val >= 0 || cc_size(&l->waiters) == 0)
+			continue;
+		if (!em->link_input) {
+			*name = *key;
+			return FINISH_UNDEFINED;
+		}
+		// an input to emitter_link hands anything it never defined
+		// to the others
+		l->global = 1;
+		cc_for_each(&l->waiters, waiter) {
+			cross_fixup reloc = {
+				.waiter = *waiter,
+				.name = *key,
+			};
+			if (!cc_push(&em->relocs, reloc))
+				emitter_panic(em, no_mem);
+		}
+		cc_clear(&l->waiters);
+	}
+	cc_for_each(&em->cross_fixups, fixup) {
+		*name = fixup->name;
+		if (fixup->name.len == 0) {
+			if (emitter_resolve_kept(em, &fixup->waiter, fixup->section, fixup->val))
+				return FINISH_RANGE;
+			continue;
+		}
+		label *l = cc_get(&em->labels, fixup->name);
+		if ((em->relocatable || em->link_input) && needs_reloc(em, l, &fixup->waiter)) {
+			// a label that's used but never defined is external
+			if (l->val < 0)
+				l->global = 1;
+			if (!cc_push(&em->relocs, *fixup))
+				emitter_panic(em, no_mem);
+			continue;
+		}
+		if (l->val < 0)
+			return FINISH_UNDEFINED;
+		if (emitter_resolve_kept(em, &fixup->waiter, l->section, l->val))
+			return FINISH_RANGE;
+	}
+	cc_clear(&em->cross_fixups);
+	return FINISH_OK;
+}
+
+void emitter_reset(emitter *em) {
+	for (int i = 0; i < N_SECTIONS; i++) {
+		int swap = em->section[i].swap;
+		// a file buffer nothing reached is already empty, so an emitter
+		// reset for every line, as --lsp does, stays in memory
+		int used = em->section[i].pos != em->section[i].len || em->section[i].stale != 0;
+		if (used && (ftruncate(swap, 0) || lseek(swap, 0, SEEK_SET) == -1))
+			emitter_panic(em, "couldn't empty a file buffer");
+		bzero(&em->section[i], sizeof em->section[i]);
+		em->section[i].swap = swap;
+	}
+	cc_clear(&em->labels);
+	cc_clear(&em->cross_fixups);
+	cc_clear(&em->relocs);
+	cc_clear(&em->resolved);
+	em->current_section = SECT_TEXT;
+	em->line = 0;
+	em->lines.len = 0;
+	em->lines.idx = 0;
+	em->lines.line = 1;
+}
+
+// copies src's labels, and the fixups naming them, into dst's, which aren't
+// initialized
+// the map is cloned as it is, rather than built up again, so it iterates in
+// the same order, and the symbol table comes out the same as it would have
+static void emitter_copy_labels(emitter *dst, emitter *src) {
+	if (!cc_init_clone(&dst->labels, &src->labels))
+		emitter_panic(src, no_mem);
+	cc_for_each(&dst->labels, key, l) {
+		// the names are still src's
+		string *name = (string *) key;
+		char *copy = malloc(name->len + 1);
+		if (!copy)
+			emitter_panic(src, no_mem);
+		memcpy(copy, name->begin, name->len + 1);
+		name->begin = copy;
+		if (l->val < 0) {
+			cc_vec(label_waiter) waiters;
+			if (!cc_init_clone(&waiters, &l->waiters))
+				emitter_panic(src, no_mem);
+			l->waiters = waiters;
+		}
+	}
+	if (!cc_init_clone(&dst->cross_fixups, &src->cross_fixups))
+		emitter_panic(src, no_mem);
+	cc_for_each(&dst->cross_fixups, fixup) {
+		// the name has to be dst's own key
+		if (fixup->name.len != 0)
+			fixup->name = *cc_key_for(&dst->labels, cc_get(&dst->labels, fixup->name));
+	}
+}
+
+void emitter_save(emitter *em, emitter *save) {
+	*save = *em;
+	cc_init(&save->relocs);
+	cc_init(&save->resolved);
+	// the line program is only ever appended to, so the length is enough
+	save->lines.program = NULL;
+	save->lines.cap = 0;
+	emitter_copy_labels(save, em);
+}
+
+void emitter_restore(emitter *em, emitter *save) {
+	cc_cleanup(&em->cross_fixups);
+	cc_clear(&em->relocs);
+	cc_clear(&em->resolved);
+	cc_cleanup(&em->labels);
+	for (int i = 0; i < N_SECTIONS; i++) {
+		uint64_t stale = MAX(em->section[i].stale, em->section[i].pos - em->section[i].len);
+		em->section[i] = save->section[i];
+		em->section[i].stale = MAX(stale, save->section[i].stale);
+		memcpy(em->section_buf[i], save->section_buf[i], save->section[i].len);
+		uint64_t flushed = em->section[i].pos - em->section[i].len;
+		if (lseek(em->section[i].swap, flushed, SEEK_SET) == -1)
+			emitter_panic(em, "lseek call failed");
+	}
+	em->current_section = save->current_section;
+	em->line = save->line;
+	em->lines.len = save->lines.len;
+	em->lines.idx = save->lines.idx;
+	em->lines.line = save->lines.line;
+	emitter_copy_labels(em, save);
+}
+
+void emitter_discard(emitter *save) {
+	cc_cleanup(&save->labels);
+	cc_cleanup(&save->cross_fixups);
+}
+
+static int waiter_same(label_waiter *a, label_waiter *b) {
+	return a->fix_idx == b->fix_idx && a->section == b->section && a->assign == b->assign;
+}
+
+int emitter_same_state(emitter *a, emitter *b) {
+	if (
+		a->current_section != b->current_section
+		|| cc_size(&a->labels) != cc_size(&b->labels)
+		|| cc_size(&a->cross_fixups) != cc_size(&b->cross_fixups)
+	)
+		return 0;
+	for (int i = 0; i < N_SECTIONS; i++) {
+		if (
+			a->section[i].pos != b->section[i].pos
+			|| a->section[i].len != b->section[i].len
+			|| memcmp(a->section_buf[i], b->section_buf[i], a->section[i].len)
+		)
+			return 0;
+	}
+	cc_for_each(&a->labels, key, la) {
+		label *lb = cc_get(&b->labels, *key);
+		if (
+			!lb
+			|| la->val != lb->val
+			|| la->section != lb->section
+			|| la->type != lb->type
+			|| la->size != lb->size
+			|| la->global != lb->global
+			|| la->added != lb->added
+		)
+			return 0;
+		if (la->val >= 0)
+			continue;
+		if (cc_size(&la->waiters) != cc_size(&lb->waiters))
+			return 0;
+		for (size_t j = 0; j < cc_size(&la->waiters); j++) {
+			if (!waiter_same(cc_get(&la->waiters, j), cc_get(&lb->waiters, j)))
+				return 0;
+		}
+	}
+	for (size_t j = 0; j < cc_size(&a->cross_fixups); j++) {
+		cross_fixup *fa = cc_get(&a->cross_fixups, j);
+		cross_fixup *fb = cc_get(&b->cross_fixups, j);
+		if (
+			!waiter_same(&fa->waiter, &fb->waiter)
+			|| fa->section != fb->section
+			|| fa->val != fb->val
+			|| fa->name.len != fb->name.len
+			|| (fa->name.len != 0 && memcmp(fa->name.begin, fb->name.begin, fa->name.len))
+		)
+			return 0;
+	}
+	return 1;
+}
+
+void emitter_catch_up(emitter *em, emitter *from, emitter *to) {
+	emitter_rebase(to, from, em);
+	// the lines in between resolved waiters from before, which patched
+	// bytes em may have assembled again, and those are patched again here
+	cc_for_each(&em->labels, key, l) {
+		if (l->val >= 0)
+			continue;
+		label *defined = cc_get(&to->labels, *key);
+		if (defined->val < 0)
+			continue;
+		// nothing moved, so these reach as they did the first time
+		cc_for_each(&l->waiters, waiter) {
+			if (waiter->section == defined->section)
+				emitter_resolve(em, waiter, defined->section, defined->val);
+		}
+	}
+	emitter_restore(em, to);
+}
+
+void emitter_rebase(emitter *save, emitter *from, emitter *to) {
+	save->line += to->line - from->line;
+}
+
+uint64_t emitter_entry(emitter *em) {
 	const string start_label = {
 		.begin = "_start",
 		.len = 6
 	};
 	label *start = cc_get(&em->labels, start_label);
-	if (start) {
-		// bad things will happen if _start was defined outside of .text
-		header.ehdr.e_entry = start->val;
-	} else {
-		header.ehdr.e_entry = em->section[SECT_TEXT].vaddr;
-	}
-	header.ehdr.e_entry += after;
-	header.ehdr.e_phoff = 0x40; // program headers come after the elf header
-	header.ehdr.e_shoff = 0;
-	header.ehdr.e_flags = 0;
-	header.ehdr.e_ehsize = 64;
-	header.ehdr.e_phentsize = 0x38;
-	//header.ehdr.e_phnum set earlier
-	header.ehdr.e_shentsize = 0;
-	header.ehdr.e_shnum = 0;
-	header.ehdr.e_shstrndx = 0;
+	// bad things will happen if _start was defined outside of .text
+	if (start && start->val >= 0)
+		return em->section[start->section].vaddr + start->val;
+	return em->section[SECT_TEXT].vaddr;
+}
 
-	if (
-		write(dst, &header, after) != after
-		|| emit_section(em, dst, SECT_TEXT)
-	)
-		return 1;
-	if (em->section[SECT_DATA].pos > 0) {
-		return (
-			lseek(dst, header.data.p_offset, SEEK_SET) == (off_t) -1
-			|| emit_section(em, dst, SECT_DATA)
-		);
-	}
-	return 0;
+int emit_section(emitter *em, output *dst, int sect) {
+	uint64_t l = em->section[sect].len;
+	uint64_t m = em->section[sect].pos - l;
+	return (
+		output_copy(dst, em->section[sect].swap, 0, m)
+		|| output_write(dst, em->section_buf[sect], l)
+	);
 }
@@ -1,9 +1,11 @@
 #ifndef EMITTER_H
 #define EMITTER_H
 
+#include <setjmp.h>
 #include <stdint.h>
 
 #include "cc.h"
+#include "output.h"
 
 typedef struct {
 	char *begin;
@@ -13,6 +15,9 @@ typedef struct {
 enum assign_type {
 	ASSIGN_BTYPE,
 	ASSIGN_JTYPE,
+	// absolute addresses, from .word and .dword
+	ASSIGN_ABS32,
+	ASSIGN_ABS64,
 };
 
 typedef struct {
@@ -23,7 +28,16 @@ typedef struct {
 
 typedef struct {
 	cc_vec(label_waiter) waiters;
-	int64_t val; // negative if unassigned (meaning there are waiters)
+	int64_t val; // offset into section, negative if unassigned (meaning there may be waiters)
+	int section; // section the label was defined in
+	// for the symbol table, from .type and .size
+	uint8_t type; // STT_NOTYPE, STT_FUNC, or STT_OBJECT
+	uint64_t size;
+	int global; // from .globl, or used but never defined with -c
+	uint32_t sym; // index in the ELF symbol table
+	// how many labels were added before it, since the map's order depends
+	// on the order labels were added in, and a prelude adds them again
+	uint32_t added;
 } label;
 
 enum section {
@@ -32,11 +46,45 @@ enum section {
 	N_SECTIONS,
 };
 
+// a reference to a label in another section, resolved by emitter_finish
+// with -c, every reference is one of these, and those emitter_finish can't
+// resolve are left as relocations
+typedef struct {
+	label_waiter waiter;
+	string name; // the labels map's own key
+	// when name is empty, the target itself, for labels local to one of
+	// several linked inputs, which have no entry in the labels map
+	int section;
+	int64_t val;
+} cross_fixup;
+
+// a write over bytes that were already emitted
+typedef struct {
+	uint64_t idx;
+	int section;
+	size_t n;
+} emitter_patch;
+
 #define CC_DTOR label, { if (val.val < 0) cc_cleanup(&val.waiters); }
+#include "cc.h"
+
+// label names are owned by the labels map, since the input they were parsed
+// from may be gone by the time the label is resolved
+#define CC_DTOR string, { free(val.begin); }
 #define CC_CMPR string, { return val_1.len != val_2.len || strncmp(val_1.begin, val_2.begin, val_1.len); }
 #define CC_HASH string, { return cc_wyhash(val.begin, val.len); }
 #include "cc.h"
 
+// something a function has open while it works on an emitter, which a panic
+// that jumps past the function has to release
+typedef struct {
+	void (*release)(void *arg);
+	void *arg;
+} emitter_held;
+
+// how many things can be held at once, by functions nested in each other
+#define EMITTER_HELD 8
+
 // the goal of an emitter is to store data in seperate places for all sections
 // (currently .text or .data) because since the program being assembled need
 // not list the sections in the "correct" order, or may swap between the same
@@ -51,22 +99,215 @@ typedef struct {
 		uint64_t len; // position of next availible byte in buffer
 		uint64_t pos; // relative to the first byte ever written
 		int swap; // fd of file buffer
+		// past where the next flush goes, the file buffer may still
+		// have bytes up to here from before a restore, which a hole
+		// has to clear
+		uint64_t stale;
 	} section[N_SECTIONS];
 	cc_map(string, label) labels;
+	cc_vec(cross_fixup) cross_fixups;
+	// set for -c, where emitter_finish leaves whatever it can't resolve
+	// in relocs instead
+	int relocatable;
+	// set for each input to emitter_link, which is assembled as usual, but
+	// leaves references to labels in other inputs and sections in relocs,
+	// where -c would also leave those to global labels
+	int link_input;
+	cc_vec(cross_fixup) relocs;
+	// every reference emitter_finish patched, with section set to where
+	// the label is, since those are what --rebase-table lists
+	cc_vec(cross_fixup) resolved;
 	int current_section;
+	// when set, every write by emitter_write that changes bytes is added
+	// here too, so --watch knows what to patch in outputs it already wrote
+	cc_vec(emitter_patch) *patches;
+	long line; // source line being assembled
+	// the .debug_line program for .text, built as lines are assembled
+	// when debug is set
+	int debug;
+	struct {
+		uint8_t *program; // rows after the initial address
+		size_t len, cap;
+		uint64_t idx; // .text offset of the last row
+		long line; // source line of the last row
+		const char *file, *dir; // source file and its directory
+	} lines;
+	// set by a caller that wants failures back rather than an exit, like
+	// libasm, for emitter_panic to jump to
+	jmp_buf *recover;
+	const char *panicked; // why it jumped
+	// released by emitter_panic, newest first, before it jumps
+	emitter_held held[EMITTER_HELD];
+	int n_held;
 } emitter;
 
+extern const char *const no_mem;
+
+[[noreturn]] extern void panic(const char *const msg);
+
+// panic, or with em->recover set, jump there
+// em is left in no state to go on with, but emitter_reset or emitter_free can
+// still be used on it
+[[noreturn]] extern void emitter_panic(emitter *em, const char *const msg);
+
+// a function that opens something, then calls what may panic, holds it so
+// that with em->recover set, a panic calls release(arg) on the way out
+// it lets go of arg before releasing it itself
+extern void emitter_hold(emitter *em, void (*release)(void *arg), void *arg);
+extern void emitter_let_go(emitter *em, void *arg);
+
+// returns a zeroed emitter, with its file buffers in swap_dir, or in memory if
+// swap_dir is NULL
+// returns NULL and sets errno if it couldn't be made
+extern emitter *emitter_new(const char *swap_dir);
+
+extern void emitter_free(emitter *em);
+
 // buffer some data
 // buffer as in "to buffer" instead of "a buffer"
 extern void emitter_buffer(emitter *em, void *data, size_t len);
 
 // make space, possibly with the help of a hole in the file buffer
-extern void emitter_advance(emitter *em, size_t len);
+extern void emitter_advance(emitter *em, uint64_t len);
+
+// read or overwrite bytes that have already been emitted to a section
+extern void emitter_read(emitter *em, int sect, uint64_t idx, void *dst, size_t n);
+
+extern void emitter_write(emitter *em, int sect, uint64_t idx, const void *src, size_t n);
 
+// returns -1 if the label is already defined, or 1 if a branch or jump
+// waiting on it doesn't reach
 extern int emitter_label_add(emitter *em, string key);
 
+// returns the label's offset if it's already defined in the current section,
+// otherwise returns -1 and the instruction at the current position is patched
+// once it can be
 extern int64_t emitter_label_get_or_add_waiter(emitter *em, string key, enum assign_type wait_assign);
 
-extern int emitter_output_elf(emitter *em, int dst);
+// once every section has its final vaddr, patch the references between
+// sections
+// returns FINISH_UNDEFINED if some label was used but never defined, or
+// FINISH_RANGE if an address doesn't fit the .word it's in or a branch or jump
+// doesn't reach it, and sets name to the label
+enum {
+	FINISH_OK,
+	FINISH_UNDEFINED,
+	FINISH_RANGE,
+	FINISH_DUPLICATE, // from emitter_link
+};
+extern int emitter_finish(emitter *em, string *name);
+
+// link inputs assembled with link_input set, and finished, into em
+// their sections are concatenated in order, global labels are resolved
+// across them, and their relocations become em's fixups, for emitter_finish
+// to patch once em has its final vaddrs
+// local labels keep their symbols, unless another input already has a symbol
+// by that name
+// returns FINISH_DUPLICATE if a global label is defined twice, or
+// FINISH_UNDEFINED if a label is used but not defined by any of them, and sets
+// name to the label
+extern int emitter_link(emitter *em, emitter **parts, size_t n, string *name);
+
+// forget everything emitted, so em can assemble another program with the
+// memory and file buffers it already has
+// the options (relocatable, link_input, debug, the source file in lines and
+// recover) are kept
+extern void emitter_reset(emitter *em);
+
+// save what em has assembled so far, so it can later go back to this point
+// and go on from there with different lines
+// save holds its own copy of the labels and fixups, and is freed with
+// emitter_discard
+extern void emitter_save(emitter *em, emitter *save);
+
+// go back to where em was when save was taken, which is left as it was
+// bytes before that point that were patched since are patched again by the
+// waiters and fixups that did it
+// what was flushed past it is left in the file buffers, where flushes and
+// holes go over it, so a save taken further along in the same run can be
+// restored too, as long as em has only assembled up to where that run was
+// since, as emitter_same_state tells
+extern void emitter_restore(emitter *em, emitter *save);
+
+// whether a and b are at the same point, with the same labels, fixups and
+// bytes not yet flushed, so the same lines assemble the same way from both,
+// even if the bytes flushed before differ
+extern int emitter_same_state(emitter *a, emitter *b);
+
+// makes save, taken after from in the same run, as if it had been taken after
+// to, which is at the same point as from by emitter_same_state, so only the
+// line numbers differ
+// the line program isn't moved along, so this isn't for -g
+extern void emitter_rebase(emitter *save, emitter *from, emitter *to);
+
+// for em, which has got to where another run was when it saved from, by
+// emitter_same_state, goes to where that run was when it saved to, without
+// assembling the lines in between again
+// to is rebased onto em, and the file buffers must still have what that run
+// flushed up to it, as emitter_restore has it
+extern void emitter_catch_up(emitter *em, emitter *from, emitter *to);
+
+extern void emitter_discard(emitter *save);
+
+// add a row mapping .text offset idx to the current line
+extern void emitter_line(emitter *em, uint64_t idx);
+
+// returns the label named key, adding an unassigned one if there is none
+extern label *emitter_label_get(emitter *em, string key);
+
+// address of _start if defined, otherwise the start of .text
+extern uint64_t emitter_entry(emitter *em);
+
+// write out everything emitted to a section
+extern int emit_section(emitter *em, output *dst, int sect);
+
+// the output formats
+// each returns 0 on success, otherwise returns nonzero and sets errno
+
+// a truncated SHA-256, the size of the SHA-1 ids GNU ld gives
+#define BUILD_ID_SIZE 20
+
+typedef struct {
+	int strip; // leave out the section headers and symbol table
+	int build_id; // add an NT_GNU_BUILD_ID note
+	uint64_t text_align; // of the .text segment, a power of two of at least a page
+	// EF_RISCV_FLOAT_ABI_*, the only e_flags set, since nothing emitted is
+	// compressed (EF_RISCV_RVC) or RV64E (EF_RISCV_RVE)
+	uint32_t float_abi;
+} elf_options;
+
+extern int emitter_output_elf(emitter *em, output *dst, const elf_options *opts);
+
+// for --rebase-table, every field of the ELF emitter_output_elf wrote, which
+// was image_size bytes, that holds an address, as rebase.h lays it out
+extern int emitter_output_rebase_table(emitter *em, output *dst, const elf_options *opts, uint64_t image_size);
+
+// bytes of headers an ELF maps in front of .text, so code starts this far
+// past .text's vaddr
+extern uint64_t elf_headers_size(emitter *em, const elf_options *opts);
+
+// bytes of the segment holding the headers and .text, including padding
+extern uint64_t elf_text_segment_size(emitter *em, const elf_options *opts);
+
+// for --watch, which patches the outputs it wrote before in place when
+// nothing moved
+// the file offset of sect's first byte in an ELF that isn't from -c
+extern uint64_t elf_section_offset(emitter *em, const elf_options *opts, int sect);
+
+// sets id to the id that goes in the build id note, which is the first
+// BUILD_ID_SIZE bytes of an image_hash of the ELF with the id left as zeros,
+// and at to where it goes in the file
+extern int elf_build_id(emitter *em, const elf_options *opts, uint8_t *id, uint64_t *at);
+
+// flat binary, with the space between sections filled with fill
+extern int emitter_output_bin(emitter *em, output *dst, uint8_t fill);
+
+// the file offset of sect's first byte in a flat binary, for a section with
+// anything in it
+extern uint64_t bin_section_offset(emitter *em, int sect);
+
+extern int emitter_output_ihex(emitter *em, output *dst);
+
+extern int emitter_output_srec(emitter *em, output *dst);
 
 #endif
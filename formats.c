@@ -0,0 +1,230 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "emitter.h"
+#include "output.h"
+
+// writers for formats other than ELF, mostly for flashing firmware
+// unlike the ELF, which maps its headers along with .text, these place each
+// section at exactly its vaddr, which is where labels say it is
+
+// how much section data is read at a time, and how much text is batched up
+// before being written
+#define CHUNK (64 * 1024)
+
+// the sections with anything in them, sorted by vaddr
+static int sorted_sections(emitter *em, int order[N_SECTIONS]) {
+	int n = 0;
+	for (int sect = 0; sect < N_SECTIONS; sect++) {
+		if (em->section[sect].pos == 0)
+			continue;
+		int i = n++;
+		while (i > 0 && em->section[order[i - 1]].vaddr > em->section[sect].vaddr) {
+			order[i] = order[i - 1];
+			i--;
+		}
+		order[i] = sect;
+	}
+	return n;
+}
+
+// flat image from the lowest section's vaddr to the end of the highest, with
+// any space between sections filled with fill
+int emitter_output_bin(emitter *em, output *dst, uint8_t fill) {
+	int order[N_SECTIONS];
+	int n = sorted_sections(em, order);
+	if (n == 0)
+		return 0;
+	uint64_t base = em->section[order[0]].vaddr;
+	uint8_t gap[CHUNK];
+	memset(gap, fill, sizeof gap);
+	for (int i = 0; i < n; i++) {
+		int sect = order[i];
+		uint64_t at = em->section[sect].vaddr - base;
+		if (at < (uint64_t) dst->pos) {
+			errno = EINVAL; // sections overlap
+			return 1;
+		}
+		if (fill == 0) {
+			// leave a hole, which reads as zeros
+			if (output_seek(dst, at))
+				return 1;
+		}
+		while ((uint64_t) dst->pos < at) {
+			if (output_write(dst, gap, MIN(sizeof gap, at - dst->pos)))
+				return 1;
+		}
+		if (emit_section(em, dst, sect))
+			return 1;
+	}
+	return 0;
+}
+
+uint64_t bin_section_offset(emitter *em, int sect) {
+	int order[N_SECTIONS];
+	sorted_sections(em, order);
+	return em->section[sect].vaddr - em->section[order[0]].vaddr;
+}
+
+// text formats are built up in a buffer of lines and written out in batches
+typedef struct {
+	output *dst;
+	char buf[CHUNK];
+	size_t len;
+	uint64_t records; // data records written, for the SREC count record
+	uint64_t upper; // upper half of the last Intel HEX extended address
+} text_out;
+
+static int text_flush(text_out *t) {
+	int err = output_write(t->dst, t->buf, t->len);
+	t->len = 0;
+	return err;
+}
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+// appends a record made of a prefix and some bytes written in hex, followed by
+// a checksum byte made by checksum()
+// every byte after the prefix, including the checksum, is two hex digits
+static int text_record(text_out *t, const char *prefix, const uint8_t *data, size_t n, uint8_t checksum) {
+	size_t need = strlen(prefix) + 2 * (n + 1) + 1;
+	if (t->len + need > sizeof t->buf && text_flush(t))
+		return 1;
+	char *s = t->buf + t->len;
+	s = stpcpy(s, prefix);
+	for (size_t i = 0; i < n; i++) {
+		*s++ = hex_digits[data[i] >> 4];
+		*s++ = hex_digits[data[i] & 15];
+	}
+	*s++ = hex_digits[checksum >> 4];
+	*s++ = hex_digits[checksum & 15];
+	*s++ = '\n';
+	t->len = s - t->buf;
+	return 0;
+}
+
+static uint8_t sum(const uint8_t *data, size_t n) {
+	uint8_t res = 0;
+	for (size_t i = 0; i < n; i++)
+		res += data[i];
+	return res;
+}
+
+// calls record(t, addr, data, n) on every piece of every section in address
+// order, with pieces of at most max bytes that never cross a multiple of
+// boundary (if boundary is nonzero)
+static int for_each_piece(emitter *em, text_out *t, size_t max, uint64_t boundary, int (*record)(text_out *, uint64_t, const uint8_t *, size_t)) {
+	int order[N_SECTIONS];
+	int n = sorted_sections(em, order);
+	uint8_t chunk[CHUNK];
+	for (int i = 0; i < n; i++) {
+		int sect = order[i];
+		uint64_t len = em->section[sect].pos;
+		for (uint64_t idx = 0; idx < len; idx += sizeof chunk) {
+			size_t m = MIN(sizeof chunk, len - idx);
+			emitter_read(em, sect, idx, chunk, m);
+			for (size_t j = 0; j < m;) {
+				uint64_t addr = em->section[sect].vaddr + idx + j;
+				size_t k = MIN(max, m - j);
+				if (boundary)
+					k = MIN(k, boundary - addr % boundary);
+				if (record(t, addr, chunk + j, k))
+					return 1;
+				j += k;
+			}
+		}
+	}
+	return 0;
+}
+
+// Intel HEX, using extended linear address records for 32-bit addresses
+static int ihex_data(text_out *t, uint64_t addr, const uint8_t *data, size_t n) {
+	if (addr + n > 0x100000000ULL) {
+		errno = ERANGE;
+		return 1;
+	}
+	uint8_t rec[4 + 16];
+	if (addr >> 16 != t->upper) {
+		t->upper = addr >> 16;
+		rec[0] = 2;
+		rec[1] = 0;
+		rec[2] = 0;
+		rec[3] = 4; // extended linear address
+		rec[4] = addr >> 24;
+		rec[5] = addr >> 16;
+		if (text_record(t, ":", rec, 6, -sum(rec, 6)))
+			return 1;
+	}
+	rec[0] = n;
+	rec[1] = addr >> 8;
+	rec[2] = addr;
+	rec[3] = 0; // data
+	memcpy(rec + 4, data, n);
+	return text_record(t, ":", rec, 4 + n, -sum(rec, 4 + n));
+}
+
+int emitter_output_ihex(emitter *em, output *dst) {
+	text_out t = { .dst = dst, .len = 0, .records = 0, .upper = -1 };
+	if (for_each_piece(em, &t, 16, 0x10000, ihex_data))
+		return 1;
+	uint64_t entry = emitter_entry(em);
+	if (entry >= 0x100000000ULL) {
+		errno = ERANGE;
+		return 1;
+	}
+	uint8_t rec[] = { 4, 0, 0, 5, entry >> 24, entry >> 16, entry >> 8, entry }; // start linear address
+	uint8_t eof[] = { 0, 0, 0, 1 };
+	return (
+		text_record(&t, ":", rec, sizeof rec, -sum(rec, sizeof rec))
+		|| text_record(&t, ":", eof, sizeof eof, -sum(eof, sizeof eof))
+		|| text_flush(&t)
+	);
+}
+
+// Motorola S-records, using S3 records for 32-bit addresses
+static int srec_data(text_out *t, uint64_t addr, const uint8_t *data, size_t n) {
+	if (addr + n > 0x100000000ULL) {
+		errno = ERANGE;
+		return 1;
+	}
+	uint8_t rec[5 + 32];
+	rec[0] = 4 + n + 1; // count of address, data, and checksum bytes
+	rec[1] = addr >> 24;
+	rec[2] = addr >> 16;
+	rec[3] = addr >> 8;
+	rec[4] = addr;
+	memcpy(rec + 5, data, n);
+	t->records++;
+	return text_record(t, "S3", rec, 5 + n, ~sum(rec, 5 + n));
+}
+
+int emitter_output_srec(emitter *em, output *dst) {
+	text_out t = { .dst = dst, .len = 0, .records = 0, .upper = 0 };
+	uint8_t head[] = { 3 + 3, 0, 0, 'a', 's', 'm' };
+	if (
+		text_record(&t, "S0", head, sizeof head, ~sum(head, sizeof head))
+		|| for_each_piece(em, &t, 32, 0, srec_data)
+	)
+		return 1;
+	if (t.records <= 0xffff) {
+		uint8_t count[] = { 3, t.records >> 8, t.records };
+		if (text_record(&t, "S5", count, sizeof count, ~sum(count, sizeof count)))
+			return 1;
+	} else if (t.records <= 0xffffff) {
+		uint8_t count[] = { 4, t.records >> 16, t.records >> 8, t.records };
+		if (text_record(&t, "S6", count, sizeof count, ~sum(count, sizeof count)))
+			return 1;
+	}
+	uint64_t entry = emitter_entry(em);
+	if (entry >= 0x100000000ULL) {
+		errno = ERANGE;
+		return 1;
+	}
+	uint8_t end[] = { 5, entry >> 24, entry >> 16, entry >> 8, entry };
+	return (
+		text_record(&t, "S7", end, sizeof end, ~sum(end, sizeof end))
+		|| text_flush(&t)
+	);
+}
@@ -0,0 +1,281 @@
+#include <string.h>
+
+#include "hash.h"
+
+// https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+// TODO: these assume a little endian machine, like the rest of the assembler
+static uint64_t read64(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t lane) {
+	acc += lane * PRIME64_2;
+	acc = rotl(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t v) {
+	acc ^= round64(0, v);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+	const uint8_t *p = data;
+	const uint8_t *end = p + len;
+	uint64_t acc;
+	if (len >= 32) {
+		// four independent lanes, so each step of the loop doesn't wait
+		// on the last
+		uint64_t v[4] = {
+			seed + PRIME64_1 + PRIME64_2,
+			seed + PRIME64_2,
+			seed,
+			seed - PRIME64_1,
+		};
+		do {
+			for (int i = 0; i < 4; i++)
+				v[i] = round64(v[i], read64(p + 8 * i));
+			p += 32;
+		} while (end - p >= 32);
+		acc = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+		for (int i = 0; i < 4; i++)
+			acc = merge64(acc, v[i]);
+	} else {
+		acc = seed + PRIME64_5;
+	}
+	acc += len;
+	for (; end - p >= 8; p += 8) {
+		acc ^= round64(0, read64(p));
+		acc = rotl(acc, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (end - p >= 4) {
+		acc ^= read32(p) * PRIME64_1;
+		acc = rotl(acc, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		acc ^= *p * PRIME64_5;
+		acc = rotl(acc, 11) * PRIME64_1;
+	}
+	acc ^= acc >> 33;
+	acc *= PRIME64_2;
+	acc ^= acc >> 29;
+	acc *= PRIME64_3;
+	acc ^= acc >> 32;
+	return acc;
+}
+
+uint64_t hash_combine(uint64_t acc, uint64_t h) {
+	uint64_t both[2] = {acc, h};
+	return xxh64(both, sizeof both, 0);
+}
+
+// https://nvlpubs.nist.gov/nistpubs/FIPS/NIST.FIPS.180-4.pdf
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr32(uint32_t x, int r) {
+	return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_block(uint32_t *state, const uint8_t *block) {
+	uint32_t w[64];
+	for (int i = 0; i < 16; i++)
+		w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 | (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	for (int i = 0; i < 64; i++) {
+		uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+void sha256_init(sha256_ctx *ctx) {
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	memcpy(ctx->state, init, sizeof init);
+	ctx->len = 0;
+}
+
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len) {
+	const uint8_t *p = data;
+	size_t have = ctx->len % 64;
+	ctx->len += len;
+	if (have > 0) {
+		size_t n = len < 64 - have ? len : 64 - have;
+		memcpy(ctx->block + have, p, n);
+		p += n;
+		len -= n;
+		if (have + n < 64)
+			return;
+		sha256_block(ctx->state, ctx->block);
+	}
+	for (; len >= 64; len -= 64, p += 64)
+		sha256_block(ctx->state, p);
+	memcpy(ctx->block, p, len);
+}
+
+void sha256_final(sha256_ctx *ctx, uint8_t *out) {
+	// the last block is padded with a 1 bit, then zeros, then the length in
+	// bits, which may spill into a block of its own
+	size_t left = ctx->len % 64;
+	uint8_t last[128] = {0};
+	memcpy(last, ctx->block, left);
+	last[left] = 0x80;
+	size_t end = left < 56 ? 64 : 128;
+	uint64_t bits = ctx->len * 8;
+	for (int i = 0; i < 8; i++)
+		last[end - 1 - i] = bits >> (8 * i);
+	sha256_block(ctx->state, last);
+	if (end == 128)
+		sha256_block(ctx->state, last + 64);
+	for (int i = 0; i < 8; i++) {
+		out[4 * i] = ctx->state[i] >> 24;
+		out[4 * i + 1] = ctx->state[i] >> 16;
+		out[4 * i + 2] = ctx->state[i] >> 8;
+		out[4 * i + 3] = ctx->state[i];
+	}
+}
+
+void sha256(const void *data, size_t len, uint8_t *out) {
+	sha256_ctx ctx;
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, len);
+	sha256_final(&ctx, out);
+}
+
+void image_hash_init(image_hash *h) {
+	sha256_init(&h->data);
+	sha256_init(&h->zeros);
+	h->len = 0;
+	h->zeros_from = -1;
+}
+
+// ends the run of zero blocks, if there is one, at at
+static void image_hash_end_zeros(image_hash *h, uint64_t at) {
+	if (h->zeros_from == (uint64_t) -1)
+		return;
+	uint64_t run[2] = {h->zeros_from, at};
+	sha256_update(&h->zeros, run, sizeof run);
+	h->zeros_from = -1;
+}
+
+// the n byte block ending at h->len, which is only short if it's the last
+static void image_hash_block(image_hash *h, const uint8_t *block, size_t n) {
+	static const uint8_t zero_block[IMAGE_BLOCK];
+	uint64_t at = h->len - n;
+	if (memcmp(block, zero_block, n) == 0) {
+		if (h->zeros_from == (uint64_t) -1)
+			h->zeros_from = at;
+		return;
+	}
+	image_hash_end_zeros(h, at);
+	sha256_update(&h->data, block, n);
+}
+
+void image_hash_update(image_hash *h, const void *data, size_t len) {
+	const uint8_t *p = data;
+	while (len > 0) {
+		size_t have = h->len % IMAGE_BLOCK;
+		if (have == 0 && len >= IMAGE_BLOCK) {
+			// a whole block, which needn't be copied
+			h->len += IMAGE_BLOCK;
+			image_hash_block(h, p, IMAGE_BLOCK);
+			p += IMAGE_BLOCK;
+			len -= IMAGE_BLOCK;
+			continue;
+		}
+		size_t n = len < IMAGE_BLOCK - have ? len : IMAGE_BLOCK - have;
+		memcpy(h->block + have, p, n);
+		h->len += n;
+		p += n;
+		len -= n;
+		if (h->len % IMAGE_BLOCK == 0)
+			image_hash_block(h, h->block, IMAGE_BLOCK);
+	}
+}
+
+void image_hash_zeros(image_hash *h, uint64_t len) {
+	size_t have = h->len % IMAGE_BLOCK;
+	if (have > 0) {
+		size_t n = len < IMAGE_BLOCK - have ? len : IMAGE_BLOCK - have;
+		memset(h->block + have, 0, n);
+		h->len += n;
+		len -= n;
+		if (h->len % IMAGE_BLOCK != 0)
+			return;
+		image_hash_block(h, h->block, IMAGE_BLOCK);
+	}
+	// whole blocks of zeros only move the run along
+	uint64_t whole = len - len % IMAGE_BLOCK;
+	if (whole > 0 && h->zeros_from == (uint64_t) -1)
+		h->zeros_from = h->len;
+	h->len += len;
+	memset(h->block, 0, len - whole);
+}
+
+void image_hash_final(image_hash *h, uint8_t *out) {
+	size_t have = h->len % IMAGE_BLOCK;
+	if (have > 0)
+		image_hash_block(h, h->block, have);
+	image_hash_end_zeros(h, h->len);
+	// the two hashes, and the length, which together pin down every byte
+	uint8_t digests[2][32];
+	sha256_final(&h->data, digests[0]);
+	sha256_final(&h->zeros, digests[1]);
+	sha256_ctx all;
+	sha256_init(&all);
+	sha256_update(&all, digests, sizeof digests);
+	sha256_update(&all, &h->len, sizeof h->len);
+	sha256_final(&all, out);
+}
@@ -0,0 +1,53 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// XXH64, which is fast enough to run over every byte that's emitted
+extern uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+// fold h into a running hash acc, in a way that depends on the order
+extern uint64_t hash_combine(uint64_t acc, uint64_t h);
+
+// SHA-256, for where something else picks the hash, like a content addressed
+// store or a build id, since it's far slower than XXH64
+// out is 32 bytes
+extern void sha256(const void *data, size_t len, uint8_t *out);
+
+// the same, for data that comes in pieces
+typedef struct {
+	uint32_t state[8];
+	uint64_t len;
+	uint8_t block[64]; // the last len % 64 bytes, not hashed yet
+} sha256_ctx;
+
+extern void sha256_init(sha256_ctx *ctx);
+extern void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+extern void sha256_final(sha256_ctx *ctx, uint8_t *out);
+
+#define IMAGE_BLOCK 4096
+
+// a SHA-256 of an image, given its bytes in order, for the build id
+// each block of zeros, which is where the holes and gaps usually are, is
+// hashed by where it is rather than by its bytes, so a gigabyte of .space
+// costs nothing, and since that only depends on the bytes, the same image
+// always hashes the same, however it was written
+typedef struct {
+	sha256_ctx data; // the blocks that aren't all zeros
+	sha256_ctx zeros; // where each run of zero blocks starts and ends
+	uint64_t len;
+	uint64_t zeros_from; // start of the current run of zero blocks, or -1
+	uint8_t block[IMAGE_BLOCK]; // the last len % IMAGE_BLOCK bytes
+} image_hash;
+
+extern void image_hash_init(image_hash *h);
+extern void image_hash_update(image_hash *h, const void *data, size_t len);
+
+// image_hash_update with len zeros
+extern void image_hash_zeros(image_hash *h, uint64_t len);
+
+// out is 32 bytes
+extern void image_hash_final(image_hash *h, uint8_t *out);
+
+#endif
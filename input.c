@@ -0,0 +1,251 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+#include "input.h"
+
+void input_stream_init(input_stream *in, int fd) {
+	in->cur = 0;
+	in->carry = NULL;
+	in->carry_len = 0;
+	in->fd = fd;
+	in->eof = 0;
+}
+
+// returns the index one past the last line ending in buf[from..len), or 0 if
+// there is none, buf[0] being the start of a line
+// a '\n' preceded by '\\' only continues the line inside a string literal,
+// and that takes a scan from the start of the line to tell
+static size_t last_line_end(char *buf, size_t from, size_t len) {
+	size_t i = len;
+	while (i > from && buf[i - 1] != '\n')
+		i--;
+	if (i == from)
+		return 0;
+	if (i < 2 || buf[i - 2] != '\\')
+		return i;
+	// a '\n' with no '\\' before it always ends a line, even one in a
+	// string (which is an error), so the line starts after the last of those
+	size_t start = i - 1;
+	while (start > 0 && !(buf[start - 1] == '\n' && (start < 2 || buf[start - 2] != '\\')))
+		start--;
+	size_t end = start;
+	int quoted = 0;
+	for (size_t j = start; j < i; j++) {
+		if (buf[j] == '\n') {
+			end = j + 1;
+			quoted = 0;
+		} else if (buf[j] == '"') {
+			quoted = !quoted;
+		} else if (buf[j] == '\\' && quoted) {
+			// skips the escaped character, a continued line's '\n' too
+			j++;
+		}
+	}
+	return end > from ? end : 0;
+}
+
+char *input_stream_next(input_stream *in, char **begin, char **end) {
+	if (in->eof && in->carry_len == 0) {
+		*begin = NULL;
+		return NULL;
+	}
+	int next = (in->cur + 1) % N_INPUT_BUFS;
+	char *buf = in->buf[next];
+	size_t len = in->carry_len;
+	memmove(buf, in->carry, len);
+	// the carried bytes are already known to hold no line ending
+	size_t scanned = len;
+	for (;;) {
+		ssize_t got = read(in->fd, buf + len, INPUT_BUF_SIZE - len);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			return strerror(errno);
+		}
+		len += got;
+		if (got == 0) {
+			in->eof = 1;
+			break;
+		}
+		size_t line_end = last_line_end(buf, scanned, len);
+		if (line_end > 0) {
+			in->cur = next;
+			in->carry = buf + line_end;
+			in->carry_len = len - line_end;
+			*begin = buf;
+			*end = buf + line_end;
+			return NULL;
+		}
+		scanned = len;
+		if (len == INPUT_BUF_SIZE)
+			return "line too long";
+	}
+	// end of input: hand out whatever is left as the final chunk
+	in->cur = next;
+	in->carry_len = 0;
+	if (len == 0) {
+		*begin = NULL;
+		return NULL;
+	}
+	if (buf[len - 1] != '\n')
+		buf[len++] = '\n';
+	buf[len] = '\0';
+	*begin = buf;
+	*end = buf + len;
+	return NULL;
+}
+
+const char *const input_strategy_names[N_INPUT_STRATEGIES] = {
+	[INPUT_AUTO] = "auto",
+	[INPUT_MMAP] = "mmap",
+	[INPUT_POPULATE] = "populate",
+	[INPUT_READ] = "read",
+	[INPUT_HUGE] = "huge",
+};
+
+// largest file INPUT_AUTO reads rather than maps
+// a file this size takes a single read call, which measured faster than
+// mapping it for files up to about this size, and slower above it
+#define AUTO_READ_MAX INPUT_BUF_SIZE
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// reads the whole file into an anonymous mapping aligned to a huge page, so
+// the kernel can back it with transparent huge pages and the parser takes
+// fewer TLB misses walking through it
+static char *input_open_huge(input *in, size_t size) {
+	// room for the terminating '\n' and '\0', plus slack for alignment
+	in->map_len = roundup(size + 2, HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE;
+	in->map = mmap(NULL, in->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (in->map == MAP_FAILED) {
+		in->map = NULL;
+		return strerror(errno);
+	}
+	in->mem = (char *) roundup((uintptr_t) in->map, HUGE_PAGE_SIZE);
+	// purely a hint, so failure (no THP support) is fine
+	madvise(in->mem, roundup(size + 2, HUGE_PAGE_SIZE), MADV_HUGEPAGE);
+	size_t len = 0;
+	while (len < size) {
+		ssize_t got = read(in->fd, in->mem + len, size - len);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			return strerror(errno);
+		}
+		if (got == 0)
+			break; // the file shrank, just use what's there
+		len += got;
+	}
+	if (len == 0 || in->mem[len - 1] != '\n')
+		in->mem[len++] = '\n';
+	in->mem[len] = '\0';
+	in->mem_len = len;
+	return NULL;
+}
+
+// maps the file read-only, and copies out the unterminated final line (if
+// any) so it can be given a '\n' without writing into the mapping
+static char *input_open_mmap(input *in, size_t size, int populate) {
+	int flags = MAP_PRIVATE;
+	if (populate)
+		flags |= MAP_POPULATE;
+	// NOTE: changes made to the underlying file while it's mapped are
+	// unspecified, the worst that can happen is that this process reads
+	// garbage, but it never reads past the last '\n' in the mapping
+	in->map = mmap(NULL, size, PROT_READ, flags, in->fd, 0);
+	if (in->map == MAP_FAILED) {
+		in->map = NULL;
+		return strerror(errno);
+	}
+	in->map_len = size;
+	if (!populate)
+		madvise(in->map, size, MADV_SEQUENTIAL);
+	in->mem = in->map;
+	in->mem_len = last_line_end(in->mem, 0, size);
+	in->tail_len = size - in->mem_len;
+	if (in->tail_len > 0) {
+		in->tail = malloc(in->tail_len + 2);
+		if (!in->tail)
+			return "out of memory";
+		memcpy(in->tail, in->mem + in->mem_len, in->tail_len);
+		if (in->tail[in->tail_len - 1] != '\n')
+			in->tail[in->tail_len++] = '\n';
+		in->tail[in->tail_len] = '\0';
+	}
+	return NULL;
+}
+
+char *input_open(input *in, int fd, const struct stat *sb, enum input_strategy strategy, input_stream *stream) {
+	memset(in, 0, sizeof *in);
+	in->fd = fd;
+	if (!S_ISREG(sb->st_mode)) {
+		// pipes, sockets, etc. can only be streamed
+		strategy = INPUT_READ;
+	} else if (strategy == INPUT_AUTO) {
+		// small files are cheaper to read than to set up and tear down
+		// a mapping for
+		// past that, parsing dominates and a plain mapping is as good
+		// as anything: prefaulting or huge pages measured no faster
+		// with the file in the page cache, so they're left opt-in
+		if ((size_t) sb->st_size <= AUTO_READ_MAX)
+			strategy = INPUT_READ;
+		else
+			strategy = INPUT_MMAP;
+	}
+	in->strategy = strategy;
+	switch (strategy) {
+	case INPUT_READ:
+		in->stream = stream;
+		if (!stream) {
+			in->stream = malloc(sizeof *in->stream);
+			if (!in->stream)
+				return "out of memory";
+			in->own_stream = 1;
+		}
+		input_stream_init(in->stream, fd);
+		return NULL;
+	case INPUT_HUGE:
+		return input_open_huge(in, sb->st_size);
+	case INPUT_MMAP:
+	case INPUT_POPULATE:
+		return input_open_mmap(in, sb->st_size, strategy == INPUT_POPULATE);
+	default:
+		return "unknown input strategy";
+	}
+}
+
+char *input_next(input *in, char **begin, char **end) {
+	if (in->stream)
+		return input_stream_next(in->stream, begin, end);
+	*begin = NULL;
+	if (in->stage == 0) {
+		in->stage++;
+		if (in->mem_len > 0) {
+			*begin = in->mem;
+			*end = in->mem + in->mem_len;
+			return NULL;
+		}
+	}
+	if (in->stage == 1) {
+		in->stage++;
+		if (in->tail_len > 0) {
+			*begin = in->tail;
+			*end = in->tail + in->tail_len;
+		}
+	}
+	return NULL;
+}
+
+void input_close(input *in) {
+	if (in->own_stream)
+		free(in->stream);
+	free(in->tail);
+	if (in->map)
+		munmap(in->map, in->map_len);
+	close(in->fd);
+}
@@ -0,0 +1,81 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+// size of each buffer that a stream is read into
+// no single line may be longer than this
+#define INPUT_BUF_SIZE (64 * 1024)
+#define N_INPUT_BUFS 2
+
+// reads a source file that can't be mmapped (a pipe, stdin, etc.) in chunks
+// of whole lines, so memory use stays bounded no matter how large the input is
+// the buffers form a ring: the incomplete line at the end of one buffer is
+// carried to the start of the next, so the last chunk handed out stays valid
+// until the next call to input_stream_next
+typedef struct {
+	// 2 extra bytes for the '\n' and '\0' terminating the final line
+	char buf[N_INPUT_BUFS][INPUT_BUF_SIZE + 2];
+	int cur; // buffer the last chunk came from
+	char *carry; // start of the incomplete line trailing the last chunk
+	size_t carry_len;
+	int fd;
+	int eof;
+} input_stream;
+
+extern void input_stream_init(input_stream *in, int fd);
+
+// sets *begin and *end to the bounds of the next chunk of complete lines, *end
+// being one past the chunk's final '\n', or sets *begin to NULL at the end of
+// the input
+// a chunk never ends on an escaped newline, so a string literal continued
+// onto the next line is never split between chunks
+// returns NULL if no error occured, otherwise returns a description of the
+// error
+extern char *input_stream_next(input_stream *in, char **begin, char **end);
+
+enum input_strategy {
+	INPUT_AUTO, // pick one of the below from the kind and size of the file
+	INPUT_MMAP, // mmap, advising the kernel that it's read sequentially
+	INPUT_POPULATE, // mmap with MAP_POPULATE, prefaulting every page up front
+	INPUT_READ, // read into a ring of reused buffers, see input_stream
+	INPUT_HUGE, // read all at once into memory backed by transparent huge pages
+
+	N_INPUT_STRATEGIES,
+};
+
+// names as given on the command line, indexed by strategy
+extern const char *const input_strategy_names[N_INPUT_STRATEGIES];
+
+// a source file, read by one of the strategies above
+// it hands out chunks of complete lines the same way input_stream does, so
+// the parser always finds a '\n' at the end of its line without anything
+// having to be written into a mapping of the file
+typedef struct {
+	enum input_strategy strategy;
+	int fd;
+	input_stream *stream; // INPUT_READ
+	int own_stream; // whether stream was allocated by input_open
+	char *mem; // the mapping or huge page buffer
+	size_t mem_len; // bytes of input in mem
+	void *map; // what to munmap
+	size_t map_len;
+	char *tail; // copy of a mapping's unterminated final line
+	size_t tail_len;
+	int stage; // how many of mem and tail have been handed out
+} input;
+
+// takes ownership of fd, which sb describes
+// stream is used if the file is read in chunks, so it can be reused from one
+// file to the next, or if it's NULL one is allocated
+// returns NULL if no error occured, otherwise returns a description of the
+// error, and in must still be closed
+extern char *input_open(input *in, int fd, const struct stat *sb, enum input_strategy strategy, input_stream *stream);
+
+// same as input_stream_next, but for any strategy
+extern char *input_next(input *in, char **begin, char **end);
+
+extern void input_close(input *in);
+
+#endif
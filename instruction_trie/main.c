@@ -281,6 +281,10 @@ int main() {
 	A(".space", K_SPACE);
 	A(".text", K_TEXT);
 	A(".data", K_DATA);
+	A(".size", K_SIZE);
+	A(".type", K_TYPE);
+	A(".globl", K_GLOBL);
+	A(".global", K_GLOBL);
 
 	gpos = 0;
 	apos = 0;
@@ -0,0 +1,176 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jobserver.h"
+
+enum {
+	JOBSERVER_NONE, // every token is free
+	JOBSERVER_OK,
+	JOBSERVER_BROKEN, // there is one, but it can't be used, so no token is
+};
+
+static struct {
+	int state;
+	int rfd, wfd; // rfd is non-blocking, and our own
+	// tokens currently taken, given back at exit if the process dies
+	// with threads still running
+	pthread_mutex_t lock;
+	char held[256];
+	size_t n_held;
+} js = {
+	.state = JOBSERVER_NONE,
+	.rfd = -1,
+	.wfd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void jobserver_release_all(void) {
+	pthread_mutex_lock(&js.lock);
+	if (js.n_held > 0 && write(js.wfd, js.held, js.n_held) < 0) {
+		// nothing more can be done about it at exit
+	}
+	js.n_held = 0;
+	pthread_mutex_unlock(&js.lock);
+}
+
+// the last --jobserver-auth= in flags, either fifo:PATH or R,W, and older
+// makes' --jobserver-fds=R,W
+// returns a pointer to the value, which ends at the next space
+static const char *jobserver_auth(const char *flags) {
+	const char *found = NULL;
+	const char *opts[] = {"--jobserver-auth=", "--jobserver-fds="};
+	for (size_t i = 0; i < sizeof opts / sizeof *opts; i++) {
+		for (const char *s = flags; (s = strstr(s, opts[i])); s++)
+			found = s + strlen(opts[i]);
+		if (found)
+			return found;
+	}
+	return NULL;
+}
+
+void jobserver_init(void) {
+	const char *flags = getenv("MAKEFLAGS");
+	if (!flags)
+		return;
+	const char *auth = jobserver_auth(flags);
+	if (!auth) {
+		// make -j1 runs without a jobserver, but still only wants one
+		// job at a time
+		const char *j = strstr(flags, "-j");
+		if (j && atoi(j + 2) == 1)
+			js.state = JOBSERVER_BROKEN;
+		return;
+	}
+	js.state = JOBSERVER_BROKEN;
+	if (strncmp(auth, "fifo:", 5) == 0) {
+		char path[4096];
+		size_t len = strcspn(auth + 5, " ");
+		if (len >= sizeof path)
+			return;
+		memcpy(path, auth + 5, len);
+		path[len] = '\0';
+		js.rfd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		js.wfd = js.rfd;
+	} else {
+		int r, w;
+		if (sscanf(auth, "%d,%d", &r, &w) != 2 || fcntl(r, F_GETFD) == -1 || fcntl(w, F_GETFD) == -1)
+			return;
+		// the pipe is shared with make and everything else it runs,
+		// so rather than make it non-blocking for all of them, open
+		// a description of our own
+		char path[64];
+		snprintf(path, sizeof path, "/proc/self/fd/%d", r);
+		js.rfd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		js.wfd = w;
+	}
+	if (js.rfd == -1)
+		return;
+	js.state = JOBSERVER_OK;
+	atexit(jobserver_release_all);
+}
+
+int jobserver_try_acquire(char *token) {
+	switch (js.state) {
+	case JOBSERVER_NONE:
+		*token = '+';
+		return 1;
+	case JOBSERVER_BROKEN:
+		return 0;
+	}
+	pthread_mutex_lock(&js.lock);
+	int got = 0;
+	if (js.n_held < sizeof js.held && read(js.rfd, token, 1) == 1) {
+		js.held[js.n_held++] = *token;
+		got = 1;
+	}
+	pthread_mutex_unlock(&js.lock);
+	return got;
+}
+
+void jobserver_release(char token) {
+	if (js.state != JOBSERVER_OK)
+		return;
+	pthread_mutex_lock(&js.lock);
+	// make only cares that the same number of bytes come back, but give
+	// back the same one anyway
+	char *held = memchr(js.held, token, js.n_held);
+	if (held) {
+		*held = js.held[--js.n_held];
+		while (write(js.wfd, &token, 1) < 0 && errno == EINTR) {
+		}
+	}
+	pthread_mutex_unlock(&js.lock);
+}
+
+void pool_init(worker_pool *pool, void (*fn)(void *ctx, size_t id), void *ctx, size_t max) {
+	pool->fn = fn;
+	pool->ctx = ctx;
+	pool->max = max;
+	pool->started = 1;
+	pool->threads = malloc(max * sizeof *pool->threads);
+	pool->workers = malloc(max * sizeof *pool->workers);
+	// without room for the others, the calling thread works alone
+	if (!pool->threads || !pool->workers) {
+		pool->max = 1;
+		return;
+	}
+	for (size_t i = 0; i < max; i++) {
+		pool->workers[i] = (pool_worker) {
+			.pool = pool,
+			.id = i,
+		};
+	}
+}
+
+static void *pool_thread(void *arg) {
+	pool_worker *w = arg;
+	w->pool->fn(w->pool->ctx, w->id);
+	jobserver_release(w->token);
+	return NULL;
+}
+
+void pool_grow(worker_pool *pool) {
+	while (pool->started < pool->max) {
+		pool_worker *w = &pool->workers[pool->started];
+		if (!jobserver_try_acquire(&w->token))
+			return;
+		if (pthread_create(&pool->threads[pool->started], NULL, pool_thread, w)) {
+			jobserver_release(w->token);
+			return;
+		}
+		pool->started++;
+	}
+}
+
+void pool_run(worker_pool *pool) {
+	pool_grow(pool);
+	pool->fn(pool->ctx, 0);
+	for (size_t i = 1; i < pool->started; i++)
+		pthread_join(pool->threads[i], NULL);
+	free(pool->threads);
+	free(pool->workers);
+}
@@ -0,0 +1,57 @@
+#ifndef JOBSERVER_H
+#define JOBSERVER_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// a client for the jobserver GNU make shares with everything it runs under
+// -jN, so the assembler's threads count against the same limit as make's
+// jobs rather than on top of them
+// the process was started with one token of its own, and every thread past
+// the first takes another
+
+// reads the jobserver from MAKEFLAGS, if there is one
+// an unusable jobserver (make didn't pass its file descriptors along, which
+// it only does for recipes marked with +) allows no extra threads
+extern void jobserver_init(void);
+
+// takes a token, if one is free right now, and returns nonzero if it got one
+// without a jobserver there's always one
+extern int jobserver_try_acquire(char *token);
+
+// gives a token back to the jobserver
+extern void jobserver_release(char token);
+
+// the threads a parallel mode runs on, which grow in number as tokens come
+// free, up to max
+// fn(ctx, id) runs once on each, with the calling thread as id 0
+typedef struct worker_pool worker_pool;
+
+typedef struct {
+	worker_pool *pool;
+	size_t id;
+	char token;
+} pool_worker;
+
+struct worker_pool {
+	void (*fn)(void *ctx, size_t id);
+	void *ctx;
+	size_t max; // including the calling thread
+	size_t started; // only changed by the calling thread
+	pthread_t *threads;
+	pool_worker *workers;
+};
+
+// allocates room for max threads, but doesn't start any
+extern void pool_init(worker_pool *pool, void (*fn)(void *ctx, size_t id), void *ctx, size_t max);
+
+// starts as many more threads as there are tokens free, up to max
+// only the calling thread may grow the pool, which it may do while it runs
+// fn as worker 0, so more threads join in when make frees up tokens
+extern void pool_grow(worker_pool *pool);
+
+// grows the pool, runs fn as worker 0, then waits for every other worker
+// each worker's token is given back as soon as it finishes
+extern void pool_run(worker_pool *pool);
+
+#endif
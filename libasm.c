@@ -0,0 +1,865 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+#include "assemble.h"
+#include "libasm.h"
+#include "parser.h"
+
+struct asm_ctx {
+	asm_options opts;
+	layout_options lo;
+	emitter *em;
+	// the image is written here, then copied out, so every format's
+	// writer works as it does for a file
+	int out_fd;
+	// a copy of the source, since the parser needs every line to end in a
+	// newline, the last one included
+	char *src;
+	size_t src_cap;
+	char *error;
+	// for programs built by calls, the labels made so far, and the calls,
+	// counted so an error can say which one it was
+	cc_vec(string) labels;
+	size_t calls;
+	int build_failed;
+};
+
+void asm_options_default(asm_options *opts) {
+	*opts = (asm_options) {
+		.format = ASM_ELF,
+		.text_vaddr = 0x00400000,
+		.data_vaddr = 0x10010000,
+		.build_id = 1,
+		.name = "<input>",
+	};
+}
+
+asm_ctx *asm_ctx_new(const asm_options *opts) {
+	const uint64_t pagesize = 0x1000;
+	// the same checks as the CLI's, for the options it has too
+	if (
+		(unsigned) opts->format > ASM_SREC
+		|| opts->text_vaddr % pagesize
+		|| (opts->relocatable && (opts->format != ASM_ELF || opts->auto_layout || opts->strip))
+	) {
+		errno = EINVAL;
+		return NULL;
+	}
+	asm_ctx *ctx = calloc(1, sizeof *ctx);
+	if (!ctx)
+		return NULL;
+	ctx->opts = *opts;
+	if (!ctx->opts.name)
+		ctx->opts.name = "<input>";
+	ctx->lo = (layout_options) {
+		.text_vaddr = opts->text_vaddr,
+		.data_vaddr = opts->data_vaddr,
+		.auto_layout = opts->auto_layout,
+		.elf = {
+			.strip = opts->strip,
+			.build_id = opts->build_id,
+			.text_align = pagesize,
+			.float_abi = opts->float_abi,
+		},
+	};
+	ctx->out_fd = memfd_create("asm output", MFD_CLOEXEC);
+	ctx->em = ctx->out_fd == -1 ? NULL : emitter_new(opts->swap_dir);
+	if (!ctx->em) {
+		int err = errno;
+		if (ctx->out_fd != -1)
+			close(ctx->out_fd);
+		free(ctx);
+		errno = err;
+		return NULL;
+	}
+	ctx->em->relocatable = opts->relocatable;
+	cc_init(&ctx->labels);
+	return ctx;
+}
+
+void asm_ctx_free(asm_ctx *ctx) {
+	// the names are freed with them
+	cc_cleanup(&ctx->labels);
+	emitter_free(ctx->em);
+	close(ctx->out_fd);
+	free(ctx->src);
+	free(ctx->error);
+	free(ctx);
+}
+
+// writes the image to ctx's out_fd, then copies it into out
+static int asm_output(asm_ctx *ctx, asm_buffer *out) {
+	output o;
+	int changed;
+	if (ftruncate(ctx->out_fd, 0) || lseek(ctx->out_fd, 0, SEEK_SET) == -1)
+		return -1;
+	output_init(&o, ctx->out_fd);
+	if (
+		write_format((enum output_format) ctx->opts.format, ctx->em, &o, &ctx->lo.elf, ctx->opts.gap_fill)
+		|| output_close(&o, &changed)
+	)
+		return -1;
+	size_t len = o.end;
+	uint8_t *data = malloc(len ? len : 1);
+	if (!data)
+		return -1;
+	size_t have = 0;
+	while (have < len) {
+		ssize_t got = pread(ctx->out_fd, data + have, len - have, have);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0) {
+			if (got == 0)
+				errno = EIO;
+			free(data);
+			return -1;
+		}
+		have += got;
+	}
+	out->data = data;
+	out->len = len;
+	return 0;
+}
+
+// closes a log opened with open_memstream, which becomes ctx's error if
+// there was one
+static const char *asm_log_close(asm_ctx *ctx, FILE *log, char **log_buf, size_t *log_len, int failed) {
+	if (fclose(log) || !failed) {
+		free(*log_buf);
+		return failed ? "Out of memory" : NULL;
+	}
+	// the last newline isn't part of the error
+	if (*log_len > 0 && (*log_buf)[*log_len - 1] == '\n')
+		(*log_buf)[*log_len - 1] = '\0';
+	ctx->error = *log_buf;
+	return ctx->error;
+}
+
+// where asm_jit puts a program: .text at addr, then .data after it
+typedef struct {
+	uint8_t *dst;
+	size_t cap;
+	uint64_t addr;
+	size_t *used;
+} jit_target;
+
+// gives em's sections their vaddrs in jit's buffer, then copies them there
+static int asm_place(asm_ctx *ctx, jit_target *jit, FILE *log) {
+	emitter *em = ctx->em;
+	uint64_t text_len = em->section[SECT_TEXT].pos;
+	uint64_t data_off = roundup(text_len, 16);
+	uint64_t data_len = em->section[SECT_DATA].pos;
+	// with no .data, there's no padding for it either
+	uint64_t len = data_len ? data_off + data_len : text_len;
+	if (len > jit->cap) {
+		fprintf(log, "%s: the program needs %" PRIu64 " bytes, but the buffer has %zu\n", ctx->opts.name, len, jit->cap);
+		return 1;
+	}
+	em->section[SECT_TEXT].vaddr = jit->addr;
+	em->section[SECT_DATA].vaddr = jit->addr + data_off;
+	if (finish_and_report(em, ctx->opts.name, log))
+		return 1;
+	emitter_read(em, SECT_TEXT, 0, jit->dst, text_len);
+	if (data_len) {
+		memset(jit->dst + text_len, 0, data_off - text_len);
+		emitter_read(em, SECT_DATA, 0, jit->dst + data_off, data_len);
+	}
+	*jit->used = len;
+	return 0;
+}
+
+// parses the first src_len bytes of ctx's copy of the source, if there are
+// any, then lays out what's been assembled and writes it to out, or with jit
+// set, places it in the caller's buffer
+// anything printed along the way is the error
+static const char *asm_run(asm_ctx *ctx, size_t src_len, asm_buffer *out, jit_target *jit) {
+	char *log_buf = NULL;
+	size_t log_len = 0;
+	FILE *log = open_memstream(&log_buf, &log_len);
+	if (!log)
+		return "Out of memory";
+	emitter *em = ctx->em;
+	jmp_buf recover;
+	int failed;
+	if (setjmp(recover)) {
+		// em is only fit to be reset, which the next run does
+		fprintf(log, "%s: %s", ctx->opts.name, em->panicked);
+		failed = 1;
+	} else {
+		em->recover = &recover;
+		long line = 1;
+		failed = src_len > 0 && assemble_chunk(ctx->src, ctx->src + src_len, em, ctx->opts.name, &line, log);
+		if (!failed && jit)
+			failed = asm_place(ctx, jit, log);
+		else if (!failed)
+			failed = layout_and_finish(em, &ctx->lo, ctx->opts.name, log);
+		if (!failed && !jit && asm_output(ctx, out)) {
+			// strerror_r, since strerror's buffer may be another
+			// thread's
+			char buf[128];
+			fprintf(log, "%s: failed to write the image: %s", ctx->opts.name, strerror_r(errno, buf, sizeof buf));
+			failed = 1;
+		}
+	}
+	em->recover = NULL;
+	return asm_log_close(ctx, log, &log_buf, &log_len, failed);
+}
+
+// empties em for another program, unless that's what fails
+static const char *asm_reset(asm_ctx *ctx) {
+	jmp_buf recover;
+	const char *err = NULL;
+	if (setjmp(recover)) {
+		err = ctx->em->panicked;
+	} else {
+		ctx->em->recover = &recover;
+		emitter_reset(ctx->em);
+	}
+	ctx->em->recover = NULL;
+	return err;
+}
+
+// copies src to ctx's copy, ending it with a newline, and sets *end to its
+// length
+static const char *asm_copy_src(asm_ctx *ctx, const char *src, size_t len, size_t *end) {
+	if (len + 1 > ctx->src_cap) {
+		char *grown = realloc(ctx->src, len + 1);
+		if (!grown)
+			return "Out of memory";
+		ctx->src = grown;
+		ctx->src_cap = len + 1;
+	}
+	memcpy(ctx->src, src, len);
+	*end = len;
+	if (len > 0 && src[len - 1] != '\n')
+		ctx->src[(*end)++] = '\n';
+	return NULL;
+}
+
+const char *asm_assemble(asm_ctx *ctx, const char *src, size_t len, asm_buffer *out) {
+	free(ctx->error);
+	ctx->error = NULL;
+	const char *err = asm_reset(ctx);
+	size_t end;
+	if (!err)
+		err = asm_copy_src(ctx, src, len, &end);
+	if (err)
+		return err;
+	return asm_run(ctx, end, out, NULL);
+}
+
+void asm_begin(asm_ctx *ctx) {
+	free(ctx->error);
+	ctx->error = NULL;
+	cc_clear(&ctx->labels);
+	ctx->calls = 0;
+	ctx->build_failed = 0;
+	const char *err = asm_reset(ctx);
+	if (err) {
+		ctx->build_failed = 1;
+		ctx->error = strdup(err);
+	}
+}
+
+// keeps the first error, and returns whether there's been one
+// a call to ignore returns nonzero before doing anything
+static int asm_failed(asm_ctx *ctx, const char *err) {
+	if (!ctx->build_failed && err) {
+		ctx->build_failed = 1;
+		if (asprintf(&ctx->error, "%s: call %zu: %s", ctx->opts.name, ctx->calls, err) < 0)
+			ctx->error = NULL;
+	}
+	return ctx->build_failed;
+}
+
+// starts a call, returning nonzero if it should be ignored
+static int asm_call(asm_ctx *ctx) {
+	ctx->calls++;
+	return ctx->build_failed;
+}
+
+// runs stmt with em->recover set, keeping a panic as the error
+// setjmp only costs a few registers' worth of stores, which is cheap next to
+// anything that could panic
+#define ASM_GUARDED(ctx, stmt) \
+	do { \
+		jmp_buf recover_; \
+		if (setjmp(recover_)) { \
+			(ctx)->em->recover = NULL; \
+			asm_failed(ctx, (ctx)->em->panicked); \
+		} else { \
+			(ctx)->em->recover = &recover_; \
+			stmt; \
+			(ctx)->em->recover = NULL; \
+		} \
+	} while (0)
+
+asm_label asm_label_new(asm_ctx *ctx, const char *name) {
+	asm_label label = cc_size(&ctx->labels);
+	if (asm_call(ctx))
+		return label;
+	string s;
+	int len = name ? (int) strlen(name) : asprintf(&s.begin, ".L%u", label);
+	s.begin = name ? strdup(name) : s.begin;
+	if (len < 0 || !s.begin) {
+		asm_failed(ctx, "Out of memory");
+		return label;
+	}
+	s.len = len;
+	if (len == 0)
+		asm_failed(ctx, "labels need a name");
+	else if (!cc_push(&ctx->labels, s))
+		asm_failed(ctx, "Out of memory");
+	if (ctx->build_failed)
+		free(s.begin);
+	return label;
+}
+
+// the name of label, or NULL after an error if label isn't one
+static string *asm_label_name(asm_ctx *ctx, asm_label label) {
+	if (label >= cc_size(&ctx->labels)) {
+		asm_failed(ctx, "no such label");
+		return NULL;
+	}
+	return cc_get(&ctx->labels, label);
+}
+
+void asm_bind(asm_ctx *ctx, asm_label label) {
+	if (asm_call(ctx))
+		return;
+	string *name = asm_label_name(ctx, label);
+	// volatile, since it's read after a longjmp past where it's set
+	volatile int err = 0;
+	if (name)
+		ASM_GUARDED(ctx, err = emitter_label_add(ctx->em, *name));
+	if (err)
+		asm_failed(ctx, err < 0 ? "label redefined" : "a branch or jump to this label is out of range");
+}
+
+void asm_section(asm_ctx *ctx, enum asm_section sect) {
+	if (asm_call(ctx))
+		return;
+	if (sect != ASM_TEXT && sect != ASM_DATA)
+		asm_failed(ctx, "no such section");
+	else
+		ctx->em->current_section = sect == ASM_TEXT ? SECT_TEXT : SECT_DATA;
+}
+
+static void asm_put(asm_ctx *ctx, uint32_t instr) {
+	ASM_GUARDED(ctx, emitter_buffer(ctx->em, &instr, sizeof instr));
+}
+
+// checks that op is an instruction of format, and its registers fit
+static int asm_check(asm_ctx *ctx, enum op op, enum format format, unsigned r0, unsigned r1, unsigned r2) {
+	if ((unsigned) op >= N_OPS || formats[op] != format)
+		return asm_failed(ctx, "wrong kind of instruction for this call");
+	if (r0 > 31 || r1 > 31 || r2 > 31)
+		return asm_failed(ctx, "register out of range");
+	return 0;
+}
+
+void asm_emit_r(asm_ctx *ctx, enum op op, unsigned rd, unsigned rs1, unsigned rs2) {
+	if (asm_call(ctx) || asm_check(ctx, op, R_TYPE, rd, rs1, rs2))
+		return;
+	asm_put(ctx, encode_r(op, rd, rs1, rs2));
+}
+
+void asm_emit_i(asm_ctx *ctx, enum op op, unsigned rd, unsigned rs1, int32_t imm) {
+	if (asm_call(ctx) || asm_check(ctx, op, I_TYPE, rd, rs1, 0))
+		return;
+	const char *err = NULL;
+	switch (op) {
+	case ECALL:
+	case EBREAK:
+		if (rd || rs1 || imm)
+			err = "ecall and ebreak take no operands";
+		imm = op == EBREAK;
+		break;
+	case SLLI:
+	case SRLI:
+	case SRAI:
+		if (imm < 0 || imm > 31)
+			err = "immediate out of range for shift operation";
+		break;
+	default:
+		if (imm < -2048 || imm >= 2048)
+			err = "immediate out of range";
+	}
+	if (asm_failed(ctx, err))
+		return;
+	asm_put(ctx, encode_i(op, rd, rs1, imm));
+}
+
+void asm_emit_s(asm_ctx *ctx, enum op op, unsigned rs2, unsigned rs1, int32_t imm) {
+	if (asm_call(ctx) || asm_check(ctx, op, S_TYPE, rs2, rs1, 0))
+		return;
+	if (asm_failed(ctx, imm < -2048 || imm >= 2048 ? "immediate out of range" : NULL))
+		return;
+	asm_put(ctx, encode_s(op, rs2, rs1, imm));
+}
+
+void asm_emit_u(asm_ctx *ctx, enum op op, unsigned rd, uint32_t imm) {
+	if (asm_call(ctx) || asm_check(ctx, op, U_TYPE, rd, 0, 0))
+		return;
+	if (asm_failed(ctx, imm >= 1 << 20 ? "immediate out of range" : NULL))
+		return;
+	asm_put(ctx, encode_u(op, rd, imm));
+}
+
+// the offset to target if it's already bound in this section, otherwise -1,
+// and the instruction about to be emitted is patched once it's known, as the
+// parser does
+static int64_t asm_target(asm_ctx *ctx, asm_label target, enum assign_type assign) {
+	string *name = asm_label_name(ctx, target);
+	volatile int64_t val = -1;
+	if (name)
+		ASM_GUARDED(ctx, val = emitter_label_get_or_add_waiter(ctx->em, *name, assign));
+	if (val < 0)
+		return -1;
+	return val - ctx->em->section[ctx->em->current_section].pos;
+}
+
+void asm_emit_branch(asm_ctx *ctx, enum op op, unsigned rs1, unsigned rs2, asm_label target) {
+	if (asm_call(ctx) || asm_check(ctx, op, B_TYPE, rs1, rs2, 0))
+		return;
+	uint32_t instr = encode_b(op, rs1, rs2);
+	int64_t offset = asm_target(ctx, target, ASSIGN_BTYPE);
+	if (asm_failed(ctx, offset < -4096 ? "branch target out of range" : NULL))
+		return;
+	if (offset != -1)
+		set_btype_imm(&instr, (uint32_t) offset);
+	if (!ctx->build_failed)
+		asm_put(ctx, instr);
+}
+
+void asm_emit_jal(asm_ctx *ctx, unsigned rd, asm_label target) {
+	if (asm_call(ctx) || asm_check(ctx, JAL, J_TYPE, rd, 0, 0))
+		return;
+	uint32_t instr = encode_j(JAL, rd);
+	int64_t offset = asm_target(ctx, target, ASSIGN_JTYPE);
+	if (asm_failed(ctx, offset < -(1 << 20) ? "jump target out of range" : NULL))
+		return;
+	if (offset != -1)
+		set_jtype_imm(&instr, (uint32_t) offset);
+	if (!ctx->build_failed)
+		asm_put(ctx, instr);
+}
+
+void asm_emit_data(asm_ctx *ctx, const void *data, size_t len) {
+	if (asm_call(ctx))
+		return;
+	// padded after as the data directives are
+	ASM_GUARDED(ctx, emitter_buffer(ctx->em, (void *) data, len); emitter_advance(ctx->em, len % 4));
+}
+
+const char *asm_end(asm_ctx *ctx, asm_buffer *out) {
+	if (ctx->build_failed)
+		return ctx->error ? ctx->error : "Out of memory";
+	return asm_run(ctx, 0, out, NULL);
+}
+
+// the checks asm_jit and asm_jit_end share
+static const char *asm_jit_check(asm_ctx *ctx) {
+	if (ctx->opts.swap_dir)
+		return "JIT contexts keep their file buffers in memory, with no swap_dir";
+	if (ctx->opts.relocatable)
+		return "JIT contexts can't be relocatable";
+	return NULL;
+}
+
+const char *asm_jit(asm_ctx *ctx, const char *src, size_t len, void *dst, size_t cap, uint64_t addr, size_t *used) {
+	free(ctx->error);
+	ctx->error = NULL;
+	const char *err = asm_jit_check(ctx);
+	if (!err)
+		err = asm_reset(ctx);
+	size_t end;
+	if (!err)
+		err = asm_copy_src(ctx, src, len, &end);
+	if (err)
+		return err;
+	jit_target jit = { .dst = dst, .cap = cap, .addr = addr, .used = used };
+	return asm_run(ctx, end, NULL, &jit);
+}
+
+const char *asm_jit_end(asm_ctx *ctx, void *dst, size_t cap, uint64_t addr, size_t *used) {
+	const char *err = asm_jit_check(ctx);
+	if (err || ctx->build_failed)
+		return err ? err : ctx->error ? ctx->error : "Out of memory";
+	jit_target jit = { .dst = dst, .cap = cap, .addr = addr, .used = used };
+	return asm_run(ctx, 0, NULL, &jit);
+}
+
+int asm_symbol(asm_ctx *ctx, const char *name, uint64_t *addr) {
+	string key = { .begin = (char *) name, .len = strlen(name) };
+	label *l = cc_get(&ctx->em->labels, key);
+	if (!l || l->val < 0)
+		return -1;
+	*addr = ctx->em->section[l->section].vaddr + l->val;
+	return 0;
+}
+
+int asm_jit_map(asm_jit_region *r, size_t size) {
+	int fd = memfd_create("asm jit", MFD_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	r->size = size;
+	r->rw = MAP_FAILED;
+	r->rx = MAP_FAILED;
+	if (!ftruncate(fd, size))
+		r->rw = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (r->rw != MAP_FAILED)
+		r->rx = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+	// the mappings keep the memory alive without the fd
+	int err = errno;
+	close(fd);
+	if (r->rx == MAP_FAILED) {
+		if (r->rw != MAP_FAILED)
+			munmap(r->rw, size);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+void asm_jit_unmap(asm_jit_region *r) {
+	munmap(r->rw, r->size);
+	munmap(r->rx, r->size);
+}
+
+void asm_jit_flush(void *code, size_t len) {
+	__builtin___clear_cache((char *) code, (char *) code + len);
+}
+
+// where a stencil's argument goes in one of its instructions
+enum hole_kind {
+	HOLE_RD,
+	HOLE_RS1,
+	HOLE_RS2,
+	HOLE_I,
+	HOLE_SHAMT,
+	HOLE_S,
+	HOLE_U,
+	HOLE_B,
+	HOLE_J,
+};
+
+typedef struct {
+	uint32_t offset; // of the instruction
+	uint16_t kind;
+	uint16_t arg;
+} stencil_hole;
+
+struct asm_stencil {
+	uint8_t *code;
+	size_t len;
+	cc_vec(stencil_hole) holes;
+	cc_vec(string) args;
+};
+
+// the operands of each format, in the order they're written
+static const int8_t hole_operands[][3] = {
+	[R_TYPE] = { HOLE_RD, HOLE_RS1, HOLE_RS2 },
+	[I_TYPE] = { HOLE_RD, HOLE_RS1, HOLE_I },
+	[S_TYPE] = { HOLE_RS2, HOLE_S, HOLE_RS1 },
+	[B_TYPE] = { HOLE_RS1, HOLE_RS2, HOLE_B },
+	[U_TYPE] = { HOLE_RD, HOLE_U, -1 },
+	[J_TYPE] = { HOLE_RD, HOLE_J, -1 },
+};
+
+// rd, imm(rs1)
+static const int8_t load_operands[3] = { HOLE_RD, HOLE_I, HOLE_RS1 };
+
+// what the idx'th operand of op is, or -1 if it has no such operand
+static int hole_kind(enum op op, int idx) {
+	if (idx > 2)
+		return -1;
+	switch (op) {
+	case ECALL:
+	case EBREAK:
+		return -1;
+	case LB:
+	case LH:
+	case LW:
+	case LBU:
+	case LHU:
+		return load_operands[idx];
+	case SLLI:
+	case SRLI:
+	case SRAI:
+		if (idx == 2)
+			return HOLE_SHAMT;
+		break;
+	default:
+		break;
+	}
+	return hole_operands[formats[op]][idx];
+}
+
+// a hole is assembled as whatever its operand can be, and patched over
+// branch and jump targets are a label defined after everything else
+static const char *hole_placeholder(int kind) {
+	switch (kind) {
+	case HOLE_RD:
+	case HOLE_RS1:
+	case HOLE_RS2:
+		return "x0";
+	case HOLE_B:
+	case HOLE_J:
+		return "__stencil_hole";
+	default:
+		return "0";
+	}
+}
+
+// the index of the argument called name, added if it's new, or -1 if there's
+// no memory for it
+static int stencil_arg(asm_stencil *st, const char *name, size_t len) {
+	size_t n = cc_size(&st->args);
+	for (size_t i = 0; i < n; i++) {
+		string *arg = cc_get(&st->args, i);
+		if (arg->len == len && !memcmp(arg->begin, name, len))
+			return i;
+	}
+	string s = { .begin = strndup(name, len), .len = len };
+	if (!s.begin || n > UINT16_MAX || !cc_push(&st->args, s)) {
+		free(s.begin);
+		return -1;
+	}
+	return n;
+}
+
+// writes the line from s to its newline to text with each hole replaced by
+// a placeholder, and adds the holes to st, with the line number as their
+// offset until it's known
+static const char *stencil_line(asm_stencil *st, char *s, long line, FILE *text) {
+	char *start = s;
+	char *nl = strchr(s, '\n');
+	if (!memchr(s, '{', nl - s)) {
+		fwrite(s, 1, nl + 1 - s, text);
+		return NULL;
+	}
+	skip_whitespace(&s);
+	int op = parse_keyword(&s);
+	if (op < 0 || op >= N_OPS)
+		return "holes can only be operands of instructions";
+	fwrite(start, 1, s - start, text);
+	int idx = 0;
+	for (; *s != '\n'; s++) {
+		if (*s == ',' || *s == '(')
+			idx++;
+		if (*s != '{') {
+			fputc(*s, text);
+			continue;
+		}
+		char *name = ++s;
+		while (identifier(*s))
+			s++;
+		if (s == name || *s != '}')
+			return "expected {name}";
+		int kind = hole_kind(op, idx);
+		if (kind < 0)
+			return "holes can only be operands of instructions";
+		int arg = stencil_arg(st, name, s - name);
+		stencil_hole hole = { .offset = line, .kind = kind, .arg = arg };
+		if (arg < 0 || !cc_push(&st->holes, hole))
+			return "Out of memory";
+		fputs(hole_placeholder(kind), text);
+	}
+	fputc('\n', text);
+	return NULL;
+}
+
+// assembles ctx's copy of the source, with holes already replaced, and sets
+// each hole's offset from its line
+static int stencil_assemble(asm_ctx *ctx, asm_stencil *st, char *text, size_t text_len, FILE *log) {
+	emitter *em = ctx->em;
+	long line = 1;
+	size_t h = 0;
+	for (char *pos = text; pos < text + text_len; ) {
+		char *nl = memchr(pos, '\n', text + text_len - pos);
+		long this_line = line;
+		uint64_t start = em->section[SECT_TEXT].pos;
+		if (assemble_chunk(pos, nl + 1, em, ctx->opts.name, &line, log))
+			return 1;
+		for (; h < cc_size(&st->holes) && cc_get(&st->holes, h)->offset == this_line; h++) {
+			// an instruction can't be anything other than 4 bytes
+			// of .text, but check, since the offsets depend on it
+			if (em->section[SECT_TEXT].pos != start + 4 || start > UINT32_MAX) {
+				fprintf(log, "%s:%ld: holes can only be operands of instructions\n", ctx->opts.name, this_line);
+				return 1;
+			}
+			cc_get(&st->holes, h)->offset = start;
+		}
+		pos = nl + 1;
+	}
+	string name;
+	if (emitter_finish(em, &name) == FINISH_UNDEFINED) {
+		fprintf(log, "%s: label %.*s used but not defined\n", ctx->opts.name, (int) name.len, name.begin);
+		return 1;
+	}
+	if (em->section[SECT_DATA].pos > 0 || cc_size(&em->cross_fixups) > 0) {
+		fprintf(log, "%s: stencils can only have .text\n", ctx->opts.name);
+		return 1;
+	}
+	st->len = em->section[SECT_TEXT].pos;
+	st->code = malloc(st->len ? st->len : 1);
+	if (!st->code) {
+		fprintf(log, "%s: %s\n", ctx->opts.name, no_mem);
+		return 1;
+	}
+	emitter_read(em, SECT_TEXT, 0, st->code, st->len);
+	return 0;
+}
+
+const char *asm_stencil_compile(asm_ctx *ctx, const char *src, size_t len, asm_stencil **out) {
+	free(ctx->error);
+	ctx->error = NULL;
+	if (ctx->opts.relocatable)
+		return "stencils can't be made by a relocatable context";
+	const char *err = asm_reset(ctx);
+	size_t end;
+	if (!err)
+		err = asm_copy_src(ctx, src, len, &end);
+	if (err)
+		return err;
+	asm_stencil *st = calloc(1, sizeof *st);
+	char *log_buf = NULL, *text = NULL;
+	size_t log_len = 0, text_len = 0;
+	FILE *log = st ? open_memstream(&log_buf, &log_len) : NULL;
+	FILE *text_f = log ? open_memstream(&text, &text_len) : NULL;
+	if (!text_f) {
+		if (log)
+			fclose(log);
+		free(log_buf);
+		free(st);
+		return "Out of memory";
+	}
+	cc_init(&st->holes);
+	cc_init(&st->args);
+
+	// first the holes are replaced, keeping the lines as they are so errors
+	// from the parser have the right line numbers
+	volatile int failed = 0;
+	long line = 1;
+	for (char *pos = ctx->src; pos < ctx->src + end; line++) {
+		err = stencil_line(st, pos, line, text_f);
+		if (err) {
+			fprintf(log, "%s:%ld: %s\n", ctx->opts.name, line, err);
+			failed = 1;
+			break;
+		}
+		pos = strchr(pos, '\n') + 1;
+	}
+	fputs(".text\n__stencil_hole:\n", text_f);
+	if (fclose(text_f)) {
+		fprintf(log, "%s: %s\n", ctx->opts.name, no_mem);
+		failed = 1;
+	}
+
+	jmp_buf recover;
+	if (!failed) {
+		if (setjmp(recover)) {
+			fprintf(log, "%s: %s\n", ctx->opts.name, ctx->em->panicked);
+			failed = 1;
+		} else {
+			ctx->em->recover = &recover;
+			failed = stencil_assemble(ctx, st, text, text_len, log);
+		}
+	}
+	ctx->em->recover = NULL;
+	free(text);
+	if (failed)
+		asm_stencil_free(st);
+	else
+		*out = st;
+	return asm_log_close(ctx, log, &log_buf, &log_len, failed);
+}
+
+void asm_stencil_free(asm_stencil *st) {
+	free(st->code);
+	cc_cleanup(&st->holes);
+	cc_cleanup(&st->args);
+	free(st);
+}
+
+size_t asm_stencil_size(const asm_stencil *st) {
+	return st->len;
+}
+
+int asm_stencil_arg(const asm_stencil *st, const char *name) {
+	size_t len = strlen(name);
+	// cc's size and get only read, but don't take const
+	asm_stencil *s = (asm_stencil *) st;
+	for (size_t i = 0; i < cc_size(&s->args); i++) {
+		string *arg = cc_get(&s->args, i);
+		if (arg->len == len && !memcmp(arg->begin, name, len))
+			return i;
+	}
+	return -1;
+}
+
+const char *asm_stencil_instantiate(const asm_stencil *st, void *dst, const int64_t *args) {
+	uint8_t *code = dst;
+	memcpy(code, st->code, st->len);
+	asm_stencil *s = (asm_stencil *) st;
+	cc_for_each(&s->holes, h) {
+		uint32_t instr;
+		memcpy(&instr, code + h->offset, sizeof instr);
+		int64_t v = args[h->arg];
+		// branches and jumps are relative to the instruction, not the
+		// start of the stencil
+		int64_t rel = (int64_t) ((uint64_t) v - h->offset);
+		int shift = h->kind == HOLE_RD ? 7 : h->kind == HOLE_RS1 ? 15 : 20;
+		switch (h->kind) {
+		case HOLE_RD:
+		case HOLE_RS1:
+		case HOLE_RS2:
+			if ((uint64_t) v > 31)
+				return "register out of range";
+			instr = (instr & ~(0x1fu << shift)) | (uint32_t) v << shift;
+			break;
+		case HOLE_I:
+			if (v < -2048 || v >= 2048)
+				return "immediate out of range";
+			instr = (instr & 0x000fffff) | (uint32_t) v << 20;
+			break;
+		case HOLE_SHAMT:
+			if ((uint64_t) v > 31)
+				return "immediate out of range for shift operation";
+			// srai's other bit is left alone
+			instr = (instr & ~(0x1fu << 20)) | (uint32_t) v << 20;
+			break;
+		case HOLE_S:
+			if (v < -2048 || v >= 2048)
+				return "immediate out of range";
+			instr = (instr & 0x01fff07f) | ((uint32_t) v & 0xfe0) << 20 | ((uint32_t) v & 0x1f) << 7;
+			break;
+		case HOLE_U:
+			if ((uint64_t) v >= 1 << 20)
+				return "immediate out of range";
+			instr = (instr & 0xfff) | (uint32_t) v << 12;
+			break;
+		case HOLE_B:
+			if (rel < -4096 || rel >= 4096 || rel % 2)
+				return "branch target out of range";
+			set_btype_imm(&instr, (uint32_t) rel);
+			break;
+		case HOLE_J:
+			if (rel < -(1 << 20) || rel >= 1 << 20 || rel % 2)
+				return "jump target out of range";
+			set_jtype_imm(&instr, (uint32_t) rel);
+			break;
+		}
+		memcpy(code + h->offset, &instr, sizeof instr);
+	}
+	return NULL;
+}
@@ -0,0 +1,186 @@
+#ifndef LIBASM_H
+#define LIBASM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ops.h"
+
+// the assembler as a library, for tools that would rather call it than start
+// a process per program
+// an asm_ctx holds everything one assembly needs, and is reused from one to
+// the next, so nothing is shared between contexts and each thread can have
+// its own
+// a context must not be used by two threads at once
+// errors are returned, never exited on, including running out of memory or
+// failing to write the file buffers
+typedef struct asm_ctx asm_ctx;
+
+enum asm_format {
+	ASM_ELF,
+	ASM_BIN,
+	ASM_IHEX,
+	ASM_SREC,
+};
+
+typedef struct {
+	enum asm_format format;
+	uint64_t text_vaddr;
+	uint64_t data_vaddr;
+	int auto_layout; // .data on the page after .text, ignoring data_vaddr
+	int relocatable; // an object, like -c
+	int strip;
+	int build_id;
+	// the float ABI in an ELF's e_flags, EF_RISCV_FLOAT_ABI_*, which
+	// linking an object has to agree on
+	uint32_t float_abi;
+	uint8_t gap_fill; // between sections of a flat binary
+	// where the file buffers go, or NULL to keep them in memory
+	const char *swap_dir;
+	// what errors call the source
+	const char *name;
+} asm_options;
+
+// an image, allocated with malloc, for the caller to free
+typedef struct {
+	uint8_t *data;
+	size_t len;
+} asm_buffer;
+
+// the same options as asm with no arguments, except that the file buffers
+// are kept in memory
+extern void asm_options_default(asm_options *opts);
+
+// returns NULL and sets errno if the context couldn't be made
+// opts is copied, but the strings in it must outlive the context
+extern asm_ctx *asm_ctx_new(const asm_options *opts);
+
+extern void asm_ctx_free(asm_ctx *ctx);
+
+// assembles len bytes of src into an image in out
+// returns NULL on success, otherwise the error, which belongs to ctx and lasts
+// until its next use, and leaves out alone
+extern const char *asm_assemble(asm_ctx *ctx, const char *src, size_t len, asm_buffer *out);
+
+// programs can also be built a call per instruction, for code generators
+// that would otherwise print source only for it to be parsed again
+// the calls encode with the parser's own tables, and labels go through the
+// same machinery as the parser's, so forward references are patched the same
+// way and the image is what the same program as source would assemble to
+// the first error is kept and every call after it ignored, so calls needn't
+// be checked one at a time, and asm_end returns it
+
+// a label, only meaningful to the ctx, and the program, it was made for
+typedef uint32_t asm_label;
+
+enum asm_section {
+	ASM_TEXT,
+	ASM_DATA,
+};
+
+// starts a program, forgetting whatever ctx assembled or built before
+extern void asm_begin(asm_ctx *ctx);
+
+// a label to bind later, or before, and refer to
+// one with no name is called .L<n>, so named ones shouldn't look like that
+extern asm_label asm_label_new(asm_ctx *ctx, const char *name);
+
+// defines label at the current position of the current section
+extern void asm_bind(asm_ctx *ctx, asm_label label);
+
+// like .text and .data
+extern void asm_section(asm_ctx *ctx, enum asm_section sect);
+
+// registers are numbered 0 to 31, and immediates are checked against what
+// the instruction can hold
+
+extern void asm_emit_r(asm_ctx *ctx, enum op op, unsigned rd, unsigned rs1, unsigned rs2);
+
+// for immediate arithmetic, loads, which are rd = imm(rs1), and jalr
+// ecall and ebreak take zeros
+extern void asm_emit_i(asm_ctx *ctx, enum op op, unsigned rd, unsigned rs1, int32_t imm);
+
+// stores, which are imm(rs1) = rs2
+extern void asm_emit_s(asm_ctx *ctx, enum op op, unsigned rs2, unsigned rs1, int32_t imm);
+
+// lui and auipc, with the 20 bit immediate that goes in the upper bits
+extern void asm_emit_u(asm_ctx *ctx, enum op op, unsigned rd, uint32_t imm);
+
+extern void asm_emit_branch(asm_ctx *ctx, enum op op, unsigned rs1, unsigned rs2, asm_label target);
+
+extern void asm_emit_jal(asm_ctx *ctx, unsigned rd, asm_label target);
+
+// like .byte, padding included
+extern void asm_emit_data(asm_ctx *ctx, const void *data, size_t len);
+
+// lays out the program built since asm_begin and writes its image to out
+// returns like asm_assemble, including with the first error from a call
+extern const char *asm_end(asm_ctx *ctx, asm_buffer *out);
+
+// for JITs, a program can instead go straight into memory the caller owns,
+// as it's to run from there: .text at addr, then .data from the next 16 byte
+// boundary, with every label resolved against addr and nothing else written
+// the context must keep its file buffers in memory, so nothing touches a
+// filesystem, and can't be relocatable
+
+// like asm_assemble, but into the cap bytes at dst, and sets *used to how many
+// bytes the program took
+// dst needn't be at addr, as with a region from asm_jit_map
+extern const char *asm_jit(asm_ctx *ctx, const char *src, size_t len, void *dst, size_t cap, uint64_t addr, size_t *used);
+
+// like asm_end, but into dst like asm_jit
+extern const char *asm_jit_end(asm_ctx *ctx, void *dst, size_t cap, uint64_t addr, size_t *used);
+
+// sets *addr to where label name ended up in what ctx last assembled or built
+// returns 0 on success, or -1 if there's no such label
+extern int asm_symbol(asm_ctx *ctx, const char *name, uint64_t *addr);
+
+// the same memory mapped twice, writable and executable, so code can be
+// written without any page being both at once
+// assemble into rw with addr set to rx, then flush rx before running it
+typedef struct {
+	void *rw;
+	void *rx;
+	size_t size;
+} asm_jit_region;
+
+// returns 0 on success, otherwise returns -1 and sets errno
+extern int asm_jit_map(asm_jit_region *r, size_t size);
+
+extern void asm_jit_unmap(asm_jit_region *r);
+
+// makes code just written visible to instruction fetch, which on RISC-V is a
+// fence.i on every hart that might run it
+extern void asm_jit_flush(void *code, size_t len);
+
+// a stencil is a snippet assembled once with holes in it, like
+//	addi {rd}, {rs}, {imm}
+//	bne {rd}, x0, {done}
+// and copied out as many times as wanted, with the holes patched, for JITs
+// and code generators that emit the same few sequences over and over
+// an instance is a memcpy and a few masks per hole, with no parser involved
+// a hole can be any operand of an instruction, and a name used twice is the
+// same argument both times
+// branch and jump targets are where they go from the start of the instance,
+// so instances can branch into each other when they're laid out together
+// labels in the snippet are its own, and it can only have .text
+typedef struct asm_stencil asm_stencil;
+
+// returns like asm_assemble, setting *out on success
+extern const char *asm_stencil_compile(asm_ctx *ctx, const char *src, size_t len, asm_stencil **out);
+
+extern void asm_stencil_free(asm_stencil *st);
+
+// the bytes an instance takes
+extern size_t asm_stencil_size(const asm_stencil *st);
+
+// the index in args of the hole called name, or -1 if it has none
+extern int asm_stencil_arg(const asm_stencil *st, const char *name);
+
+// writes an instance to dst, with each hole patched with its argument
+// returns NULL, or a static error if an argument doesn't fit, in which case
+// dst is left with the holes only partly patched
+// a stencil is never changed once compiled, so threads can share one
+extern const char *asm_stencil_instantiate(const asm_stencil *st, void *dst, const int64_t *args);
+
+#endif
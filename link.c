@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "emitter.h"
+
+// append everything part emitted to sect to the end of em's sect
+static void link_copy(emitter *em, emitter *part, int sect) {
+	uint8_t buf[64 * 1024];
+	uint64_t len = part->section[sect].pos;
+	em->current_section = sect;
+	for (uint64_t off = 0; off < len; off += sizeof buf) {
+		size_t n = MIN(sizeof buf, len - off);
+		emitter_read(part, sect, off, buf, n);
+		emitter_buffer(em, buf, n);
+	}
+}
+
+int emitter_link(emitter *em, emitter **parts, size_t n, string *name) {
+	uint64_t (*base)[N_SECTIONS] = malloc(n * sizeof *base);
+	if (!base)
+		emitter_panic(em, no_mem);
+	emitter_hold(em, free, base);
+	int err = FINISH_OK;
+
+	// each input's sections start 4-byte aligned, after the previous
+	// input's
+	for (size_t p = 0; p < n; p++) {
+		for (int sect = 0; sect < N_SECTIONS; sect++) {
+			uint64_t pos = em->section[sect].pos;
+			em->current_section = sect;
+			emitter_advance(em, roundup(pos, 4) - pos);
+			base[p][sect] = em->section[sect].pos;
+			link_copy(em, parts[p], sect);
+		}
+	}
+	em->current_section = SECT_TEXT;
+
+	// the globals go in first, so a local never takes a global's name
+	for (int global = 1; global >= 0; global--) {
+		for (size_t p = 0; p < n; p++) {
+			cc_for_each(&parts[p]->labels, key, l) {
+				if (l->val < 0 || l->global != global)
+					continue;
+				if (cc_get(&em->labels, *key)) {
+					if (!global)
+						continue;
+					*name = *key;
+					err = FINISH_DUPLICATE;
+					goto out;
+				}
+				label *nu = emitter_label_get(em, *key);
+				nu->val = l->val + base[p][l->section];
+				nu->section = l->section;
+				nu->type = l->type;
+				nu->size = l->size;
+				nu->global = global;
+				cc_cleanup(&nu->waiters);
+			}
+		}
+	}
+
+	for (size_t p = 0; p < n; p++) {
+		cc_for_each(&parts[p]->relocs, reloc) {
+			label *l = cc_get(&parts[p]->labels, reloc->name);
+			cross_fixup fixup = {
+				.waiter = reloc->waiter,
+			};
+			fixup.waiter.fix_idx += base[p][reloc->waiter.section];
+			if (l->val >= 0 && !l->global) {
+				fixup.section = l->section;
+				fixup.val = l->val + base[p][l->section];
+			} else {
+				label *g = cc_get(&em->labels, reloc->name);
+				if (!g || !g->global) {
+					*name = reloc->name;
+					err = FINISH_UNDEFINED;
+					goto out;
+				}
+				fixup.name = *cc_key_for(&em->labels, g);
+			}
+			if (!cc_push(&em->cross_fixups, fixup))
+				emitter_panic(em, no_mem);
+		}
+	}
+out:
+	emitter_let_go(em, base);
+	free(base);
+	return err;
+}
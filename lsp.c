@@ -0,0 +1,931 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/param.h>
+
+#include "directives.h"
+#include "emitter.h"
+#include "lsp.h"
+#include "parser.h"
+
+// a message this large is refused rather than trusted with an allocation
+#define MAX_MESSAGE (256 << 20)
+
+// just enough JSON for the protocol: a message is only ever read by looking
+// up members, so a value is a pointer to its first byte, and is skipped over
+// to find the next one
+
+static const char *json_ws(const char *s) {
+	while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r')
+		s++;
+	return s;
+}
+
+// past the value at s, or NULL if it's malformed
+static const char *json_skip(const char *s) {
+	if (!s)
+		return NULL;
+	s = json_ws(s);
+	if (*s != '"' && *s != '{' && *s != '[') {
+		const char *start = s;
+		while (isalnum((unsigned char) *s) || *s == '-' || *s == '+' || *s == '.')
+			s++;
+		return s == start ? NULL : s;
+	}
+	size_t depth = 0;
+	do {
+		if (*s == '\0')
+			return NULL;
+		if (*s == '"') {
+			for (s++; *s != '"'; s++) {
+				if (*s == '\0' || (*s == '\\' && *++s == '\0'))
+					return NULL;
+			}
+		} else if (*s == '{' || *s == '[') {
+			depth++;
+		} else if (*s == '}' || *s == ']') {
+			depth--;
+		}
+		s++;
+	} while (depth > 0);
+	return s;
+}
+
+// the value of member key of the object at obj, or NULL if it has none
+static const char *json_member(const char *obj, const char *key) {
+	if (!obj)
+		return NULL;
+	const char *s = json_ws(obj);
+	if (*s != '{')
+		return NULL;
+	s = json_ws(s + 1);
+	size_t key_len = strlen(key);
+	while (*s == '"') {
+		const char *name = s + 1;
+		const char *end = json_skip(s);
+		if (!end)
+			return NULL;
+		s = json_ws(end);
+		if (*s != ':')
+			return NULL;
+		const char *val = json_ws(s + 1);
+		if ((size_t) (end - 1 - name) == key_len && memcmp(name, key, key_len) == 0)
+			return val;
+		s = json_skip(val);
+		if (!s)
+			return NULL;
+		s = json_ws(s);
+		if (*s == ',')
+			s = json_ws(s + 1);
+	}
+	return NULL;
+}
+
+// json_member down a path like "params.position.line"
+static const char *json_path(const char *v, const char *path) {
+	char key[64];
+	while (v && *path) {
+		size_t len = strcspn(path, ".");
+		if (len >= sizeof key)
+			return NULL;
+		memcpy(key, path, len);
+		key[len] = '\0';
+		v = json_member(v, key);
+		path += len + (path[len] == '.');
+	}
+	return v;
+}
+
+// the first element of the array at v, or NULL if it's empty or not an array
+static const char *json_first(const char *v) {
+	if (!v || *json_ws(v) != '[')
+		return NULL;
+	v = json_ws(json_ws(v) + 1);
+	return *v == ']' ? NULL : v;
+}
+
+// the element after the one at v, or NULL if it was the last
+static const char *json_next(const char *v) {
+	v = json_skip(v);
+	if (!v)
+		return NULL;
+	v = json_ws(v);
+	return *v == ',' ? json_ws(v + 1) : NULL;
+}
+
+// returns 0 and sets *out if v is a whole number, otherwise returns -1
+static int json_int(const char *v, long *out) {
+	if (!v || (*v != '-' && !isdigit((unsigned char) *v)))
+		return -1;
+	char *end;
+	*out = strtol(v, &end, 10);
+	return *end == '.' || *end == 'e' || *end == 'E' ? -1 : 0;
+}
+
+static int json_bool(const char *v) {
+	return v && strncmp(v, "true", 4) == 0;
+}
+
+static int json_hex4(const char *s, uint32_t *out) {
+	*out = 0;
+	for (int i = 0; i < 4; i++) {
+		char c = s[i];
+		int d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+		if (d < 0)
+			return -1;
+		*out = *out << 4 | d;
+	}
+	return 0;
+}
+
+// the string at v, unescaped into a '\0' terminated copy to be freed, with
+// its length in *len, or NULL if v isn't a string
+static char *json_string(const char *v, size_t *len) {
+	if (!v || *v != '"')
+		return NULL;
+	const char *end = json_skip(v);
+	if (!end)
+		return NULL;
+	// escapes only ever make it shorter
+	char *out = malloc(end - v);
+	if (!out)
+		panic(no_mem);
+	char *o = out;
+	for (const char *s = v + 1; s < end - 1; s++) {
+		if (*s != '\\') {
+			*o++ = *s;
+			continue;
+		}
+		uint32_t c;
+		switch (*++s) {
+		case 'b': *o++ = '\b'; break;
+		case 'f': *o++ = '\f'; break;
+		case 'n': *o++ = '\n'; break;
+		case 'r': *o++ = '\r'; break;
+		case 't': *o++ = '\t'; break;
+		case 'u':
+			if (s + 5 > end - 1 || json_hex4(s + 1, &c))
+				goto bad;
+			s += 4;
+			// a pair of surrogates is one code point
+			if (c >= 0xd800 && c < 0xdc00 && s + 7 <= end - 1 && s[1] == '\\' && s[2] == 'u') {
+				uint32_t low;
+				if (!json_hex4(s + 3, &low) && low >= 0xdc00 && low < 0xe000) {
+					c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+					s += 6;
+				}
+			}
+			if (c < 0x80) {
+				*o++ = c;
+			} else if (c < 0x800) {
+				*o++ = 0xc0 | c >> 6;
+				*o++ = 0x80 | (c & 0x3f);
+			} else if (c < 0x10000) {
+				*o++ = 0xe0 | c >> 12;
+				*o++ = 0x80 | (c >> 6 & 0x3f);
+				*o++ = 0x80 | (c & 0x3f);
+			} else {
+				*o++ = 0xf0 | c >> 18;
+				*o++ = 0x80 | (c >> 12 & 0x3f);
+				*o++ = 0x80 | (c >> 6 & 0x3f);
+				*o++ = 0x80 | (c & 0x3f);
+			}
+			break;
+		default:
+			*o++ = *s; // '"', '\\' and '/'
+			break;
+		}
+	}
+	*o = '\0';
+	*len = o - out;
+	return out;
+bad:
+	free(out);
+	return NULL;
+}
+
+static void json_write_string(FILE *f, const char *s, size_t len) {
+	fputc('"', f);
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+// a document is a vector of lines, each parsed on its own, with an index from
+// every label to the lines that define it and the lines that use it
+
+typedef struct {
+	string name; // the symbols map's own key
+	size_t col;
+} lsp_ref;
+
+typedef struct {
+	char *text; // ends in '\n' then '\0', for parse_line
+	size_t len; // without the '\n'
+	size_t idx; // line number, kept up to date as lines come and go
+	char *err; // from parse_line, or NULL
+	string def; // the label the line defines, or an empty name
+	size_t def_col;
+	int section; // current after the line, so the one its label is in
+	cc_vec(lsp_ref) refs; // each label the line uses, once
+} lsp_line;
+
+typedef lsp_line *lsp_line_ptr;
+
+typedef struct {
+	cc_vec(lsp_line_ptr) defs;
+	cc_vec(lsp_line_ptr) refs;
+	int bad; // in the document's list of undefined or redefined labels
+} lsp_symbol;
+
+#define CC_DTOR lsp_symbol, { cc_cleanup(&val.defs); cc_cleanup(&val.refs); }
+#include "cc.h"
+
+// a name that belongs to the symbols map, which a vector of strings would
+// free along with itself
+typedef struct {
+	string name;
+} lsp_name;
+
+// what's wrong is kept as lines are parsed, rather than looked for, so
+// publishing it costs as much as there is of it, not as much as the document
+typedef struct {
+	char *uri;
+	cc_vec(lsp_line_ptr) lines;
+	cc_map(string, lsp_symbol) symbols;
+	cc_vec(lsp_line_ptr) errors; // lines parse_line failed on
+	cc_vec(lsp_name) bad; // the bad symbols
+} lsp_doc;
+
+typedef lsp_doc *lsp_doc_ptr;
+
+typedef struct {
+	FILE *out;
+	emitter *em; // lines are parsed into it one at a time
+	cc_vec(lsp_doc_ptr) docs;
+	int shutdown;
+} lsp;
+
+// where name is in l from column from on, as a whole identifier, or from if
+// it isn't there
+static size_t lsp_find(const lsp_line *l, string name, size_t from) {
+	for (size_t i = from; i + name.len <= l->len; i++) {
+		if (
+			memcmp(&l->text[i], name.begin, name.len) == 0
+			&& (i == 0 || !identifier(l->text[i - 1]))
+			&& !identifier(l->text[i + name.len])
+		)
+			return i;
+	}
+	return MIN(from, l->len);
+}
+
+// the symbol called name, added if there's none, with *key set to the map's
+// own copy of the name
+static lsp_symbol *lsp_symbol_get(lsp_doc *doc, string name, string *key) {
+	lsp_symbol *sym = cc_get(&doc->symbols, name);
+	if (!sym) {
+		char *copy = malloc(name.len + 1);
+		if (!copy)
+			panic(no_mem);
+		memcpy(copy, name.begin, name.len);
+		copy[name.len] = '\0';
+		lsp_symbol nu;
+		cc_init(&nu.defs);
+		cc_init(&nu.refs);
+		nu.bad = 0;
+		sym = cc_insert(&doc->symbols, ((string) { copy, name.len }), nu);
+		if (!sym)
+			panic(no_mem);
+	}
+	*key = *cc_key_for(&doc->symbols, sym);
+	return sym;
+}
+
+static void lsp_forget(cc_vec(lsp_line_ptr) *lines, lsp_line *l) {
+	for (size_t i = 0; i < cc_size(lines); i++) {
+		if (*cc_get(lines, i) == l) {
+			cc_erase(lines, i);
+			return;
+		}
+	}
+}
+
+// brings the label called name, the symbols map's own key, in or out of the
+// bad list after its definitions or references changed, then drops it if
+// nothing defines or uses it anymore
+// a line never names a label twice, so nothing else it has goes with it
+static void lsp_recheck(lsp_doc *doc, string name) {
+	lsp_symbol *sym = cc_get(&doc->symbols, name);
+	size_t defs = cc_size(&sym->defs);
+	int bad = (defs == 0 && cc_size(&sym->refs) != 0) || defs > 1;
+	if (bad && !sym->bad) {
+		if (!cc_push(&doc->bad, ((lsp_name) { name })))
+			panic(no_mem);
+	} else if (!bad && sym->bad) {
+		for (size_t i = 0; i < cc_size(&doc->bad); i++) {
+			if (cc_get(&doc->bad, i)->name.begin == name.begin) {
+				cc_erase(&doc->bad, i);
+				break;
+			}
+		}
+	}
+	sym->bad = bad;
+	if (cc_size(&sym->defs) == 0 && cc_size(&sym->refs) == 0)
+		cc_erase(&doc->symbols, name);
+}
+
+// takes l out of the index
+static void lsp_unindex(lsp_doc *doc, lsp_line *l) {
+	if (l->err)
+		lsp_forget(&doc->errors, l);
+	if (l->def.len != 0) {
+		lsp_forget(&cc_get(&doc->symbols, l->def)->defs, l);
+		lsp_recheck(doc, l->def);
+	}
+	cc_for_each(&l->refs, ref) {
+		lsp_forget(&cc_get(&doc->symbols, ref->name)->refs, l);
+		lsp_recheck(doc, ref->name);
+	}
+	l->def.len = 0;
+	cc_clear(&l->refs);
+}
+
+// the section current where line i starts, as the line before left it
+static int lsp_section_at(lsp_doc *doc, size_t i) {
+	return i == 0 ? SECT_TEXT : (*cc_get(&doc->lines, i - 1))->section;
+}
+
+// whether l is a .size, the one line whose check depends on other lines
+static int lsp_is_size(const lsp_line *l) {
+	char *s = l->text;
+	skip_whitespace(&s);
+	return parse_keyword(&s) == K_SIZE;
+}
+
+// adds to em, as defined where it is, each label l names that an earlier line
+// defines in em's section, which is what .-label is checked against
+// the distance isn't known, but nothing is laid out anyway
+static void lsp_seed(emitter *em, lsp_doc *doc, const lsp_line *l) {
+	for (size_t i = 0; i < l->len; i++) {
+		if (!identifier(l->text[i]) || (i > 0 && identifier(l->text[i - 1])))
+			continue;
+		size_t end = i;
+		while (identifier(l->text[end]))
+			end++;
+		string name = { &l->text[i], end - i };
+		lsp_symbol *sym = cc_get(&doc->symbols, name);
+		if (!sym)
+			continue;
+		cc_for_each(&sym->defs, def) {
+			if ((*def)->idx < l->idx && (*def)->section == em->current_section) {
+				emitter_label_add(em, name);
+				break;
+			}
+		}
+	}
+}
+
+// parse_line on l, into an emptied em, keeping a panic as the error
+// em starts in the section the line before left current, and a .size with
+// the labels it measures from, so *seeded is set, and every label em has
+// after is one the line uses
+static char *lsp_parse_line(emitter *em, lsp_doc *doc, lsp_line *l, int *seeded) {
+	char *err;
+	jmp_buf recover;
+	if (setjmp(recover)) {
+		err = (char *) em->panicked;
+	} else {
+		em->recover = &recover;
+		emitter_reset(em);
+		em->current_section = lsp_section_at(doc, l->idx);
+		*seeded = lsp_is_size(l);
+		if (*seeded)
+			lsp_seed(em, doc, l);
+		char *pos = l->text;
+		err = parse_line(&pos, em);
+	}
+	em->recover = NULL;
+	l->section = em->current_section;
+	return err;
+}
+
+// parses l, and adds what it defines and uses to the index
+static void lsp_parse(lsp *ls, lsp_doc *doc, lsp_line *l) {
+	emitter *em = ls->em;
+	int seeded = 0;
+	l->err = lsp_parse_line(em, doc, l, &seeded);
+	if (l->err) {
+		if (!cc_push(&doc->errors, l))
+			panic(no_mem);
+		return;
+	}
+	// a reference comes after the operation, so the search for it starts
+	// there, in case a register has the same name
+	const char *s = l->text;
+	while (*s == ' ' || *s == '\t')
+		s++;
+	while (*s && *s != ' ' && *s != '\t' && *s != '\n')
+		s++;
+	size_t after_op = s - l->text;
+	cc_for_each(&em->labels, name, lbl) {
+		string key;
+		lsp_symbol *sym = lsp_symbol_get(doc, *name, &key);
+		if (lbl->val >= 0 && !seeded) {
+			l->def = key;
+			l->def_col = lsp_find(l, key, 0);
+			if (!cc_push(&sym->defs, l))
+				panic(no_mem);
+			lsp_recheck(doc, key);
+		} else {
+			lsp_ref ref = {
+				.name = key,
+				.col = lsp_find(l, key, after_op),
+			};
+			if (!cc_push(&l->refs, ref) || !cc_push(&sym->refs, l))
+				panic(no_mem);
+			lsp_recheck(doc, key);
+		}
+	}
+}
+
+static lsp_line *lsp_line_new(const char *text, size_t len) {
+	lsp_line *l = malloc(sizeof *l);
+	if (!l || !(l->text = malloc(len + 2)))
+		panic(no_mem);
+	memcpy(l->text, text, len);
+	l->text[len] = '\n';
+	l->text[len + 1] = '\0';
+	l->len = len;
+	l->err = NULL;
+	l->def.len = 0;
+	l->section = SECT_TEXT;
+	cc_init(&l->refs);
+	return l;
+}
+
+static void lsp_line_free(lsp_line *l) {
+	cc_cleanup(&l->refs);
+	free(l->text);
+	free(l);
+}
+
+// replaces n_old lines from first with the lines of text, of which there's
+// always at least one, and parses those, and the lines after them that it
+// changes the section of, or that a label it defines may fix
+static void lsp_splice(lsp *ls, lsp_doc *doc, size_t first, size_t n_old, const char *text, size_t len) {
+	int was = lsp_section_at(doc, first + n_old);
+	for (size_t i = first; i < first + n_old; i++) {
+		lsp_line *l = *cc_get(&doc->lines, i);
+		lsp_unindex(doc, l);
+		lsp_line_free(l);
+	}
+	cc_erase_n(&doc->lines, first, n_old);
+	cc_vec(lsp_line_ptr) fresh;
+	cc_init(&fresh);
+	const char *end = text + len;
+	for (const char *s = text;;) {
+		const char *nl = memchr(s, '\n', end - s);
+		if (!cc_push(&fresh, lsp_line_new(s, (nl ? nl : end) - s)))
+			panic(no_mem);
+		if (!nl)
+			break;
+		s = nl + 1;
+	}
+	size_t n_new = cc_size(&fresh);
+	if (!cc_insert_n(&doc->lines, first, cc_first(&fresh), n_new))
+		panic(no_mem);
+	cc_cleanup(&fresh);
+	// lines past the edit only need numbering again if it moved them
+	size_t renumber = n_new == n_old ? first + n_new : cc_size(&doc->lines);
+	for (size_t i = first; i < renumber; i++)
+		(*cc_get(&doc->lines, i))->idx = i;
+	for (size_t i = first; i < first + n_new; i++)
+		lsp_parse(ls, doc, *cc_get(&doc->lines, i));
+	// the lines after start where the edit leaves off, which only
+	// matters up to the first that ends up in the same section as before
+	for (size_t i = first + n_new; i < cc_size(&doc->lines) && lsp_section_at(doc, i) != was; i++) {
+		lsp_line *l = *cc_get(&doc->lines, i);
+		was = l->section;
+		lsp_unindex(doc, l);
+		lsp_parse(ls, doc, l);
+	}
+	// and a .size after the edit that failed may have its label now
+	cc_vec(lsp_line_ptr) failed;
+	if (!cc_init_clone(&failed, &doc->errors))
+		panic(no_mem);
+	cc_for_each(&failed, l) {
+		if ((*l)->idx >= first + n_new && lsp_is_size(*l)) {
+			lsp_unindex(doc, *l);
+			lsp_parse(ls, doc, *l);
+		}
+	}
+	cc_cleanup(&failed);
+}
+
+// applies one of a didChange's contentChanges, a range replaced with text or,
+// without a range, the whole document
+static int lsp_change(lsp *ls, lsp_doc *doc, const char *change) {
+	size_t len;
+	char *text = json_string(json_member(change, "text"), &len);
+	if (!text)
+		return -1;
+	const char *range = json_member(change, "range");
+	if (!range) {
+		lsp_splice(ls, doc, 0, cc_size(&doc->lines), text, len);
+		free(text);
+		return 0;
+	}
+	long sl, sc, el, ec;
+	if (
+		json_int(json_path(range, "start.line"), &sl)
+		|| json_int(json_path(range, "start.character"), &sc)
+		|| json_int(json_path(range, "end.line"), &el)
+		|| json_int(json_path(range, "end.character"), &ec)
+		|| sl < 0 || sc < 0 || el < sl || ec < 0
+	) {
+		free(text);
+		return -1;
+	}
+	// past the end is the end
+	size_t n = cc_size(&doc->lines);
+	lsp_line *start = *cc_get(&doc->lines, MIN((size_t) sl, n - 1));
+	lsp_line *end = *cc_get(&doc->lines, MIN((size_t) el, n - 1));
+	size_t sc_ = (size_t) sl >= n ? start->len : MIN((size_t) sc, start->len);
+	size_t ec_ = (size_t) el >= n ? end->len : MIN((size_t) ec, end->len);
+	if (start == end && ec_ < sc_)
+		ec_ = sc_;
+	size_t joined_len = sc_ + len + (end->len - ec_);
+	char *joined = malloc(joined_len + 1);
+	if (!joined)
+		panic(no_mem);
+	memcpy(joined, start->text, sc_);
+	memcpy(joined + sc_, text, len);
+	memcpy(joined + sc_ + len, end->text + ec_, end->len - ec_);
+	lsp_splice(ls, doc, start->idx, end->idx - start->idx + 1, joined, joined_len);
+	free(joined);
+	free(text);
+	return 0;
+}
+
+static lsp_doc *lsp_doc_find(lsp *ls, const char *uri) {
+	cc_for_each(&ls->docs, doc) {
+		if (strcmp((*doc)->uri, uri) == 0)
+			return *doc;
+	}
+	return NULL;
+}
+
+static void lsp_doc_free(lsp_doc *doc) {
+	cc_for_each(&doc->lines, l)
+		lsp_line_free(*l);
+	cc_cleanup(&doc->lines);
+	cc_cleanup(&doc->symbols);
+	cc_cleanup(&doc->errors);
+	cc_cleanup(&doc->bad);
+	free(doc->uri);
+	free(doc);
+}
+
+// the document a request's params.textDocument.uri names
+static lsp_doc *lsp_doc_of(lsp *ls, const char *msg) {
+	size_t len;
+	char *uri = json_string(json_path(msg, "params.textDocument.uri"), &len);
+	if (!uri)
+		return NULL;
+	lsp_doc *doc = lsp_doc_find(ls, uri);
+	free(uri);
+	return doc;
+}
+
+static void lsp_send(lsp *ls, const char *body, size_t len) {
+	fprintf(ls->out, "Content-Length: %zu\r\n\r\n", len);
+	fwrite(body, 1, len, ls->out);
+	fflush(ls->out);
+}
+
+static void lsp_write_range(FILE *f, size_t line, size_t start, size_t end) {
+	fprintf(f, "{\"start\":{\"line\":%zu,\"character\":%zu},\"end\":{\"line\":%zu,\"character\":%zu}}", line, start, line, end);
+}
+
+static void lsp_write_location(FILE *f, const lsp_doc *doc, size_t line, size_t start, size_t end) {
+	fputs("{\"uri\":", f);
+	json_write_string(f, doc->uri, strlen(doc->uri));
+	fputs(",\"range\":", f);
+	lsp_write_range(f, line, start, end);
+	fputc('}', f);
+}
+
+// an error about name, or the whole line if name is empty
+static void lsp_write_diagnostic(FILE *f, int *first, const lsp_line *l, size_t col, const char *msg, string name) {
+	fputs(*first ? "" : ",", f);
+	*first = 0;
+	fputs("{\"range\":", f);
+	lsp_write_range(f, l->idx, col, name.len ? col + name.len : l->len);
+	fputs(",\"severity\":1,\"source\":\"asm\",\"message\":", f);
+	char buf[256];
+	int len = snprintf(buf, sizeof buf, msg, (int) name.len, name.begin);
+	json_write_string(f, buf, MIN((size_t) len, sizeof buf - 1));
+	fputc('}', f);
+}
+
+// the definition the editor jumps to, the one that comes first
+static lsp_line *lsp_first_def(lsp_symbol *sym) {
+	lsp_line *first = NULL;
+	cc_for_each(&sym->defs, l) {
+		if (!first || (*l)->idx < first->idx)
+			first = *l;
+	}
+	return first;
+}
+
+// every error there is in doc, from the lists kept as it was parsed
+static void lsp_publish(lsp *ls, lsp_doc *doc) {
+	char *body;
+	size_t len;
+	FILE *f = open_memstream(&body, &len);
+	if (!f)
+		panic(no_mem);
+	fputs("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":", f);
+	json_write_string(f, doc->uri, strlen(doc->uri));
+	fputs(",\"diagnostics\":[", f);
+	int first = 1;
+	cc_for_each(&doc->errors, l)
+		lsp_write_diagnostic(f, &first, *l, 0, (*l)->err, (string) { "", 0 });
+	cc_for_each(&doc->bad, bad) {
+		string *name = &bad->name;
+		lsp_symbol *sym = cc_get(&doc->symbols, *name);
+		if (cc_size(&sym->defs) == 0) {
+			cc_for_each(&sym->refs, l) {
+				cc_for_each(&(*l)->refs, ref) {
+					if (ref->name.begin == name->begin)
+						lsp_write_diagnostic(f, &first, *l, ref->col, "undefined label %.*s", *name);
+				}
+			}
+		}
+		lsp_line *def = lsp_first_def(sym);
+		cc_for_each(&sym->defs, l) {
+			if (*l != def)
+				lsp_write_diagnostic(f, &first, *l, (*l)->def_col, "label %.*s redefined", *name);
+		}
+	}
+	fputs("]}}", f);
+	fclose(f);
+	lsp_send(ls, body, len);
+	free(body);
+}
+
+// replies to the request msg with result, which is already JSON
+static void lsp_reply(lsp *ls, const char *msg, const char *result, size_t result_len) {
+	const char *id = json_member(msg, "id");
+	const char *id_end = json_skip(id);
+	char *body;
+	size_t len;
+	FILE *f = open_memstream(&body, &len);
+	if (!f)
+		panic(no_mem);
+	fprintf(f, "{\"jsonrpc\":\"2.0\",\"id\":%.*s,\"result\":%.*s}", (int) (id_end - id), id, (int) result_len, result);
+	fclose(f);
+	lsp_send(ls, body, len);
+	free(body);
+}
+
+static void lsp_reply_error(lsp *ls, const char *msg, int code, const char *message) {
+	const char *id = json_member(msg, "id");
+	const char *id_end = json_skip(id);
+	char *body;
+	size_t len;
+	FILE *f = open_memstream(&body, &len);
+	if (!f)
+		panic(no_mem);
+	fprintf(f, "{\"jsonrpc\":\"2.0\",\"id\":%.*s,\"error\":{\"code\":%d,\"message\":", (int) (id_end - id), id, code);
+	json_write_string(f, message, strlen(message));
+	fputs("}}", f);
+	fclose(f);
+	lsp_send(ls, body, len);
+	free(body);
+}
+
+// the label at params.position in doc, with *name set to its name, or NULL
+// if there's no label there
+static lsp_symbol *lsp_symbol_at(lsp_doc *doc, const char *msg, string *name) {
+	long line, character;
+	if (
+		json_int(json_path(msg, "params.position.line"), &line)
+		|| json_int(json_path(msg, "params.position.character"), &character)
+		|| line < 0 || (size_t) line >= cc_size(&doc->lines) || character < 0
+	)
+		return NULL;
+	lsp_line *l = *cc_get(&doc->lines, line);
+	size_t start = MIN((size_t) character, l->len), end = start;
+	while (start > 0 && identifier(l->text[start - 1]))
+		start--;
+	while (identifier(l->text[end]))
+		end++;
+	string key = { &l->text[start], end - start };
+	lsp_symbol *sym = key.len ? cc_get(&doc->symbols, key) : NULL;
+	if (sym)
+		*name = *cc_key_for(&doc->symbols, sym);
+	return sym;
+}
+
+static void lsp_definition(lsp *ls, lsp_doc *doc, const char *msg) {
+	char *body;
+	size_t len;
+	FILE *f = open_memstream(&body, &len);
+	if (!f)
+		panic(no_mem);
+	string name;
+	lsp_symbol *sym = doc ? lsp_symbol_at(doc, msg, &name) : NULL;
+	lsp_line *def = sym ? lsp_first_def(sym) : NULL;
+	if (def)
+		lsp_write_location(f, doc, def->idx, def->def_col, def->def_col + name.len);
+	else
+		fputs("null", f);
+	fclose(f);
+	lsp_reply(ls, msg, body, len);
+	free(body);
+}
+
+static void lsp_references(lsp *ls, lsp_doc *doc, const char *msg) {
+	char *body;
+	size_t len;
+	FILE *f = open_memstream(&body, &len);
+	if (!f)
+		panic(no_mem);
+	string name;
+	lsp_symbol *sym = doc ? lsp_symbol_at(doc, msg, &name) : NULL;
+	int first = 1;
+	fputc('[', f);
+	if (sym && json_bool(json_path(msg, "params.context.includeDeclaration"))) {
+		cc_for_each(&sym->defs, l) {
+			fputs(first ? "" : ",", f);
+			first = 0;
+			lsp_write_location(f, doc, (*l)->idx, (*l)->def_col, (*l)->def_col + name.len);
+		}
+	}
+	if (sym) {
+		cc_for_each(&sym->refs, l) {
+			cc_for_each(&(*l)->refs, ref) {
+				if (ref->name.begin != name.begin)
+					continue;
+				fputs(first ? "" : ",", f);
+				first = 0;
+				lsp_write_location(f, doc, (*l)->idx, ref->col, ref->col + name.len);
+			}
+		}
+	}
+	fputc(']', f);
+	fclose(f);
+	lsp_reply(ls, msg, body, len);
+	free(body);
+}
+
+static void lsp_open(lsp *ls, const char *msg) {
+	size_t uri_len, len;
+	char *uri = json_string(json_path(msg, "params.textDocument.uri"), &uri_len);
+	char *text = json_string(json_path(msg, "params.textDocument.text"), &len);
+	if (uri && text) {
+		// opened again, it starts over
+		lsp_doc *doc = lsp_doc_find(ls, uri);
+		if (doc) {
+			free(uri);
+		} else {
+			doc = malloc(sizeof *doc);
+			if (!doc)
+				panic(no_mem);
+			doc->uri = uri;
+			cc_init(&doc->lines);
+			cc_init(&doc->symbols);
+			cc_init(&doc->errors);
+			cc_init(&doc->bad);
+			if (!cc_push(&ls->docs, doc))
+				panic(no_mem);
+		}
+		lsp_splice(ls, doc, 0, cc_size(&doc->lines), text, len);
+		lsp_publish(ls, doc);
+	} else {
+		free(uri);
+	}
+	free(text);
+}
+
+static void lsp_close(lsp *ls, const char *msg) {
+	lsp_doc *doc = lsp_doc_of(ls, msg);
+	if (!doc)
+		return;
+	// an empty document clears what was published for it
+	lsp_splice(ls, doc, 0, cc_size(&doc->lines), "", 0);
+	lsp_publish(ls, doc);
+	for (size_t i = 0; i < cc_size(&ls->docs); i++) {
+		if (*cc_get(&ls->docs, i) == doc) {
+			cc_erase(&ls->docs, i);
+			break;
+		}
+	}
+	lsp_doc_free(doc);
+}
+
+// handles one message
+// returns the exit status once the client says to exit, otherwise -1
+static int lsp_handle(lsp *ls, const char *msg) {
+	size_t len;
+	char *method = json_string(json_member(msg, "method"), &len);
+	int is_request = json_member(msg, "id") != NULL;
+	int status = -1;
+	if (!method) {
+		// a reply to a request of ours, and there are none
+	} else if (strcmp(method, "initialize") == 0) {
+		const char *caps =
+			"{\"capabilities\":{"
+			"\"textDocumentSync\":{\"openClose\":true,\"change\":2},"
+			"\"definitionProvider\":true,"
+			"\"referencesProvider\":true"
+			"},\"serverInfo\":{\"name\":\"asm\"}}";
+		lsp_reply(ls, msg, caps, strlen(caps));
+	} else if (strcmp(method, "shutdown") == 0) {
+		ls->shutdown = 1;
+		lsp_reply(ls, msg, "null", 4);
+	} else if (strcmp(method, "exit") == 0) {
+		status = !ls->shutdown;
+	} else if (strcmp(method, "textDocument/didOpen") == 0) {
+		lsp_open(ls, msg);
+	} else if (strcmp(method, "textDocument/didChange") == 0) {
+		lsp_doc *doc = lsp_doc_of(ls, msg);
+		if (doc) {
+			const char *changes = json_path(msg, "params.contentChanges");
+			for (const char *c = json_first(changes); c; c = json_next(c))
+				lsp_change(ls, doc, c);
+			lsp_publish(ls, doc);
+		}
+	} else if (strcmp(method, "textDocument/didClose") == 0) {
+		lsp_close(ls, msg);
+	} else if (strcmp(method, "textDocument/definition") == 0) {
+		lsp_definition(ls, lsp_doc_of(ls, msg), msg);
+	} else if (strcmp(method, "textDocument/references") == 0) {
+		lsp_references(ls, lsp_doc_of(ls, msg), msg);
+	} else if (is_request) {
+		lsp_reply_error(ls, msg, -32601, "method not found");
+	}
+	free(method);
+	return status;
+}
+
+// reads one message into a '\0' terminated buffer to be freed
+// returns NULL at the end of in, or if the headers are malformed
+static char *lsp_read(FILE *in) {
+	char header[256];
+	long len = -1;
+	for (;;) {
+		if (!fgets(header, sizeof header, in))
+			return NULL;
+		if (strcmp(header, "\r\n") == 0 || strcmp(header, "\n") == 0)
+			break;
+		if (strncasecmp(header, "Content-Length:", 15) == 0)
+			len = strtol(header + 15, NULL, 10);
+	}
+	if (len < 0 || len > MAX_MESSAGE)
+		return NULL;
+	char *msg = malloc(len + 1);
+	if (!msg)
+		panic(no_mem);
+	if (fread(msg, 1, len, in) != (size_t) len) {
+		free(msg);
+		return NULL;
+	}
+	msg[len] = '\0';
+	return msg;
+}
+
+int lsp_serve(FILE *in, FILE *out) {
+	lsp ls = {
+		.out = out,
+		.em = emitter_new(NULL),
+	};
+	if (!ls.em)
+		panic(no_mem);
+	cc_init(&ls.docs);
+	int status = -1;
+	char *msg;
+	while (status < 0 && (msg = lsp_read(in))) {
+		status = lsp_handle(&ls, msg);
+		free(msg);
+	}
+	cc_for_each(&ls.docs, doc)
+		lsp_doc_free(*doc);
+	cc_cleanup(&ls.docs);
+	emitter_free(ls.em);
+	// the client went away without saying
+	return status < 0 ? 1 : status;
+}
@@ -0,0 +1,26 @@
+#ifndef LSP_H
+#define LSP_H
+
+#include <stdio.h>
+
+// asm --lsp speaks the language server protocol over stdin and stdout, so an
+// editor can show errors as a file is typed, and jump between labels and
+// where they're used, without running the whole assembler every keystroke
+// each open document is a table of lines, and an edit only parses again the
+// lines it touched, each with parse_line on its own, starting in the section
+// the line before left current, and the lines after it that it moved to
+// another section
+// labels are indexed by name as lines are parsed, so going to a definition or
+// finding the references is a lookup rather than a search
+// nothing is laid out or written, so only what can be told from the lines
+// themselves is reported: errors in a line, and labels that are used but
+// never defined, or defined twice
+// positions count bytes, which for assembly, being ASCII, are the UTF-16 code
+// units the protocol counts by default
+
+// serves requests from in, replying on out, until the client says to exit
+// returns the exit status, which is 0 if the client asked for a shutdown
+// first, as the protocol has it
+extern int lsp_serve(FILE *in, FILE *out);
+
+#endif
@@ -1,113 +1,1578 @@
+#include <assert.h>
+#include <elf.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/param.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "argparse.h"
+#include "assemble.h"
+#include "cache.h"
 #include "emitter.h"
+#include "hash.h"
+#include "input.h"
+#include "jobserver.h"
+#include "lsp.h"
+#include "output.h"
 #include "parser.h"
+#include "prelude.h"
+#include "rebase.h"
+#include "remote.h"
+#include "server.h"
 
-int main(int argc, char **argv) {
-	char *output_file = "a.out";
-	long long text_vaddr = 0x00400000;
-	long long data_vaddr = 0x10010000;
-	Option opts[] = {
-		OPT('o', NULL, OPT_STR, &output_file),
-		OPT('\0', "text-vaddr", OPT_LLONG, &text_vaddr),
-		OPT('\0', "data-vaddr", OPT_LLONG, &data_vaddr),
-	};
-	int extra_args = argparse(argc, argv, opts, sizeof(opts) / sizeof(opts[0]));
-	if (extra_args != 2) {
-		printf("Exactly one input must be specified.\n");
+// the CLI's file buffers are on disk, since a program can be far larger than
+// what's worth keeping in memory
+// returns a zeroed emitter, or NULL after printing why it couldn't
+emitter *open_emitter(void) {
+	emitter *em = emitter_new("/var/tmp");
+	if (!em)
+		printf("Failed to open temporary files: %s\n", strerror(errno));
+	return em;
+}
+
+// for emitter_hold, so a panic while an output is being written doesn't leave
+// it open
+void release_output(void *out) {
+	output_abort(out);
+}
+
+// several inputs are assembled in parallel, each into its own emitter, by
+// threads that each take the next input not yet taken
+typedef struct {
+	char **input_files;
+	emitter **parts;
+	size_t n;
+	atomic_size_t next;
+	atomic_int failed;
+	enum input_strategy strategy;
+	worker_pool pool;
+} assembly;
+
+// a panic, like running out of memory, fails only the input it happened in,
+// since it can't jump from one thread to another
+int assemble_part(assembly *a, size_t i) {
+	emitter *part = a->parts[i];
+	jmp_buf recover;
+	if (setjmp(recover)) {
+		part->recover = NULL;
+		printf("%s: %s\n", a->input_files[i], part->panicked);
+		return 1;
+	}
+	part->recover = &recover;
+	string name;
+	int failed = (
+		assemble_file(a->input_files[i], part, a->strategy, NULL, stdout)
+		|| emitter_finish(part, &name) // can't fail for an input to link
+	);
+	part->recover = NULL;
+	return failed;
+}
+
+void assemble_worker(void *ctx, size_t id) {
+	assembly *a = ctx;
+	for (;;) {
+		// between inputs, the main thread picks up any tokens that
+		// have come free
+		if (id == 0)
+			pool_grow(&a->pool);
+		size_t i = atomic_fetch_add(&a->next, 1);
+		if (i >= a->n)
+			return;
+		if (assemble_part(a, i))
+			a->failed = 1;
+	}
+}
+
+// assembles every input into its own part, on up to one thread per core, or
+// fewer if make's jobserver is short of tokens
+// returns 0 on success, otherwise prints the errors and returns 1
+int assemble_parallel(assembly *a) {
+	for (size_t i = 0; i < a->n; i++) {
+		a->parts[i] = open_emitter();
+		if (!a->parts[i])
+			return 1;
+		a->parts[i]->link_input = 1;
+	}
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	atomic_init(&a->next, 0);
+	atomic_init(&a->failed, 0);
+	pool_init(&a->pool, assemble_worker, a, MIN(a->n, (size_t) MAX(cores, 1)));
+	pool_run(&a->pool);
+	return a->failed;
+}
+
+// frees the parts, even those only partly assembled
+void release_parts(void *ctx) {
+	assembly *a = ctx;
+	for (size_t i = 0; i < a->n; i++) {
+		if (a->parts[i])
+			emitter_free(a->parts[i]);
+	}
+	free(a->parts);
+}
+
+// --batch assembles every input in a manifest into its own ELF, on a pool of
+// threads, so thousands of small programs don't each pay for starting a
+// process
+typedef struct {
+	char *input_file, *output_file;
+	off_t size; // of the input, so the largest can go first
+	int failed;
+	// what was printed while assembling it, shown once every job is done
+	char *log;
+	size_t log_len;
+} batch_job;
+
+// each worker has a deque of jobs, and takes the largest from its front
+// a worker with none left steals the smallest from the back of another's,
+// so the last jobs to run anywhere are the smallest
+typedef struct {
+	pthread_mutex_t lock;
+	batch_job **jobs;
+	size_t head, tail;
+} batch_deque;
+
+typedef struct {
+	batch_job *jobs;
+	size_t n_jobs;
+	batch_deque *deques;
+	size_t n_workers;
+	const layout_options *lo;
+	enum input_strategy strategy;
+	int write_if_changed;
+	int relocatable;
+	int debug;
+	const char *cwd;
+	atomic_size_t failed;
+	worker_pool pool;
+} batch;
+
+// returns the next job for worker id, or NULL if there are none left
+// anywhere
+// jobs are never added, so once every deque has been seen empty they stay
+// that way
+batch_job *batch_take(batch *b, size_t id) {
+	batch_deque *own = &b->deques[id];
+	batch_job *job = NULL;
+	pthread_mutex_lock(&own->lock);
+	if (own->head < own->tail)
+		job = own->jobs[own->head++];
+	pthread_mutex_unlock(&own->lock);
+	for (size_t i = 1; !job && i < b->n_workers; i++) {
+		batch_deque *victim = &b->deques[(id + i) % b->n_workers];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head < victim->tail)
+			job = victim->jobs[--victim->tail];
+		pthread_mutex_unlock(&victim->lock);
+	}
+	return job;
+}
+
+// assembles one job with a worker's emitter and stream, which are reused from
+// job to job
+int batch_run_job(batch *b, batch_job *job, emitter *em, input_stream *stream, FILE *log) {
+	emitter_reset(em);
+	if (b->debug)
+		em->lines.file = job->input_file;
+	if (
+		assemble_file(job->input_file, em, b->strategy, stream, log)
+		|| layout_and_finish(em, b->lo, job->input_file, log)
+	)
+		return 1;
+	output out;
+	int changed;
+	if (output_open(&out, job->output_file, b->write_if_changed)) {
+		fprintf(log, "Failed to open %s: %s\n", job->output_file, strerror(errno));
 		return 1;
 	}
-	char *input_file = argv[1];
-	if (strcmp(input_file, output_file) == 0) {
-		printf("Input and output files share the same name %s\n", input_file);
+	emitter_hold(em, release_output, &out);
+	int err = emitter_output_elf(em, &out, &b->lo->elf);
+	emitter_let_go(em, &out);
+	if (err || output_close(&out, &changed)) {
+		fprintf(log, "Failed to emit to %s: %s\n", job->output_file, strerror(errno));
+		output_abort(&out);
 		return 1;
 	}
+	return 0;
+}
 
-	// TODO: write to a temporary file then link that to the expected
-	// output location because calls to lseek that expand the file must
-	// pad with zeros and that might not happen if the file exists and has
-	// data up to the seek
-	int output_fd = open(output_file, O_WRONLY | O_CREAT/* | O_EXCL*/, 0755);
-	if (output_fd == -1) {
-		printf("Failed to open %s: %s\n", output_file, strerror(errno));
+// a panic, like running out of memory, fails only the job it happened in, and
+// the next job resets em
+int batch_run(batch *b, batch_job *job, emitter *em, input_stream *stream, FILE *log) {
+	jmp_buf recover;
+	if (setjmp(recover)) {
+		em->recover = NULL;
+		fprintf(log, "%s: %s\n", job->input_file, em->panicked);
 		return 1;
 	}
+	em->recover = &recover;
+	int failed = batch_run_job(b, job, em, stream, log);
+	em->recover = NULL;
+	return failed;
+}
+
+void batch_worker(void *ctx, size_t id) {
+	batch *b = ctx;
+	emitter *em = open_emitter();
+	input_stream *stream = malloc(sizeof *stream);
+	// a worker that can't start fails every job it takes, rather than
+	// taking the process, which may be a server, down with it
+	if (em && !stream)
+		printf("Out of memory!\n");
+	if (em) {
+		em->relocatable = b->relocatable;
+		if (b->debug) {
+			em->debug = 1;
+			em->lines.dir = b->cwd;
+		}
+	}
+	for (;;) {
+		// between jobs, the main thread picks up any tokens that have
+		// come free
+		if (id == 0)
+			pool_grow(&b->pool);
+		batch_job *job = batch_take(b, id);
+		if (!job)
+			break;
+		FILE *log = NULL;
+		if (em && stream && !(log = open_memstream(&job->log, &job->log_len)))
+			printf("Out of memory!\n");
+		job->failed = !log || batch_run(b, job, em, stream, log);
+		if (log)
+			fclose(log);
+		if (job->failed)
+			b->failed++;
+	}
+	free(stream);
+	if (em)
+		emitter_free(em);
+}
+
+int batch_compare_size(const void *a, const void *b) {
+	off_t x = (*(batch_job *const *) a)->size, y = (*(batch_job *const *) b)->size;
+	return (x < y) - (x > y);
+}
 
-	int input_fd = open(input_file, O_RDONLY);
-	if (input_fd == -1) {
-		printf("Failed to open %s: %s\n", input_file, strerror(errno));
+// frees the jobs and what each of them has
+void batch_free_jobs(batch_job *jobs, size_t n_jobs) {
+	for (size_t i = 0; i < n_jobs; i++) {
+		free(jobs[i].log);
+		free(jobs[i].input_file);
+		free(jobs[i].output_file);
+	}
+	free(jobs);
+}
+
+// reads pairs of input and output paths, one pair per line
+// returns 0 on success, otherwise prints the error and returns 1
+int batch_read_manifest(const char *path, batch_job **jobs, size_t *n_jobs) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		printf("Failed to open %s: %s\n", path, strerror(errno));
 		return 1;
 	}
-	struct stat sb;
-	if (fstat(input_fd, &sb)) {
-		printf("Failed to stat %s: %s\n", input_file, strerror(errno));
+	size_t cap = 0;
+	*jobs = NULL;
+	*n_jobs = 0;
+	char *line = NULL;
+	size_t line_cap = 0;
+	int err = 0;
+	for (long n = 1; !err && getline(&line, &line_cap, f) >= 0; n++) {
+		char in[4096], out[4096], extra;
+		int got = sscanf(line, "%4095s %4095s %c", in, out, &extra);
+		if (got <= 0)
+			continue; // blank
+		if (got != 2) {
+			printf("%s:%ld: expected an input and an output\n", path, n);
+			err = 1;
+			break;
+		}
+		if (*n_jobs == cap) {
+			cap = cap ? 2 * cap : 256;
+			batch_job *more = realloc(*jobs, cap * sizeof **jobs);
+			if (!more) {
+				printf("Out of memory!\n");
+				err = 1;
+				break;
+			}
+			*jobs = more;
+		}
+		batch_job *job = &(*jobs)[(*n_jobs)++];
+		bzero(job, sizeof *job);
+		job->input_file = strdup(in);
+		job->output_file = strdup(out);
+		if (!job->input_file || !job->output_file) {
+			printf("Out of memory!\n");
+			err = 1;
+		}
+		// a missing input fails when its job runs, so it's reported
+		// along with everything else
+		struct stat sb;
+		if (stat(in, &sb) == 0)
+			job->size = sb.st_size;
+	}
+	free(line);
+	fclose(f);
+	if (err) {
+		batch_free_jobs(*jobs, *n_jobs);
+		*jobs = NULL;
+		*n_jobs = 0;
+	}
+	return err;
+}
+
+// returns the number of jobs that failed, or -1 if the batch couldn't start
+long batch_assemble(const char *manifest, batch *b, size_t n_workers) {
+	if (batch_read_manifest(manifest, &b->jobs, &b->n_jobs))
+		return -1;
+	n_workers = MAX(MIN(n_workers, b->n_jobs), 1);
+	b->n_workers = n_workers;
+	b->deques = calloc(n_workers, sizeof *b->deques);
+	// each deque gets every n_workers'th job, so it has room for at most
+	// per of them
+	size_t per = (b->n_jobs + n_workers - 1) / n_workers;
+	batch_job **order = malloc(MAX(b->n_jobs, 1) * sizeof *order);
+	batch_job **slots = malloc(MAX(per * n_workers, 1) * sizeof *slots);
+	if (!b->deques || !order || !slots) {
+		printf("Out of memory!\n");
+		batch_free_jobs(b->jobs, b->n_jobs);
+		free(b->deques);
+		free(order);
+		free(slots);
+		return -1;
+	}
+	// deal the jobs out largest first, so every deque starts with a share
+	// of the large ones at its front
+	// the jobs themselves stay in the manifest's order, which is the order
+	// their errors are shown in
+	for (size_t i = 0; i < b->n_jobs; i++)
+		order[i] = &b->jobs[i];
+	qsort(order, b->n_jobs, sizeof *order, batch_compare_size);
+	for (size_t w = 0; w < n_workers; w++) {
+		pthread_mutex_init(&b->deques[w].lock, NULL);
+		b->deques[w].jobs = &slots[w * per];
+	}
+	for (size_t i = 0; i < b->n_jobs; i++) {
+		batch_deque *d = &b->deques[i % n_workers];
+		d->jobs[d->tail++] = order[i];
+	}
+	atomic_init(&b->failed, 0);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// the main thread is worker 0, and any worker that never gets a token
+	// to start just has its jobs stolen
+	pool_init(&b->pool, batch_worker, b, n_workers);
+	pool_run(&b->pool);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	// a job a worker couldn't run has no log
+	for (size_t i = 0; i < b->n_jobs; i++) {
+		if (b->jobs[i].log)
+			fwrite(b->jobs[i].log, 1, b->jobs[i].log_len, stdout);
+	}
+	printf(
+		"Assembled %zu of %zu files in %.3fs, %.0f files/s, starting %zu threads\n",
+		b->n_jobs - b->failed, b->n_jobs, secs, b->n_jobs / secs, b->pool.started
+	);
+	for (size_t w = 0; w < n_workers; w++)
+		pthread_mutex_destroy(&b->deques[w].lock);
+	batch_free_jobs(b->jobs, b->n_jobs);
+	free(b->deques);
+	free(order);
+	free(slots);
+	return b->failed;
+}
+
+// a size like 4096, 4K or 2M
+// returns 0 on success
+int parse_size_arg(const char *s, uint64_t *size) {
+	char *end;
+	errno = 0;
+	unsigned long long n = strtoull(s, &end, 0);
+	if (errno || end == s)
+		return -1;
+	int shift = 0;
+	switch (*end) {
+	case 'K': case 'k':
+		shift = 10;
+		end++;
+		break;
+	case 'M': case 'm':
+		shift = 20;
+		end++;
+		break;
+	case 'G': case 'g':
+		shift = 30;
+		end++;
+		break;
+	}
+	if (*end != '\0' || n > UINT64_MAX >> shift)
+		return -1;
+	*size = (uint64_t) n << shift;
+	return 0;
+}
+
+// what gets written once a program is assembled, and how
+typedef struct {
+	char *files[N_OUT_FORMATS]; // NULL for formats not written
+	int write_if_changed;
+	elf_options elf;
+	uint8_t gap_fill;
+	const char *text_align; // as given, for reporting the padding
+	char *rebase_table; // NULL unless one's written along with the ELF
+} output_options;
+
+// writes em to oo's output in format i, and the rebase table along with the ELF
+// returns 0 on success, otherwise prints the error and returns 1
+int write_output(emitter *em, const output_options *oo, int i) {
+	// TODO: when not writing only if changed, also write to a temporary
+	// file then link that to the expected output location, so a failed
+	// write doesn't leave a truncated file behind
+	// with --write-if-changed, an output identical to the existing file is
+	// left untouched, so its mtime doesn't trigger rebuilds of everything
+	// that depends on it
+	const uint64_t pagesize = 0x1000;
+	output out;
+	int changed;
+	if (output_open(&out, oo->files[i], oo->write_if_changed)) {
+		printf("Failed to open %s: %s\n", oo->files[i], strerror(errno));
 		return 1;
 	}
-	if (sb.st_size == 0) {
-		printf("%s is completely empty!\n", input_file);
+	emitter_hold(em, release_output, &out);
+	int err = write_format(i, em, &out, &oo->elf, oo->gap_fill);
+	emitter_let_go(em, &out);
+	off_t size = out.end;
+	if (err || output_close(&out, &changed)) {
+		printf("Failed to emit to %s: %s\n", oo->files[i], strerror(errno));
+		output_abort(&out);
 		return 1;
 	}
-	// NOTE: changes made to the underlying file should not be visible in
-	// this mapped region, but man pages say this behavior is unspecified
-	// the worst that can happen is that this process reads out-of-bounds,
-	// general UB, and possibly crash :)
-	char *in = mmap(NULL, sb.st_size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, input_fd, 0);
-	close(input_fd);
-	if (in == MAP_FAILED) {
-		printf("Failed to mmap %s: %s\n", input_file, strerror(errno));
+	if (i == OUT_ELF && oo->rebase_table) {
+		if (output_open(&out, oo->rebase_table, oo->write_if_changed)) {
+			printf("Failed to open %s: %s\n", oo->rebase_table, strerror(errno));
+			return 1;
+		}
+		emitter_hold(em, release_output, &out);
+		err = emitter_output_rebase_table(em, &out, &oo->elf, size);
+		emitter_let_go(em, &out);
+		if (err || output_close(&out, &changed)) {
+			printf("Failed to emit to %s: %s\n", oo->rebase_table, strerror(errno));
+			output_abort(&out);
+			return 1;
+		}
+	}
+	// huge page alignment can cost most of a huge page in file
+	// size, though it's a hole, so say how much
+	if (i == OUT_ELF && oo->elf.text_align > pagesize && !em->relocatable) {
+		uint64_t padding = elf_text_segment_size(em, &oo->elf) - elf_headers_size(em, &oo->elf) - em->section[SECT_TEXT].pos;
+		printf(
+			"Padded .text to %s with %lu bytes, %.1f%% of %s's %ld bytes, left as a hole\n",
+			oo->text_align, padding, 100.0 * padding / size, oo->files[i], size
+		);
+	}
+	return 0;
+}
+
+// writes em to every output in oo
+// outputs are only opened once there's something to write to them, so a
+// failed run leaves them alone
+// returns 0 on success, otherwise prints the error and returns 1
+int write_outputs(emitter *em, const output_options *oo) {
+	for (int i = 0; i < N_OUT_FORMATS; i++) {
+		if (oo->files[i] && write_output(em, oo, i))
+			return 1;
+	}
+	return 0;
+}
+
+// writes em, as it is before being laid out, as a prelude to path
+// returns 0 on success, otherwise prints the error and returns 1
+int write_prelude(emitter *em, const char *path, int write_if_changed) {
+	output out;
+	int changed;
+	if (output_open(&out, path, write_if_changed)) {
+		printf("Failed to open %s: %s\n", path, strerror(errno));
 		return 1;
 	}
-	in[sb.st_size] = '\n';
+	emitter_hold(em, release_output, &out);
+	int err = prelude_write(em, &out);
+	emitter_let_go(em, &out);
+	if (err || output_close(&out, &changed)) {
+		printf("Failed to emit to %s: %s\n", path, strerror(errno));
+		output_abort(&out);
+		return 1;
+	}
+	return 0;
+}
 
-	emitter *em = calloc(1, sizeof *em);
-	if (!em) {
-		printf("Out of memory!\n");
+int watch(char *input_file, emitter *em, const layout_options *lo, const output_options *oo);
+
+int serve(const char *path);
+
+// the options run() takes, as OPT takes them, expanded in run() where the
+// variables they set are
+// a server checks a request's arguments against them before argparse, which
+// exits on ones it doesn't take
+#define RUN_OPTIONS(X) \
+	X('g', NULL, OPT_BOOL, &debug) \
+	X('c', NULL, OPT_BOOL, &relocatable) \
+	X('o', NULL, OPT_STR, &output_files[OUT_ELF]) \
+	X('\0', "bin", OPT_STR, &output_files[OUT_BIN]) \
+	X('\0', "ihex", OPT_STR, &output_files[OUT_IHEX]) \
+	X('\0', "srec", OPT_STR, &output_files[OUT_SREC]) \
+	X('\0', "gap-fill", OPT_LLONG, &gap_fill) \
+	X('\0', "strip", OPT_BOOL, &elf.strip) \
+	X('\0', "no-build-id", OPT_BOOL, &no_build_id) \
+	X('\0', "text-vaddr", OPT_LLONG, &text_vaddr) \
+	X('\0', "data-vaddr", OPT_LLONG, &data_vaddr) \
+	X('\0', "auto-layout", OPT_BOOL, &auto_layout) \
+	X('\0', "text-align", OPT_STR, &text_align) \
+	X('\0', "float-abi", OPT_STR, &float_abi) \
+	X('\0', "input", OPT_STR, &input_strategy) \
+	X('\0', "write-if-changed", OPT_BOOL, &write_if_changed) \
+	X('\0', "batch", OPT_STR, &batch_manifest) \
+	X('\0', "jobs", OPT_LLONG, &jobs) \
+	X('\0', "server", OPT_STR, &server_path) \
+	X('\0', "watch", OPT_BOOL, &watching) \
+	X('\0', "cache", OPT_STR, &cache_dir) \
+	X('\0', "cache-size", OPT_STR, &cache_size) \
+	X('\0', "cache-stats", OPT_BOOL, &cache_stats) \
+	X('\0', "remote-cache", OPT_STR, &remote_url) \
+	X('\0', "rebase-table", OPT_STR, &rebase_table) \
+	X('\0', "rebase", OPT_STR, &rebase_image) \
+	X('\0', "prelude", OPT_STR, &prelude) \
+	X('\0', "emit-prelude", OPT_BOOL, &emit_prelude) \
+	X('\0', "lsp", OPT_BOOL, &lsp) \
+	X('h', "help", OPT_BOOL, &help)
+
+#define RUN_OPTION(s, l, type, p) OPT(s, l, type, p),
+#define RUN_OPTION_NAME(s, l, type, p) { s, l, type != OPT_BOOL },
+
+// what check_options needs to know about an option
+typedef struct {
+	char short_name; // or '\0'
+	const char *long_name; // or NULL
+	int takes_value;
+} option_name;
+
+// prints the options run() takes
+void print_usage(const char *name) {
+	printf("Usage: %s [options] input...\n"
+		"  -o file              write the ELF to file, a.out by default\n"
+		"  -g                   include debug info\n"
+		"  -c                   write a relocatable object rather than linking\n"
+		"  --bin file           also write a flat binary to file\n"
+		"  --ihex file          also write Intel HEX to file\n"
+		"  --srec file          also write Motorola S-records to file\n"
+		"  --gap-fill byte      fill the gaps in a --bin, --ihex or --srec with byte\n"
+		"  --strip              leave out the symbol table\n"
+		"  --no-build-id        leave out the build id note\n"
+		"  --text-vaddr addr    where .text is loaded, 0x00400000 by default\n"
+		"  --data-vaddr addr    where .data is loaded, 0x10010000 by default\n"
+		"  --auto-layout        place .data after .text\n"
+		"  --text-align size    align segments to size, 4K by default\n"
+		"  --float-abi abi      soft, single, double or quad, soft by default\n"
+		"  --input how          read inputs with auto, mmap, populate, read or huge\n"
+		"  --write-if-changed   leave outputs whose bytes are the same untouched\n"
+		"  --batch manifest     assemble each job in manifest\n"
+		"  --jobs n             workers for --batch, one per core by default\n"
+		"  --server path        take requests on the socket at path\n"
+		"  --watch              reassemble the input each time it's saved\n"
+		"                       only edits that keep every line's size catch up\n"
+		"                       in place, others reassemble from the last\n"
+		"                       checkpoint before the change to the end\n"
+		"  --cache dir          reuse outputs cached in dir\n"
+		"  --cache-size size    evict from --cache past size, 1G by default\n"
+		"  --cache-stats        print --cache's stats\n"
+		"  --remote-cache url   reuse outputs cached at url, a bazel-remote server\n"
+		"                       started with --disable_http_ac_validation\n"
+		"  --rebase-table file  write what --rebase needs to move the image to file\n"
+		"  --rebase elf         move elf to --text-vaddr and --data-vaddr\n"
+		"  --prelude file       start from the prelude in file\n"
+		"  --emit-prelude       write the input as a prelude rather than an ELF\n"
+		"  --lsp                serve the language server protocol on stdin\n"
+		"  -h, --help           print this\n", name);
+}
+
+// argparse exits on an option it doesn't know, or one missing its value,
+// which for a server would end every request along with this one, so a
+// server looks for those first
+// returns 0 if there are none, otherwise prints the first and returns 1
+int check_options(int argc, char **argv, const option_name *names, size_t n) {
+	for (int i = 1; i < argc; i++) {
+		char *arg = argv[i];
+		if (strcmp(arg, "--") == 0)
+			break;
+		if (arg[0] != '-' || arg[1] == '\0')
+			continue; // an input, or "-" for stdin
+		const option_name *o = NULL;
+		int has_value;
+		if (arg[1] == '-') {
+			size_t len = strcspn(arg + 2, "=");
+			for (size_t j = 0; j < n && !o; j++) {
+				if (names[j].long_name && strlen(names[j].long_name) == len && strncmp(names[j].long_name, arg + 2, len) == 0)
+					o = &names[j];
+			}
+			has_value = arg[2 + len] == '=';
+		} else {
+			for (size_t j = 0; j < n && !o; j++) {
+				if (names[j].short_name == arg[1])
+					o = &names[j];
+			}
+			has_value = arg[2] != '\0';
+		}
+		if (!o) {
+			printf("Unknown option %s\n", arg);
+			return 1;
+		}
+		if (o->takes_value && !has_value && ++i == argc) {
+			printf("Option %s needs a value\n", arg);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// runs asm with the arguments it was given, which for a server come from a
+// client
+// a server assembles into the emitter and stream it keeps warm, rather than
+// new ones, and those are NULL otherwise
+// returns the exit status
+int run(int argc, char **argv, emitter *warm, input_stream *stream) {
+	// every format can be written from the same run, each to its own file
+	// an ELF is always written
+	char *output_files[N_OUT_FORMATS] = {
+		[OUT_ELF] = "a.out",
+	};
+	long long gap_fill = 0;
+	elf_options elf = {
+		.strip = 0,
+		.build_id = 1,
+	};
+	int no_build_id = 0;
+	long long text_vaddr = 0x00400000;
+	long long data_vaddr = -1; // 0x10010000 unless laid out automatically
+	int auto_layout = 0;
+	char *text_align = "4K";
+	char *float_abi = "soft";
+	char *input_strategy = "auto";
+	int write_if_changed = 0;
+	int debug = 0;
+	int relocatable = 0;
+	char *batch_manifest = NULL;
+	long long jobs = 0; // one per core
+	char *server_path = NULL;
+	int watching = 0;
+	char *cache_dir = NULL;
+	char *cache_size = "1G";
+	int cache_stats = 0;
+	char *remote_url = NULL;
+	char *rebase_table = NULL;
+	char *rebase_image = NULL;
+	char *prelude = NULL;
+	int emit_prelude = 0;
+	int lsp = 0;
+	int help = 0;
+	Option opts[] = { RUN_OPTIONS(RUN_OPTION) };
+	if (warm) {
+		option_name names[] = { RUN_OPTIONS(RUN_OPTION_NAME) };
+		if (check_options(argc, argv, names, sizeof names / sizeof *names))
+			return 1;
+	}
+	int extra_args = argparse(argc, argv, opts, sizeof(opts) / sizeof(opts[0]));
+	if (help) {
+		print_usage(argv[0]);
+		return 0;
+	}
+	if (server_path) {
+		if (warm) {
+			printf("A server can't start another.\n");
+			return 1;
+		}
+		return serve(server_path);
+	}
+	// the documents come from the editor, and replies go to stdout, so
+	// nothing else may be printed there
+	if (lsp) {
+		if (warm || extra_args != 1) {
+			printf("--lsp takes no inputs, and can't be sent to a server.\n");
+			return 1;
+		}
+		return lsp_serve(stdin, stdout);
+	}
+	uint64_t cache_max = 0;
+	if (cache_dir && parse_size_arg(cache_size, &cache_max)) {
+		printf("Cache size must be a size like 512M.\n");
 		return 1;
 	}
-	// Why do I have to make this definition? No idea! Should've been done
-	// in fcntl.h
-#define O_TMPFILE __O_TMPFILE
-	em->section[SECT_TEXT].swap = open("/var/tmp", O_TMPFILE | O_RDWR, 0600);
-	em->section[SECT_DATA].swap = open("/var/tmp", O_TMPFILE | O_RDWR, 0600);
-	if (em->section[SECT_TEXT].swap == -1 || em->section[SECT_DATA].swap == -1) {
-		printf("Failed to open temporary files.\n");
+	remote rc;
+	if (remote_url && remote_init(&rc, remote_url)) {
+		printf("The remote cache must be a URL like http://host:port/prefix.\n");
+		return 1;
+	}
+	if (cache_stats) {
+		if (!cache_dir) {
+			printf("--cache-stats needs a --cache to report on.\n");
+			return 1;
+		}
+		if (cache_print_stats(cache_dir, cache_max)) {
+			printf("Failed to read %s's stats: %s\n", cache_dir, strerror(errno));
+			return 1;
+		}
+		return 0;
+	}
+	if (rebase_image) {
+		if (extra_args != 1 || !rebase_table) {
+			printf("--rebase takes an ELF and its --rebase-table, and no inputs.\n");
+			return 1;
+		}
+		if (output_files[OUT_BIN] || output_files[OUT_IHEX] || output_files[OUT_SREC]) {
+			printf("--rebase only writes an ELF.\n");
+			return 1;
+		}
+		if (auto_layout && data_vaddr != -1) {
+			printf("The data vaddr can't be given with an automatic layout.\n");
+			return 1;
+		}
+		// the same defaults as assembling, so moving an image gives
+		// what assembling with the same options would, build id aside
+		rebase_options ro = {
+			.text_vaddr = text_vaddr,
+			.data_vaddr = data_vaddr == -1 ? 0x10010000 : data_vaddr,
+			.auto_layout = auto_layout,
+		};
+		char *err = rebase(rebase_image, rebase_table, output_files[OUT_ELF], &ro);
+		if (err) {
+			printf("Failed to rebase %s: %s\n", rebase_image, err);
+			return 1;
+		}
+		return 0;
+	}
+	if (batch_manifest) {
+		if (rebase_table || prelude || emit_prelude) {
+			printf("With --batch, there's no --rebase-table, --prelude or --emit-prelude.\n");
+			return 1;
+		}
+		if (extra_args != 1) {
+			printf("With --batch, the inputs come from the manifest.\n");
+			return 1;
+		}
+		if (output_files[OUT_BIN] || output_files[OUT_IHEX] || output_files[OUT_SREC] || strcmp(output_files[OUT_ELF], "a.out")) {
+			printf("With --batch, each input is written to the ELF named in the manifest.\n");
+			return 1;
+		}
+	} else if (extra_args < 2) {
+		printf("At least one input must be specified.\n");
+		return 1;
+	}
+	if (jobs < 0) {
+		printf("Jobs can't be negative.\n");
+		return 1;
+	}
+	char **input_files = &argv[1];
+	size_t n_inputs = extra_args - 1;
+	// with more than one input, all of them are assembled then linked
+	char *input_file = n_inputs == 1 ? input_files[0] : "<linked>";
+	char *input_name = strcmp(input_file, "-") == 0 ? "<stdin>" : input_file;
+	if (n_inputs > 1 && (relocatable || debug)) {
+		printf("-c and -g take exactly one input.\n");
+		return 1;
+	}
+	if (watching && (batch_manifest || warm || n_inputs > 1 || strcmp(input_file, "-") == 0)) {
+		printf("--watch takes exactly one input file, and can't be sent to a server.\n");
+		return 1;
+	}
+	if ((prelude || emit_prelude) && n_inputs > 1) {
+		printf("--prelude and --emit-prelude take exactly one input.\n");
+		return 1;
+	}
+	// a prelude is the emitter before anything is laid out, so none of
+	// the formats, or the line numbers that only they have, apply
+	if (emit_prelude && (watching || debug || rebase_table || output_files[OUT_BIN] || output_files[OUT_IHEX] || output_files[OUT_SREC])) {
+		printf("--emit-prelude only writes the prelude, to -o, and can't be used with --watch, -g or --rebase-table.\n");
+		return 1;
+	}
+	elf.build_id = !no_build_id;
+	if (gap_fill < 0 || gap_fill > 255) {
+		printf("Gap fill must be a byte.\n");
+		return 1;
+	}
+	if (auto_layout && data_vaddr != -1) {
+		printf("The data vaddr can't be given with an automatic layout.\n");
+		return 1;
+	}
+	// an object has no addresses of its own, and only an ELF can hold its
+	// relocations
+	if (relocatable) {
+		if (output_files[OUT_BIN] || output_files[OUT_IHEX] || output_files[OUT_SREC]) {
+			printf("An object can only be written as an ELF.\n");
+			return 1;
+		}
+		if (auto_layout || elf.strip || debug || rebase_table) {
+			printf("-c can't be used with --auto-layout, --strip, -g or --rebase-table.\n");
+			return 1;
+		}
+	}
+	if (data_vaddr == -1)
+		data_vaddr = 0x10010000;
+	const uint64_t pagesize = 0x1000;
+	if (
+		parse_size_arg(text_align, &elf.text_align)
+		|| elf.text_align < pagesize
+		|| (elf.text_align & (elf.text_align - 1))
+	) {
+		printf("Text alignment must be a power of two of at least 4K.\n");
+		return 1;
+	}
+	if (text_vaddr % elf.text_align) {
+		printf("Text vaddr must be aligned to %s.\n", text_align);
+		return 1;
+	}
+	// nothing this assembles passes floats, so the float ABI in the ELF
+	// header only has to agree with what it's linked with, which a linker
+	// insists on
+	// soft, all zeros, is what riscv64-unknown-elf defaults to, but a
+	// Linux toolchain's lp64d objects need double
+	static const struct {
+		const char *name;
+		uint32_t flag;
+	} float_abis[] = {
+		{ "soft", EF_RISCV_FLOAT_ABI_SOFT },
+		{ "single", EF_RISCV_FLOAT_ABI_SINGLE },
+		{ "double", EF_RISCV_FLOAT_ABI_DOUBLE },
+		{ "quad", EF_RISCV_FLOAT_ABI_QUAD },
+	};
+	size_t n_float_abis = sizeof float_abis / sizeof *float_abis, abi = 0;
+	while (abi < n_float_abis && strcmp(float_abi, float_abis[abi].name))
+		abi++;
+	if (abi == n_float_abis) {
+		printf("The float ABI must be soft, single, double or quad.\n");
+		return 1;
+	}
+	elf.float_abi = float_abis[abi].flag;
+	const layout_options lo = {
+		.text_vaddr = text_vaddr,
+		.data_vaddr = data_vaddr,
+		.auto_layout = auto_layout,
+		.elf = elf,
+	};
+	output_options oo = {
+		.write_if_changed = write_if_changed,
+		.elf = elf,
+		.gap_fill = gap_fill,
+		.text_align = text_align,
+		.rebase_table = rebase_table,
+	};
+	memcpy(oo.files, output_files, sizeof oo.files);
+
+	enum input_strategy strategy = N_INPUT_STRATEGIES;
+	for (int i = 0; i < N_INPUT_STRATEGIES; i++) {
+		if (strcmp(input_strategy, input_strategy_names[i]) == 0)
+			strategy = i;
+	}
+	if (strategy == N_INPUT_STRATEGIES) {
+		printf("Unknown input strategy %s\n", input_strategy);
 		return 1;
 	}
-	em->section[SECT_TEXT].vaddr = text_vaddr;
-	em->section[SECT_DATA].vaddr = data_vaddr;
-	em->current_section = SECT_TEXT;
-	cc_init(&em->labels);
 
-	char *pos = in;
-	char *end = in + sb.st_size;
-	int line = 1;
-	do {
-		char *err = parse_line(&pos, em);
+	// the parallel modes hold a token from make's jobserver for each
+	// thread past the first
+	if (batch_manifest || n_inputs > 1)
+		jobserver_init();
+
+	// line numbers only make it into the ELF, and only with its section
+	// headers
+	char cwd[PATH_MAX];
+	int with_lines = debug && !elf.strip && output_files[OUT_ELF];
+	if (with_lines && !getcwd(cwd, sizeof cwd)) {
+		printf("Failed to get the working directory: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (batch_manifest) {
+		batch b = {
+			.lo = &lo,
+			.strategy = strategy,
+			.write_if_changed = write_if_changed,
+			.relocatable = relocatable,
+			.debug = with_lines,
+			.cwd = cwd,
+		};
+		if (jobs == 0)
+			jobs = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+		long failed = batch_assemble(batch_manifest, &b, jobs);
+		return failed != 0;
+	}
+
+	for (int i = 0; i < N_OUT_FORMATS; i++) {
+		if (!output_files[i])
+			continue;
+		for (size_t j = 0; j < n_inputs; j++) {
+			if (strcmp(input_files[j], output_files[i]) == 0) {
+				printf("Input and output files share the same name %s\n", input_files[j]);
+				return 1;
+			}
+		}
+		for (int j = 0; j < i; j++) {
+			if (output_files[j] && strcmp(output_files[i], output_files[j]) == 0) {
+				printf("Two outputs share the same name %s\n", output_files[i]);
+				return 1;
+			}
+		}
+	}
+
+	// with --cache, a hit is copied out of the cache rather than assembled,
+	// and a miss is assembled as usual then added to it
+	// --remote-cache is looked in after --cache misses, and what's found
+	// there is added to --cache
+	// the key covers everything that changes the image: the options, and
+	// with line numbers, where the inputs are and what they're called
+	cache c;
+	// the rebase table isn't one of the formats kept, so it's always
+	// assembled for
+	int caching = (cache_dir || remote_url) && !watching && !rebase_table && !emit_prelude;
+	for (size_t i = 0; i < n_inputs; i++)
+		caching = caching && strcmp(input_files[i], "-") != 0;
+	if (caching && cache_init(&c, cache_dir, cache_max)) {
+		printf("Failed to start a cache key: %s\n", strerror(errno));
+		caching = 0;
+	}
+	if (caching) {
+		char options[256];
+		snprintf(
+			options, sizeof options,
+			"text %lx data %lx auto %d align %lx abi %x strip %d id %d c %d fill %lld lines %d",
+			lo.text_vaddr, lo.data_vaddr, lo.auto_layout, elf.text_align, elf.float_abi,
+			elf.strip, elf.build_id, relocatable, gap_fill, with_lines
+		);
+		cache_key(&c, options, strlen(options));
+		if (with_lines)
+			cache_key(&c, cwd, strlen(cwd));
+		for (size_t i = 0; i < n_inputs && caching; i++) {
+			if (with_lines)
+				cache_key(&c, input_files[i], strlen(input_files[i]));
+			// a missing input fails as usual when it's assembled
+			caching = !cache_key_file(&c, input_files[i]);
+		}
+		if (caching && prelude)
+			caching = !cache_key_file(&c, prelude);
+	}
+	if (caching && cache_dir) {
+		switch (cache_fetch(&c, output_format_names, output_files, N_OUT_FORMATS, write_if_changed)) {
+		case 0:
+			return 0;
+		case -1:
+			printf("Failed to copy %s out of the cache: %s\n", input_name, strerror(errno));
+			break;
+		}
+	}
+	if (caching && remote_url) {
+		switch (remote_fetch(&rc, c.key, output_format_names, output_files, N_OUT_FORMATS, write_if_changed)) {
+		case 0:
+			if (cache_dir && cache_store(&c, output_format_names, output_files, N_OUT_FORMATS))
+				printf("Failed to add %s to the cache: %s\n", input_name, strerror(errno));
+			return 0;
+		case -1:
+			printf("Failed to fetch %s from %s: %s\n", input_name, remote_url, strerror(errno));
+			break;
+		}
+	}
+
+	// a server's emitter is left as it was after the last request, other
+	// than being emptied, so everything a request sets is set every time
+	emitter *em = warm;
+	if (em)
+		emitter_reset(em);
+	else if (!(em = open_emitter()))
+		return 1;
+	em->relocatable = relocatable;
+	em->debug = 0;
+	if (with_lines) {
+		em->debug = 1;
+		em->lines.line = 1;
+		em->lines.file = input_name;
+		em->lines.dir = cwd;
+	}
+
+	if (prelude) {
+		char *err = prelude_load(em, prelude);
 		if (err) {
-			printf("%s:%d: %s\n", input_file, line, err);
+			printf("Failed to load %s: %s\n", prelude, err);
+			if (!warm)
+				emitter_free(em);
 			return 1;
 		}
-		line++;
-		pos++;
-	} while (pos < end);
+	}
 
-	int err = emitter_output_elf(em, output_fd);
-	if (err) {
-		printf("Failed to emit to %s: %s\n", output_file, strerror(errno));
+	if (watching)
+		return watch(input_file, em, &lo, &oo);
+
+	int failed = 0;
+	string name;
+	if (n_inputs == 1) {
+		failed = assemble_file(input_file, em, strategy, stream, stdout);
+	} else {
+		// the parts are freed even on failure, or a panic, since a
+		// server goes on
+		emitter **parts = calloc(n_inputs, sizeof *parts);
+		if (!parts) {
+			printf("Out of memory!\n");
+			if (!warm)
+				emitter_free(em);
+			return 1;
+		}
+		assembly a = {
+			.input_files = input_files,
+			.parts = parts,
+			.n = n_inputs,
+			.strategy = strategy,
+		};
+		emitter_hold(em, release_parts, &a);
+		failed = assemble_parallel(&a);
+		if (!failed) {
+			switch (emitter_link(em, parts, n_inputs, &name)) {
+			case FINISH_UNDEFINED:
+				printf("undefined label %.*s\n", (int) name.len, name.begin);
+				failed = 1;
+				break;
+			case FINISH_DUPLICATE:
+				printf("label %.*s is defined by more than one input\n", (int) name.len, name.begin);
+				failed = 1;
+				break;
+			}
+		}
+		emitter_let_go(em, &a);
+		release_parts(&a);
+	}
+
+	if (emit_prelude) {
+		failed = failed || write_prelude(em, output_files[OUT_ELF], write_if_changed);
+		if (!warm)
+			emitter_free(em);
+		return failed;
+	}
+
+	failed = failed || layout_and_finish(em, &lo, input_name, stdout) || write_outputs(em, &oo);
+	if (caching && !failed && cache_dir && cache_store(&c, output_format_names, output_files, N_OUT_FORMATS))
+		printf("Failed to add %s to the cache: %s\n", input_name, strerror(errno));
+	if (caching && !failed && remote_url && remote_store(&rc, c.key, output_format_names, output_files, N_OUT_FORMATS))
+		printf("Failed to upload %s to %s: %s\n", input_name, remote_url, strerror(errno));
+	if (!warm)
+		emitter_free(em);
+	return failed;
+}
+
+// --watch assembles its input again whenever it changes, from the last
+// checkpoint of the emitter before the first line that changed, so the cost
+// of a run is in the lines from there to the end rather than the whole file
+// checkpoints are taken every so many lines, and those past the change are
+// taken again as the run gets to them
+// those in the lines at the end that didn't change are where the last run
+// was at those lines, and a run that gets to one in the same state would go
+// on as that run did, so it goes straight to where that run ended instead,
+// and the cost is in the lines that changed
+typedef struct {
+	size_t offset; // of the first line not yet assembled
+	long line; // its line number
+	emitter em;
+} watch_checkpoint;
+
+// lines between checkpoints, at the least
+#define WATCH_INTERVAL 4096
+// checkpoints in a file, at the most, since each has a copy of every label
+// defined so far
+#define WATCH_CHECKPOINTS 16
+
+// what a run left the outputs as, so when a change leaves the layout and the
+// symbols as they were, only the bytes that changed are written over the
+// ELF and flat binary, in place
+// Intel HEX and SREC are written again every time, since every line of them
+// has a checksum of its own
+typedef struct {
+	uint64_t from, to;
+} watch_range;
+
+// ranges of a section, at the most, before they're merged into one
+#define WATCH_RANGES 8
+
+typedef struct {
+	int written; // whether the outputs are as the last write left them
+	uint64_t layout; // watch_layout as of that write
+	struct stat sb[N_OUT_FORMATS]; // to tell if an output was touched since
+	// bytes of each section that may differ from the outputs, besides
+	// those in patches, which the emitter notes
+	watch_range dirty[N_SECTIONS][WATCH_RANGES];
+	size_t n_dirty[N_SECTIONS];
+	cc_vec(emitter_patch) patches;
+} watch_outputs;
+
+// reads all of path into a new buffer, ending in a '\n' even if the file
+// doesn't
+// returns NULL after printing why if it can't
+char *watch_read(const char *path, size_t *len) {
+	int fd = open(path, O_RDONLY);
+	struct stat sb;
+	if (fd == -1 || fstat(fd, &sb)) {
+		printf("Failed to open %s: %s\n", path, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return NULL;
+	}
+	char *text = malloc(sb.st_size + 1);
+	if (!text) {
+		printf("Failed to read %s: %s\n", path, no_mem);
+		close(fd);
+		return NULL;
+	}
+	size_t got = 0;
+	while (got < (size_t) sb.st_size) {
+		ssize_t n = read(fd, text + got, sb.st_size - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break; // truncated while it was read, and read again soon
+		got += n;
+	}
+	close(fd);
+	if (got > 0 && text[got - 1] != '\n')
+		text[got++] = '\n';
+	*len = got;
+	return text;
+}
+
+// waits for name, in the directory watched by fd, to be written or replaced
+// events lost to a full queue may have been name's, so it's read again then
+// too
+// returns 0 on success, otherwise prints the error and returns 1
+int watch_wait(int fd, const char *name) {
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	for (;;) {
+		ssize_t len = read(fd, events, sizeof events);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			printf("Failed to wait for %s to change: %s\n", name, len < 0 ? strerror(errno) : "the watch ended");
+			return 1;
+		}
+		for (char *p = events; p < events + len; ) {
+			struct inotify_event *event = (struct inotify_event *) p;
+			if ((event->mask & IN_Q_OVERFLOW) || (event->len && strcmp(event->name, name) == 0))
+				return 0;
+			p += sizeof *event + event->len;
+		}
+	}
+}
+
+// marks bytes from to to of sect as maybe not what's in the outputs
+void watch_dirty(watch_outputs *wo, int sect, uint64_t from, uint64_t to) {
+	watch_range *dirty = wo->dirty[sect];
+	if (wo->n_dirty[sect] == WATCH_RANGES) {
+		for (size_t i = 1; i < WATCH_RANGES; i++) {
+			dirty[0].from = MIN(dirty[0].from, dirty[i].from);
+			dirty[0].to = MAX(dirty[0].to, dirty[i].to);
+		}
+		wo->n_dirty[sect] = 1;
+	}
+	dirty[wo->n_dirty[sect]++] = (watch_range) { .from = from, .to = to };
+}
+
+int watch_is_dirty(watch_outputs *wo, int sect, uint64_t from, uint64_t to) {
+	for (size_t i = 0; i < wo->n_dirty[sect]; i++) {
+		if (wo->dirty[sect][i].from <= from && to <= wo->dirty[sect][i].to)
+			return 1;
+	}
+	return 0;
+}
+
+// what has to be as it was for the outputs to be patched in place: where
+// the sections are and how big, the entry point, and every symbol, in order
+uint64_t watch_layout(emitter *em) {
+	uint64_t layout = emitter_entry(em);
+	for (int i = 0; i < N_SECTIONS; i++) {
+		uint64_t sect[] = {em->section[i].vaddr, em->section[i].pos};
+		layout = hash_combine(layout, xxh64(sect, sizeof sect, 0));
+	}
+	cc_for_each(&em->labels, key, l) {
+		uint64_t sym[] = {xxh64(key->begin, key->len, 0), l->val, l->section, l->type, l->size, l->global, l->added};
+		layout = hash_combine(layout, xxh64(sym, sizeof sym, 0));
+	}
+	return layout;
+}
+
+// whether the file at path is still the one that was stat'd as sb
+int watch_untouched(const char *path, const struct stat *sb) {
+	struct stat now;
+	return (
+		stat(path, &now) == 0
+		&& now.st_dev == sb->st_dev
+		&& now.st_ino == sb->st_ino
+		&& now.st_size == sb->st_size
+		&& now.st_mtim.tv_sec == sb->st_mtim.tv_sec
+		&& now.st_mtim.tv_nsec == sb->st_mtim.tv_nsec
+	);
+}
+
+// pwrite, but with if_changed, bytes the file already has are left alone
+// returns 0 on success, otherwise returns nonzero and sets errno
+int watch_pwrite(int fd, const void *src, size_t n, uint64_t at, int if_changed) {
+	// compared a block at a time, and only what follows the bytes that
+	// are the same is written
+	uint8_t old[4096];
+	size_t same = 0;
+	while (if_changed && same < n) {
+		size_t k = MIN(sizeof old, n - same);
+		if (pread(fd, old, k, at + same) != (ssize_t) k || memcmp(old, (const uint8_t *) src + same, k))
+			break;
+		same += k;
+	}
+	if (same == n)
+		return 0;
+	ssize_t wrote = pwrite(fd, (const uint8_t *) src + same, n - same, at + same);
+	if (wrote != (ssize_t) (n - same)) {
+		if (wrote >= 0)
+			errno = EIO;
 		return 1;
 	}
+	return 0;
+}
 
-	close(em->section[SECT_TEXT].swap);
-	close(em->section[SECT_DATA].swap);
-	free(em);
-	munmap(in, sb.st_size + 1);
-	close(output_fd);
+// writes bytes from to to of sect to fd, where the section starts at off
+// returns 0 on success, otherwise returns nonzero and sets errno
+int watch_patch_range(emitter *em, int fd, uint64_t off, int sect, uint64_t from, uint64_t to, int if_changed) {
+	uint8_t buf[64 * 1024];
+	while (from < to) {
+		size_t n = MIN(sizeof buf, to - from);
+		emitter_read(em, sect, from, buf, n);
+		if (watch_pwrite(fd, buf, n, off + from, if_changed))
+			return 1;
+		from += n;
+	}
 	return 0;
 }
+
+// writes what changed over oo's ELF or flat binary, given as format i, which
+// is laid out as it was when it was last written
+// returns 0 on success, otherwise prints the error and returns 1
+int watch_patch(watch_outputs *wo, emitter *em, const output_options *oo, int i) {
+	int fd = open(oo->files[i], O_RDWR | O_CLOEXEC);
+	if (fd == -1) {
+		printf("Failed to open %s: %s\n", oo->files[i], strerror(errno));
+		return 1;
+	}
+	int err = 0;
+	for (int sect = 0; sect < N_SECTIONS && !err; sect++) {
+		uint64_t pos = em->section[sect].pos;
+		if (pos == 0)
+			continue;
+		uint64_t off = i == OUT_ELF ? elf_section_offset(em, &oo->elf, sect) : bin_section_offset(em, sect);
+		for (size_t j = 0; j < wo->n_dirty[sect] && !err; j++) {
+			watch_range *r = &wo->dirty[sect][j];
+			if (r->from < pos)
+				err = watch_patch_range(em, fd, off, sect, r->from, MIN(r->to, pos), oo->write_if_changed);
+		}
+		cc_for_each(&wo->patches, patch) {
+			if (err)
+				break;
+			uint64_t to = patch->idx + patch->n;
+			if (patch->section != sect || to > pos || watch_is_dirty(wo, sect, patch->idx, to))
+				continue;
+			err = watch_patch_range(em, fd, off, sect, patch->idx, to, oo->write_if_changed);
+		}
+	}
+	if (!err && i == OUT_ELF && oo->elf.build_id) {
+		// the id hashes the whole image, so this is the one part that
+		// costs what a full write does, less the writing
+		uint8_t id[BUILD_ID_SIZE];
+		uint64_t at;
+		err = (
+			elf_build_id(em, &oo->elf, id, &at)
+			|| watch_pwrite(fd, id, sizeof id, at, oo->write_if_changed)
+		);
+	}
+	if (err)
+		printf("Failed to emit to %s: %s\n", oo->files[i], strerror(errno));
+	close(fd);
+	return err;
+}
+
+// writes em to the outputs, in place if it can, which sets in_place
+// returns 0 on success, otherwise prints the error and returns 1
+int watch_write(watch_outputs *wo, emitter *em, const output_options *oo, int *in_place) {
+	uint64_t layout = watch_layout(em);
+	// -c has relocations, and -g a line program, that aren't kept track
+	// of, and a rebase table lists every address anyway
+	*in_place = (
+		wo->written
+		&& layout == wo->layout
+		&& !em->relocatable
+		&& !em->debug
+		&& !oo->rebase_table
+		&& (oo->files[OUT_ELF] || oo->files[OUT_BIN])
+	);
+	for (int i = 0; i < N_OUT_FORMATS && *in_place; i++) {
+		if (oo->files[i] && !watch_untouched(oo->files[i], &wo->sb[i]))
+			*in_place = 0;
+	}
+	wo->written = 0;
+	for (int i = 0; i < N_OUT_FORMATS; i++) {
+		if (!oo->files[i])
+			continue;
+		if (*in_place && (i == OUT_ELF || i == OUT_BIN) ? watch_patch(wo, em, oo, i) : write_output(em, oo, i))
+			return 1;
+		if (stat(oo->files[i], &wo->sb[i])) {
+			printf("Failed to stat %s: %s\n", oo->files[i], strerror(errno));
+			return 1;
+		}
+	}
+	wo->written = 1;
+	wo->layout = layout;
+	for (int i = 0; i < N_SECTIONS; i++)
+		wo->n_dirty[i] = 0;
+	cc_clear(&wo->patches);
+	return 0;
+}
+
+// only returns if it couldn't start watching, or the watch failed
+int watch(char *input_file, emitter *em, const layout_options *lo, const output_options *oo) {
+	// editors often save by writing a new file and renaming it over the
+	// old one, which a watch on the file itself would lose track of, so
+	// its directory is watched instead
+	char *slash = strrchr(input_file, '/');
+	char *name = slash ? slash + 1 : input_file;
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof dir, "%.*s", slash ? (int) (slash - input_file) + 1 : 1, slash ? input_file : ".");
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd == -1 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+		printf("Failed to watch %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+
+	watch_checkpoint *checkpoints = malloc(WATCH_CHECKPOINTS * sizeof *checkpoints);
+	if (!checkpoints) {
+		printf("Out of memory!\n");
+		close(fd);
+		return 1;
+	}
+	// the first checkpoint is before any line at all
+	size_t n_checkpoints = 1;
+	checkpoints[0].offset = 0;
+	checkpoints[0].line = 1;
+	emitter_save(em, &checkpoints[0].em);
+	// where the last run to get through every line was then, before
+	// anything was laid out, while the file buffers still have what it
+	// flushed past the checkpoints
+	watch_checkpoint last;
+	int have_last = 0;
+	watch_outputs wo = {0};
+	cc_init(&wo.patches);
+	em->patches = &wo.patches;
+	char *text = NULL; // as of the last run
+	size_t text_len = 0;
+	for (int lost = 0; !lost; lost = watch_wait(fd, name)) {
+		size_t len;
+		char *next = watch_read(input_file, &len);
+		if (!next)
+			continue;
+		if (text && len == text_len && memcmp(next, text, len) == 0) {
+			free(next);
+			continue;
+		}
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		// everything before the first byte that changed is as it was,
+		// and so are the checkpoints taken there, and everything after
+		// the last byte that changed is too, just moved along
+		size_t same = 0, same_tail = 0;
+		if (text) {
+			size_t common = MIN(len, text_len);
+			while (same < common && next[same] == text[same])
+				same++;
+			while (same_tail < common - same && next[len - 1 - same_tail] == text[text_len - 1 - same_tail])
+				same_tail++;
+		}
+		size_t n_before = 0, n_kept = 0;
+		for (size_t i = 0; i < n_checkpoints; i++) {
+			watch_checkpoint *c = &checkpoints[i];
+			if (c->offset <= same) {
+				checkpoints[n_kept++] = *c;
+				n_before = n_kept;
+			} else if (have_last && c->offset > text_len - same_tail) {
+				c->offset += len - text_len;
+				checkpoints[n_kept++] = *c;
+			} else {
+				emitter_discard(&c->em);
+			}
+		}
+		n_checkpoints = n_kept;
+		free(text);
+		text = next;
+		text_len = len;
+		watch_checkpoint *from = &checkpoints[n_before - 1];
+		long from_line = from->line;
+		emitter_restore(em, &from->em);
+		uint64_t flushed[N_SECTIONS];
+		for (int i = 0; i < N_SECTIONS; i++)
+			flushed[i] = em->section[i].pos - em->section[i].len;
+
+		size_t lines = 0;
+		for (char *p = text; (p = memchr(p, '\n', text + len - p)); p++)
+			lines++;
+		size_t interval = MAX(WATCH_INTERVAL, lines / (WATCH_CHECKPOINTS - 1) + 1);
+		char *pos = text + from->offset;
+		long line = from->line;
+		int failed = len == 0;
+		if (failed)
+			printf("%s is completely empty!\n", input_file);
+		// checkpoints from ahead on are still the last run's, and each
+		// chunk stops at the next of them, to see if the run caught up
+		size_t ahead = n_before;
+		int caught_up = 0;
+		while (!failed && pos < text + len) {
+			char *chunk_end = pos;
+			for (size_t i = 0; i < interval && chunk_end < text + len; i++)
+				chunk_end = (char *) memchr(chunk_end, '\n', text + len - chunk_end) + 1;
+			watch_checkpoint *c = &checkpoints[ahead];
+			if (ahead < n_checkpoints && text + c->offset < chunk_end)
+				chunk_end = text + c->offset;
+			failed = assemble_chunk(pos, chunk_end, em, input_file, &line, stdout);
+			pos = chunk_end;
+			if (failed)
+				break;
+			if (ahead < n_checkpoints && pos == text + c->offset) {
+				if (!em->debug && emitter_same_state(em, &c->em)) {
+					// the rest would come out as it did, so
+					// skip to the end of it, with the
+					// checkpoints on the way
+					for (size_t i = ahead + 1; i < n_checkpoints; i++) {
+						emitter_rebase(&checkpoints[i].em, &c->em, em);
+						checkpoints[i].line += line - c->line;
+					}
+					last.line += line - c->line;
+					for (int i = 0; i < N_SECTIONS; i++)
+						watch_dirty(&wo, i, flushed[i], em->section[i].pos);
+					watch_checkpoint here = {
+						.offset = c->offset,
+						.line = line,
+					};
+					emitter_save(em, &here.em);
+					emitter_catch_up(em, &c->em, &last.em);
+					emitter_discard(&c->em);
+					*c = here;
+					caught_up = 1;
+					break;
+				}
+				emitter_discard(&c->em);
+			} else if (pos < text + len && n_checkpoints < WATCH_CHECKPOINTS) {
+				memmove(c + 1, c, (n_checkpoints - ahead) * sizeof *c);
+				n_checkpoints++;
+			} else {
+				continue;
+			}
+			c->offset = pos - text;
+			c->line = line;
+			emitter_save(em, &c->em);
+			ahead++;
+		}
+		if (failed) {
+			// the file buffers have lost what the last run flushed
+			// past here, which catching up with it needs
+			while (n_checkpoints > ahead)
+				emitter_discard(&checkpoints[--n_checkpoints].em);
+			if (have_last)
+				emitter_discard(&last.em);
+			have_last = 0;
+		} else if (!caught_up) {
+			if (have_last)
+				emitter_discard(&last.em);
+			last.offset = len;
+			last.line = line;
+			emitter_save(em, &last.em);
+			have_last = 1;
+		}
+		if (!caught_up) {
+			for (int i = 0; i < N_SECTIONS; i++)
+				watch_dirty(&wo, i, flushed[i], UINT64_MAX);
+		}
+		int in_place = 0;
+		failed = failed || layout_and_finish(em, lo, input_file, stdout) || watch_write(&wo, em, oo, &in_place);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+		if (!failed)
+			printf("Assembled %s from line %ld to %ld of %zu in %.2fms%s\n", input_file, from_line, line - 1, lines, ms, in_place ? ", patched in place" : "");
+		fflush(stdout);
+	}
+	em->patches = NULL;
+	cc_cleanup(&wo.patches);
+	for (size_t i = 0; i < n_checkpoints; i++)
+		emitter_discard(&checkpoints[i].em);
+	free(checkpoints);
+	if (have_last)
+		emitter_discard(&last.em);
+	free(text);
+	close(fd);
+	return 1;
+}
+
+// what a server keeps warm from one request to the next
+typedef struct {
+	emitter *em;
+	input_stream *stream;
+} server_state;
+
+// a panic deep in the emitter, like running out of memory, fails only the
+// request it happened in, as in libasm, rather than taking the server down
+// whatever run() had open is held on the emitter, so the panic releases it on
+// the way here
+int serve_request(void *ctx, int argc, char **argv) {
+	server_state *s = ctx;
+	jmp_buf recover;
+	int failed;
+	if (setjmp(recover)) {
+		// em is only fit to be reset, and what the panic left in its
+		// file buffers shouldn't sit there until the next request
+		s->em->recover = NULL;
+		printf("%s\n", s->em->panicked);
+		emitter_reset(s->em);
+		failed = 1;
+	} else {
+		s->em->recover = &recover;
+		failed = run(argc, argv, s->em, s->stream);
+	}
+	s->em->recover = NULL;
+	return failed;
+}
+
+// asm --server, which only returns if it couldn't start
+// requests are handled one at a time, each into the same emitter and stream
+int serve(const char *path) {
+	server_state s = {
+		.em = open_emitter(),
+		.stream = malloc(sizeof *s.stream),
+	};
+	if (!s.em || !s.stream) {
+		printf("Out of memory!\n");
+		return 1;
+	}
+	// the server's jobserver, if it was started with one, belongs to
+	// some other build than its clients'
+	unsetenv("MAKEFLAGS");
+	printf("Listening on %s\n", path);
+	fflush(stdout);
+	server_listen(path, serve_request, &s);
+	printf("Failed to listen on %s: %s\n", path, strerror(errno));
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	return run(argc, argv, NULL, NULL);
+}
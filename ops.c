@@ -168,3 +168,30 @@ uint8_t func7s[] = {
 	[SLT] = 0x00,
 	[SLTU] = 0x00,
 };
+
+uint32_t encode_r(enum op op, uint32_t rd, uint32_t rs1, uint32_t rs2) {
+	return opcodes[op] | rd << 7 | (uint32_t) func3s[op] << 12 | rs1 << 15 | rs2 << 20 | (uint32_t) func7s[op] << 25;
+}
+
+uint32_t encode_i(enum op op, uint32_t rd, uint32_t rs1, uint32_t imm) {
+	uint32_t instr = opcodes[op] | rd << 7 | (uint32_t) func3s[op] << 12 | rs1 << 15 | imm << 20;
+	if (op == SRAI)
+		instr |= 0x20 << 25;
+	return instr;
+}
+
+uint32_t encode_s(enum op op, uint32_t rs2, uint32_t rs1, uint32_t imm) {
+	return opcodes[op] | (imm & 0x1f) << 7 | (uint32_t) func3s[op] << 12 | rs1 << 15 | rs2 << 20 | (imm & 0xfe0) << 20;
+}
+
+uint32_t encode_b(enum op op, uint32_t rs1, uint32_t rs2) {
+	return opcodes[op] | (uint32_t) func3s[op] << 12 | rs1 << 15 | rs2 << 20;
+}
+
+uint32_t encode_u(enum op op, uint32_t rd, uint32_t imm) {
+	return opcodes[op] | rd << 7 | imm << 12;
+}
+
+uint32_t encode_j(enum op op, uint32_t rd) {
+	return opcodes[op] | rd << 7;
+}
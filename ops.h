@@ -73,4 +73,17 @@ extern uint8_t func3s[];
 // only for R-type
 extern uint8_t func7s[];
 
+// instructions put together from the tables above, with the operands already
+// checked
+// immediates are the bits as they are in the instruction, so an I-type's is
+// 12 bits and a U-type's is 20
+// a branch or jump's offset is left as zeros, for set_btype_imm or
+// set_jtype_imm once it's known
+extern uint32_t encode_r(enum op op, uint32_t rd, uint32_t rs1, uint32_t rs2);
+extern uint32_t encode_i(enum op op, uint32_t rd, uint32_t rs1, uint32_t imm);
+extern uint32_t encode_s(enum op op, uint32_t rs2, uint32_t rs1, uint32_t imm);
+extern uint32_t encode_b(enum op op, uint32_t rs1, uint32_t rs2);
+extern uint32_t encode_u(enum op op, uint32_t rd, uint32_t imm);
+extern uint32_t encode_j(enum op op, uint32_t rd);
+
 #endif
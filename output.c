@@ -0,0 +1,388 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "output.h"
+
+// how much of a copied range is compared at a time
+#define COMPARE_CHUNK (16 * 1024)
+
+// what a gap in the image is compared against, a block at a time
+static const uint8_t zero_block[4096];
+
+int write_all(int fd, const void *data, size_t len) {
+	while (len > 0) {
+		ssize_t written = write(fd, data, len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data = (const uint8_t *) data + written;
+		len -= written;
+	}
+	return 0;
+}
+
+// copies [off, end) of src through memory, for when copy_file_range can't,
+// as between some file systems
+static int copy_read(int src, off_t off, int dst, off_t end) {
+	uint8_t chunk[COMPARE_CHUNK];
+	while (off < end) {
+		ssize_t got = pread(src, chunk, MIN((off_t) sizeof chunk, end - off), off);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got == 0)
+			errno = EIO;
+		if (got <= 0 || write_all(dst, chunk, got))
+			return -1;
+		off += got;
+	}
+	return 0;
+}
+
+// copy_file_range may copy less than asked for, so loop until done
+int copy_sparse(int src, off_t off, int dst, uint64_t len) {
+	off_t end = off + len;
+	while (off < end) {
+		off_t data = lseek(src, off, SEEK_DATA);
+		if (data == -1) {
+			if (errno == ENXIO)
+				data = end; // only a hole remains
+			else if (errno == EINVAL)
+				data = off; // the file system can't tell us
+			else
+				return -1;
+		}
+		data = MIN(data, end);
+		if (data > off) {
+			if (lseek(dst, data - off, SEEK_CUR) == -1)
+				return -1;
+			off = data;
+		}
+		if (off == end)
+			break;
+		off_t hole = lseek(src, off, SEEK_HOLE);
+		if (hole == -1)
+			hole = end;
+		hole = MIN(hole, end);
+		while (off < hole) {
+			ssize_t copied = copy_file_range(src, &off, dst, NULL, hole - off, 0);
+			if (copied < 0 && errno == EINTR)
+				continue;
+			if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS)) {
+				if (copy_read(src, off, dst, hole))
+					return -1;
+				off = hole;
+				break;
+			}
+			if (copied == 0)
+				errno = EIO; // src is shorter than it claimed
+			if (copied <= 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+int hash_sparse(image_hash *h, int src, off_t off, uint64_t len) {
+	uint8_t chunk[COMPARE_CHUNK];
+	off_t end = off + len;
+	while (off < end) {
+		off_t data = lseek(src, off, SEEK_DATA);
+		if (data == -1) {
+			if (errno == ENXIO)
+				data = end; // only a hole remains
+			else if (errno == EINVAL)
+				data = off; // the file system can't tell us
+			else
+				return -1;
+		}
+		data = MIN(data, end);
+		if (data > off) {
+			image_hash_zeros(h, data - off);
+			off = data;
+		}
+		if (off == end)
+			break;
+		off_t hole = lseek(src, off, SEEK_HOLE);
+		if (hole == -1)
+			hole = end;
+		hole = MIN(hole, end);
+		while (off < hole) {
+			ssize_t got = pread(src, chunk, MIN((off_t) sizeof chunk, hole - off), off);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got < 0)
+				return -1;
+			if (got == 0) {
+				// anything past the end of src is a hole
+				image_hash_zeros(h, hole - off);
+				off = hole;
+				break;
+			}
+			image_hash_update(h, chunk, got);
+			off += got;
+		}
+	}
+	return 0;
+}
+
+void output_init(output *out, int fd) {
+	memset(out, 0, sizeof *out);
+	out->fd = fd;
+	out->old_fd = -1;
+}
+
+void output_init_hash(output *out, image_hash *h) {
+	output_init(out, -1);
+	out->hash = h;
+}
+
+int output_open(output *out, const char *path, int if_changed) {
+	output_init(out, -1);
+	out->path = path;
+	if (if_changed) {
+		out->old_fd = open(path, O_RDONLY);
+		struct stat sb;
+		if (out->old_fd != -1 && !fstat(out->old_fd, &sb) && S_ISREG(sb.st_mode)) {
+			out->old_len = sb.st_size;
+			if (out->old_len == 0)
+				return 0;
+			out->old = mmap(NULL, out->old_len, PROT_READ, MAP_SHARED, out->old_fd, 0);
+			if (out->old != MAP_FAILED) {
+				madvise((void *) out->old, out->old_len, MADV_SEQUENTIAL);
+				return 0;
+			}
+			out->old = NULL;
+		}
+		// nothing usable to compare against, so just write
+		if (out->old_fd != -1)
+			close(out->old_fd);
+		out->old_fd = -1;
+		out->old_len = 0;
+	}
+	out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+	return out->fd == -1;
+}
+
+// whether the image is only being compared, not written
+static int comparing(output *out) {
+	return out->fd == -1 && !out->hash;
+}
+
+// gives the file replacing an existing one the existing one's mode, and its
+// owner and ACL where allowed: only root can give a file away, and not every
+// file system has ACLs
+static int copy_attributes(int old_fd, int fd) {
+	struct stat sb;
+	if (fstat(old_fd, &sb))
+		return -1;
+	// before the chmod, since a chown clears the set-user-ID bit
+	if (fchown(fd, sb.st_uid, sb.st_gid))
+		fchown(fd, -1, sb.st_gid);
+	if (fchmod(fd, sb.st_mode & 07777))
+		return -1;
+	char acl[4096];
+	ssize_t len = fgetxattr(old_fd, "system.posix_acl_access", acl, sizeof acl);
+	if (len > 0)
+		fsetxattr(fd, "system.posix_acl_access", acl, len, 0);
+	return 0;
+}
+
+// the image differs from the existing file from out->pos on, so start writing
+// it for real, reusing the matching prefix of the existing file
+static int output_diverge(output *out) {
+	char dir[PATH_MAX];
+	const char *slash = strrchr(out->path, '/');
+	if (!slash) {
+		strcpy(dir, ".");
+	} else if ((size_t) (slash - out->path) < sizeof dir) {
+		memcpy(dir, out->path, slash - out->path);
+		dir[slash - out->path] = '\0';
+		if (slash == out->path)
+			strcpy(dir, "/");
+	} else {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	out->fd = open(dir, O_TMPFILE | O_WRONLY, 0755);
+	if (out->fd == -1)
+		return -1;
+	out->temp = 1;
+	if (copy_attributes(out->old_fd, out->fd))
+		return -1;
+	if (copy_sparse(out->old_fd, 0, out->fd, out->pos))
+		return -1;
+	if (out->old)
+		munmap((void *) out->old, out->old_len);
+	close(out->old_fd);
+	out->old = NULL;
+	out->old_fd = -1;
+	return 0;
+}
+
+// whether the existing file holds exactly data at out->pos
+static int matches(output *out, const void *data, size_t len) {
+	return out->pos + len <= out->old_len && memcmp(out->old + out->pos, data, len) == 0;
+}
+
+static void advance(output *out, uint64_t len) {
+	out->pos += len;
+	out->end = MAX(out->end, out->pos);
+}
+
+int output_write(output *out, const void *data, size_t len) {
+	if (out->hash) {
+		image_hash_update(out->hash, data, len);
+		advance(out, len);
+		return 0;
+	}
+	if (comparing(out)) {
+		if (matches(out, data, len)) {
+			advance(out, len);
+			return 0;
+		}
+		if (output_diverge(out))
+			return -1;
+	}
+	if (write_all(out->fd, data, len))
+		return -1;
+	advance(out, len);
+	return 0;
+}
+
+int output_copy(output *out, int src, off_t off, uint64_t len) {
+	if (out->hash) {
+		if (hash_sparse(out->hash, src, off, len))
+			return -1;
+		advance(out, len);
+		return 0;
+	}
+	uint8_t chunk[COMPARE_CHUNK];
+	while (comparing(out) && len > 0) {
+		size_t n = MIN(len, sizeof chunk);
+		ssize_t got = pread(src, chunk, n, off);
+		if (got < 0)
+			return -1;
+		// anything past the end of src is a hole
+		memset(chunk + got, 0, n - got);
+		if (!matches(out, chunk, n)) {
+			if (output_diverge(out))
+				return -1;
+			break;
+		}
+		advance(out, n);
+		off += n;
+		len -= n;
+	}
+	if (len == 0)
+		return 0;
+	if (copy_sparse(src, off, out->fd, len))
+		return -1;
+	advance(out, len);
+	return 0;
+}
+
+int output_seek(output *out, off_t pos) {
+	if (pos < out->pos) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (out->hash) {
+		image_hash_zeros(out->hash, pos - out->pos);
+		advance(out, pos - out->pos);
+		return 0;
+	}
+	if (comparing(out)) {
+		// the gap is zeros in the new image
+		off_t at = out->pos;
+		while (at < pos && (size_t) at < out->old_len) {
+			// a hole in the existing file is zeros without reading it
+			off_t data = lseek(out->old_fd, at, SEEK_DATA);
+			if (data == (off_t) -1)
+				data = errno == ENXIO ? (off_t) out->old_len : at;
+			if (data > at) {
+				at = MIN(data, pos);
+				continue;
+			}
+			size_t n = MIN((size_t) (pos - at), MIN(sizeof zero_block, out->old_len - at));
+			if (memcmp(out->old + at, zero_block, n))
+				break;
+			at += n;
+		}
+		if (at == pos) {
+			advance(out, pos - out->pos);
+			return 0;
+		}
+		if (output_diverge(out))
+			return -1;
+	}
+	if (lseek(out->fd, pos, SEEK_SET) == (off_t) -1)
+		return -1;
+	advance(out, pos - out->pos);
+	return 0;
+}
+
+// put the finished temporary file in place of the existing one
+// an O_TMPFILE file can only be linked through /proc, and linkat won't
+// replace an existing file, so link it beside the file and rename it over
+static int output_replace(output *out) {
+	char fd_path[64], temp_path[PATH_MAX];
+	snprintf(fd_path, sizeof fd_path, "/proc/self/fd/%d", out->fd);
+	if (snprintf(temp_path, sizeof temp_path, "%s.%d.tmp", out->path, getpid()) >= (int) sizeof temp_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	unlink(temp_path);
+	if (linkat(AT_FDCWD, fd_path, AT_FDCWD, temp_path, AT_SYMLINK_FOLLOW))
+		return -1;
+	if (rename(temp_path, out->path)) {
+		unlink(temp_path);
+		return -1;
+	}
+	return 0;
+}
+
+int output_close(output *out, int *changed) {
+	// a matching prefix isn't enough, the sizes must match too
+	if (comparing(out) && (size_t) out->end != out->old_len && output_diverge(out))
+		return -1;
+	*changed = !comparing(out);
+	if (comparing(out)) {
+		if (out->old)
+			munmap((void *) out->old, out->old_len);
+		close(out->old_fd);
+		return 0;
+	}
+	// an image ending in a hole leaves the file short, so set its size
+	// explicitly
+	if (ftruncate(out->fd, out->end))
+		return -1;
+	if (out->temp && output_replace(out))
+		return -1;
+	if (out->path)
+		return close(out->fd);
+	return 0;
+}
+
+void output_abort(output *out) {
+	if (out->old)
+		munmap((void *) out->old, out->old_len);
+	if (out->old_fd != -1)
+		close(out->old_fd);
+	if (out->fd != -1 && out->path)
+		close(out->fd);
+	out->old = NULL;
+	out->old_fd = -1;
+	out->fd = -1;
+}
@@ -0,0 +1,72 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hash.h"
+
+// where an image is written
+// normally that's straight to the output file, but when only writing if
+// changed, the image is compared against the existing file (mapped) as it's
+// emitted, and nothing is written unless a difference turns up
+// at the first difference, the matching prefix is copied from the existing
+// file into a temporary file, and the rest of the image goes there, which
+// replaces the existing file once the image is complete
+typedef struct {
+	int fd; // where the image is written, -1 while only comparing
+	off_t pos; // offset of the next byte of the image
+	off_t end; // size of the image so far
+	const char *path; // NULL if fd was given rather than opened
+	int temp; // whether fd is a temporary file that replaces path
+	// the existing file, while comparing
+	int old_fd;
+	const uint8_t *old;
+	size_t old_len;
+	// when set, the image is hashed here rather than written anywhere
+	image_hash *hash;
+} output;
+
+// write(2), but retrying short writes, which large writes are allowed to be
+extern int write_all(int fd, const void *data, size_t len);
+
+// copy len bytes of src starting at off to the current offset of dst
+// holes in src are skipped so they stay holes in dst
+extern int copy_sparse(int src, off_t off, int dst, uint64_t len);
+
+// image_hash_update over len bytes of src starting at off, where holes are
+// hashed as zeros without reading them
+extern int hash_sparse(image_hash *h, int src, off_t off, uint64_t len);
+
+// write the image to an already open file
+extern void output_init(output *out, int fd);
+
+// hash the image with h, which has been through image_hash_init, rather
+// than write it
+extern void output_init_hash(output *out, image_hash *h);
+
+// the following return 0 on success, otherwise they return nonzero and set
+// errno
+
+// write the image to path, or if if_changed, only write it if it differs from
+// what's already there
+extern int output_open(output *out, const char *path, int if_changed);
+
+extern int output_write(output *out, const void *data, size_t len);
+
+// output_write, but from len bytes of src starting at off
+extern int output_copy(output *out, int src, off_t off, uint64_t len);
+
+// move to an offset at or past the end of the image so far, anything skipped
+// over reads as zeros
+extern int output_seek(output *out, off_t pos);
+
+// sets *changed to whether the output file was touched
+extern int output_close(output *out, int *changed);
+
+// gives up on the image after an error, closing whatever out still has open
+// an image only being compared, or going to a temporary file, leaves the
+// existing file untouched, but one written directly is left as far as it got
+extern void output_abort(output *out);
+
+#endif
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <elf.h>
 #include <errno.h>
 
 #include "directives.h"
@@ -164,6 +165,8 @@ int parse_reg(char **_s, uint32_t *r) {
 int parse_imm(char **_s, long long *imm) {
 	char *s = *_s;
 	char *end;
+	// strtoll only sets errno on failure, so clear anything left over
+	errno = 0;
 	long long res = strtoll(s, &end, 0);
 	if (
 		s == end || (
@@ -315,6 +318,20 @@ char *parse_data_array(char **_s, emitter *em, int bytes) {
 	long long y = -(x / 2);
 	size_t bytes_emitted = 0;
 	for (;;) {
+		skip_whitespace(&s);
+		// .word and .dword may also hold the address of a label, which
+		// is filled in once it's known
+		if (identifier(*s) && !(*s >= '0' && *s <= '9')) {
+			if (bytes != 4 && bytes != 8)
+				return "only .word and .dword can hold a label";
+			string name = str_parse_identifier(&s);
+			emitter_label_get_or_add_waiter(em, name, bytes == 4 ? ASSIGN_ABS32 : ASSIGN_ABS64);
+			emitter_advance(em, bytes);
+			bytes_emitted += bytes;
+			if (expect_char_literal(&s, ','))
+				break;
+			continue;
+		}
 		if (
 			parse_imm(&s, &ibuf)
 			|| (
@@ -336,12 +353,106 @@ char *parse_data_array(char **_s, emitter *em, int bytes) {
 	return NULL;
 }
 
+// .size label, size
+// where size is an immediate, or .-label for the distance from an earlier
+// label in the same section to here
+char *parse_size(char **_s, emitter *em) {
+	char *s = *_s;
+	long long size;
+	string name = str_parse_identifier(&s);
+	if (name.len == 0 || expect_char_literal(&s, ','))
+		return "expected label, size";
+	if (!expect_char_literal(&s, '.')) {
+		if (expect_char_literal(&s, '-'))
+			return "expected .-label";
+		string from = str_parse_identifier(&s);
+		label *l = cc_get(&em->labels, from);
+		if (!l || l->val < 0 || l->section != em->current_section)
+			return "size must be measured from a label defined earlier in this section";
+		size = em->section[em->current_section].pos - l->val;
+	} else if (parse_imm(&s, &size) || size < 0) {
+		return "size out of range";
+	}
+	emitter_label_get(em, name)->size = size;
+	*_s = s;
+	return NULL;
+}
+
+// .type label, @function
+// or @object, or @notype, and % may be used in place of @
+char *parse_type(char **_s, emitter *em) {
+	char *s = *_s;
+	string name = str_parse_identifier(&s);
+	if (
+		name.len == 0
+		|| expect_char_literal(&s, ',')
+		|| (expect_char_literal(&s, '@') && *s++ != '%')
+	)
+		return "expected label, @type";
+	uint8_t type;
+	if (!EXPECT_LITERAL(&s, "function"))
+		type = STT_FUNC;
+	else if (!EXPECT_LITERAL(&s, "object"))
+		type = STT_OBJECT;
+	else if (!EXPECT_LITERAL(&s, "notype"))
+		type = STT_NOTYPE;
+	else
+		return "unknown type, expected @function, @object, or @notype";
+	if (identifier(*s))
+		return "unknown type, expected @function, @object, or @notype";
+	emitter_label_get(em, name)->type = type;
+	*_s = s;
+	return NULL;
+}
+
+// .globl label
+// the label gets a global symbol, and with -c references to it are left to
+// the linker
+char *parse_globl(char **_s, emitter *em) {
+	char *s = *_s;
+	string name = str_parse_identifier(&s);
+	if (name.len == 0)
+		return "expected label";
+	emitter_label_get(em, name)->global = 1;
+	*_s = s;
+	return NULL;
+}
+
+// these replace whatever immediate the instruction had, since an emitter
+// restored by --watch patches some instructions more than once
 void set_btype_imm(uint32_t *instr, uint32_t i) {
-	*instr |= ((i & 0x1000) << 19) | ((i & 0x7e0) << 20) | ((i & 0x1e) << 7) | ((i & 0x800) >> 4);
+	*instr = (*instr & 0x01fff07f) | ((i & 0x1000) << 19) | ((i & 0x7e0) << 20) | ((i & 0x1e) << 7) | ((i & 0x800) >> 4);
 }
 
 void set_jtype_imm(uint32_t *instr, uint32_t i) {
-	*instr |= ((i & 0x100000) << 11) | (i & 0xff000) | ((i & 0x7fe) << 20) | ((i & 0x800) << 9);
+	*instr = (*instr & 0x00000fff) | ((i & 0x100000) << 11) | (i & 0xff000) | ((i & 0x7fe) << 20) | ((i & 0x800) << 9);
+}
+
+// parses an operation or directive, returning its value in the trie
+// returns -1, leaving *_s alone, if the next identifier isn't one
+int parse_keyword(char **_s) {
+	char *s = *_s;
+	trie *pos = &tbase[0];
+	char here = *s++;
+	for (;;) {
+		char next = *s;
+		if (!identifier(next)) {
+			int termidx = trie_term(pos, here);
+			if (termidx < 0)
+				return -1; // it's not a string we know about
+			*_s = s;
+			return tbase_auxiliary[termidx];
+		}
+		// TODO: trie_next should really be called before trie_term,
+		// but I can get away with this because I check for the end
+		// of an identifier before trying trie_term
+		int nextidx = trie_next(pos, here);
+		if (nextidx < 0)
+			return -1; // not a string we know about
+		pos = tbase + tbase_auxiliary[nextidx];
+		s++;
+		here = next;
+	}
 }
 
 // *_s is *optionally* null-terminated
@@ -351,7 +462,7 @@ void set_jtype_imm(uint32_t *instr, uint32_t i) {
 // otherwise, returns a string with a description of the error that may be
 // presented to the user
 // may add data to the emitter's buffer even in the event of parsing failure
-char *parse_line(char **_s, emitter *em) {
+char *parse_statement(char **_s, emitter *em) {
 	char *s = *_s;
 
 	char *err;
@@ -360,203 +471,182 @@ char *parse_line(char **_s, emitter *em) {
 	if (*s == '\n')
 		return NULL;
 
-	char *rewind = s; // go back here to parse as another kind of line
-
 	string lstr;
 
 	// try parsing as an instruction/known identifier
-	trie *pos = &tbase[0];
-	char here = *s++;
-	for (;;) {
-		char next = *s;
-		if (!identifier(next)) {
-			int termidx = trie_term(pos, here);
-			if (termidx < 0)
-				break; // it's not a string we know about
-
-			int operation = tbase_auxiliary[termidx];
-
-			long long ibuf;
-
-			// check if it's a directive
-			// TODO
-			switch (operation) {
-			case K_BYTE:
-				err = parse_data_array(&s, em, 1);
-				if (err != NULL)
-					return err;
-				goto out_check_line;
-			case K_HALF:
-				err = parse_data_array(&s, em, 2);
-				if (err != NULL)
-					return err;
-				goto out_check_line;
-			case K_WORD:
-				err = parse_data_array(&s, em, 4);
-				if (err != NULL)
-					return err;
-				goto out_check_line;
-			case K_DWORD:
-				err = parse_data_array(&s, em, 8);
-				if (err != NULL)
-					return err;
-				goto out_check_line;
-			case K_TEXT:
-				em->current_section = SECT_TEXT;
-				goto out_check_line;
-			case K_DATA:
-				em->current_section = SECT_DATA;
-				goto out_check_line;
-			case K_ASCII:
-				err = parse_string_literal(&s, em);
-				if (err != NULL)
-					return err;
-				goto out_check_line;
-			case K_SPACE:
-				if (
-					parse_imm(&s, &ibuf)
-					|| ibuf >= 4294967296LL || ibuf < 0
-				)
-					return "immediate out of range";
-				emitter_advance(em, ibuf);
-				goto out_check_line;
-			}
+	int operation = parse_keyword(&s);
+	if (operation >= 0) {
+		long long ibuf;
+
+		// check if it's a directive
+		// TODO
+		switch (operation) {
+		case K_BYTE:
+			err = parse_data_array(&s, em, 1);
+			if (err != NULL)
+				return err;
+			goto out_check_line;
+		case K_HALF:
+			err = parse_data_array(&s, em, 2);
+			if (err != NULL)
+				return err;
+			goto out_check_line;
+		case K_WORD:
+			err = parse_data_array(&s, em, 4);
+			if (err != NULL)
+				return err;
+			goto out_check_line;
+		case K_DWORD:
+			err = parse_data_array(&s, em, 8);
+			if (err != NULL)
+				return err;
+			goto out_check_line;
+		case K_TEXT:
+			em->current_section = SECT_TEXT;
+			goto out_check_line;
+		case K_DATA:
+			em->current_section = SECT_DATA;
+			goto out_check_line;
+		case K_ASCII:
+			err = parse_string_literal(&s, em);
+			if (err != NULL)
+				return err;
+			goto out_check_line;
+		case K_SIZE:
+			err = parse_size(&s, em);
+			if (err != NULL)
+				return err;
+			goto out_check_line;
+		case K_TYPE:
+			err = parse_type(&s, em);
+			if (err != NULL)
+				return err;
+			goto out_check_line;
+		case K_GLOBL:
+			err = parse_globl(&s, em);
+			if (err != NULL)
+				return err;
+			goto out_check_line;
+		case K_SPACE:
+			if (parse_imm(&s, &ibuf) || ibuf < 0)
+				return "immediate out of range";
+			// sections are addressed with 64-bit offsets, but keep
+			// them small enough to fit an off_t
+			if ((uint64_t) ibuf > INT64_MAX - em->section[em->current_section].pos)
+				return "section too large";
+			emitter_advance(em, ibuf);
+			goto out_check_line;
+		}
 
-			// not a directive, must be an operation
+		// not a directive, must be an operation
 
-			assert(operation < N_OPS && operation >= 0);
+		assert(operation < N_OPS && operation >= 0);
 
-			uint32_t t0, t1, t2;
+		uint32_t t0, t1, t2;
 
-			int64_t lbval;
+		int64_t lbval;
 
-			uint32_t instr = opcodes[operation];
-			switch (formats[operation]) {
-			case R_TYPE:
-				if (parse_reg_reg_reg(&s, &t0, &t1, &t2))
-					return "could not parse register, register, register required for this operation";
-				instr |= t0 << 7; // rd
-				instr |= t1 << 15; // rs1
-				instr |= t2 << 20; // rs2
-				instr |= (uint32_t) func3s[operation] << 12;
-				instr |= (uint32_t) func7s[operation] << 25;
+		uint32_t instr;
+		switch (formats[operation]) {
+		case R_TYPE:
+			if (parse_reg_reg_reg(&s, &t0, &t1, &t2))
+				return "could not parse register, register, register required for this operation";
+			instr = encode_r(operation, t0, t1, t2);
+			break;
+		case I_TYPE:
+			switch (operation) {
+			case ECALL:
+				t0 = 0, t1 = 0, t2 = 0;
 				break;
-			case I_TYPE:
-				switch (operation) {
-				case ECALL:
-					t0 = 0, t1 = 0, t2 = 0;
-					break;
-				case EBREAK:
-					t0 = 0, t1 = 0, t2 = 1;
-					break;
-				case LB:
-				case LH:
-				case LW:
-				case LBU:
-				case LHU:
-					// note order of t0, t1, t2
-					if (parse_ls_reg_imm_reg(&s, &t0, &t2, &t1))
-						return "could not parse register, immediate(register) required for this operation";
-					break;
-				default:
-					if (parse_reg_reg_imm(&s, &t0, &t1, &t2))
-						return "could not parse register, register, immediate required for this operation";
-					break;
-				}
-				switch (operation) {
-				case SRAI:
-					instr |= 0x20 << 25;
-					// fallthrough
-				case SLLI:
-				case SRLI:
-					if (t2 > 31)
-						return "immediate out of range for shift operation";
-				}
-				instr |= t0 << 7; // rd
-				instr |= t1 << 15; // rs1
-				instr |= t2 << 20; // imm
-				instr |= (uint32_t) func3s[operation] << 12;
+			case EBREAK:
+				t0 = 0, t1 = 0, t2 = 1;
 				break;
-			case S_TYPE:
-				if (parse_ls_reg_imm_reg(&s, &t0, &t1, &t2))
+			case LB:
+			case LH:
+			case LW:
+			case LBU:
+			case LHU:
+				// note order of t0, t1, t2
+				if (parse_ls_reg_imm_reg(&s, &t0, &t2, &t1))
 					return "could not parse register, immediate(register) required for this operation";
-				instr |= t2 << 15; // rs1
-				instr |= t0 << 20; // rs2
-				instr |= (t1 & 0xfe0) << 20; // imm[11:5]
-				instr |= (t1 & 0x1f) << 7; // imm[4:0]
-				instr |= (uint32_t) func3s[operation] << 12;
-				break;
-			case B_TYPE:
-				if (
-					parse_reg(&s, &t0)
-					|| expect_char_literal(&s, ',')
-					|| parse_reg(&s, &t1)
-					|| expect_char_literal(&s, ',')
-				)
-					return "could not parse register, register required for this operation";
-				lstr = str_parse_identifier(&s);
-				if (lstr.len == 0)
-					return "invalid label";
-				lbval = emitter_label_get_or_add_waiter(em, lstr, ASSIGN_BTYPE);
-				instr |= t0 << 15; // rs1
-				instr |= t1 << 20; // rs2
-				instr |= (uint32_t) func3s[operation] << 12;
-				if (lbval < 0)
-					break; // label has yet to be defined
-				lbval -= em->section[em->current_section].vaddr;
-				lbval -= em->section[em->current_section].pos;
-				set_btype_imm(&instr, (uint32_t) lbval);
-				break;
-			case U_TYPE:
-				if (
-					parse_reg(&s, &t0)
-					|| expect_char_literal(&s, ',')
-					|| parse_imm(&s, &ibuf)
-					|| ibuf >= 1048576 || ibuf < 0
-				)
-					return "could not parse register, immediate required for this operation";
-				instr |= t0 << 7; // rd
-				instr |= (uint32_t) ibuf << 12;
-				break;
-			case J_TYPE:
-				if (
-					parse_reg(&s, &t0)
-					|| expect_char_literal(&s, ',')
-				)
-					return "could not parse register required for this operation";
-				lstr = str_parse_identifier(&s);
-				if (lstr.len == 0)
-					return "invalid label";
-				lbval = emitter_label_get_or_add_waiter(em, lstr, ASSIGN_JTYPE);
-				instr |= t0 << 7; // rd
-				if (lbval < 0)
-					break; // label has yet to be defined
-				lbval -= em->section[em->current_section].vaddr;
-				lbval -= em->section[em->current_section].pos;
-				set_jtype_imm(&instr, (uint32_t) lbval);
 				break;
 			default:
-				// default should never occur
-				// if it does, somehow, the global trie is
-				// messed up (or a instruction info buffer)
-				assert(0);
+				if (parse_reg_reg_imm(&s, &t0, &t1, &t2))
+					return "could not parse register, register, immediate required for this operation";
+				break;
 			}
-			emitter_buffer(em, &instr, sizeof instr);
-			goto out_check_line;
+			switch (operation) {
+			case SRAI:
+			case SLLI:
+			case SRLI:
+				if (t2 > 31)
+					return "immediate out of range for shift operation";
+			}
+			instr = encode_i(operation, t0, t1, t2);
+			break;
+		case S_TYPE:
+			if (parse_ls_reg_imm_reg(&s, &t0, &t1, &t2))
+				return "could not parse register, immediate(register) required for this operation";
+			instr = encode_s(operation, t0, t2, t1);
+			break;
+		case B_TYPE:
+			if (
+				parse_reg(&s, &t0)
+				|| expect_char_literal(&s, ',')
+				|| parse_reg(&s, &t1)
+				|| expect_char_literal(&s, ',')
+			)
+				return "could not parse register, register required for this operation";
+			lstr = str_parse_identifier(&s);
+			if (lstr.len == 0)
+				return "invalid label";
+			lbval = emitter_label_get_or_add_waiter(em, lstr, ASSIGN_BTYPE);
+			instr = encode_b(operation, t0, t1);
+			if (lbval < 0)
+				break; // label has yet to be defined
+			lbval -= em->section[em->current_section].pos;
+			if (lbval < -4096)
+				return "branch target out of range";
+			set_btype_imm(&instr, (uint32_t) lbval);
+			break;
+		case U_TYPE:
+			if (
+				parse_reg(&s, &t0)
+				|| expect_char_literal(&s, ',')
+				|| parse_imm(&s, &ibuf)
+				|| ibuf >= 1048576 || ibuf < 0
+			)
+				return "could not parse register, immediate required for this operation";
+			instr = encode_u(operation, t0, ibuf);
+			break;
+		case J_TYPE:
+			if (
+				parse_reg(&s, &t0)
+				|| expect_char_literal(&s, ',')
+			)
+				return "could not parse register required for this operation";
+			lstr = str_parse_identifier(&s);
+			if (lstr.len == 0)
+				return "invalid label";
+			lbval = emitter_label_get_or_add_waiter(em, lstr, ASSIGN_JTYPE);
+			instr = encode_j(operation, t0);
+			if (lbval < 0)
+				break; // label has yet to be defined
+			lbval -= em->section[em->current_section].pos;
+			if (lbval < -(1 << 20))
+				return "jump target out of range";
+			set_jtype_imm(&instr, (uint32_t) lbval);
+			break;
+		default:
+			// default should never occur
+			// if it does, somehow, the global trie is
+			// messed up (or a instruction info buffer)
+			assert(0);
 		}
-		// TODO: trie_next should really be called before trie_term,
-		// but I can get away with this because I check for the end
-		// of an identifier before trying trie_term
-		int nextidx = trie_next(pos, here);
-		if (nextidx < 0)
-			break; // not a string we know about
-		pos = tbase + tbase_auxiliary[nextidx];
-		s++;
-		here = next;
+		emitter_buffer(em, &instr, sizeof instr);
+		goto out_check_line;
 	}
 
-	s = rewind;
-
 	// not an instruction/section/data entry, better be a label
 	lstr = str_parse_identifier(&s);
 	if (
@@ -564,8 +654,12 @@ char *parse_line(char **_s, emitter *em) {
 		|| expect_char_literal(&s, ':')
 	)
 		return "unknown operation/directive";
-	if (emitter_label_add(em, lstr))
+	switch (emitter_label_add(em, lstr)) {
+	case -1:
 		return "label redefined";
+	case 1:
+		return "a branch or jump to this label is out of range";
+	}
 	// TODO: do stuff with id_start and id_end
 	// like putting the string in the label structure
 
@@ -577,3 +671,15 @@ out_check_line:
 	*_s = s;
 	return NULL;
 }
+
+char *parse_line(char **_s, emitter *em) {
+	if (!em->debug)
+		return parse_statement(_s, em);
+	// only lines that put something in .text get a row
+	uint64_t start = em->section[SECT_TEXT].pos;
+	char *err = parse_statement(_s, em);
+	if (err || em->section[SECT_TEXT].pos == start)
+		return err;
+	emitter_line(em, start);
+	return NULL;
+}
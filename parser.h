@@ -6,6 +6,13 @@
 // used in testing
 extern int parse_reg(char **_s, uint32_t *r);
 
+extern int identifier(char c);
+
+extern void skip_whitespace(char **_s);
+
+// an operation, or directive, or -1
+extern int parse_keyword(char **_s);
+
 // used in testing
 extern char *parse_line(char **_s, emitter *em);
 
@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "emitter.h"
+#include "output.h"
+#include "prelude.h"
+
+static prelude_waiter prelude_waiter_of(const label_waiter *w) {
+	prelude_waiter pw = {
+		.fix_idx = w->fix_idx,
+		.section = w->section,
+		.assign = w->assign,
+	};
+	return pw;
+}
+
+int prelude_write(emitter *em, output *dst) {
+	prelude_header h = {
+		.magic = PRELUDE_MAGIC,
+		.current_section = em->current_section,
+		.relocatable = em->relocatable,
+		.n_labels = cc_size(&em->labels),
+		.n_fixups = cc_size(&em->cross_fixups),
+	};
+	// labels are written in the order they were added, so adding them
+	// again builds the same map, which iterates in the same order, and the
+	// symbol table comes out as if the prelude's source had been assembled
+	// along with the input
+	cc_for_each(&em->labels, key, l) {
+		h.names_len += key->len + 1;
+		if (l->val < 0)
+			h.n_waiters += cc_size(&l->waiters);
+	}
+	uint64_t off = sizeof h;
+	for (int i = 0; i < N_SECTIONS; i++) {
+		h.section[i].pos = em->section[i].pos;
+		h.section[i].len = em->section[i].len;
+		h.section[i].at = off;
+		off = roundup(off + h.section[i].pos, 8);
+	}
+	h.labels = off;
+	h.waiters = h.labels + h.n_labels * sizeof(prelude_label);
+	h.fixups = h.waiters + h.n_waiters * sizeof(prelude_waiter);
+	h.names = h.fixups + h.n_fixups * sizeof(prelude_fixup);
+
+	prelude_label *labels = calloc(MAX(h.n_labels, 1), sizeof *labels);
+	prelude_waiter *waiters = calloc(MAX(h.n_waiters, 1), sizeof *waiters);
+	prelude_fixup *fixups = calloc(MAX(h.n_fixups, 1), sizeof *fixups);
+	char *names = malloc(MAX(h.names_len, 1));
+	int failed = 1;
+	if (!labels || !waiters || !fixups || !names) {
+		errno = ENOMEM;
+		goto out;
+	}
+	// the names and waiters are in map order, which is as good as any
+	uint64_t name_at = 0, waiter_at = 0;
+	cc_for_each(&em->labels, key, l) {
+		prelude_label *pl = &labels[l->added];
+		pl->name = name_at;
+		pl->name_len = key->len;
+		memcpy(&names[name_at], key->begin, key->len);
+		names[name_at + key->len] = '\0';
+		name_at += key->len + 1;
+		pl->val = l->val;
+		pl->size = l->size;
+		pl->section = l->section;
+		pl->type = l->type;
+		pl->global = l->global;
+		pl->first_waiter = waiter_at;
+		if (l->val < 0) {
+			cc_for_each(&l->waiters, w)
+				waiters[waiter_at++] = prelude_waiter_of(w);
+		}
+		pl->n_waiters = waiter_at - pl->first_waiter;
+	}
+	size_t n = 0;
+	cc_for_each(&em->cross_fixups, fixup) {
+		prelude_fixup *pf = &fixups[n++];
+		pf->waiter = prelude_waiter_of(&fixup->waiter);
+		pf->label = -1;
+		pf->val = fixup->val;
+		pf->section = fixup->section;
+		if (fixup->name.len != 0)
+			pf->label = cc_get(&em->labels, fixup->name)->added;
+	}
+
+	if (output_write(dst, &h, sizeof h))
+		goto out;
+	for (int i = 0; i < N_SECTIONS; i++) {
+		if (output_seek(dst, h.section[i].at) || emit_section(em, dst, i))
+			goto out;
+	}
+	failed = (
+		output_seek(dst, h.labels)
+		|| output_write(dst, labels, h.n_labels * sizeof *labels)
+		|| output_write(dst, waiters, h.n_waiters * sizeof *waiters)
+		|| output_write(dst, fixups, h.n_fixups * sizeof *fixups)
+		|| output_write(dst, names, h.names_len)
+	);
+out:
+	free(labels);
+	free(waiters);
+	free(fixups);
+	free(names);
+	return failed;
+}
+
+// whether the n records of size bytes at off are all in the len bytes of the
+// file, without overflowing
+static int prelude_fits(uint64_t off, uint64_t n, uint64_t size, uint64_t len) {
+	return off <= len && n <= (len - off) / size;
+}
+
+// whether w patches bytes the prelude's sections have, as emitter_read and
+// emitter_write expect
+static int prelude_waiter_fits(const prelude_header *h, const prelude_waiter *w) {
+	if (w->section >= N_SECTIONS || w->assign > ASSIGN_ABS64 || w->fix_idx < 0)
+		return 0;
+	uint64_t width = w->assign == ASSIGN_ABS64 ? 8 : 4;
+	uint64_t pos = h->section[w->section].pos;
+	return width <= pos && (uint64_t) w->fix_idx <= pos - width;
+}
+
+// checks everything the file claims before any of it is used, so a corrupt
+// prelude is an error rather than a crash
+static char *prelude_check(const prelude_header *h, size_t len) {
+	if (len < sizeof *h || memcmp(h->magic, PRELUDE_MAGIC, sizeof h->magic))
+		return "not a prelude";
+	if (
+		h->current_section >= N_SECTIONS
+		|| !prelude_fits(h->labels, h->n_labels, sizeof(prelude_label), len)
+		|| !prelude_fits(h->waiters, h->n_waiters, sizeof(prelude_waiter), len)
+		|| !prelude_fits(h->fixups, h->n_fixups, sizeof(prelude_fixup), len)
+		|| !prelude_fits(h->names, h->names_len, 1, len)
+	)
+		return "the prelude is corrupt";
+	for (int i = 0; i < N_SECTIONS; i++) {
+		if (
+			!prelude_fits(h->section[i].at, h->section[i].pos, 1, len)
+			|| h->section[i].len > h->section[i].pos
+			|| h->section[i].len >= sizeof(((emitter *) NULL)->section_buf[0])
+		)
+			return "the prelude is corrupt";
+	}
+	const prelude_label *labels = (const prelude_label *) ((const uint8_t *) h + h->labels);
+	const char *names = (const char *) h + h->names;
+	for (uint64_t i = 0; i < h->n_labels; i++) {
+		const prelude_label *pl = &labels[i];
+		if (
+			pl->section >= N_SECTIONS
+			|| (pl->val >= 0 && (uint64_t) pl->val > h->section[pl->section].pos)
+			|| pl->name >= h->names_len
+			|| pl->name_len >= h->names_len - pl->name
+			|| names[pl->name + pl->name_len] != '\0'
+			|| pl->first_waiter > h->n_waiters
+			|| pl->n_waiters > h->n_waiters - pl->first_waiter
+		)
+			return "the prelude is corrupt";
+	}
+	const prelude_waiter *waiters = (const prelude_waiter *) ((const uint8_t *) h + h->waiters);
+	for (uint64_t i = 0; i < h->n_waiters; i++) {
+		if (!prelude_waiter_fits(h, &waiters[i]))
+			return "the prelude is corrupt";
+	}
+	const prelude_fixup *fixups = (const prelude_fixup *) ((const uint8_t *) h + h->fixups);
+	for (uint64_t i = 0; i < h->n_fixups; i++) {
+		const prelude_fixup *pf = &fixups[i];
+		if (
+			!prelude_waiter_fits(h, &pf->waiter)
+			|| pf->section >= N_SECTIONS
+			|| (pf->label == -1 && (pf->val < 0 || (uint64_t) pf->val > h->section[pf->section].pos))
+			|| pf->label < -1
+			|| pf->label >= (int64_t) h->n_labels
+		)
+			return "the prelude is corrupt";
+	}
+	return NULL;
+}
+
+static label_waiter label_waiter_of(const prelude_waiter *pw) {
+	label_waiter w = {
+		.fix_idx = pw->fix_idx,
+		.section = pw->section,
+		.assign = pw->assign,
+	};
+	return w;
+}
+
+// the prelude's file and its mapping, while prelude_load reads them
+typedef struct {
+	int fd;
+	const uint8_t *base;
+	size_t len;
+} prelude_mapping;
+
+static void prelude_unmap(void *arg) {
+	prelude_mapping *m = arg;
+	munmap((void *) m->base, m->len);
+	close(m->fd);
+}
+
+char *prelude_load(emitter *em, const char *path) {
+	for (int i = 0; i < N_SECTIONS; i++) {
+		if (em->section[i].pos != 0)
+			return "a prelude has to come before anything else";
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return strerror(errno);
+	struct stat sb;
+	if (fstat(fd, &sb)) {
+		int e = errno;
+		close(fd);
+		return strerror(e);
+	}
+	size_t len = sb.st_size;
+	if (len < sizeof(prelude_header)) {
+		close(fd);
+		return "not a prelude";
+	}
+	const uint8_t *base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) {
+		int e = errno;
+		close(fd);
+		return strerror(e);
+	}
+	prelude_mapping m = {
+		.fd = fd,
+		.base = base,
+		.len = len,
+	};
+	emitter_hold(em, prelude_unmap, &m);
+	const prelude_header *h = (const prelude_header *) base;
+	char *err = prelude_check(h, len);
+	if (!err && h->relocatable != (uint32_t) em->relocatable)
+		err = h->relocatable ? "the prelude was made with -c" : "the prelude was made without -c";
+	if (err)
+		goto out;
+
+	// what was flushed goes to the file buffer without passing through
+	// memory, and keeps its holes, and the rest is the buffer itself
+	for (int i = 0; i < N_SECTIONS; i++) {
+		uint64_t flushed = h->section[i].pos - h->section[i].len;
+		int swap = em->section[i].swap;
+		// so emitter_reset knows to empty the file buffer, should the
+		// copy fail partway
+		em->section[i].stale = flushed;
+		if (
+			copy_sparse(fd, h->section[i].at, swap, flushed)
+			|| ftruncate(swap, flushed)
+			|| lseek(swap, flushed, SEEK_SET) == -1
+		) {
+			err = strerror(errno);
+			goto out;
+		}
+		memcpy(em->section_buf[i], base + h->section[i].at + flushed, h->section[i].len);
+		em->section[i].pos = h->section[i].pos;
+		em->section[i].len = h->section[i].len;
+	}
+	em->current_section = h->current_section;
+
+	const prelude_label *labels = (const prelude_label *) (base + h->labels);
+	const prelude_waiter *waiters = (const prelude_waiter *) (base + h->waiters);
+	const prelude_fixup *fixups = (const prelude_fixup *) (base + h->fixups);
+	const char *names = (const char *) base + h->names;
+	for (uint64_t i = 0; i < h->n_labels; i++) {
+		const prelude_label *pl = &labels[i];
+		string key = {
+			.begin = (char *) &names[pl->name],
+			.len = pl->name_len,
+		};
+		if (cc_get(&em->labels, key)) {
+			err = "the prelude is corrupt";
+			goto out;
+		}
+		label *l = emitter_label_get(em, key);
+		l->section = pl->section;
+		l->type = pl->type;
+		l->size = pl->size;
+		l->global = pl->global;
+		for (uint64_t j = 0; j < pl->n_waiters; j++) {
+			if (!cc_push(&l->waiters, label_waiter_of(&waiters[pl->first_waiter + j])))
+				emitter_panic(em, no_mem);
+		}
+		l->val = pl->val;
+		if (l->val >= 0)
+			cc_cleanup(&l->waiters);
+	}
+	for (uint64_t i = 0; i < h->n_fixups; i++) {
+		const prelude_fixup *pf = &fixups[i];
+		cross_fixup fixup = {
+			.waiter = label_waiter_of(&pf->waiter),
+			.section = pf->section,
+			.val = pf->val,
+		};
+		if (pf->label >= 0) {
+			const prelude_label *pl = &labels[pf->label];
+			string key = {
+				.begin = (char *) &names[pl->name],
+				.len = pl->name_len,
+			};
+			// the name has to be the map's own key
+			fixup.name = *cc_key_for(&em->labels, cc_get(&em->labels, key));
+		}
+		if (!cc_push(&em->cross_fixups, fixup))
+			emitter_panic(em, no_mem);
+	}
+
+out:
+	emitter_let_go(em, &m);
+	prelude_unmap(&m);
+	return err;
+}
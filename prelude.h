@@ -0,0 +1,76 @@
+#ifndef PRELUDE_H
+#define PRELUDE_H
+
+#include <stdint.h>
+
+#include "emitter.h"
+#include "output.h"
+
+// --emit-prelude saves an emitter as it is once its input is parsed, before
+// anything is laid out, so --prelude can start another input from there
+// rather than parsing the same definitions again for every file that starts
+// with them
+// loading one is a copy of the section bytes, which stays sparse, and an
+// insert per label, with no parsing at all
+// everything in the file is found by offset from its start, so it can be
+// mapped anywhere, and it's little endian like the images
+// the header comes first, then each section's bytes, then the labels, in the
+// order they were added, the waiters, the fixups and the names
+
+#define PRELUDE_MAGIC "asmpch2"
+
+typedef struct {
+	char magic[8];
+	struct {
+		// as in the emitter
+		uint64_t pos;
+		uint64_t len;
+		uint64_t at; // file offset of all pos bytes
+	} section[N_SECTIONS];
+	uint32_t current_section;
+	uint32_t relocatable; // a prelude for -c can only start an object
+	uint64_t n_labels, labels;
+	uint64_t n_waiters, waiters;
+	uint64_t n_fixups, fixups;
+	uint64_t names_len, names;
+} prelude_header;
+
+typedef struct {
+	uint64_t name; // offset into the names, which are '\0' terminated
+	uint64_t name_len;
+	int64_t val;
+	uint64_t size;
+	// only an undefined label has waiters, the n from first on
+	uint64_t first_waiter;
+	uint64_t n_waiters;
+	uint8_t section;
+	uint8_t type;
+	uint8_t global;
+	uint8_t pad[5];
+} prelude_label;
+
+typedef struct {
+	int64_t fix_idx;
+	uint8_t section;
+	uint8_t assign;
+	uint8_t pad[6];
+} prelude_waiter;
+
+typedef struct {
+	prelude_waiter waiter;
+	int64_t label; // index of the label, or -1 for a target given by value
+	int64_t val;
+	uint8_t section;
+	uint8_t pad[7];
+} prelude_fixup;
+
+// writes what em has assembled so far as a prelude, leaving em as it was
+// returns 0 on success, otherwise returns nonzero and sets errno
+extern int prelude_write(emitter *em, output *dst);
+
+// starts em, which must have nothing assembled, from the prelude at path
+// returns NULL on success, otherwise the error, after which em may be partly
+// loaded, and needs emitter_reset before it's used again
+extern char *prelude_load(emitter *em, const char *path);
+
+#endif
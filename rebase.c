@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "emitter.h"
+#include "hash.h"
+#include "output.h"
+#include "parser.h"
+#include "rebase.h"
+
+// the immediates set_btype_imm and set_jtype_imm put in, sign extended
+static int64_t btype_imm(uint32_t instr) {
+	uint32_t i = ((instr >> 19) & 0x1000) | ((instr >> 20) & 0x7e0) | ((instr >> 7) & 0x1e) | ((instr << 4) & 0x800);
+	return (int64_t) (i ^ 0x1000) - 0x1000;
+}
+
+static int64_t jtype_imm(uint32_t instr) {
+	uint32_t i = ((instr >> 11) & 0x100000) | (instr & 0xff000) | ((instr >> 20) & 0x7fe) | ((instr >> 9) & 0x800);
+	return (int64_t) (i ^ 0x100000) - 0x100000;
+}
+
+// moves the field e describes by delta, a move per section
+// only checks whether it would fit unless write is set
+static char *rebase_field(uint8_t *image, const rebase_entry *e, const int64_t *delta, int write) {
+	uint8_t *p = image + e->at;
+	uint32_t u32;
+	uint64_t u64;
+	int64_t rel;
+	switch (e->assign) {
+	case ASSIGN_ABS32:
+		memcpy(&u32, p, sizeof u32);
+		u64 = u32 + delta[e->sect];
+		if (u64 > UINT32_MAX)
+			return "an address in a .word doesn't fit at the new vaddrs";
+		u32 = u64;
+		if (write)
+			memcpy(p, &u32, sizeof u32);
+		break;
+	case ASSIGN_ABS64:
+		memcpy(&u64, p, sizeof u64);
+		u64 += delta[e->sect];
+		if (write)
+			memcpy(p, &u64, sizeof u64);
+		break;
+	case ASSIGN_BTYPE:
+		memcpy(&u32, p, sizeof u32);
+		rel = btype_imm(u32) + delta[e->sect] - delta[e->from];
+		if (rel < -4096 || rel >= 4096)
+			return "a branch between sections doesn't reach at the new vaddrs";
+		set_btype_imm(&u32, rel);
+		if (write)
+			memcpy(p, &u32, sizeof u32);
+		break;
+	case ASSIGN_JTYPE:
+		memcpy(&u32, p, sizeof u32);
+		rel = jtype_imm(u32) + delta[e->sect] - delta[e->from];
+		if (rel < -(1 << 20) || rel >= 1 << 20)
+			return "a jump between sections doesn't reach at the new vaddrs";
+		set_jtype_imm(&u32, rel);
+		if (write)
+			memcpy(p, &u32, sizeof u32);
+		break;
+	default:
+		return "the table is corrupt";
+	}
+	return NULL;
+}
+
+// where .data goes after .text, as layout_and_finish puts it
+static uint64_t auto_data_vaddr(uint64_t text_vaddr, uint64_t text_segment_size) {
+	const uint64_t pagesize = 0x1000;
+	uint64_t text_end = text_vaddr + text_segment_size;
+	return roundup(text_end, pagesize) + (roundup(text_end, 16) & (pagesize - 1));
+}
+
+// checks the table against the image and works out how far each section moves
+static char *rebase_plan(const rebase_header *h, size_t table_len, const uint8_t *image, size_t image_len, const rebase_options *ro, int64_t *delta) {
+	const uint64_t pagesize = 0x1000;
+	if (
+		table_len < sizeof *h
+		|| memcmp(h->magic, REBASE_MAGIC, sizeof h->magic)
+		|| h->n != (table_len - sizeof *h) / sizeof(rebase_entry)
+	)
+		return "not a rebase table";
+	// .text's segment is the first program header
+	const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *) image;
+	uint64_t text_vaddr;
+	if (
+		image_len != h->size
+		|| image_len < sizeof *ehdr
+		|| memcmp(ehdr->e_ident, ELFMAG, SELFMAG)
+		|| ehdr->e_phoff > image_len - sizeof(Elf64_Phdr)
+	)
+		return "the table is for another image";
+	memcpy(&text_vaddr, image + ehdr->e_phoff + offsetof(Elf64_Phdr, p_vaddr), sizeof text_vaddr);
+	if (text_vaddr != h->text_vaddr)
+		return "the table is for another image, or this one before it was moved";
+	if (ro->text_vaddr % h->text_align)
+		return "the new text vaddr isn't aligned like the old one";
+	uint64_t data_vaddr = ro->auto_layout ? auto_data_vaddr(ro->text_vaddr, h->text_segment_size) : ro->data_vaddr;
+	delta[SECT_TEXT] = ro->text_vaddr - h->text_vaddr;
+	delta[SECT_DATA] = data_vaddr - h->data_vaddr;
+	if (h->data_size > 0 && delta[SECT_DATA] % pagesize)
+		return ".data can only move by whole pages, since its file offset goes with its vaddr";
+	if (h->build_id > image_len - BUILD_ID_SIZE)
+		return "the table is corrupt";
+	for (uint64_t i = 0; i < h->n; i++) {
+		const rebase_entry *e = (const rebase_entry *) (h + 1) + i;
+		if (e->at > image_len - 8 || e->sect >= N_SECTIONS || e->from >= N_SECTIONS)
+			return "the table is corrupt";
+	}
+	return NULL;
+}
+
+// maps all of path, writable if prot says so
+static void *map_file(int fd, size_t *len, int prot) {
+	struct stat sb;
+	if (fstat(fd, &sb))
+		return MAP_FAILED;
+	*len = sb.st_size;
+	if (*len == 0) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+	return mmap(NULL, *len, prot, MAP_SHARED, fd, 0);
+}
+
+char *rebase(const char *image_path, const char *table_path, const char *out_path, const rebase_options *ro) {
+	int in_place = strcmp(image_path, out_path) == 0;
+	char *err = NULL;
+	int table_fd = open(table_path, (in_place ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	int image_fd = open(image_path, (in_place ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	size_t table_len, image_len;
+	rebase_header *h = MAP_FAILED;
+	uint8_t *image = MAP_FAILED;
+	if (table_fd == -1 || image_fd == -1)
+		goto sys_err;
+	h = map_file(table_fd, &table_len, PROT_READ | (in_place ? PROT_WRITE : 0));
+	if (h == MAP_FAILED)
+		goto sys_err;
+	// the image is checked read only, so a table that doesn't fit it
+	// leaves out_path alone
+	image = map_file(image_fd, &image_len, PROT_READ);
+	if (image == MAP_FAILED)
+		goto sys_err;
+	int64_t delta[N_SECTIONS];
+	err = rebase_plan(h, table_len, image, image_len, ro, delta);
+	const rebase_entry *entries = (const rebase_entry *) (h + 1);
+	for (uint64_t i = 0; !err && i < h->n; i++)
+		err = rebase_field(image, &entries[i], delta, 0);
+	munmap(image, image_len);
+	image = MAP_FAILED;
+	if (err)
+		goto out;
+
+	if (!in_place) {
+		// a copy of a sparse file stays sparse, so the padding of a
+		// huge page aligned .text costs nothing here either
+		int out_fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+		if (out_fd == -1)
+			goto sys_err;
+		if (copy_sparse(image_fd, 0, out_fd, image_len) || ftruncate(out_fd, image_len)) {
+			int e = errno;
+			close(out_fd);
+			errno = e;
+			goto sys_err;
+		}
+		close(image_fd);
+		image_fd = out_fd;
+	}
+	image = map_file(image_fd, &image_len, PROT_READ | PROT_WRITE);
+	if (image == MAP_FAILED)
+		goto sys_err;
+	for (uint64_t i = 0; i < h->n; i++)
+		rebase_field(image, &entries[i], delta, 1);
+	if (in_place) {
+		// so the image can be moved again
+		h->text_vaddr += delta[SECT_TEXT];
+		h->data_vaddr += delta[SECT_DATA];
+	}
+	if (h->build_id) {
+		// hashed as emitter_output_elf hashes it, with the id as zeros,
+		// through the file rather than the mapping so holes are skipped
+		memset(image + h->build_id, 0, BUILD_ID_SIZE);
+		image_hash ih;
+		image_hash_init(&ih);
+		if (hash_sparse(&ih, image_fd, 0, image_len))
+			goto sys_err;
+		uint8_t digest[32];
+		image_hash_final(&ih, digest);
+		memcpy(image + h->build_id, digest, BUILD_ID_SIZE);
+	}
+	goto out;
+
+sys_err:
+	err = strerror(errno);
+out:
+	if (image != MAP_FAILED)
+		munmap(image, image_len);
+	if (h != MAP_FAILED)
+		munmap(h, table_len);
+	if (image_fd != -1)
+		close(image_fd);
+	if (table_fd != -1)
+		close(table_fd);
+	return err;
+}
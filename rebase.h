@@ -0,0 +1,55 @@
+#ifndef REBASE_H
+#define REBASE_H
+
+#include <stdint.h>
+
+// --rebase-table lists every field of an ELF that holds an address, and
+// --rebase moves the image to new vaddrs by patching only those, rather than
+// assembling the program again for every address it's loaded at
+// the file layout doesn't change, so .text moves by whole aligned pages, and
+// .data by whole pages, its offset into a page being tied to its file offset
+// the table is a header, then n entries, little endian like the image
+
+#define REBASE_MAGIC "asmrbt1"
+
+typedef struct {
+	char magic[8];
+	uint64_t size; // of the image
+	// what the image was laid out with, as given to --text-vaddr, which is
+	// where .text's segment starts, and .data's vaddr
+	uint64_t text_vaddr;
+	uint64_t data_vaddr;
+	uint64_t text_segment_size; // for --auto-layout
+	uint64_t text_align;
+	uint64_t data_size;
+	uint64_t build_id; // file offset of the build id, or 0 without one
+	uint64_t n;
+} rebase_header;
+
+typedef struct {
+	uint64_t at; // file offset of the field
+	uint8_t assign; // how it holds the address, an enum assign_type
+	uint8_t sect; // the section the address is in
+	// for branches and jumps, the section they're in, since only a move of
+	// one relative to the other changes them
+	uint8_t from;
+	uint8_t pad[5];
+} rebase_entry;
+
+// where --rebase moves an image to, with the defaults assembling has
+typedef struct {
+	uint64_t text_vaddr;
+	uint64_t data_vaddr;
+	int auto_layout; // ignore data_vaddr, and lay .data out after .text
+} rebase_options;
+
+// writes image_path, moved as ro says, to out_path, which may be image_path
+// to move it in place, in which case table_path is updated to match
+// only the fields in the table are touched, through a mapping of the image,
+// so the cost is in how many there are rather than the image's size, except
+// for the build id, which is hashed again from the moved image, holes aside
+// returns NULL on success, otherwise the error, with out_path left alone if
+// a field doesn't fit at the new vaddrs
+extern char *rebase(const char *image_path, const char *table_path, const char *out_path, const rebase_options *ro);
+
+#endif
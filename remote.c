@@ -0,0 +1,675 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "emitter.h"
+#include "hash.h"
+#include "output.h"
+#include "remote.h"
+
+// a store that stops answering costs a build this long, then it's assembled
+// as if nothing were cached
+#define REMOTE_TIMEOUT 5
+
+// anything this large is refused, as a sign the other side is confused
+#define MAX_HEADER 8192
+#define MAX_LISTING 4096
+
+// replies are read through this, since they're pipelined and one read may
+// end partway into the next
+typedef struct {
+	int fd;
+	size_t start, end;
+	char buf[MAX_HEADER];
+} http_reader;
+
+static int http_fill(http_reader *h) {
+	if (h->start > 0) {
+		memmove(h->buf, h->buf + h->start, h->end - h->start);
+		h->end -= h->start;
+		h->start = 0;
+	}
+	if (h->end == sizeof h->buf) {
+		errno = EPROTO;
+		return -1;
+	}
+	ssize_t got;
+	while ((got = read(h->fd, h->buf + h->end, sizeof h->buf - h->end)) < 0 && errno == EINTR) {
+	}
+	if (got <= 0) {
+		if (got == 0)
+			errno = ECONNRESET;
+		return -1;
+	}
+	h->end += got;
+	return 0;
+}
+
+// reads a line, without its \r\n, into line
+static int http_line(http_reader *h, char *line, size_t size) {
+	char *nl;
+	while (!(nl = memchr(h->buf + h->start, '\n', h->end - h->start))) {
+		if (http_fill(h))
+			return -1;
+	}
+	size_t len = nl - (h->buf + h->start);
+	if (len > 0 && nl[-1] == '\r')
+		len--;
+	if (len >= size) {
+		errno = EPROTO;
+		return -1;
+	}
+	memcpy(line, h->buf + h->start, len);
+	line[len] = '\0';
+	h->start = nl + 1 - h->buf;
+	return 0;
+}
+
+// reads the first line of a request or reply into first, then its headers,
+// of which only the length of the body matters
+// bodies without a length aren't understood
+static int http_head(http_reader *h, char *first, size_t size, size_t *content_length) {
+	if (http_line(h, first, size))
+		return -1;
+	int has_length = 0;
+	for (;;) {
+		char line[1024];
+		if (http_line(h, line, sizeof line))
+			return -1;
+		if (line[0] == '\0')
+			break;
+		if (!strncasecmp(line, "content-length:", 15)) {
+			char *end;
+			*content_length = strtoull(line + 15, &end, 10);
+			has_length = end != line + 15;
+		} else if (!strncasecmp(line, "transfer-encoding:", 18)) {
+			errno = EPROTO;
+			return -1;
+		}
+	}
+	if (!has_length)
+		*content_length = 0;
+	return 0;
+}
+
+// reads a body of len bytes into a new allocation
+static int http_body(http_reader *h, size_t len, char **body) {
+	*body = malloc(len ? len : 1);
+	if (!*body) {
+		errno = ENOMEM;
+		return -1;
+	}
+	size_t have = h->end - h->start;
+	if (have > len)
+		have = len;
+	memcpy(*body, h->buf + h->start, have);
+	h->start += have;
+	while (have < len) {
+		ssize_t got = read(h->fd, *body + have, len - have);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0) {
+			if (got == 0)
+				errno = ECONNRESET;
+			free(*body);
+			*body = NULL;
+			return -1;
+		}
+		have += got;
+	}
+	return 0;
+}
+
+// reads a reply, returning 0 with its body if it's a success of at most max
+// bytes, or 1 if it isn't, or its body couldn't be allocated
+// on 1 the body is left unread, so nothing more can be read from h, which
+// is fine since nothing after a miss is wanted
+static int http_reply(http_reader *h, size_t max, char **body, size_t *len) {
+	char first[256];
+	int status;
+	*body = NULL;
+	if (http_head(h, first, sizeof first, len))
+		return -1;
+	if (sscanf(first, "HTTP/1.%*d %d", &status) != 1) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (status / 100 != 2 || *len > max)
+		return 1;
+	if (http_body(h, *len, body))
+		return errno == ENOMEM ? 1 : -1;
+	return 0;
+}
+
+static void hex(const uint8_t *data, size_t len, char *out) {
+	for (size_t i = 0; i < len; i++)
+		sprintf(out + 2 * i, "%02x", data[i]);
+}
+
+// what the entry for key is called in /ac
+static void remote_key(const uint64_t *key, char *out) {
+	uint8_t digest[32];
+	sha256(key, 2 * sizeof *key, digest);
+	hex(digest, sizeof digest, out);
+}
+
+int remote_init(remote *r, const char *url) {
+	const char *rest;
+	if (strncmp(url, "http://", 7)) {
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+	url += 7;
+	rest = url + strcspn(url, ":/");
+	size_t host_len = rest - url;
+	const char *port = "80";
+	size_t port_len = 2;
+	if (*rest == ':') {
+		port = rest + 1;
+		port_len = strcspn(port, "/");
+		rest = port + port_len;
+	}
+	// the prefix keeps its leading slash but not a trailing one, so paths
+	// are just appended to it
+	size_t prefix_len = strlen(rest);
+	while (prefix_len > 0 && rest[prefix_len - 1] == '/')
+		prefix_len--;
+	if (host_len == 0 || port_len == 0 || host_len >= sizeof r->host || port_len >= sizeof r->port || prefix_len >= sizeof r->prefix) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(r->host, url, host_len);
+	r->host[host_len] = '\0';
+	memcpy(r->port, port, port_len);
+	r->port[port_len] = '\0';
+	memcpy(r->prefix, rest, prefix_len);
+	r->prefix[prefix_len] = '\0';
+	return 0;
+}
+
+static int remote_connect(remote *r) {
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *addrs;
+	int gai = getaddrinfo(r->host, r->port, &hints, &addrs);
+	if (gai) {
+		errno = gai == EAI_SYSTEM ? errno : EHOSTUNREACH;
+		return -1;
+	}
+	int sock = -1;
+	for (struct addrinfo *a = addrs; a && sock == -1; a = a->ai_next) {
+		sock = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+		if (sock == -1)
+			continue;
+		struct timeval timeout = { .tv_sec = REMOTE_TIMEOUT };
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+		if (connect(sock, a->ai_addr, a->ai_addrlen)) {
+			int err = errno;
+			close(sock);
+			sock = -1;
+			errno = err;
+		}
+	}
+	freeaddrinfo(addrs);
+	return sock;
+}
+
+// appends a request to req, which has room for len more bytes
+static int http_request(remote *r, char *req, size_t len, const char *method, const char *kind, const char *name, size_t body_len) {
+	int n = snprintf(
+		req, len, "%s %s/%s/%s HTTP/1.1\r\nHost: %s\r\nContent-Length: %zu\r\n\r\n",
+		method, r->prefix, kind, name, r->host, body_len
+	);
+	if (n < 0 || (size_t) n >= len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return n;
+}
+
+typedef struct {
+	char format[16];
+	char digest[65];
+	size_t size;
+} remote_blob;
+
+// finds format's blob in a listing from /ac
+static int remote_find(const char *listing, const char *format, remote_blob *blob) {
+	const char *line = listing;
+	while (*line) {
+		if (sscanf(line, "%15s %64[0-9a-f] %zu", blob->format, blob->digest, &blob->size) == 3 && !strcmp(blob->format, format) && strlen(blob->digest) == 64)
+			return 0;
+		line += strcspn(line, "\n");
+		line += *line == '\n';
+	}
+	return -1;
+}
+
+int remote_fetch(remote *r, const uint64_t *key, const char *const *formats, char *const *paths, size_t n, int if_changed) {
+	int sock = remote_connect(r);
+	if (sock == -1)
+		return -1;
+	// running out of memory is a miss, like anything else that isn't the
+	// store's fault
+	http_reader *h = malloc(sizeof *h);
+	remote_blob *blobs = calloc(n, sizeof *blobs);
+	char **data = calloc(n, sizeof *data);
+	output *outs = calloc(n, sizeof *outs);
+	size_t opened = 0, closed = 0; // outs[closed] to outs[opened - 1] are open
+	char *listing = NULL;
+	int ret = 1;
+	if (!h || !blobs || !data || !outs)
+		goto out;
+	h->fd = sock;
+	h->start = h->end = 0;
+
+	char name[65], req[MAX_HEADER];
+	remote_key(key, name);
+	int len = http_request(r, req, sizeof req, "GET", "ac", name, 0);
+	size_t listing_len;
+	if (len < 0 || write_all(sock, req, len)) {
+		ret = -1;
+		goto out;
+	}
+	ret = http_reply(h, MAX_LISTING, &listing, &listing_len);
+	if (ret)
+		goto out;
+	ret = 1;
+	char *terminated = realloc(listing, listing_len + 1);
+	if (!terminated)
+		goto out;
+	listing = terminated;
+	listing[listing_len] = '\0';
+
+	// every blob is asked for at once, then the replies are read in the
+	// same order, rather than waiting on each one in turn
+	size_t used = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (!paths[i])
+			continue;
+		if (remote_find(listing, formats[i], &blobs[i]))
+			goto out;
+		len = http_request(r, req + used, sizeof req - used, "GET", "cas", blobs[i].digest, 0);
+		if (len < 0) {
+			ret = -1;
+			goto out;
+		}
+		used += len;
+	}
+	ret = -1;
+	if (write_all(sock, req, used))
+		goto out;
+	for (size_t i = 0; i < n; i++) {
+		if (!paths[i])
+			continue;
+		// a listing can outlive a blob that's been evicted, and a
+		// blob longer than listed isn't read, since it's wrong anyway
+		size_t blob_len;
+		ret = http_reply(h, blobs[i].size, &data[i], &blob_len);
+		if (ret)
+			goto out;
+		ret = -1;
+		uint8_t digest[32];
+		char digest_hex[65];
+		sha256(data[i], blob_len, digest);
+		hex(digest, sizeof digest, digest_hex);
+		if (blob_len != blobs[i].size || strcmp(digest_hex, blobs[i].digest)) {
+			errno = EBADMSG;
+			goto out;
+		}
+	}
+
+	// nothing is written until everything has arrived, and every output
+	// is opened before any is written, so a miss or an error leaves the
+	// outputs as they were
+	// they're compared rather than truncated, so an image that differs goes
+	// to a temporary file, which only replaces its output when it's closed
+	for (; opened < n; opened++) {
+		if (paths[opened] && output_open(&outs[opened], paths[opened], 1))
+			goto out;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (paths[i] && output_write(&outs[i], data[i], blobs[i].size))
+			goto out;
+	}
+	for (; closed < n; closed++) {
+		int changed;
+		if (!paths[closed])
+			continue;
+		if (output_close(&outs[closed], &changed)) {
+			output_abort(&outs[closed++]);
+			goto out;
+		}
+		// without if_changed, an output is written, not just checked
+		if (!changed && !if_changed)
+			utimensat(AT_FDCWD, paths[closed], NULL, 0);
+	}
+	ret = 0;
+out:;
+	int errno_was = errno;
+	for (size_t i = closed; i < opened; i++) {
+		if (paths[i])
+			output_abort(&outs[i]);
+	}
+	free(outs);
+	close(sock);
+	for (size_t i = 0; data && i < n; i++)
+		free(data[i]);
+	free(data);
+	free(blobs);
+	free(listing);
+	free(h);
+	errno = errno_was;
+	return ret;
+}
+
+// reads the whole of the file at path into a new allocation, for the
+// stand-in, whose blobs are small
+static char *read_file(const char *path, size_t *len) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat sb;
+	if (fd == -1 || fstat(fd, &sb)) {
+		if (fd != -1)
+			close(fd);
+		return NULL;
+	}
+	char *data = malloc(sb.st_size ? sb.st_size : 1);
+	if (!data) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	size_t have = 0;
+	while (have < (size_t) sb.st_size) {
+		ssize_t got = read(fd, data + have, sb.st_size - have);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0) {
+			if (got == 0)
+				errno = EIO; // it shrank while being read
+			free(data);
+			close(fd);
+			return NULL;
+		}
+		have += got;
+	}
+	close(fd);
+	*len = have;
+	return data;
+}
+
+// an unnamed copy of the file at path, made beside it so it can share its
+// blocks, and keeping its holes, so a sparse image costs what it uses
+// returns -1 and sets errno if it couldn't be made
+static int remote_snapshot(const char *path) {
+	char dir[PATH_MAX];
+	const char *slash = strrchr(path, '/');
+	if (!slash) {
+		strcpy(dir, ".");
+	} else if (slash == path) {
+		strcpy(dir, "/");
+	} else if ((size_t) (slash - path) < sizeof dir) {
+		memcpy(dir, path, slash - path);
+		dir[slash - path] = '\0';
+	} else {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	int src = open(path, O_RDONLY | O_CLOEXEC);
+	if (src == -1)
+		return -1;
+	struct stat sb;
+	int copy = -1;
+	if (
+		fstat(src, &sb)
+		|| (copy = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) == -1
+		|| copy_sparse(src, 0, copy, sb.st_size)
+	) {
+		int err = errno;
+		if (copy != -1)
+			close(copy);
+		close(src);
+		errno = err;
+		return -1;
+	}
+	close(src);
+	return copy;
+}
+
+// maps each snapshot and takes its digest, then uploads every blob, then,
+// only if they all made it, the listing of them
+// the snapshots are mapped rather than read, so a large image costs page
+// cache rather than memory of its own, and holes cost nothing
+// it runs in a process of its own that exits right after, which frees
+// everything
+static int remote_upload(remote *r, const char *name, const char *const *formats, const int *snapshots, size_t n) {
+	char **data = calloc(n, sizeof *data);
+	remote_blob *blobs = calloc(n, sizeof *blobs);
+	if (!data || !blobs)
+		return -1;
+	for (size_t i = 0; i < n; i++) {
+		if (snapshots[i] == -1)
+			continue;
+		struct stat sb;
+		if (fstat(snapshots[i], &sb) || strlen(formats[i]) >= sizeof blobs[i].format)
+			return -1;
+		blobs[i].size = sb.st_size;
+		// an empty file can't be mapped, but is still a blob
+		data[i] = sb.st_size ? mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, snapshots[i], 0) : (char *) "";
+		if (data[i] == MAP_FAILED)
+			return -1;
+		strcpy(blobs[i].format, formats[i]);
+		uint8_t digest[32];
+		sha256(data[i], blobs[i].size, digest);
+		hex(digest, sizeof digest, blobs[i].digest);
+	}
+
+	int sock = remote_connect(r);
+	if (sock == -1)
+		return -1;
+	http_reader h = { .fd = sock };
+	char req[MAX_HEADER], listing[MAX_LISTING];
+	size_t listing_len = 0, sent = 0;
+	int err = 0;
+	for (size_t i = 0; i < n && !err; i++) {
+		if (!data[i])
+			continue;
+		int len = http_request(r, req, sizeof req, "PUT", "cas", blobs[i].digest, blobs[i].size);
+		err = len < 0 || write_all(sock, req, len) || write_all(sock, data[i], blobs[i].size);
+		sent++;
+		int line = snprintf(listing + listing_len, sizeof listing - listing_len, "%s %s %zu\n", blobs[i].format, blobs[i].digest, blobs[i].size);
+		listing_len += line;
+		if (listing_len >= sizeof listing) {
+			errno = ENAMETOOLONG;
+			err = 1;
+		}
+	}
+	for (size_t i = 0; i < sent && !err; i++) {
+		char *body;
+		size_t len;
+		err = http_reply(&h, MAX_LISTING, &body, &len) != 0;
+		free(body);
+	}
+	if (!err) {
+		int len = http_request(r, req, sizeof req, "PUT", "ac", name, listing_len);
+		char *body = NULL;
+		size_t reply_len;
+		err = (
+			len < 0
+			|| write_all(sock, req, len)
+			|| write_all(sock, listing, listing_len)
+			|| http_reply(&h, MAX_LISTING, &body, &reply_len) != 0
+		);
+		free(body);
+	}
+	close(sock);
+	return err ? -1 : 0;
+}
+
+int remote_store(remote *r, const uint64_t *key, const char *const *formats, char *const *paths, size_t n) {
+	// the images are copied now, since the outputs may be written over
+	// again before the upload is done
+	int *snapshots = malloc(n * sizeof *snapshots);
+	if (!snapshots) {
+		errno = ENOMEM;
+		return -1;
+	}
+	int err = 0;
+	for (size_t i = 0; i < n; i++) {
+		snapshots[i] = -1;
+		if (paths[i] && !err)
+			err = (snapshots[i] = remote_snapshot(paths[i])) == -1;
+	}
+	char name[65];
+	remote_key(key, name);
+	// the upload runs in a grandchild, so there's no child left for anyone
+	// to wait on, and it lets go of stdout so whatever reads that doesn't
+	// wait on it either
+	pid_t child = err ? -1 : fork();
+	if (child == 0) {
+		if (fork() == 0) {
+			// the upload is on its own, so a ^C meant for the build
+			// doesn't cut it off, and it doesn't run a server's
+			// handlers
+			setsid();
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			int null = open("/dev/null", O_RDWR);
+			for (int fd = 0; fd < 3; fd++)
+				dup2(null, fd);
+			_exit(remote_upload(r, name, formats, snapshots, n) ? 1 : 0);
+		}
+		_exit(0);
+	}
+	int errno_was = errno;
+	if (child != -1)
+		waitpid(child, NULL, 0);
+	for (size_t i = 0; i < n; i++) {
+		if (snapshots[i] != -1)
+			close(snapshots[i]);
+	}
+	free(snapshots);
+	errno = errno_was;
+	return child == -1 ? -1 : 0;
+}
+
+static int http_respond(int conn, int status, const char *reason, const void *body, size_t len) {
+	char head[256];
+	int n = snprintf(head, sizeof head, "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\n\r\n", status, reason, len);
+	return write_all(conn, head, n) || write_all(conn, body, len);
+}
+
+// the path of a blob under dir, from the path it's requested by, which
+// must end in /ac/ or /cas/ then 64 hex digits, after any prefix
+static int remote_serve_path(const char *dir, const char *req_path, char *path, size_t size, int *cas) {
+	const char *name;
+	size_t len = strlen(req_path);
+	if (len >= 68 && !strncmp(req_path + len - 68, "/ac/", 4)) {
+		name = req_path + len - 64;
+		*cas = 0;
+	} else if (len >= 69 && !strncmp(req_path + len - 69, "/cas/", 5)) {
+		name = req_path + len - 64;
+		*cas = 1;
+	} else {
+		return -1;
+	}
+	if (strlen(name) != 64 || strspn(name, "0123456789abcdef") != 64)
+		return -1;
+	snprintf(path, size, "%s/%s/%s", dir, *cas ? "cas" : "ac", name);
+	return 0;
+}
+
+// answers requests on conn until it's closed
+static void remote_serve_conn(int conn, const char *dir) {
+	http_reader h = { .fd = conn };
+	for (;;) {
+		char first[512], method[8], req_path[256], path[PATH_MAX];
+		size_t len;
+		char *body;
+		int cas;
+		// a request that can't be read ends the connection
+		if (http_head(&h, first, sizeof first, &len) || sscanf(first, "%7s %255s HTTP/1.%*d", method, req_path) != 2)
+			return;
+		if (http_body(&h, len, &body))
+			return;
+		int err;
+		if (remote_serve_path(dir, req_path, path, sizeof path, &cas)) {
+			err = http_respond(conn, 404, "Not Found", "", 0);
+		} else if (!strcmp(method, "GET")) {
+			size_t data_len;
+			char *data = read_file(path, &data_len);
+			if (data)
+				err = http_respond(conn, 200, "OK", data, data_len);
+			else
+				err = http_respond(conn, 404, "Not Found", "", 0);
+			free(data);
+		} else if (!strcmp(method, "PUT")) {
+			// like the real thing, a blob must be what it claims to be
+			uint8_t digest[32];
+			char digest_hex[65], temp[PATH_MAX + 16];
+			sha256(body, len, digest);
+			hex(digest, sizeof digest, digest_hex);
+			snprintf(temp, sizeof temp, "%s.XXXXXX", path);
+			int fd = -1;
+			if (cas && strcmp(digest_hex, strrchr(path, '/') + 1)) {
+				err = http_respond(conn, 400, "Bad Request", "", 0);
+			} else if ((fd = mkostemp(temp, O_CLOEXEC)) == -1 || write_all(fd, body, len) || rename(temp, path)) {
+				if (fd != -1)
+					unlink(temp);
+				err = http_respond(conn, 500, "Internal Server Error", "", 0);
+			} else {
+				err = http_respond(conn, 200, "OK", "", 0);
+			}
+			if (fd != -1)
+				close(fd);
+		} else {
+			err = http_respond(conn, 405, "Method Not Allowed", "", 0);
+		}
+		free(body);
+		if (err)
+			return;
+	}
+}
+
+int remote_serve(int sock, const char *dir) {
+	char path[PATH_MAX];
+	for (int cas = 0; cas < 2; cas++) {
+		snprintf(path, sizeof path, "%s/%s", dir, cas ? "cas" : "ac");
+		if (mkdir(path, 0777) && errno != EEXIST)
+			return -1;
+	}
+	// connections aren't waited on, so they're reaped as they finish
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	for (;;) {
+		int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (conn == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return -1;
+		}
+		pid_t child = fork();
+		if (child == 0) {
+			close(sock);
+			remote_serve_conn(conn, dir);
+			_exit(0);
+		}
+		close(conn);
+	}
+}
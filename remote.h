@@ -0,0 +1,44 @@
+#ifndef REMOTE_H
+#define REMOTE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// --remote-cache shares cache entries between machines through an HTTP store
+// laid out like bazel-remote's: each image is a blob at /cas/<its SHA-256>,
+// and /ac/<the SHA-256 of the cache key> lists which blob each format is, a
+// line "<format> <SHA-256> <size>" per format
+// that listing isn't the ActionResult bazel-remote expects under /ac, so a
+// bazel-remote server has to be started with --disable_http_ac_validation
+// for it to be stored
+// reads go over one connection, with every blob requested before any reply
+// is waited on, and writes are left to a child process so the run that made
+// the images doesn't wait on them
+typedef struct {
+	char host[256];
+	char port[8];
+	char prefix[256]; // the URL's path, which /ac and /cas go under
+} remote;
+
+// the following return 0 on success, otherwise they return nonzero and set
+// errno
+
+// takes a URL like http://host:port/prefix
+extern int remote_init(remote *r, const char *url);
+
+// like cache_fetch, but from the store, keyed by key, which is 2 words
+// returns 1 without writing anything if any format isn't stored, or anything
+// the store sends is larger than it should be, or doesn't fit in memory
+extern int remote_fetch(remote *r, const uint64_t *key, const char *const *formats, char *const *paths, size_t n, int if_changed);
+
+// copies the file at each path that isn't NULL, then returns while a child
+// process uploads the copies as the entry for key
+extern int remote_store(remote *r, const uint64_t *key, const char *const *formats, char *const *paths, size_t n);
+
+// a stand-in for the store, keeping blobs under dir, for tests and for trying
+// --remote-cache out without a real store
+// serves connections accepted on sock, each in a child process, until an
+// error, so it only returns -1
+extern int remote_serve(int sock, const char *dir);
+
+#endif
@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "server.h"
+
+// a request this large is refused rather than trusted with an allocation
+#define MAX_REQUEST (1 << 20)
+
+// room for the descriptors sent with a request
+typedef union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(N_SERVER_FDS * sizeof(int))];
+} server_control;
+
+// read(2), but until len bytes have come, which reads from a socket need not
+// do at once
+static int read_all(int fd, void *data, size_t len) {
+	while (len > 0) {
+		ssize_t got = read(fd, data, len);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0) {
+			if (got == 0)
+				errno = ECONNRESET; // the other side hung up
+			return -1;
+		}
+		data = (char *) data + got;
+		len -= got;
+	}
+	return 0;
+}
+
+static int server_address(struct sockaddr_un *addr, const char *path) {
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr->sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int server_connect(const char *path) {
+	struct sockaddr_un addr;
+	if (server_address(&addr, path))
+		return -1;
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -1;
+	if (connect(sock, (struct sockaddr *) &addr, sizeof addr)) {
+		int err = errno;
+		close(sock);
+		errno = err;
+		return -1;
+	}
+	return sock;
+}
+
+int server_send(int sock, int argc, char **argv, int *status) {
+	size_t len = 0;
+	for (int i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if (len > MAX_REQUEST) {
+		errno = E2BIG;
+		return -1;
+	}
+	int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (cwd == -1)
+		return -1;
+	size_t size = sizeof(server_header) + len;
+	char *request = malloc(size);
+	if (!request) {
+		close(cwd);
+		errno = ENOMEM;
+		return -1;
+	}
+	server_header header = {
+		.argc = argc,
+		.len = len,
+	};
+	memcpy(request, &header, sizeof header);
+	char *arg = request + sizeof header;
+	for (int i = 0; i < argc; i++)
+		arg = stpcpy(arg, argv[i]) + 1;
+
+	const int fds[N_SERVER_FDS] = {
+		[SERVER_STDIN] = STDIN_FILENO,
+		[SERVER_STDOUT] = STDOUT_FILENO,
+		[SERVER_STDERR] = STDERR_FILENO,
+		[SERVER_CWD] = cwd,
+	};
+	server_control control;
+	struct iovec iov = {
+		.iov_base = request,
+		.iov_len = size,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof control.buf,
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+	ssize_t sent;
+	while ((sent = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+	}
+	close(cwd);
+	// the descriptors go with the first byte, so the rest of a short send
+	// can just be written
+	int err = sent < 0 || write_all(sock, request + sent, size - sent);
+	free(request);
+	if (err)
+		return -1;
+	int32_t reply;
+	if (read_all(sock, &reply, sizeof reply))
+		return -1;
+	*status = reply;
+	return 0;
+}
+
+// receives the header of a request, and the descriptors sent with it
+// anything but exactly N_SERVER_FDS descriptors is refused
+static int server_receive(int conn, server_header *header, int *fds) {
+	server_control control;
+	struct iovec iov = {
+		.iov_base = header,
+		.iov_len = sizeof *header,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof control.buf,
+	};
+	ssize_t got;
+	while ((got = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+	}
+	if (got <= 0) {
+		if (got == 0)
+			errno = ECONNRESET;
+		return -1;
+	}
+	int n = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		int *received = (int *) CMSG_DATA(cmsg);
+		int n_received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (int i = 0; i < n_received; i++) {
+			if (n < N_SERVER_FDS)
+				fds[n++] = received[i];
+			else
+				close(received[i]);
+		}
+	}
+	if (n != N_SERVER_FDS || (msg.msg_flags & MSG_CTRUNC)) {
+		for (int i = 0; i < n; i++)
+			close(fds[i]);
+		errno = EPROTO;
+		return -1;
+	}
+	if (read_all(conn, (char *) header + got, sizeof *header - got)) {
+		for (int i = 0; i < n; i++)
+			close(fds[i]);
+		return -1;
+	}
+	return 0;
+}
+
+// runs handler with the client's descriptors standing in for the server's
+// stdin, stdout, stderr and working directory
+static int server_run(int *fds, server_handler handler, void *ctx, int argc, char **argv, int32_t *status) {
+	int saved[N_SERVER_FDS];
+	saved[SERVER_CWD] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (saved[SERVER_CWD] == -1)
+		return -1;
+	fflush(stdout);
+	fflush(stderr);
+	int err = 0;
+	for (int i = 0; i < SERVER_CWD; i++) {
+		saved[i] = err ? -1 : fcntl(i, F_DUPFD_CLOEXEC, 0);
+		if (saved[i] == -1 || dup2(fds[i], i) == -1)
+			err = 1;
+	}
+	if (!err && fchdir(fds[SERVER_CWD]))
+		err = 1;
+	if (!err) {
+		*status = handler(ctx, argc, argv);
+		fflush(stdout);
+		fflush(stderr);
+		clearerr(stdin);
+	}
+	int errno_was = errno;
+	for (int i = 0; i < SERVER_CWD; i++) {
+		if (saved[i] == -1)
+			continue;
+		dup2(saved[i], i);
+		close(saved[i]);
+	}
+	if (fchdir(saved[SERVER_CWD]))
+		err = 1;
+	close(saved[SERVER_CWD]);
+	errno = errno_was;
+	return err ? -1 : 0;
+}
+
+int server_handle(int conn, server_handler handler, void *ctx) {
+	server_header header;
+	int fds[N_SERVER_FDS];
+	if (server_receive(conn, &header, fds))
+		return -1;
+	int err = -1;
+	char *args = NULL;
+	char **argv = NULL;
+	if (header.argc == 0 || header.len > MAX_REQUEST || header.argc > header.len) {
+		errno = EPROTO;
+		goto out;
+	}
+	args = malloc(header.len);
+	argv = malloc((header.argc + 1) * sizeof *argv);
+	if (!args || !argv) {
+		errno = ENOMEM;
+		goto out;
+	}
+	if (read_all(conn, args, header.len))
+		goto out;
+	// every argument must end within the request
+	size_t argc = 0;
+	for (char *arg = args; arg < args + header.len; arg += strlen(arg) + 1) {
+		if (argc == header.argc || !memchr(arg, '\0', args + header.len - arg))
+			break;
+		argv[argc++] = arg;
+	}
+	if (argc != header.argc || args[header.len - 1] != '\0') {
+		errno = EPROTO;
+		goto out;
+	}
+	argv[argc] = NULL;
+	int32_t status;
+	if (server_run(fds, handler, ctx, argc, argv, &status))
+		goto out;
+	err = write_all(conn, &status, sizeof status);
+out:
+	for (int i = 0; i < N_SERVER_FDS; i++)
+		close(fds[i]);
+	free(args);
+	free(argv);
+	return err;
+}
+
+static const char *listening_on;
+
+static void server_stop(int sig) {
+	unlink(listening_on);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+int server_listen(const char *path, server_handler handler, void *ctx) {
+	struct sockaddr_un addr;
+	if (server_address(&addr, path))
+		return -1;
+	int live = server_connect(path);
+	if (live != -1) {
+		close(live);
+		errno = EADDRINUSE;
+		return -1;
+	}
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -1;
+	// whoever can connect can have the server read and write anything
+	// it can, so only its own user may
+	unlink(path);
+	mode_t mask = umask(0077);
+	int err = bind(sock, (struct sockaddr *) &addr, sizeof addr);
+	umask(mask);
+	if (err || listen(sock, SOMAXCONN)) {
+		int errno_was = errno;
+		close(sock);
+		errno = errno_was;
+		return -1;
+	}
+	listening_on = path;
+	signal(SIGINT, server_stop);
+	signal(SIGTERM, server_stop);
+	// a client that goes away mid-request only fails its own request
+	signal(SIGPIPE, SIG_IGN);
+	for (;;) {
+		int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (conn == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		server_handle(conn, handler, ctx);
+		close(conn);
+	}
+	int errno_was = errno;
+	unlink(path);
+	close(sock);
+	errno = errno_was;
+	return -1;
+}
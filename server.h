@@ -0,0 +1,52 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+
+// asm --server stays running on a unix socket, with its emitter, buffers and
+// tables already warm, and asmc hands it the arguments asm would've been run
+// with, so a small input doesn't pay for starting a process
+// a request is a server_header then argc nul-terminated arguments, sent along
+// with the client's stdin, stdout, stderr and working directory
+// the server opens the client's files itself, relative to that directory, and
+// prints where the client would have, so only the arguments go over the
+// socket, and only the exit status, as an int32_t, comes back
+typedef struct {
+	uint32_t argc;
+	uint32_t len; // of the arguments, including their nuls
+} server_header;
+
+// the descriptors sent with a request, in order
+enum {
+	SERVER_STDIN,
+	SERVER_STDOUT,
+	SERVER_STDERR,
+	SERVER_CWD,
+
+	N_SERVER_FDS,
+};
+
+// runs a request, with the client's descriptors in place of the server's own
+// returns the exit status for the client
+typedef int (*server_handler)(void *ctx, int argc, char **argv);
+
+// the following return 0 on success, otherwise they return nonzero and set
+// errno
+
+// listens on path and handles one request at a time until killed, which
+// removes path again
+// path may be left over from a server that didn't get to remove it, but not
+// from one still running
+// only returns if it couldn't start
+extern int server_listen(const char *path, server_handler handler, void *ctx);
+
+// reads one request from conn, runs it and replies
+extern int server_handle(int conn, server_handler handler, void *ctx);
+
+// sends argv to the server on sock, and waits for its exit status
+extern int server_send(int sock, int argc, char **argv, int *status);
+
+// returns a socket connected to the server at path, or -1 and sets errno
+extern int server_connect(const char *path);
+
+#endif
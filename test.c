@@ -1,10 +1,36 @@
 #include <assert.h>
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include "assemble.h"
+#include "cache.h"
+#include "dwarf.h"
 #include "emitter.h"
+#include "hash.h"
+#include "input.h"
+#include "jobserver.h"
+#include "libasm.h"
+#include "lsp.h"
 #include "parser.h"
+#include "prelude.h"
+#include "rebase.h"
+#include "remote.h"
+#include "server.h"
 
 // regular slow bytewise compare
 // this is needed since memcmp doesn't return the index of the discrepancy
@@ -150,6 +176,8 @@ int test_parse_line() {
 	};
 	static emitter em;
 	cc_init(&em.labels);
+	cc_init(&em.cross_fixups);
+	cc_init(&em.resolved);
 	em.current_section = SECT_TEXT;
 	em.section[SECT_TEXT].vaddr = 0x00400000;
 	em.section[SECT_DATA].vaddr = 0x10010000;
@@ -232,6 +260,7 @@ int test_parse_line() {
 skip_compare:
 	}
 	cc_cleanup(&em.labels);
+	cc_cleanup(&em.cross_fixups);
 	return 0;
 }
 
@@ -339,9 +368,2859 @@ int test_parse_reg() {
 	return 0;
 }
 
+// feeds a few buffers' worth of lines through a stream, checking that every
+// chunk ends on an unescaped line ending and that nothing is lost or repeated
+int test_input_stream() {
+	FILE *f = tmpfile();
+	assert(f);
+	size_t total = 0;
+	for (int i = 0; total < 3 * INPUT_BUF_SIZE; i++) {
+		// every so often, continue a string literal onto the next line
+		if (i % 7 == 0)
+			total += fprintf(f, ".ascii \"%d\\\n%d\"\n", i, i);
+		else
+			total += fprintf(f, "addi x%d, x%d, %d\n", i % 32, (i + 1) % 32, i % 2048);
+	}
+	// no final newline, the stream should add one
+	total += fprintf(f, "ecall");
+	fflush(f);
+	rewind(f);
+
+	static char expect[3 * INPUT_BUF_SIZE + 64];
+	assert(total + 1 < sizeof expect);
+	if (fread(expect, 1, total, f) != total) {
+		printf("failed input stream: could not read back test input\n");
+		return 1;
+	}
+	expect[total] = '\n';
+	rewind(f);
+
+	static input_stream in;
+	input_stream_init(&in, fileno(f));
+	size_t got = 0;
+	int chunks = 0;
+	for (;;) {
+		char *begin, *end;
+		char *err = input_stream_next(&in, &begin, &end);
+		if (err) {
+			printf("failed input stream: got error %s\n", err);
+			return 1;
+		}
+		if (!begin)
+			break;
+		chunks++;
+		size_t len = end - begin;
+		if (end[-1] != '\n' || (len > 1 && end[-2] == '\\')) {
+			printf("failed input stream: chunk %d ends mid-line\n", chunks);
+			return 1;
+		}
+		if (got + len > total + 1 || memcmp(begin, expect + got, len)) {
+			printf("failed input stream: chunk %d differs from the input at offset %lu\n", chunks, got);
+			return 1;
+		}
+		got += len;
+	}
+	if (got != total + 1 || chunks < 3) {
+		printf("failed input stream: got %lu bytes in %d chunks, expect %lu bytes\n", got, chunks, total + 1);
+		return 1;
+	}
+	fclose(f);
+	return 0;
+}
+
+// a '\\' before a line ending only continues the line inside a string, so
+// lines ending in one anywhere else still have to end chunks, and a stream of
+// them longer than a buffer isn't one long line
+int test_input_stream_backslash() {
+	FILE *f = tmpfile();
+	assert(f);
+	static char line_end[3 * INPUT_BUF_SIZE + 64];
+	size_t total = 0;
+	for (int i = 0; total < 3 * INPUT_BUF_SIZE; i++) {
+		if (i % 5000 == 0) {
+			total += fprintf(f, ".ascii \"%d\\\n%d\"\n", i, i);
+		} else if (i % 2) {
+			total += fprintf(f, "addi x1, x1, %d \\\n", i % 2048);
+		} else {
+			// a string ending in an escaped '\\', then a '\\' outside it
+			total += fprintf(f, ".ascii \"\\\\\" \\\n");
+		}
+		line_end[total] = 1;
+	}
+	fflush(f);
+	rewind(f);
+
+	static input_stream in;
+	input_stream_init(&in, fileno(f));
+	size_t got = 0;
+	int chunks = 0;
+	for (;;) {
+		char *begin, *end;
+		char *err = input_stream_next(&in, &begin, &end);
+		if (err) {
+			printf("failed input stream backslash: got error %s after %lu bytes\n", err, got);
+			return 1;
+		}
+		if (!begin)
+			break;
+		chunks++;
+		got += end - begin;
+		if (!line_end[got]) {
+			printf("failed input stream backslash: chunk %d ends mid-line at offset %lu\n", chunks, got);
+			return 1;
+		}
+	}
+	if (got != total || chunks < 3) {
+		printf("failed input stream backslash: got %lu bytes in %d chunks, expect %lu bytes\n", got, chunks, total);
+		return 1;
+	}
+	fclose(f);
+	return 0;
+}
+
+// every strategy has to hand out the same lines for the same file: a large
+// one with no final newline, and two exactly a page long, so a mapping ends
+// right at the end of the file, one ending mid-line so its last line is
+// copied out to be terminated
+int test_input_strategies() {
+	const size_t page = 4096;
+	static char text[3 * INPUT_BUF_SIZE + 64];
+	size_t large = 0;
+	for (int i = 0; large < 3 * INPUT_BUF_SIZE; i++)
+		large += sprintf(text + large, "addi x%d, x%d, %d\n", i % 32, (i + 1) % 32, i % 2048);
+	large += sprintf(text + large, "ecall");
+	struct {
+		size_t len;
+		char last; // what the file ends with
+	} T[] = {
+		{ large, 'l' },
+		{ page, 'l' },
+		{ page, '\n' },
+	};
+	for (size_t t = 0; t < sizeof T / sizeof *T; t++) {
+		// the large text cut short, with its last line filled out to
+		// end at len
+		static char want[sizeof text + 1];
+		memcpy(want, text, T[t].len);
+		size_t line = T[t].len - 1;
+		while (want[line - 1] != '\n')
+			line--;
+		memset(want + line, 'l', T[t].len - line);
+		want[T[t].len - 1] = T[t].last;
+		size_t want_len = T[t].len;
+		if (want[want_len - 1] != '\n')
+			want[want_len++] = '\n';
+		FILE *f = tmpfile();
+		assert(f);
+		if (fwrite(want, 1, T[t].len, f) != T[t].len || fflush(f)) {
+			printf("failed input strategies: could not write test input\n");
+			return 1;
+		}
+		for (int s = 0; s < N_INPUT_STRATEGIES; s++) {
+			// input_close closes its own descriptor
+			input in;
+			struct stat sb;
+			int fd = dup(fileno(f));
+			if (fd == -1 || lseek(fd, 0, SEEK_SET) || fstat(fd, &sb)) {
+				printf("failed input strategies: could not open test input\n");
+				return 1;
+			}
+			char *err = input_open(&in, fd, &sb, s, NULL);
+			size_t got = 0;
+			while (!err) {
+				char *begin, *end;
+				err = input_next(&in, &begin, &end);
+				if (err || !begin)
+					break;
+				size_t len = end - begin;
+				if (end[-1] != '\n' || got + len > want_len || memcmp(begin, want + got, len)) {
+					err = "a chunk differs from the input";
+					break;
+				}
+				got += len;
+			}
+			input_close(&in);
+			if (err || got != want_len) {
+				printf(
+					"failed input strategies: %s on %lu bytes ending in %s: %s\n",
+					input_strategy_names[s], T[t].len, T[t].last == '\n' ? "a newline" : "a line",
+					err ? err : "short"
+				);
+				return 1;
+			}
+		}
+		fclose(f);
+	}
+	return 0;
+}
+
+// assembles an image with an 8 GB .data section, which is almost entirely a
+// hole so it takes next to no space or time, and checks both the ELF headers
+// and the data on either side of the hole
+// the .text section has a forward jump that is patched after it has been
+// flushed to the file buffer
+int test_large_sections() {
+	emitter *em = emitter_new(NULL);
+	FILE *image = tmpfile();
+	if (!em || !image) {
+		printf("failed large sections: couldn't make an emitter\n");
+		return 1;
+	}
+	em->section[SECT_TEXT].vaddr = 0x00400000;
+	em->section[SECT_DATA].vaddr = 0x10010000;
+	char *lines[] = {
+		".text\n",
+		"jal zero, far\n",
+		".space 100000\n",
+		"far:\n",
+		"ecall\n",
+		".data\n",
+		".word 1\n",
+		".space 8589934592\n",
+		".word 2\n",
+	};
+	for (size_t i = 0; i < sizeof lines / sizeof *lines; i++) {
+		char *pos = lines[i];
+		char *err = parse_line(&pos, em);
+		if (err) {
+			printf("failed large sections: line %s got error %s\n", lines[i], err);
+			return 1;
+		}
+	}
+	int out = fileno(image);
+	output o;
+	output_init(&o, out);
+	int changed;
+	elf_options opts = {
+		.strip = 1,
+		.build_id = 0,
+		.text_align = 0x1000,
+	};
+	if (emitter_output_elf(em, &o, &opts) || output_close(&o, &changed)) {
+		printf("failed large sections: could not output\n");
+		return 1;
+	}
+
+	struct {
+		Elf64_Ehdr ehdr;
+		Elf64_Phdr text;
+		Elf64_Phdr data;
+	} header;
+	if (pread(out, &header, sizeof header, 0) != sizeof header || header.ehdr.e_phnum != 2) {
+		printf("failed large sections: bad headers\n");
+		return 1;
+	}
+	uint64_t data_len = 8 + 8589934592ULL;
+	uint64_t text_len = header.text.p_offset + 4 + 100000 + 4;
+	if (header.text.p_filesz < text_len || header.data.p_offset < header.text.p_filesz || header.data.p_filesz != data_len) {
+		printf("failed large sections: text %lu bytes, data %lu bytes at %lu\n", header.text.p_filesz, header.data.p_filesz, header.data.p_offset);
+		return 1;
+	}
+	struct stat sb;
+	if (fstat(out, &sb) || (uint64_t) sb.st_size != header.data.p_offset + data_len) {
+		printf("failed large sections: output is %ld bytes\n", sb.st_size);
+		return 1;
+	}
+	uint32_t want = 0x6f, got;
+	set_jtype_imm(&want, 100004);
+	off_t jal = sizeof header.ehdr + 2 * sizeof header.text;
+	if (pread(out, &got, sizeof got, jal) != sizeof got || got != want) {
+		printf("failed large sections: expect jal %08x, got %08x\n", want, got);
+		return 1;
+	}
+	uint32_t words[2];
+	if (
+		pread(out, &words[0], sizeof words[0], header.data.p_offset) != sizeof words[0]
+		|| pread(out, &words[1], sizeof words[1], header.data.p_offset + data_len - 4) != sizeof words[1]
+		|| words[0] != 1 || words[1] != 2
+	) {
+		printf("failed large sections: bad data on either side of the hole\n");
+		return 1;
+	}
+	fclose(image);
+	emitter_free(em);
+	return 0;
+}
+
+// assembles a function and an object with .type and .size, then reads the
+// symbol table back through the section headers
+int test_symbols() {
+	emitter *em = emitter_new(NULL);
+	FILE *image = tmpfile();
+	if (!em || !image) {
+		printf("failed symbols: couldn't make an emitter\n");
+		return 1;
+	}
+	em->section[SECT_TEXT].vaddr = 0x00400000;
+	em->section[SECT_DATA].vaddr = 0x10010000;
+	char *lines[] = {
+		".text\n",
+		".type f, @function\n",
+		"f:\n",
+		"addi a0, a0, 1\n",
+		"addi a0, a0, 2\n",
+		".size f, .-f\n",
+		".data\n",
+		".type v, %object\n",
+		"v:\n",
+		".word 5\n",
+		".size v, 4\n",
+	};
+	for (size_t i = 0; i < sizeof lines / sizeof *lines; i++) {
+		char *pos = lines[i];
+		char *err = parse_line(&pos, em);
+		if (err) {
+			printf("failed symbols: line %s got error %s\n", lines[i], err);
+			return 1;
+		}
+	}
+	int out = fileno(image);
+	output o;
+	output_init(&o, out);
+	int changed;
+	elf_options opts = {
+		.strip = 0,
+		.build_id = 1,
+		.text_align = 0x1000,
+	};
+	if (emitter_output_elf(em, &o, &opts) || output_close(&o, &changed)) {
+		printf("failed symbols: could not output\n");
+		return 1;
+	}
+
+	Elf64_Ehdr ehdr;
+	Elf64_Shdr shdrs[8];
+	if (
+		pread(out, &ehdr, sizeof ehdr, 0) != sizeof ehdr
+		|| ehdr.e_shnum > sizeof shdrs / sizeof *shdrs
+		|| pread(out, shdrs, ehdr.e_shnum * sizeof *shdrs, ehdr.e_shoff) != (ssize_t) (ehdr.e_shnum * sizeof *shdrs)
+	) {
+		printf("failed symbols: bad section headers\n");
+		return 1;
+	}
+	Elf64_Shdr *symtab = NULL;
+	for (int i = 0; i < ehdr.e_shnum; i++) {
+		if (shdrs[i].sh_type == SHT_SYMTAB)
+			symtab = &shdrs[i];
+	}
+	if (!symtab || symtab->sh_size != 3 * sizeof(Elf64_Sym)) {
+		printf("failed symbols: expect a symbol table with 3 entries\n");
+		return 1;
+	}
+	Elf64_Sym syms[3];
+	char strtab[16];
+	Elf64_Shdr *str = &shdrs[symtab->sh_link];
+	if (
+		pread(out, syms, sizeof syms, symtab->sh_offset) != sizeof syms
+		|| str->sh_size > sizeof strtab
+		|| pread(out, strtab, str->sh_size, str->sh_offset) != (ssize_t) str->sh_size
+	) {
+		printf("failed symbols: could not read the symbol table\n");
+		return 1;
+	}
+	struct {
+		char *name;
+		int type;
+		uint64_t size;
+		uint64_t value;
+		int section;
+	} T[] = {
+		{ "f", STT_FUNC, 8, shdrs[SECT_TEXT + 1].sh_addr, SECT_TEXT + 1 },
+		{ "v", STT_OBJECT, 4, 0x10010000, SECT_DATA + 1 },
+	};
+	for (size_t i = 0; i < sizeof T / sizeof *T; i++) {
+		Elf64_Sym *sym = NULL;
+		for (int j = 1; j < 3; j++) {
+			if (!strcmp(strtab + syms[j].st_name, T[i].name))
+				sym = &syms[j];
+		}
+		if (
+			!sym
+			|| ELF64_ST_TYPE(sym->st_info) != T[i].type
+			|| sym->st_size != T[i].size
+			|| sym->st_value != T[i].value
+			|| sym->st_shndx != T[i].section
+		) {
+			printf("failed symbols: bad symbol %s\n", T[i].name);
+			return 1;
+		}
+	}
+	fclose(image);
+	emitter_free(em);
+	return 0;
+}
+
+// records rows for a few lines, some emitting nothing and one far enough
+// from the last to need the long form, then checks the encoded program
+int test_debug_line() {
+	static emitter em;
+	em.debug = 1;
+	em.lines.line = 1;
+	struct {
+		long line;
+		uint64_t idx;
+	} rows[] = {
+		{ 1, 0 },
+		{ 2, 4 },
+		{ 4, 8 },
+		{ 1000, 12 },
+		{ 1001, 4096 },
+	};
+	for (size_t i = 0; i < sizeof rows / sizeof *rows; i++) {
+		em.line = rows[i].line;
+		emitter_line(&em, rows[i].idx);
+	}
+	uint8_t want[] = {
+		(0 - LINE_BASE) + LINE_RANGE * 0 + LINE_OPCODE_BASE,
+		(1 - LINE_BASE) + LINE_RANGE * 4 + LINE_OPCODE_BASE,
+		(2 - LINE_BASE) + LINE_RANGE * 4 + LINE_OPCODE_BASE,
+		DW_LNS_advance_line, 0xe4, 0x07, // 996
+		(0 - LINE_BASE) + LINE_RANGE * 4 + LINE_OPCODE_BASE,
+		DW_LNS_advance_pc, 0xf4, 0x1f, // 4084
+		(1 - LINE_BASE) + LINE_OPCODE_BASE,
+	};
+	size_t where = compare(want, em.lines.program, MIN(sizeof want, em.lines.len));
+	if (em.lines.len != sizeof want || where != sizeof want) {
+		printf("failed debug line: program differs at byte %lu of %lu\n", where, em.lines.len);
+		return 1;
+	}
+	free(em.lines.program);
+	return 0;
+}
+
+// the build id of em as an ELF with the usual options, or 1 if it couldn't be
+// worked out
+int test_elf_id(emitter *em, uint8_t *id) {
+	elf_options opts = {
+		.build_id = 1,
+		.text_align = 0x1000,
+	};
+	uint64_t at;
+	return elf_build_id(em, &opts, id, &at);
+}
+
+// checks xxh64 and the streamed SHA-256 against reference values, then that
+// the build id only follows the bytes of the image, not how they got there
+int test_build_id() {
+	struct {
+		char *s;
+		uint64_t seed;
+		uint64_t want;
+	} T[] = {
+		{ "", 0, 0xef46db3751d8e999 },
+		{ "a", 0, 0xd24ec4f1a98c6e5b },
+		{ "abc", 0, 0x44bc2cf5ad770999 },
+		{ "Nobody inspects the spammish repetition", 0, 0xfbcea83c8a378bf1 },
+	};
+	for (size_t i = 0; i < sizeof T / sizeof *T; i++) {
+		uint64_t got = xxh64(T[i].s, strlen(T[i].s), T[i].seed);
+		if (got != T[i].want) {
+			printf("failed build id: xxh64(\"%s\") expect %016lx, got %016lx\n", T[i].s, T[i].want, got);
+			return 1;
+		}
+	}
+	// the second spills its padding into a block of its own, and it's also
+	// streamed a byte at a time
+	struct {
+		char *s;
+		uint8_t want[4];
+	} S[] = {
+		{ "abc", { 0xba, 0x78, 0x16, 0xbf } },
+		{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", { 0x24, 0x8d, 0x6a, 0x61 } },
+	};
+	for (size_t i = 0; i < sizeof S / sizeof *S; i++) {
+		uint8_t whole[32], streamed[32];
+		sha256(S[i].s, strlen(S[i].s), whole);
+		sha256_ctx ctx;
+		sha256_init(&ctx);
+		for (size_t j = 0; j < strlen(S[i].s); j++)
+			sha256_update(&ctx, S[i].s + j, 1);
+		sha256_final(&ctx, streamed);
+		if (memcmp(whole, S[i].want, sizeof S[i].want) || memcmp(whole, streamed, sizeof whole)) {
+			printf("failed build id: sha256(\"%s\") starts %02x%02x%02x%02x\n", S[i].s, whole[0], whole[1], whole[2], whole[3]);
+			return 1;
+		}
+	}
+
+	// the same bytes every way round: the 10th patched after being
+	// flushed, written to start with, and the zeros after them written out
+	// or left as a hole, then one byte different
+	uint8_t ids[4][BUILD_ID_SIZE];
+	for (int i = 0; i < 4; i++) {
+		emitter *em = emitter_new(NULL);
+		if (!em) {
+			printf("failed build id: couldn't make an emitter\n");
+			return 1;
+		}
+		uint8_t block[1000];
+		for (size_t j = 0; j < sizeof block; j++)
+			block[j] = j;
+		if (i > 0)
+			block[10] = 'x';
+		if (i == 3)
+			block[999] = 'y';
+		for (int j = 0; j < 10; j++)
+			emitter_buffer(em, block, sizeof block);
+		for (int j = 0; i == 0 && j < 10; j++)
+			emitter_write(em, SECT_TEXT, 1000 * j + 10, "x", 1);
+		if (i == 1) {
+			static uint8_t zeros[3 * 4096];
+			emitter_buffer(em, zeros, sizeof zeros);
+		} else {
+			emitter_advance(em, 3 * 4096);
+		}
+		emitter_buffer(em, block, 4);
+		int err = test_elf_id(em, ids[i]);
+		emitter_free(em);
+		if (err) {
+			printf("failed build id: couldn't hash the image\n");
+			return 1;
+		}
+	}
+	if (memcmp(ids[0], ids[1], BUILD_ID_SIZE) || memcmp(ids[0], ids[2], BUILD_ID_SIZE) || !memcmp(ids[0], ids[3], BUILD_ID_SIZE)) {
+		printf("failed build id: expect the first 3 ids the same and the last different\n");
+		return 1;
+	}
+
+	// the note holds the hash of the file it's in with the id as zeros,
+	// which is how --rebase works it out again, here past a 1 GB hole
+	FILE *f = tmpfile();
+	emitter *em = emitter_new(NULL);
+	if (!f || !em) {
+		printf("failed build id: couldn't make an emitter and a file\n");
+		return 1;
+	}
+	emitter_buffer(em, "abcd", 4);
+	emitter_advance(em, 1 << 30);
+	emitter_buffer(em, "efgh", 4);
+	elf_options opts = {
+		.build_id = 1,
+		.text_align = 0x1000,
+	};
+	output out;
+	output_init(&out, fileno(f));
+	int changed;
+	uint8_t id[BUILD_ID_SIZE], got[BUILD_ID_SIZE];
+	uint64_t at;
+	int err = (
+		emitter_output_elf(em, &out, &opts)
+		|| output_close(&out, &changed)
+		|| elf_build_id(em, &opts, id, &at)
+		|| pread(fileno(f), got, sizeof got, at) != sizeof got
+	);
+	emitter_free(em);
+	if (err || memcmp(id, got, sizeof id)) {
+		printf("failed build id: expect the note to hold the id\n");
+		return 1;
+	}
+	image_hash h;
+	image_hash_init(&h);
+	uint8_t digest[32];
+	struct stat sb;
+	err = (
+		fstat(fileno(f), &sb)
+		|| hash_sparse(&h, fileno(f), 0, at)
+	);
+	image_hash_zeros(&h, BUILD_ID_SIZE);
+	err = err || hash_sparse(&h, fileno(f), at + BUILD_ID_SIZE, sb.st_size - at - BUILD_ID_SIZE);
+	fclose(f);
+	image_hash_final(&h, digest);
+	if (err || memcmp(id, digest, sizeof id)) {
+		printf("failed build id: expect the id to be the hash of the file\n");
+		return 1;
+	}
+	return 0;
+}
+
+// references between sections are only patched by emitter_finish, once the
+// sections have their final vaddrs, and a label that's used but never
+// defined is an error there
+int test_cross_section() {
+	emitter *em = emitter_new(NULL);
+	if (!em) {
+		printf("failed cross section: couldn't make an emitter\n");
+		return 1;
+	}
+	char *lines[] = {
+		".text\n",
+		"f:\n",
+		"jal ra, d\n",
+		".data\n",
+		"d:\n",
+		"jal zero, f\n",
+		"jal zero, g\n",
+		".text\n",
+		"g:\n",
+	};
+	for (size_t i = 0; i < sizeof lines / sizeof *lines; i++) {
+		char *pos = lines[i];
+		char *err = parse_line(&pos, em);
+		if (err) {
+			printf("failed cross section: line %s got error %s\n", lines[i], err);
+			return 1;
+		}
+	}
+	em->section[SECT_TEXT].vaddr = 0x400100;
+	em->section[SECT_DATA].vaddr = 0x401120;
+	string undefined;
+	if (emitter_finish(em, &undefined)) {
+		printf("failed cross section: undefined label %.*s\n", (int) undefined.len, undefined.begin);
+		return 1;
+	}
+	struct {
+		int sect;
+		uint64_t idx;
+		uint32_t opcode;
+		int64_t offset;
+	} T[] = {
+		{ SECT_TEXT, 0, 0xef, 0x401120 - 0x400100 },
+		{ SECT_DATA, 0, 0x6f, 0x400100 - 0x401120 },
+		{ SECT_DATA, 4, 0x6f, 0x400104 - 0x401124 },
+	};
+	for (size_t i = 0; i < sizeof T / sizeof *T; i++) {
+		uint32_t want = T[i].opcode, got;
+		set_jtype_imm(&want, T[i].offset);
+		emitter_read(em, T[i].sect, T[i].idx, &got, sizeof got);
+		if (got != want) {
+			printf("failed cross section %lu: expect %08x, got %08x\n", i, want, got);
+			return 1;
+		}
+	}
+
+	char *pos = "jal ra, nowhere\n";
+	if (parse_line(&pos, em) || !emitter_finish(em, &undefined) || undefined.len != 7 || strncmp(undefined.begin, "nowhere", 7)) {
+		printf("failed cross section: expect nowhere to be undefined\n");
+		return 1;
+	}
+	emitter_free(em);
+	return 0;
+}
+
+// assembles one way past a save, then goes back and assembles another, which
+// has to come out as if the first never happened
+int test_save_restore() {
+	static emitter save;
+	emitter *em = emitter_new(NULL);
+	if (!em) {
+		printf("failed save restore: couldn't make an emitter\n");
+		return 1;
+	}
+	char *before[] = { ".text\n", "jal ra, f\n", ".data\n", ".word f\n", ".text\n" };
+	char *first[] = { "f:\n" };
+	char *second[] = { "addi zero, zero, 0\n", "f:\n" };
+	struct {
+		char **lines;
+		size_t n;
+		int64_t f; // where f ends up
+	} T[] = {
+		{ before, sizeof before / sizeof *before, -1 },
+		{ first, sizeof first / sizeof *first, 4 },
+		{ second, sizeof second / sizeof *second, 8 },
+	};
+	for (size_t i = 0; i < sizeof T / sizeof *T; i++) {
+		if (i == 1)
+			emitter_save(em, &save);
+		if (i == 2)
+			emitter_restore(em, &save);
+		for (size_t j = 0; j < T[i].n; j++) {
+			char *pos = T[i].lines[j];
+			char *err = parse_line(&pos, em);
+			if (err) {
+				printf("failed save restore: line %s got error %s\n", T[i].lines[j], err);
+				return 1;
+			}
+		}
+		if (T[i].f < 0)
+			continue;
+		em->section[SECT_TEXT].vaddr = 0x400100;
+		em->section[SECT_DATA].vaddr = 0x401000;
+		string name;
+		if (emitter_finish(em, &name)) {
+			printf("failed save restore %lu: finish failed on %.*s\n", i, (int) name.len, name.begin);
+			return 1;
+		}
+		uint32_t want = 0xef, got, word;
+		set_jtype_imm(&want, T[i].f);
+		emitter_read(em, SECT_TEXT, 0, &got, sizeof got);
+		emitter_read(em, SECT_DATA, 0, &word, sizeof word);
+		if (got != want || word != 0x400100 + T[i].f) {
+			printf("failed save restore %lu: expect %08x and %08lx, got %08x and %08x\n", i, want, 0x400100 + T[i].f, got, word);
+			return 1;
+		}
+	}
+	// the save is still as it was
+	emitter_restore(em, &save);
+	string name;
+	if (emitter_finish(em, &name) != FINISH_UNDEFINED || name.len != 1 || name.begin[0] != 'f') {
+		printf("failed save restore: expect f to be undefined again\n");
+		return 1;
+	}
+	emitter_discard(&save);
+	emitter_free(em);
+	return 0;
+}
+
+// a run that gets to a save of another, with different bytes before it, can
+// catch up with where the other ended, and comes out as if it had assembled
+// the lines in between itself
+int test_catch_up() {
+	static emitter start, mid, end;
+	emitter *em = emitter_new(NULL);
+	emitter *fresh = emitter_new(NULL);
+	// long enough that the first line is flushed by mid, while the jal
+	// there waits for f, which comes after
+	const char add[] = "addi a0, a0, 1\n";
+	size_t body_len = 2000 * (sizeof add - 1);
+	char *body = malloc(body_len + 1);
+	if (!em || !fresh || !body) {
+		printf("failed catch up: couldn't make an emitter\n");
+		return 1;
+	}
+	for (size_t i = 0; i < 2000; i++)
+		memcpy(body + i * (sizeof add - 1), add, sizeof add - 1);
+	char first[] = "jal ra, f\n";
+	char edited[] = "jal a1, f\n";
+	char tail[] = ".space 8192\nf:\n.data\n.dword f\n";
+	char hole[] = ".space 16384\n";
+	long line = 1;
+	int fail = 1;
+	emitter_save(em, &start);
+	if (
+		assemble_chunk(first, first + strlen(first), em, "first.s", &line, stdout)
+		|| assemble_chunk(body, body + body_len, em, "body.s", &line, stdout)
+	)
+		return 1;
+	emitter_save(em, &mid);
+	if (assemble_chunk(tail, tail + strlen(tail), em, "tail.s", &line, stdout))
+		return 1;
+	emitter_save(em, &end);
+
+	emitter_restore(em, &start);
+	if (
+		assemble_chunk(edited, edited + strlen(edited), em, "edited.s", &line, stdout)
+		|| assemble_chunk(body, body + body_len, em, "body.s", &line, stdout)
+	)
+		goto out;
+	if (!emitter_same_state(em, &mid)) {
+		printf("failed catch up: expect the same state as the first run\n");
+		goto out;
+	}
+	emitter_catch_up(em, &mid, &end);
+	if (
+		assemble_chunk(edited, edited + strlen(edited), fresh, "edited.s", &line, stdout)
+		|| assemble_chunk(body, body + body_len, fresh, "body.s", &line, stdout)
+		|| assemble_chunk(tail, tail + strlen(tail), fresh, "tail.s", &line, stdout)
+	)
+		goto out;
+	emitter *both[] = { em, fresh };
+	for (int i = 0; i < 2; i++) {
+		both[i]->section[SECT_TEXT].vaddr = 0x400100;
+		both[i]->section[SECT_DATA].vaddr = 0x410000;
+		string name;
+		if (emitter_finish(both[i], &name)) {
+			printf("failed catch up: finish failed on %.*s\n", (int) name.len, name.begin);
+			goto out;
+		}
+	}
+	for (int sect = 0; sect < N_SECTIONS; sect++) {
+		uint64_t pos = fresh->section[sect].pos;
+		if (em->section[sect].pos != pos) {
+			printf("failed catch up: expect section %d to be %lu bytes, got %lu\n", sect, pos, em->section[sect].pos);
+			goto out;
+		}
+		uint8_t a[4096], b[4096];
+		for (uint64_t at = 0; at < pos; at += sizeof a) {
+			size_t n = MIN(sizeof a, pos - at);
+			emitter_read(em, sect, at, a, n);
+			emitter_read(fresh, sect, at, b, n);
+			if (memcmp(a, b, n)) {
+				printf("failed catch up: section %d differs from %lu on\n", sect, at);
+				goto out;
+			}
+		}
+	}
+	uint8_t ids[2][BUILD_ID_SIZE];
+	if (test_elf_id(em, ids[0]) || test_elf_id(fresh, ids[1]) || memcmp(ids[0], ids[1], BUILD_ID_SIZE)) {
+		printf("failed catch up: expect the same build id\n");
+		goto out;
+	}
+
+	// without the first line, everything after is somewhere else
+	emitter_restore(em, &start);
+	if (assemble_chunk(body, body + body_len, em, "body.s", &line, stdout))
+		goto out;
+	if (emitter_same_state(em, &mid)) {
+		printf("failed catch up: expect a different state without the first line\n");
+		goto out;
+	}
+
+	// a hole where the first run left bytes reads back as zeros
+	emitter_restore(em, &start);
+	if (assemble_chunk(hole, hole + strlen(hole), em, "hole.s", &line, stdout))
+		goto out;
+	uint8_t zeros[16384], got[16384];
+	bzero(zeros, sizeof zeros);
+	emitter_read(em, SECT_TEXT, 0, got, sizeof got);
+	if (memcmp(got, zeros, sizeof got)) {
+		printf("failed catch up: expect a hole over the first run's bytes to read as zeros\n");
+		goto out;
+	}
+	fail = 0;
+out:
+	emitter_discard(&start);
+	emitter_discard(&mid);
+	emitter_discard(&end);
+	emitter_free(em);
+	emitter_free(fresh);
+	free(body);
+	return fail;
+}
+
+// with -c, branches to local labels in their own section are still patched,
+// and everything else is left as a relocation against its label
+int test_relocatable() {
+	emitter *em = emitter_new(NULL);
+	if (!em) {
+		printf("failed relocatable: couldn't make an emitter\n");
+		return 1;
+	}
+	em->relocatable = 1;
+	char *lines[] = {
+		".text\n",
+		"loop:\n",
+		"beq a0, a1, loop\n",
+		"jal ra, puts\n",
+		"jal ra, main\n",
+		".data\n",
+		"table:\n",
+		".dword loop, puts\n",
+		".word main\n",
+		".text\n",
+		".globl main\n",
+		"main:\n",
+	};
+	for (size_t i = 0; i < sizeof lines / sizeof *lines; i++) {
+		char *pos = lines[i];
+		char *err = parse_line(&pos, em);
+		if (err) {
+			printf("failed relocatable: line %s got error %s\n", lines[i], err);
+			return 1;
+		}
+	}
+	string name;
+	if (emitter_finish(em, &name)) {
+		printf("failed relocatable: finish failed on %.*s\n", (int) name.len, name.begin);
+		return 1;
+	}
+	uint32_t want = 0x00b50063, got;
+	set_btype_imm(&want, 0);
+	emitter_read(em, SECT_TEXT, 0, &got, sizeof got);
+	if (got != want) {
+		printf("failed relocatable: expect beq %08x, got %08x\n", want, got);
+		return 1;
+	}
+	struct {
+		int sect;
+		int64_t idx;
+		enum assign_type assign;
+		char *name;
+	} T[] = {
+		{ SECT_TEXT, 4, ASSIGN_JTYPE, "puts" },
+		{ SECT_TEXT, 8, ASSIGN_JTYPE, "main" },
+		{ SECT_DATA, 0, ASSIGN_ABS64, "loop" },
+		{ SECT_DATA, 8, ASSIGN_ABS64, "puts" },
+		{ SECT_DATA, 16, ASSIGN_ABS32, "main" },
+	};
+	if (cc_size(&em->relocs) != sizeof T / sizeof *T) {
+		printf("failed relocatable: expect %lu relocations, got %lu\n", sizeof T / sizeof *T, cc_size(&em->relocs));
+		return 1;
+	}
+	for (size_t i = 0; i < sizeof T / sizeof *T; i++) {
+		cross_fixup *r = cc_get(&em->relocs, i);
+		if (
+			r->waiter.section != T[i].sect
+			|| r->waiter.fix_idx != T[i].idx
+			|| r->waiter.assign != T[i].assign
+			|| r->name.len != strlen(T[i].name)
+			|| strncmp(r->name.begin, T[i].name, r->name.len)
+		) {
+			printf("failed relocatable %lu: expect %s at %ld\n", i, T[i].name, T[i].idx);
+			return 1;
+		}
+	}
+	string puts_label = { .begin = "puts", .len = 4 };
+	if (!cc_get(&em->labels, puts_label)->global) {
+		printf("failed relocatable: expect puts to be external\n");
+		return 1;
+	}
+	// the float ABI is the only thing in e_flags, so the object links with
+	// others built for it
+	elf_options elf = { .float_abi = EF_RISCV_FLOAT_ABI_DOUBLE };
+	output out;
+	Elf64_Ehdr ehdr;
+	FILE *object = tmpfile();
+	assert(object);
+	int fd = fileno(object);
+	output_init(&out, fd);
+	if (
+		emitter_output_elf(em, &out, &elf)
+		|| pread(fd, &ehdr, sizeof ehdr, 0) != sizeof ehdr
+		|| ehdr.e_type != ET_REL
+		|| ehdr.e_flags != EF_RISCV_FLOAT_ABI_DOUBLE
+	) {
+		printf("failed relocatable: expect an object with the double float ABI\n");
+		return 1;
+	}
+	fclose(object);
+	emitter_free(em);
+	return 0;
+}
+
+// two inputs linked together, each with a local label of the same name, and
+// one calling a global label defined in the other
+int test_link() {
+	emitter *parts[3];
+	char *lines[2][4] = {
+		{ ".globl f\n", "jal ra, g\n", "l:\n", "jal zero, l\n" },
+		{ ".globl g\n", "l:\n", "g:\n", "jal zero, l\n" },
+	};
+	for (int p = 0; p < 3; p++) {
+		parts[p] = emitter_new(NULL);
+		if (!parts[p]) {
+			printf("failed link: couldn't make an emitter\n");
+			return 1;
+		}
+		if (p == 2)
+			break;
+		parts[p]->link_input = 1;
+		for (size_t i = 0; i < sizeof lines[p] / sizeof *lines[p]; i++) {
+			char *pos = lines[p][i];
+			if (parse_line(&pos, parts[p])) {
+				printf("failed link: input %d line %s\n", p, lines[p][i]);
+				return 1;
+			}
+		}
+		string name;
+		if (emitter_finish(parts[p], &name)) {
+			printf("failed link: input %d didn't finish\n", p);
+			return 1;
+		}
+	}
+	emitter *em = parts[2];
+	string name;
+	em->section[SECT_TEXT].vaddr = 0x400000;
+	if (emitter_link(em, parts, 2, &name) || emitter_finish(em, &name)) {
+		printf("failed link: couldn't link %.*s\n", (int) name.len, name.begin);
+		return 1;
+	}
+	int64_t T[] = { 8, 0, 0 };
+	for (size_t i = 0; i < sizeof T / sizeof *T; i++) {
+		uint32_t want = i == 0 ? 0xef : 0x6f, got;
+		set_jtype_imm(&want, T[i]);
+		emitter_read(em, SECT_TEXT, 4 * i, &got, sizeof got);
+		if (got != want) {
+			printf("failed link %lu: expect %08x, got %08x\n", i, want, got);
+			return 1;
+		}
+	}
+	string g = { .begin = "g", .len = 1 };
+	label *l = cc_get(&em->labels, g);
+	if (!l || l->val != 8 || !l->global) {
+		printf("failed link: expect global g at 8\n");
+		return 1;
+	}
+	for (int p = 0; p < 3; p++)
+		emitter_free(parts[p]);
+	return 0;
+}
+
+// a branch and a jump from one input to a global label in the other, either
+// just in reach or just out of it, and a branch within one input that's out
+// of reach when its label comes
+int test_link_reach() {
+	struct {
+		char *jump;
+		uint64_t space;
+		uint32_t instr;
+		int64_t offset;
+		int err;
+	} T[] = {
+		{ "beq a0, a1, g\n", 4088, 0x00b50063, 4092, FINISH_OK },
+		{ "beq a0, a1, g\n", 4092, 0x00b50063, 4096, FINISH_RANGE },
+		{ "jal ra, g\n", (1 << 20) - 8, 0xef, (1 << 20) - 4, FINISH_OK },
+		{ "jal ra, g\n", (1 << 20) - 4, 0xef, 1 << 20, FINISH_RANGE },
+	};
+	for (size_t t = 0; t < sizeof T / sizeof *T; t++) {
+		char space[32];
+		snprintf(space, sizeof space, ".space %lu\n", T[t].space);
+		char *lines[2][2] = {
+			{ T[t].jump, space },
+			{ ".globl g\n", "g:\n" },
+		};
+		emitter *parts[3];
+		string name;
+		for (int p = 0; p < 3; p++) {
+			parts[p] = emitter_new(NULL);
+			if (!parts[p]) {
+				printf("failed link reach: couldn't make an emitter\n");
+				return 1;
+			}
+			if (p == 2)
+				break;
+			parts[p]->link_input = 1;
+			for (int i = 0; i < 2; i++) {
+				char *pos = lines[p][i];
+				if (parse_line(&pos, parts[p])) {
+					printf("failed link reach %lu: input %d line %s\n", t, p, lines[p][i]);
+					return 1;
+				}
+			}
+			if (emitter_finish(parts[p], &name)) {
+				printf("failed link reach %lu: input %d didn't finish\n", t, p);
+				return 1;
+			}
+		}
+		emitter *em = parts[2];
+		em->section[SECT_TEXT].vaddr = 0x400000;
+		if (emitter_link(em, parts, 2, &name) || emitter_finish(em, &name) != T[t].err) {
+			printf("failed link reach %lu: expect %s\n", t, T[t].err ? "out of range" : "it to link");
+			return 1;
+		}
+		uint32_t want = T[t].instr, got;
+		if (T[t].err == FINISH_OK) {
+			if (T[t].instr == 0xef)
+				set_jtype_imm(&want, T[t].offset);
+			else
+				set_btype_imm(&want, T[t].offset);
+		}
+		emitter_read(em, SECT_TEXT, 0, &got, sizeof got);
+		if (got != want) {
+			printf("failed link reach %lu: expect %08x, got %08x\n", t, want, got);
+			return 1;
+		}
+		for (int p = 0; p < 3; p++)
+			emitter_free(parts[p]);
+	}
+
+	emitter *em = emitter_new(NULL);
+	char *lines[] = { "beq a0, a1, far\n", ".space 4092\n", "far:\n" };
+	char *err = NULL;
+	if (!em) {
+		printf("failed link reach: couldn't make an emitter\n");
+		return 1;
+	}
+	for (size_t i = 0; i < sizeof lines / sizeof *lines && !err; i++) {
+		char *pos = lines[i];
+		err = parse_line(&pos, em);
+	}
+	if (!err) {
+		printf("failed link reach: expect a branch 4096 bytes ahead to be out of range\n");
+		return 1;
+	}
+	emitter_free(em);
+	return 0;
+}
+
+// takes tokens from a pipe set up the way make -j3 would, with two tokens for
+// the two threads past the first, and gives them back
+int test_jobserver() {
+	int fds[2];
+	if (pipe(fds)) {
+		printf("failed jobserver: no pipe\n");
+		return 1;
+	}
+	char flags[64];
+	snprintf(flags, sizeof flags, " -j3 --jobserver-auth=%d,%d", fds[0], fds[1]);
+	setenv("MAKEFLAGS", flags, 1);
+	if (write(fds[1], "ab", 2) != 2) {
+		printf("failed jobserver: couldn't write tokens\n");
+		return 1;
+	}
+	jobserver_init();
+	char tokens[3];
+	if (!jobserver_try_acquire(&tokens[0]) || !jobserver_try_acquire(&tokens[1])) {
+		printf("failed jobserver: expect two tokens\n");
+		return 1;
+	}
+	if (jobserver_try_acquire(&tokens[2])) {
+		printf("failed jobserver: expect no third token\n");
+		return 1;
+	}
+	jobserver_release(tokens[0]);
+	jobserver_release(tokens[1]);
+	char back[3];
+	int flags_before = fcntl(fds[0], F_GETFL);
+	fcntl(fds[0], F_SETFL, flags_before | O_NONBLOCK);
+	ssize_t got = read(fds[0], back, sizeof back);
+	if (got != 2 || (flags_before & O_NONBLOCK)) {
+		printf("failed jobserver: expect 2 tokens back in a blocking pipe, got %ld\n", got);
+		return 1;
+	}
+	unsetenv("MAKEFLAGS");
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+// runs ./asm with argv, keeping what it prints in out
+// returns its exit status, or -1 if it couldn't be run
+int test_asm(char **argv, char *out, size_t size) {
+	int pipefd[2];
+	if (pipe(pipefd))
+		return -1;
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		dup2(pipefd[1], STDOUT_FILENO);
+		execv("./asm", argv);
+		_exit(127);
+	}
+	close(pipefd[1]);
+	size_t len = 0;
+	ssize_t got;
+	while (len < size - 1 && (got = read(pipefd[0], out + len, size - 1 - len)) > 0)
+		len += got;
+	out[len] = '\0';
+	close(pipefd[0]);
+	int status;
+	if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+// whether the files at a and b have the same contents
+int test_same_file(const char *a, const char *b) {
+	char cmp[160];
+	snprintf(cmp, sizeof cmp, "cmp -s %s %s", a, b);
+	return system(cmp) == 0;
+}
+
+// ./asm --batch on one worker, so every job goes through the same emitter,
+// with a failing job between two that succeed
+// the failure is reported against its own file, and the jobs after it come
+// out the same as when assembled alone
+int test_batch() {
+	char dir[] = "/tmp/asm-test-XXXXXX";
+	if (!mkdtemp(dir)) {
+		printf("failed batch: could not make a directory\n");
+		return 1;
+	}
+	// jobs run largest first, so the bad one runs in the middle
+	const char *srcs[] = {
+		"_start:\naddi a0, zero, 1\naddi a1, zero, 2\njal ra, _start\n.data\n.word 7\n",
+		"_start:\nnot an instruction\n",
+		"_start:\necall\n",
+	};
+	char src[3][64], out[3][64], alone[64], manifest[64], bad_manifest[64];
+	FILE *m = NULL;
+	snprintf(manifest, sizeof manifest, "%s/manifest", dir);
+	snprintf(bad_manifest, sizeof bad_manifest, "%s/bad", dir);
+	snprintf(alone, sizeof alone, "%s/alone", dir);
+	int fail = 1;
+	for (int i = 0; i < 3; i++) {
+		snprintf(src[i], sizeof src[i], "%s/%d.s", dir, i);
+		snprintf(out[i], sizeof out[i], "%s/%d.out", dir, i);
+		FILE *f = fopen(src[i], "w");
+		if (!f || fputs(srcs[i], f) == EOF || fclose(f)) {
+			printf("failed batch: could not write an input\n");
+			goto out;
+		}
+	}
+	// blank lines are skipped
+	m = fopen(manifest, "w");
+	if (!m || fprintf(m, "%s %s\n\n%s %s\n  %s\t%s\n", src[0], out[0], src[1], out[1], src[2], out[2]) < 0 || fclose(m)) {
+		printf("failed batch: could not write the manifest\n");
+		goto out;
+	}
+	m = fopen(bad_manifest, "w");
+	if (!m || fprintf(m, "%s %s\n%s\n", src[0], out[0], src[2]) < 0 || fclose(m)) {
+		printf("failed batch: could not write the manifest\n");
+		goto out;
+	}
+
+	char printed[1024], want[256];
+	int status = test_asm((char *[]) { "asm", "--batch", manifest, "--jobs", "1", NULL }, printed, sizeof printed);
+	snprintf(want, sizeof want, "%s:2: ", src[1]);
+	if (status != 1 || strncmp(printed, want, strlen(want)) || !strstr(printed, "Assembled 2 of 3 files")) {
+		printf("failed batch: expect only %s to fail, got %d and\n%s", src[1], status, printed);
+		goto out;
+	}
+	for (int i = 0; i < 3; i += 2) {
+		status = test_asm((char *[]) { "asm", src[i], "-o", alone, NULL }, printed, sizeof printed);
+		if (status || !test_same_file(out[i], alone)) {
+			printf("failed batch: expect %s the same as when assembled alone\n", out[i]);
+			goto out;
+		}
+	}
+
+	// a line without an output stops the batch before anything runs
+	unlink(out[0]);
+	status = test_asm((char *[]) { "asm", "--batch", bad_manifest, NULL }, printed, sizeof printed);
+	snprintf(want, sizeof want, "%s:2: expected an input and an output\n", bad_manifest);
+	if (status != 1 || strcmp(printed, want) || access(out[0], F_OK) == 0) {
+		printf("failed batch: expect the manifest to be rejected, got %d and\n%s", status, printed);
+		goto out;
+	}
+	fail = 0;
+out:;
+	char rm[96];
+	snprintf(rm, sizeof rm, "rm -rf %s", dir);
+	return system(rm) != 0 || fail;
+}
+
+// writes the watched input for test_watch, by rename as an editor would, with
+// first as its second line and mid as the middle one of a body long enough to
+// have checkpoints ahead of it
+int test_watch_source(const char *dir, const char *first, const char *mid) {
+	char tmp[64], src[64];
+	snprintf(tmp, sizeof tmp, "%s/w.tmp", dir);
+	snprintf(src, sizeof src, "%s/w.s", dir);
+	FILE *f = fopen(tmp, "w");
+	if (!f)
+		return 1;
+	fprintf(f, "_start:\n%s\n", first);
+	for (int i = 0; i < 3 * 4096; i++)
+		fprintf(f, "%s\n", i == 6000 ? mid : "addi a0, a0, 1");
+	fprintf(f, "end:\necall\n.data\n.dword _start, end\n.word 7\n");
+	return fclose(f) || rename(tmp, src);
+}
+
+// ./asm --watch with an ELF and a binary, through edits that keep the layout,
+// which are patched in place, and one that moves everything after it
+// after each, the outputs are the same as assembling the input from scratch
+int test_watch() {
+	char dir[] = "/tmp/asm-test-XXXXXX";
+	if (!mkdtemp(dir)) {
+		printf("failed watch: could not make a directory\n");
+		return 1;
+	}
+	struct {
+		const char *first, *mid;
+		int in_place;
+	} T[] = {
+		{ "jal ra, end", "addi a0, a0, 1", 0 },
+		{ "jal ra, end", "addi a0, a0, 2", 1 },
+		{ "jal a1, end", "addi a0, a0, 2", 1 },
+		{ "jal a1, end", ".space 8", 0 },
+		{ "jal a1, end", "addi a0, a0, 3", 0 },
+	};
+	char src[64], elf[64], bin[64], fresh_elf[64], fresh_bin[64];
+	snprintf(src, sizeof src, "%s/w.s", dir);
+	snprintf(elf, sizeof elf, "%s/w.elf", dir);
+	snprintf(bin, sizeof bin, "%s/w.bin", dir);
+	snprintf(fresh_elf, sizeof fresh_elf, "%s/f.elf", dir);
+	snprintf(fresh_bin, sizeof fresh_bin, "%s/f.bin", dir);
+	int fail = 1;
+	pid_t pid = -1;
+	FILE *printed = NULL;
+	if (test_watch_source(dir, T[0].first, T[0].mid)) {
+		printf("failed watch: could not write the input\n");
+		goto out;
+	}
+	int pipefd[2];
+	if (pipe(pipefd)) {
+		printf("failed watch: no pipe\n");
+		goto out;
+	}
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		dup2(pipefd[1], STDOUT_FILENO);
+		execv("./asm", (char *[]) { "asm", "--watch", src, "-o", elf, "--bin", bin, NULL });
+		_exit(127);
+	}
+	close(pipefd[1]);
+	printed = fdopen(pipefd[0], "r");
+	for (size_t i = 0; i < sizeof T / sizeof *T; i++) {
+		if (i > 0 && test_watch_source(dir, T[i].first, T[i].mid)) {
+			printf("failed watch %ld: could not write the input\n", i);
+			goto out;
+		}
+		char line[256];
+		if (!printed || !fgets(line, sizeof line, printed) || strncmp(line, "Assembled ", 10)) {
+			printf("failed watch %ld: expect it to be assembled\n", i);
+			goto out;
+		}
+		if (!!strstr(line, "patched in place") != T[i].in_place) {
+			printf("failed watch %ld: expect in_place = %d, got %s", i, T[i].in_place, line);
+			goto out;
+		}
+		char out[256];
+		int status = test_asm((char *[]) { "asm", src, "-o", fresh_elf, "--bin", fresh_bin, NULL }, out, sizeof out);
+		if (status || !test_same_file(elf, fresh_elf) || !test_same_file(bin, fresh_bin)) {
+			printf("failed watch %ld: expect the outputs the same as from scratch after %s", i, line);
+			goto out;
+		}
+	}
+	fail = 0;
+out:
+	if (pid > 0) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	if (printed)
+		fclose(printed);
+	char rm[96];
+	snprintf(rm, sizeof rm, "rm -rf %s", dir);
+	return system(rm) != 0 || fail;
+}
+
+// prints its arguments, and where it ran, to the client's stdout
+int test_server_handler(void *ctx, int argc, char **argv) {
+	(void) ctx;
+	char cwd[PATH_MAX];
+	printf("%s", getcwd(cwd, sizeof cwd) ? cwd : "?");
+	for (int i = 0; i < argc; i++)
+		printf(" %s", argv[i]);
+	return argc;
+}
+
+// sends argv to the server at path, with the server's printing going nowhere
+// returns the request's exit status, or -1 if it couldn't be sent, once the
+// server has hung up, and so closed what the request sent it
+int test_server_request(const char *path, int argc, char **argv) {
+	int sock = server_connect(path);
+	int null = open("/dev/null", O_WRONLY);
+	int out = dup(STDOUT_FILENO);
+	int status = -1;
+	fflush(stdout);
+	if (sock != -1 && null != -1 && out != -1 && dup2(null, STDOUT_FILENO) != -1) {
+		char c;
+		if (server_send(sock, argc, argv, &status))
+			status = -1;
+		while (read(sock, &c, 1) > 0) {
+		}
+		dup2(out, STDOUT_FILENO);
+	}
+	close(sock);
+	close(null);
+	close(out);
+	return status;
+}
+
+// the descriptors pid has open
+int test_count_fds(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof path, "/proc/%d/fd", (int) pid);
+	DIR *d = opendir(path);
+	if (!d)
+		return -1;
+	int n = 0;
+	while (readdir(d))
+		n++;
+	closedir(d);
+	return n;
+}
+
+// ./asm --server, limited to small files, gets a request too big for its file
+// buffers, which panics, and has to go on to the next one with nothing the
+// failed request opened left open
+// an option argparse doesn't take fails its request without ending the server
+// too
+int test_server_recover() {
+	char dir[] = "/tmp/asm-test-XXXXXX";
+	if (!mkdtemp(dir)) {
+		printf("failed server recover: could not make a directory\n");
+		return 1;
+	}
+	char sock[64], big[64], small[64], out[64];
+	snprintf(sock, sizeof sock, "%s/sock", dir);
+	snprintf(big, sizeof big, "%s/big.s", dir);
+	snprintf(small, sizeof small, "%s/small.s", dir);
+	snprintf(out, sizeof out, "%s/out", dir);
+	FILE *f = fopen(big, "w");
+	for (int i = 0; f && i < 64 * 1024; i++)
+		fprintf(f, ".word %d\n", i);
+	if (!f || fclose(f)) {
+		printf("failed server recover: could not write the input\n");
+		return 1;
+	}
+	f = fopen(small, "w");
+	if (!f || fputs("_start:\njal ra, _start\n", f) == EOF || fclose(f)) {
+		printf("failed server recover: could not write the input\n");
+		return 1;
+	}
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		// a write past the limit fails with EFBIG, rather than killing
+		struct rlimit limit = { .rlim_cur = 64 * 1024, .rlim_max = 64 * 1024 };
+		int null = open("/dev/null", O_WRONLY);
+		signal(SIGXFSZ, SIG_IGN);
+		if (setrlimit(RLIMIT_FSIZE, &limit) || dup2(null, STDOUT_FILENO) == -1)
+			_exit(2);
+		execl("./asm", "asm", "--server", sock, NULL);
+		_exit(2);
+	}
+	int sock_fd = -1;
+	for (int i = 0; i < 500 && (sock_fd = server_connect(sock)) == -1; i++)
+		usleep(10000);
+	close(sock_fd);
+
+	char *big_argv[] = {"asm", big, "-o", out};
+	char *small_argv[] = {"asm", small, "-o", out};
+	char *bad_argv[] = {"asm", small, "--no-such-option"};
+	char *short_argv[] = {"asm", small, "-o"};
+	int warm_status = test_server_request(sock, 4, small_argv);
+	int fds_before = test_count_fds(pid);
+	int big_status = test_server_request(sock, 4, big_argv);
+	int fds_after = test_count_fds(pid);
+	int bad_status = test_server_request(sock, 3, bad_argv);
+	int short_status = test_server_request(sock, 3, short_argv);
+	int small_status = test_server_request(sock, 4, small_argv);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	int fail = 0;
+	if (sock_fd == -1) {
+		printf("failed server recover: the server didn't start\n");
+		fail = 1;
+	} else if (warm_status != 0) {
+		printf("failed server recover: expect the first request to succeed, got %d\n", warm_status);
+		fail = 1;
+	} else if (big_status <= 0) {
+		printf("failed server recover: expect the big request to fail, got %d\n", big_status);
+		fail = 1;
+	} else if (fds_before == -1 || fds_after != fds_before) {
+		printf("failed server recover: expect %d descriptors open after the panic, got %d\n", fds_before, fds_after);
+		fail = 1;
+	} else if (bad_status != 1 || short_status != 1) {
+		printf("failed server recover: expect bad options to fail, got %d and %d\n", bad_status, short_status);
+		fail = 1;
+	} else if (small_status != 0) {
+		printf("failed server recover: expect the request after a panic to succeed, got %d\n", small_status);
+		fail = 1;
+	}
+	unlink(out);
+	unlink(small);
+	unlink(big);
+	rmdir(dir);
+	return fail;
+}
+
+// a client in a child process sends a request from /, with its stdout a pipe,
+// and the server, this process, has to run it there then put everything back
+int test_server() {
+	int sv[2], out[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) || pipe(out)) {
+		printf("failed server: no socket\n");
+		return 1;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		char *argv[] = {"asm", "hello.s", "-o", "hello"};
+		int status;
+		dup2(out[1], STDOUT_FILENO);
+		if (chdir("/") || server_send(sv[0], 4, argv, &status))
+			_exit(2);
+		_exit(status == 4 ? 0 : 1);
+	}
+	close(out[1]);
+	char before[PATH_MAX], after[PATH_MAX];
+	if (!getcwd(before, sizeof before) || server_handle(sv[1], test_server_handler, NULL)) {
+		printf("failed server: couldn't handle the request\n");
+		return 1;
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		printf("failed server: expect the client to get status 4\n");
+		return 1;
+	}
+	char got[64] = {0};
+	read(out[0], got, sizeof got - 1);
+	if (strcmp(got, "/ asm hello.s -o hello")) {
+		printf("failed server: expect \"/ asm hello.s -o hello\", got \"%s\"\n", got);
+		return 1;
+	}
+	if (!getcwd(after, sizeof after) || strcmp(before, after)) {
+		printf("failed server: expect the server's directory back\n");
+		return 1;
+	}
+	close(out[0]);
+	close(sv[0]);
+	close(sv[1]);
+	return test_server_recover();
+}
+
+// writes an image, then writes it again only if changed, first unchanged,
+// then with a difference in the middle, then cut short
+int test_write_if_changed() {
+	char dir[] = "/tmp/asm-test-XXXXXX";
+	if (!mkdtemp(dir)) {
+		printf("failed write if changed: could not make a directory\n");
+		return 1;
+	}
+	char path[64];
+	snprintf(path, sizeof path, "%s/out", dir);
+	struct {
+		char *head;
+		off_t gap;
+		char *tail;
+		int if_changed;
+		int changed;
+	} T[] = {
+		{ "abcd", 100, "efgh", 0, 1 },
+		{ "abcd", 100, "efgh", 1, 0 },
+		{ "abcd", 100, "efgi", 1, 1 },
+		{ "abcd", 50, "efgi", 1, 1 },
+		// the existing file is longer, then shorter, than the image, with
+		// the rest of them the same
+		{ "abcd", 50, "", 1, 1 },
+		{ "abcd", 50, "efgi", 1, 1 },
+	};
+	for (size_t i = 0; i < sizeof T / sizeof *T; i++) {
+		output out;
+		int changed;
+		if (
+			output_open(&out, path, T[i].if_changed)
+			|| output_write(&out, T[i].head, strlen(T[i].head))
+			|| output_seek(&out, strlen(T[i].head) + T[i].gap)
+			|| output_write(&out, T[i].tail, strlen(T[i].tail))
+			|| output_close(&out, &changed)
+		) {
+			printf("failed write if changed %ld: output error\n", i);
+			return 1;
+		}
+		if (changed != T[i].changed) {
+			printf("failed write if changed %ld: expect changed = %d, got %d\n", i, T[i].changed, changed);
+			return 1;
+		}
+		char want[256], got[256];
+		size_t len = strlen(T[i].head) + T[i].gap + strlen(T[i].tail);
+		memset(want, 0, sizeof want);
+		memcpy(want, T[i].head, strlen(T[i].head));
+		memcpy(want + strlen(T[i].head) + T[i].gap, T[i].tail, strlen(T[i].tail));
+		FILE *f = fopen(path, "r");
+		if (!f || fread(got, 1, sizeof got, f) != len || memcmp(want, got, len)) {
+			printf("failed write if changed %ld: wrong contents\n", i);
+			return 1;
+		}
+		fclose(f);
+	}
+
+	// a replaced file keeps its mode
+	if (chmod(path, 0640)) {
+		printf("failed write if changed: could not chmod\n");
+		return 1;
+	}
+	output out;
+	int changed;
+	struct stat sb;
+	if (
+		output_open(&out, path, 1)
+		|| output_write(&out, "abce", 4)
+		|| output_close(&out, &changed)
+		|| stat(path, &sb)
+	) {
+		printf("failed write if changed with a mode: output error\n");
+		return 1;
+	}
+	if (!changed || (sb.st_mode & 07777) != 0640) {
+		printf("failed write if changed with a mode: expect a change keeping mode 640, got changed = %d, mode %o\n", changed, sb.st_mode & 07777);
+		return 1;
+	}
+
+	// a gap several blocks long matches zeros written out in full, and
+	// doesn't match once one byte in the middle of them is set
+	static char image[10008];
+	memset(image, 0, sizeof image);
+	memcpy(image, "abcd", 4);
+	memcpy(image + sizeof image - 4, "efgh", 4);
+	for (int set = 0; set < 2; set++) {
+		image[6000] = set;
+		FILE *f = fopen(path, "w");
+		if (!f || fwrite(image, 1, sizeof image, f) != sizeof image || fclose(f)) {
+			printf("failed write if changed: could not write a file of zeros\n");
+			return 1;
+		}
+		if (
+			output_open(&out, path, 1)
+			|| output_write(&out, "abcd", 4)
+			|| output_seek(&out, sizeof image - 4)
+			|| output_write(&out, "efgh", 4)
+			|| output_close(&out, &changed)
+		) {
+			printf("failed write if changed over zeros: output error\n");
+			return 1;
+		}
+		if (changed != set) {
+			printf("failed write if changed over zeros: expect changed = %d, got %d\n", set, changed);
+			return 1;
+		}
+	}
+	unlink(path);
+	rmdir(dir);
+	return 0;
+}
+
+int test_cache() {
+	char dir[] = "/tmp/asm-test-XXXXXX";
+	if (!mkdtemp(dir)) {
+		printf("failed cache: could not make a directory\n");
+		return 1;
+	}
+	char cache_dir[64], path[64];
+	snprintf(cache_dir, sizeof cache_dir, "%s/cache", dir);
+	snprintf(path, sizeof path, "%s/out", dir);
+	const char *formats[] = { "bin", "elf" };
+	char *paths[] = { path, NULL };
+	char data[8192];
+	for (size_t i = 0; i < sizeof data; i++)
+		data[i] = i * 7;
+
+	cache c;
+	if (cache_init(&c, cache_dir, 1 << 20)) {
+		printf("failed cache: could not start a key\n");
+		return 1;
+	}
+	cache_key(&c, "a", 1);
+	if (cache_fetch(&c, formats, paths, 2, 0) != 1) {
+		printf("failed cache: expect a miss before anything is stored\n");
+		return 1;
+	}
+	FILE *f = fopen(path, "w");
+	if (!f || fwrite(data, 1, sizeof data, f) != sizeof data || fclose(f) || cache_store(&c, formats, paths, 2)) {
+		printf("failed cache: could not store\n");
+		return 1;
+	}
+	unlink(path);
+	if (cache_fetch(&c, formats, paths, 2, 0) != 0) {
+		printf("failed cache: expect a hit once stored\n");
+		return 1;
+	}
+	char got[sizeof data + 1];
+	f = fopen(path, "r");
+	if (!f || fread(got, 1, sizeof got, f) != sizeof data || memcmp(data, got, sizeof data)) {
+		printf("failed cache: the hit has the wrong contents\n");
+		return 1;
+	}
+	fclose(f);
+	// the elf entry was never stored, so asking for it too is a miss
+	paths[1] = path;
+	if (cache_fetch(&c, formats, paths, 2, 0) != 1) {
+		printf("failed cache: expect a miss for a format never stored\n");
+		return 1;
+	}
+	paths[1] = NULL;
+
+	// a different key misses, and storing it pushes out the first entry,
+	// since the cache only has room for one
+	// mtimes only tick every few milliseconds, so the entries would
+	// otherwise look as old as each other
+	usleep(50000);
+	cache small;
+	if (cache_init(&small, cache_dir, sizeof data + sizeof data / 2)) {
+		printf("failed cache: could not start a key\n");
+		return 1;
+	}
+	cache_key(&small, "b", 1);
+	if (cache_fetch(&small, formats, paths, 2, 0) != 1 || cache_store(&small, formats, paths, 2)) {
+		printf("failed cache: could not store a second entry\n");
+		return 1;
+	}
+	c.max_size = small.max_size;
+	if (cache_fetch(&small, formats, paths, 2, 0) != 0 || cache_fetch(&c, formats, paths, 2, 0) != 1) {
+		printf("failed cache: expect the older entry to be evicted\n");
+		return 1;
+	}
+
+	char stats_path[96];
+	snprintf(stats_path, sizeof stats_path, "%s/stats", cache_dir);
+	f = fopen(stats_path, "r");
+	unsigned long hits, misses;
+	if (!f || fscanf(f, "hits %lu\nmisses %lu\n", &hits, &misses) != 2 || hits != 2 || misses != 4) {
+		printf("failed cache: expect 2 hits and 4 misses counted\n");
+		return 1;
+	}
+	fclose(f);
+	char rm[96];
+	snprintf(rm, sizeof rm, "rm -rf %s", dir);
+	return system(rm) != 0;
+}
+
+int test_remote() {
+	char dir[] = "/tmp/asm-test-XXXXXX";
+	if (!mkdtemp(dir)) {
+		printf("failed remote: could not make a directory\n");
+		return 1;
+	}
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t addr_len = sizeof addr;
+	if (
+		sock == -1
+		|| bind(sock, (struct sockaddr *) &addr, sizeof addr)
+		|| listen(sock, SOMAXCONN)
+		|| getsockname(sock, (struct sockaddr *) &addr, &addr_len)
+	) {
+		printf("failed remote: could not listen\n");
+		return 1;
+	}
+	pid_t server = fork();
+	if (server == 0)
+		_exit(remote_serve(sock, dir) ? 1 : 0);
+	close(sock);
+
+	char url[64], bin[64], elf[64];
+	snprintf(url, sizeof url, "http://127.0.0.1:%d/some/prefix/", ntohs(addr.sin_port));
+	snprintf(bin, sizeof bin, "%s/out.bin", dir);
+	snprintf(elf, sizeof elf, "%s/out.elf", dir);
+	const char *formats[] = { "bin", "elf" };
+	char *paths[] = { bin, elf };
+	const char *contents[] = { "the binary", "the elf, which is longer" };
+	uint64_t key[2] = { 1, 2 };
+	remote r;
+	int fail = 1;
+	if (remote_init(&r, url) || strcmp(r.host, "127.0.0.1") || strcmp(r.prefix, "/some/prefix")) {
+		printf("failed remote: %s parsed wrong\n", url);
+		goto out;
+	}
+	if (remote_fetch(&r, key, formats, paths, 2, 0) != 1) {
+		printf("failed remote: expect a miss before anything is stored\n");
+		goto out;
+	}
+	for (int i = 0; i < 2; i++) {
+		FILE *f = fopen(paths[i], "w");
+		if (!f || fputs(contents[i], f) == EOF || fclose(f)) {
+			printf("failed remote: could not write %s\n", paths[i]);
+			goto out;
+		}
+	}
+	if (remote_store(&r, key, formats, paths, 2)) {
+		printf("failed remote: could not store\n");
+		goto out;
+	}
+	for (int i = 0; i < 2; i++)
+		unlink(paths[i]);
+	// the upload happens in the background, so it may take a few tries
+	int got = 1;
+	for (int tries = 0; tries < 200 && got == 1; tries++) {
+		got = remote_fetch(&r, key, formats, paths, 2, 0);
+		if (got == 1)
+			usleep(10000);
+	}
+	if (got != 0) {
+		printf("failed remote: expect a hit once stored, got %d\n", got);
+		goto out;
+	}
+	for (int i = 0; i < 2; i++) {
+		char buf[64] = {0};
+		FILE *f = fopen(paths[i], "r");
+		if (!f || !fgets(buf, sizeof buf, f) || strcmp(buf, contents[i])) {
+			printf("failed remote: %s has the wrong contents\n", paths[i]);
+			goto out;
+		}
+		fclose(f);
+	}
+	// an output that can't be opened leaves the others as they were
+	char missing[64], buf[64] = {0};
+	snprintf(missing, sizeof missing, "%s/missing/out.elf", dir);
+	FILE *f = fopen(bin, "w");
+	if (!f || fputs("stale", f) == EOF || fclose(f)) {
+		printf("failed remote: could not write %s\n", bin);
+		goto out;
+	}
+	paths[1] = missing;
+	got = remote_fetch(&r, key, formats, paths, 2, 0);
+	paths[1] = elf;
+	f = fopen(bin, "r");
+	if (got != -1 || !f || !fgets(buf, sizeof buf, f) || strcmp(buf, "stale")) {
+		printf("failed remote: expect a failed open to leave %s alone, got %d\n", bin, got);
+		if (f)
+			fclose(f);
+		goto out;
+	}
+	fclose(f);
+	// the same key with a format that was never stored misses
+	paths[0] = NULL;
+	key[1] = 2;
+	const char *other[] = { "bin", "srec" };
+	if (remote_fetch(&r, key, other, paths, 2, 0) != 1) {
+		printf("failed remote: expect a miss for a format never stored\n");
+		goto out;
+	}
+	paths[0] = bin;
+	// another key misses
+	key[1] = 3;
+	if (remote_fetch(&r, key, formats, paths, 2, 0) != 1) {
+		printf("failed remote: expect a miss for another key\n");
+		goto out;
+	}
+
+	// a reply longer than the listing says is a miss, and isn't read
+	// the listing for key 2 is written over with each size one short
+	key[1] = 2;
+	uint8_t digest[32];
+	char name[65], listing[256], ac[128];
+	size_t listing_len = 0;
+	sha256(key, sizeof key, digest);
+	for (int i = 0; i < 32; i++)
+		sprintf(name + 2 * i, "%02x", digest[i]);
+	for (int i = 0; i < 2; i++) {
+		char blob[65];
+		sha256(contents[i], strlen(contents[i]), digest);
+		for (int j = 0; j < 32; j++)
+			sprintf(blob + 2 * j, "%02x", digest[j]);
+		listing_len += sprintf(listing + listing_len, "%s %s %zu\n", formats[i], blob, strlen(contents[i]) - 1);
+	}
+	snprintf(ac, sizeof ac, "%s/ac/%s", dir, name);
+	f = fopen(ac, "w");
+	if (!f || fputs(listing, f) == EOF || fclose(f)) {
+		printf("failed remote: could not write over the listing\n");
+		goto out;
+	}
+	if ((got = remote_fetch(&r, key, formats, paths, 2, 0)) != 1) {
+		printf("failed remote: expect a miss for a blob longer than listed, got %d\n", got);
+		goto out;
+	}
+
+	// a sparse image goes up from a copy that keeps its holes, and comes
+	// back the same
+	key[1] = 4;
+	int fd = open(bin, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || pwrite(fd, "x", 1, 0) != 1 || pwrite(fd, "y", 1, 1 << 20) != 1 || close(fd)) {
+		printf("failed remote: could not write a sparse image\n");
+		goto out;
+	}
+	paths[1] = NULL;
+	if (remote_store(&r, key, formats, paths, 2)) {
+		printf("failed remote: could not store a sparse image\n");
+		goto out;
+	}
+	unlink(bin);
+	got = 1;
+	for (int tries = 0; tries < 200 && got == 1; tries++) {
+		got = remote_fetch(&r, key, formats, paths, 2, 0);
+		if (got == 1)
+			usleep(10000);
+	}
+	paths[1] = elf;
+	struct stat sb;
+	char x, y;
+	fd = open(bin, O_RDONLY);
+	if (
+		got != 0
+		|| fd == -1
+		|| fstat(fd, &sb)
+		|| sb.st_size != (1 << 20) + 1
+		|| pread(fd, &x, 1, 0) != 1
+		|| pread(fd, &y, 1, 1 << 20) != 1
+		|| x != 'x'
+		|| y != 'y'
+	) {
+		printf("failed remote: expect the sparse image back, got %d\n", got);
+		goto out;
+	}
+	close(fd);
+	fail = 0;
+out:
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	char rm[96];
+	snprintf(rm, sizeof rm, "rm -rf %s", dir);
+	return system(rm) != 0 || fail;
+}
+
+static const char libasm_src[] =
+	"_start:\n"
+	"addi a0, zero, 1\n"
+	"auipc a1, 0\n"
+	"jal ra, _start\n"
+	".data\n"
+	"msg:\n"
+	".word 1\n"
+	".word msg\n";
+
+void *test_libasm_thread(void *arg) {
+	asm_buffer *want = arg;
+	asm_options opts;
+	asm_options_default(&opts);
+	asm_ctx *ctx = asm_ctx_new(&opts);
+	if (!ctx)
+		return "couldn't make a context";
+	char *fail = NULL;
+	for (int i = 0; i < 50 && !fail; i++) {
+		asm_buffer got;
+		if (asm_assemble(ctx, libasm_src, sizeof libasm_src - 1, &got))
+			fail = "failed to assemble";
+		else if (got.len != want->len || memcmp(got.data, want->data, got.len))
+			fail = "assembled something different";
+		else
+			free(got.data);
+	}
+	asm_ctx_free(ctx);
+	return fail;
+}
+
+int test_libasm() {
+	asm_options opts;
+	asm_options_default(&opts);
+	opts.name = "src.s";
+	asm_ctx *ctx = asm_ctx_new(&opts);
+	if (!ctx) {
+		printf("failed libasm: couldn't make a context\n");
+		return 1;
+	}
+	asm_buffer want, got;
+	// the missing newline at the end is added
+	const char *err = asm_assemble(ctx, libasm_src, sizeof libasm_src - 2, &want);
+	if (err || want.len < sizeof(Elf64_Ehdr) || memcmp(want.data, ELFMAG, SELFMAG)) {
+		printf("failed libasm: expect an ELF, got %s\n", err ? err : "something else");
+		return 1;
+	}
+	err = asm_assemble(ctx, "ecall\nnot an instruction\n", 25, &got);
+	if (!err || strncmp(err, "src.s:2: ", 9)) {
+		printf("failed libasm: expect an error on line 2, got %s\n", err ? err : "none");
+		return 1;
+	}
+	err = asm_assemble(ctx, "jal ra, nowhere\n", 16, &got);
+	if (!err || !strstr(err, "undefined label nowhere")) {
+		printf("failed libasm: expect an undefined label, got %s\n", err ? err : "none");
+		return 1;
+	}
+	// a context is as good as new after an error
+	err = asm_assemble(ctx, libasm_src, sizeof libasm_src - 1, &got);
+	if (err || got.len != want.len || memcmp(got.data, want.data, got.len)) {
+		printf("failed libasm: expect the same ELF after an error\n");
+		return 1;
+	}
+	free(got.data);
+	asm_ctx_free(ctx);
+
+	// a failure deep in the emitter comes back to whoever set recover,
+	// rather than exiting
+	emitter *em = emitter_new(NULL);
+	jmp_buf recover;
+	if (!em) {
+		printf("failed libasm: couldn't make an emitter\n");
+		return 1;
+	}
+	em->recover = &recover;
+	if (!setjmp(recover)) {
+		close(em->section[SECT_TEXT].swap);
+		em->section[SECT_TEXT].swap = -1;
+		static uint8_t big[8192];
+		emitter_buffer(em, big, sizeof big);
+		printf("failed libasm: expect a write to a closed file buffer to fail\n");
+		return 1;
+	}
+	if (strcmp(em->panicked, "write call failed")) {
+		printf("failed libasm: expect the write to fail, got %s\n", em->panicked);
+		return 1;
+	}
+	emitter_free(em);
+
+	opts.swap_dir = "/nonexistent";
+	if (asm_ctx_new(&opts)) {
+		printf("failed libasm: expect no context with a missing swap dir\n");
+		return 1;
+	}
+
+	// contexts share nothing, so threads can each use their own
+	pthread_t threads[4];
+	for (int i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, test_libasm_thread, &want);
+	int fails = 0;
+	for (int i = 0; i < 4; i++) {
+		char *fail;
+		pthread_join(threads[i], (void **) &fail);
+		if (fail) {
+			printf("failed libasm thread %d: %s\n", i, fail);
+			fails = 1;
+		}
+	}
+	free(want.data);
+	return fails;
+}
+
+// the value of the two hex digits at s, or -1
+int test_hex_byte(const char *s) {
+	int hi = s[0] >= 'A' ? s[0] - 'A' + 10 : s[0] - '0';
+	int lo = s[1] >= 'A' ? s[1] - 'A' + 10 : s[1] - '0';
+	if (hi < 0 || hi > 15 || lo < 0 || lo > 15)
+		return -1;
+	return hi << 4 | lo;
+}
+
+// the bytes of every record in a text format, each line's after its prefix
+// of skip characters, which have to sum to sum
+// returns the number of records, or -1 if one is malformed
+int test_records(const asm_buffer *b, size_t skip, uint8_t sum, uint8_t rec[][64], const char **types, int max) {
+	int n = 0;
+	const char *line = (const char *) b->data, *end = line + b->len;
+	while (line < end) {
+		const char *nl = memchr(line, '\n', end - line);
+		size_t len = nl ? (size_t) (nl - line) : (size_t) (end - line);
+		if (n == max || len < skip || (len - skip) % 2 || (len - skip) / 2 > 64)
+			return -1;
+		uint8_t total = 0;
+		for (size_t i = 0; i < (len - skip) / 2; i++) {
+			int byte = test_hex_byte(line + skip + 2 * i);
+			if (byte < 0)
+				return -1;
+			rec[n][i] = byte;
+			total += byte;
+		}
+		if (total != sum)
+			return -1;
+		types[n++] = line;
+		line += len + 1;
+	}
+	return n;
+}
+
+// the same program as a flat binary with its gap filled, Intel HEX and
+// SREC, checked record by record, with .data on the next 64K so Intel HEX
+// needs a second extended linear address
+int test_formats() {
+	static const char src[] =
+		"_start:\n"
+		"addi a0, zero, 1\n"
+		"jal ra, _start\n"
+		".data\n"
+		".word 0x11223344\n";
+	const uint64_t data_vaddr = 0x410000;
+	asm_options opts;
+	asm_options_default(&opts);
+	opts.data_vaddr = data_vaddr;
+	opts.gap_fill = 0xaa;
+	asm_buffer bin, ihex, srec;
+	uint64_t start;
+	const char *err = NULL;
+	enum asm_format formats[] = { ASM_BIN, ASM_IHEX, ASM_SREC };
+	asm_buffer *outs[] = { &bin, &ihex, &srec };
+	for (int i = 0; i < 3 && !err; i++) {
+		opts.format = formats[i];
+		asm_ctx *ctx = asm_ctx_new(&opts);
+		if (!ctx) {
+			printf("failed formats: couldn't make a context\n");
+			return 1;
+		}
+		err = asm_assemble(ctx, src, sizeof src - 1, outs[i]);
+		if (!err && asm_symbol(ctx, "_start", &start))
+			err = "no _start";
+		asm_ctx_free(ctx);
+	}
+	if (err) {
+		printf("failed formats: %s\n", err);
+		return 1;
+	}
+	const uint8_t data[] = { 0x44, 0x33, 0x22, 0x11 };
+
+	// .text, then the fill up to .data, then .data
+	if (start >= data_vaddr || bin.len != data_vaddr - start + 4 || memcmp(bin.data + bin.len - 4, data, 4)) {
+		printf("failed formats: expect the binary to run from _start to the end of .data\n");
+		return 1;
+	}
+	for (size_t i = 8; i < bin.len - 4; i++) {
+		if (bin.data[i] != 0xaa) {
+			printf("failed formats: expect the gap filled with 0xaa, got %02x at %lu\n", bin.data[i], i);
+			return 1;
+		}
+	}
+
+	// :LLAAAATT, then data, then a checksum that makes the bytes sum to 0
+	// .text is an extended linear address and a data record, .data the
+	// same, then the start address and the end of file
+	uint8_t rec[8][64];
+	const char *types[8];
+	int n = test_records(&ihex, 1, 0, rec, types, 8);
+	struct {
+		uint8_t head[4];
+		const uint8_t *body;
+		size_t len;
+	} want[] = {
+		{ { 2, 0, 0, 4 }, (uint8_t []) { 0, start >> 16 }, 2 },
+		{ { 8, start >> 8, start, 0 }, bin.data, 8 },
+		{ { 2, 0, 0, 4 }, (uint8_t []) { 0, data_vaddr >> 16 }, 2 },
+		{ { 4, data_vaddr >> 8, data_vaddr, 0 }, data, 4 },
+		{ { 4, 0, 0, 5 }, (uint8_t []) { start >> 24, start >> 16, start >> 8, start }, 4 },
+		{ { 0, 0, 0, 1 }, NULL, 0 },
+	};
+	if (n != sizeof want / sizeof *want) {
+		printf("failed formats: expect %lu Intel HEX records with good checksums, got %d\n", sizeof want / sizeof *want, n);
+		return 1;
+	}
+	for (int i = 0; i < n; i++) {
+		if (types[i][0] != ':' || memcmp(rec[i], want[i].head, 4) || (want[i].len && memcmp(rec[i] + 4, want[i].body, want[i].len))) {
+			printf("failed formats: Intel HEX record %d is wrong\n", i);
+			return 1;
+		}
+	}
+
+	// SLL, then a 4 byte address, then data, then a checksum that makes the
+	// bytes sum to 0xff
+	// a header, .text and .data as S3 records, the count of them, then the
+	// start address in an S7
+	n = test_records(&srec, 2, 0xff, rec, types, 8);
+	const char *want_types[] = { "S0", "S3", "S3", "S5", "S7" };
+	if (n != sizeof want_types / sizeof *want_types) {
+		printf("failed formats: expect %lu SREC records with good checksums, got %d\n", sizeof want_types / sizeof *want_types, n);
+		return 1;
+	}
+	for (int i = 0; i < n; i++) {
+		if (strncmp(types[i], want_types[i], 2)) {
+			printf("failed formats: expect SREC record %d to be %s\n", i, want_types[i]);
+			return 1;
+		}
+	}
+	uint8_t s3_text[] = { 13, start >> 24, start >> 16, start >> 8, start };
+	uint8_t s3_data[] = { 9, data_vaddr >> 24, data_vaddr >> 16, data_vaddr >> 8, data_vaddr };
+	uint8_t s5[] = { 3, 0, 2 };
+	uint8_t s7[] = { 5, start >> 24, start >> 16, start >> 8, start };
+	if (
+		memcmp(rec[1], s3_text, 5) || memcmp(rec[1] + 5, bin.data, 8)
+		|| memcmp(rec[2], s3_data, 5) || memcmp(rec[2] + 5, data, 4)
+		|| memcmp(rec[3], s5, 3)
+		|| memcmp(rec[4], s7, 5)
+	) {
+		printf("failed formats: wrong SREC records\n");
+		return 1;
+	}
+	free(bin.data);
+	free(ihex.data);
+	free(srec.data);
+	return 0;
+}
+
+// every instruction, as source, and built by calls to the same effect
+static const char builder_src[] =
+	"_start:\n"
+	"add a0, a1, a2\n"
+	"sub t0, t1, t2\n"
+	"srai a0, a1, 13\n"
+	"sltiu a0, a1, -5\n"
+	"lw a0, -2048(sp)\n"
+	"sb a0, -3(sp)\n"
+	"back:\n"
+	"beq a0, a1, back\n"
+	"bne a0, a1, fwd\n"
+	"jalr ra, a0, -4\n"
+	"ecall\n"
+	"ebreak\n"
+	"fwd:\n"
+	"jal ra, back\n"
+	"jal zero, end\n"
+	"lui a0, 1048575\n"
+	"auipc a1, 12345\n"
+	".data\n"
+	".byte 1, 2, 3\n"
+	".text\n"
+	"end:\n"
+	"ecall\n";
+
+void test_builder_program(asm_ctx *ctx) {
+	asm_begin(ctx);
+	asm_label start = asm_label_new(ctx, "_start");
+	asm_label back = asm_label_new(ctx, "back");
+	asm_label fwd = asm_label_new(ctx, "fwd");
+	asm_label end = asm_label_new(ctx, "end");
+	asm_bind(ctx, start);
+	asm_emit_r(ctx, ADD, 10, 11, 12);
+	asm_emit_r(ctx, SUB, 5, 6, 7);
+	asm_emit_i(ctx, SRAI, 10, 11, 13);
+	asm_emit_i(ctx, SLTIU, 10, 11, -5);
+	asm_emit_i(ctx, LW, 10, 2, -2048);
+	asm_emit_s(ctx, SB, 10, 2, -3);
+	asm_bind(ctx, back);
+	asm_emit_branch(ctx, BEQ, 10, 11, back);
+	asm_emit_branch(ctx, BNE, 10, 11, fwd);
+	asm_emit_i(ctx, JALR, 1, 10, -4);
+	asm_emit_i(ctx, ECALL, 0, 0, 0);
+	asm_emit_i(ctx, EBREAK, 0, 0, 0);
+	asm_bind(ctx, fwd);
+	asm_emit_jal(ctx, 1, back);
+	asm_emit_jal(ctx, 0, end);
+	asm_emit_u(ctx, LUI, 10, 1048575);
+	asm_emit_u(ctx, AUIPC, 11, 12345);
+	asm_section(ctx, ASM_DATA);
+	asm_emit_data(ctx, "\1\2\3", 3);
+	asm_section(ctx, ASM_TEXT);
+	asm_bind(ctx, end);
+	asm_emit_i(ctx, ECALL, 0, 0, 0);
+}
+
+int test_builder() {
+	asm_options opts;
+	asm_options_default(&opts);
+	asm_ctx *ctx = asm_ctx_new(&opts);
+	if (!ctx) {
+		printf("failed builder: couldn't make a context\n");
+		return 1;
+	}
+	asm_buffer want, got;
+	const char *err = asm_assemble(ctx, builder_src, sizeof builder_src - 1, &want);
+	if (err) {
+		printf("failed builder: couldn't assemble the source: %s\n", err);
+		return 1;
+	}
+	test_builder_program(ctx);
+	err = asm_end(ctx, &got);
+	if (err || got.len != want.len || memcmp(got.data, want.data, got.len)) {
+		printf("failed builder: expect the same ELF as the source, got %s\n", err ? err : "a different one");
+		return 1;
+	}
+	free(got.data);
+
+	// the first error is the one that's kept, and says which call it was
+	asm_begin(ctx);
+	asm_emit_r(ctx, ADD, 1, 2, 3);
+	asm_emit_i(ctx, ADDI, 1, 2, 2048);
+	asm_emit_r(ctx, ADDI, 1, 2, 3);
+	err = asm_end(ctx, &got);
+	if (!err || strcmp(err, "<input>: call 2: immediate out of range")) {
+		printf("failed builder: expect the out of range immediate, got %s\n", err ? err : "none");
+		return 1;
+	}
+	asm_begin(ctx);
+	asm_emit_jal(ctx, 0, asm_label_new(ctx, NULL));
+	err = asm_end(ctx, &got);
+	if (!err || !strstr(err, "undefined label .L0")) {
+		printf("failed builder: expect .L0 to be undefined, got %s\n", err ? err : "none");
+		return 1;
+	}
+	asm_begin(ctx);
+	asm_label twice = asm_label_new(ctx, NULL);
+	asm_bind(ctx, twice);
+	asm_bind(ctx, twice);
+	asm_emit_branch(ctx, BEQ, 0, 0, 7);
+	err = asm_end(ctx, &got);
+	if (!err || strcmp(err, "<input>: call 3: label redefined")) {
+		printf("failed builder: expect the label to be redefined, got %s\n", err ? err : "none");
+		return 1;
+	}
+
+	// and after all that, the same program still builds the same
+	test_builder_program(ctx);
+	err = asm_end(ctx, &got);
+	if (err || got.len != want.len || memcmp(got.data, want.data, got.len)) {
+		printf("failed builder: expect the same ELF again, got %s\n", err ? err : "a different one");
+		return 1;
+	}
+	free(got.data);
+	free(want.data);
+	asm_ctx_free(ctx);
+	return 0;
+}
+
+static const char stencil_src[] =
+	"loop:\n"
+	"addi {rd}, {rs}, {imm}\n"
+	"slli {rd}, {rd}, {sh}\n"
+	"srai {rd}, {rd}, {sh}\n"
+	"lw {rd}, {off}({rs})\n"
+	"sw {rd}, {off}({rs})\n"
+	"lui {rd}, {up}\n"
+	"bne {rd}, x0, {out}\n"
+	"beq {rd}, {rs}, loop\n"
+	"jal x1, {out}\n"
+	"add {rd}, {rs}, {rd}";
+
+// two instances of stencil_src, one after the other, with the first
+// branching past the second and the second back to the first
+static const char stencil_want_src[] =
+	"first:\n"
+	"addi x10, x11, -5\n"
+	"slli x10, x10, 3\n"
+	"srai x10, x10, 3\n"
+	"lw x10, -2048(x11)\n"
+	"sw x10, -2048(x11)\n"
+	"lui x10, 1048575\n"
+	"bne x10, x0, end\n"
+	"beq x10, x11, first\n"
+	"jal x1, end\n"
+	"add x10, x11, x10\n"
+	"second:\n"
+	"addi x5, x6, 2047\n"
+	"slli x5, x5, 31\n"
+	"srai x5, x5, 31\n"
+	"lw x5, 2047(x6)\n"
+	"sw x5, 2047(x6)\n"
+	"lui x5, 0\n"
+	"bne x5, x0, first\n"
+	"beq x5, x6, second\n"
+	"jal x1, first\n"
+	"add x5, x6, x5\n"
+	"end:\n";
+
+int test_stencil() {
+	asm_options opts;
+	asm_options_default(&opts);
+	opts.format = ASM_BIN;
+	asm_ctx *ctx = asm_ctx_new(&opts);
+	if (!ctx) {
+		printf("failed stencil: couldn't make a context\n");
+		return 1;
+	}
+	asm_buffer want;
+	const char *err = asm_assemble(ctx, stencil_want_src, sizeof stencil_want_src - 1, &want);
+	if (err) {
+		printf("failed stencil: couldn't assemble the source: %s\n", err);
+		return 1;
+	}
+	asm_stencil *st;
+	err = asm_stencil_compile(ctx, stencil_src, sizeof stencil_src - 1, &st);
+	if (err) {
+		printf("failed stencil: couldn't compile: %s\n", err);
+		return 1;
+	}
+	size_t size = asm_stencil_size(st);
+	if (size != 40 || asm_stencil_arg(st, "rs") != 1 || asm_stencil_arg(st, "loop") != -1) {
+		printf("failed stencil: expect 40 bytes and rs to be the second argument\n");
+		return 1;
+	}
+	int64_t args[7];
+	const char *names[] = { "rd", "rs", "imm", "sh", "off", "up", "out" };
+	const int64_t first[] = { 10, 11, -5, 3, -2048, 1048575, 2 * size };
+	const int64_t second[] = { 5, 6, 2047, 31, 2047, 0, -size };
+	uint8_t got[80];
+	for (int i = 0; i < 7; i++)
+		args[asm_stencil_arg(st, names[i])] = first[i];
+	err = asm_stencil_instantiate(st, got, args);
+	for (int i = 0; i < 7; i++)
+		args[asm_stencil_arg(st, names[i])] = second[i];
+	if (!err)
+		err = asm_stencil_instantiate(st, got + size, args);
+	if (err || want.len != sizeof got || memcmp(got, want.data, sizeof got)) {
+		printf("failed stencil: expect the same code as the source, got %s\n", err ? err : "different code");
+		return 1;
+	}
+	free(want.data);
+
+	// arguments are checked like the parser checks operands
+	args[asm_stencil_arg(st, "rd")] = 32;
+	err = asm_stencil_instantiate(st, got, args);
+	if (!err || strcmp(err, "register out of range")) {
+		printf("failed stencil: expect the register to be out of range, got %s\n", err ? err : "none");
+		return 1;
+	}
+	args[asm_stencil_arg(st, "rd")] = 1;
+	args[asm_stencil_arg(st, "out")] = 4097 * 2;
+	err = asm_stencil_instantiate(st, got, args);
+	if (!err || strcmp(err, "branch target out of range")) {
+		printf("failed stencil: expect the branch to be out of range, got %s\n", err ? err : "none");
+		return 1;
+	}
+	asm_stencil_free(st);
+
+	static const char bad[] = "addi x1, x1, 1\n.word {x}\n";
+	err = asm_stencil_compile(ctx, bad, sizeof bad - 1, &st);
+	if (!err || strcmp(err, "<input>:2: holes can only be operands of instructions")) {
+		printf("failed stencil: expect the hole in .word to be refused, got %s\n", err ? err : "none");
+		return 1;
+	}
+	static const char no_data[] = "addi x1, x1, {x}\n.data\n.word 1\n";
+	err = asm_stencil_compile(ctx, no_data, sizeof no_data - 1, &st);
+	if (!err || strcmp(err, "<input>: stencils can only have .text")) {
+		printf("failed stencil: expect .data to be refused, got %s\n", err ? err : "none");
+		return 1;
+	}
+	asm_ctx_free(ctx);
+	return 0;
+}
+
+static const char jit_src[] =
+	"_start:\n"
+	"addi x10, x0, 1\n"
+	"beq x10, x0, _start\n"
+	"jal x0, done\n"
+	"done:\n"
+	"ecall\n"
+	".data\n"
+	"ptr:\n"
+	".word done\n";
+
+int test_jit() {
+	asm_options opts;
+	asm_options_default(&opts);
+	asm_ctx *ctx = asm_ctx_new(&opts);
+	if (!ctx) {
+		printf("failed jit: couldn't make a context\n");
+		return 1;
+	}
+	// a flat binary with .data right after .text, which starts after the
+	// ELF headers and the build id note, 0x10c bytes in, is the same bytes
+	opts.format = ASM_BIN;
+	opts.text_vaddr = 0x80000000;
+	opts.data_vaddr = 0x8000011c;
+	asm_ctx *flat = asm_ctx_new(&opts);
+	asm_buffer want;
+	const char *err = flat ? asm_assemble(flat, jit_src, sizeof jit_src - 1, &want) : "no context";
+	if (err) {
+		printf("failed jit: couldn't assemble the source: %s\n", err);
+		return 1;
+	}
+	uint64_t text_vaddr;
+	asm_symbol(flat, "_start", &text_vaddr);
+	asm_ctx_free(flat);
+	uint8_t got[32];
+	size_t used;
+	err = asm_jit(ctx, jit_src, sizeof jit_src - 1, got, sizeof got, text_vaddr, &used);
+	if (err || used != 20 || want.len != used || memcmp(got, want.data, used)) {
+		printf("failed jit: expect the same code as a flat binary, got %s\n", err ? err : "different code");
+		return 1;
+	}
+	free(want.data);
+	uint64_t addr;
+	if (asm_symbol(ctx, "ptr", &addr) || addr != text_vaddr + 16 || !asm_symbol(ctx, "nowhere", &addr)) {
+		printf("failed jit: expect ptr to be 16 bytes in\n");
+		return 1;
+	}
+	err = asm_jit(ctx, jit_src, sizeof jit_src - 1, got, 19, text_vaddr, &used);
+	if (!err || strcmp(err, "<input>: the program needs 20 bytes, but the buffer has 19")) {
+		printf("failed jit: expect the buffer to be too small, got %s\n", err ? err : "none");
+		return 1;
+	}
+
+	// the same through a dual mapping, with the labels where it runs
+	asm_jit_region r;
+	if (asm_jit_map(&r, 4096)) {
+		printf("failed jit: couldn't map a region: %s\n", strerror(errno));
+		return 1;
+	}
+	static const char no_word[] = "_start:\njal x0, _start\nend:\n";
+	err = asm_jit(ctx, no_word, sizeof no_word - 1, r.rw, r.size, (uint64_t) r.rx, &used);
+	asm_jit_flush(r.rx, used);
+	if (
+		err || used != 4 || memcmp(r.rx, "\x6f\0\0\0", 4)
+		|| asm_symbol(ctx, "end", &addr) || addr != (uint64_t) r.rx + 4
+	) {
+		printf("failed jit: expect a jump to itself in the region, got %s\n", err ? err : "something else");
+		return 1;
+	}
+	asm_jit_unmap(&r);
+	asm_ctx_free(ctx);
+	return 0;
+}
+
+// assembles src as laid out by lo, with line numbers, writing the ELF to
+// path, and its rebase table too if table isn't NULL
+int test_rebase_assemble(const char *src, const layout_options *lo, const char *path, const char *table) {
+	emitter *em = emitter_new(NULL);
+	char *copy = strdup(src);
+	long line = 1;
+	if (!em || !copy)
+		return 1;
+	em->debug = 1;
+	em->lines.line = 1;
+	em->lines.file = "rebase.s";
+	em->lines.dir = "/";
+	output o;
+	int changed;
+	int failed = (
+		assemble_chunk(copy, copy + strlen(copy), em, "rebase.s", &line, stdout)
+		|| layout_and_finish(em, lo, "rebase.s", stdout)
+		|| output_open(&o, path, 0)
+		|| emitter_output_elf(em, &o, &lo->elf)
+	);
+	off_t size = o.end;
+	failed = failed || output_close(&o, &changed);
+	if (!failed && table) {
+		failed = (
+			output_open(&o, table, 0)
+			|| emitter_output_rebase_table(em, &o, &lo->elf, size)
+			|| output_close(&o, &changed)
+		);
+	}
+	emitter_free(em);
+	free(copy);
+	return failed;
+}
+
+// whether the files at a and b are the same
+int test_rebase_same(const char *a, const char *b) {
+	static uint8_t buf[2][65536];
+	size_t len[2];
+	const char *paths[] = { a, b };
+	for (int i = 0; i < 2; i++) {
+		FILE *f = fopen(paths[i], "r");
+		if (!f)
+			return 0;
+		len[i] = fread(buf[i], 1, sizeof buf[i], f);
+		fclose(f);
+	}
+	return len[0] == len[1] && !memcmp(buf[0], buf[1], len[0]);
+}
+
+static const char rebase_src[] =
+	"_start:\n"
+	"addi x10, x0, 1\n"
+	"beq x10, x0, _start\n"
+	"ecall\n"
+	".data\n"
+	"ptr:\n"
+	".word _start\n"
+	".dword ptr\n";
+
+// with .data on the page after .text, a jump between them reaches
+static const char rebase_auto_src[] =
+	"_start:\n"
+	"jal x1, far\n"
+	"ecall\n"
+	".data\n"
+	"ptr:\n"
+	".dword _start\n"
+	"far:\n"
+	".word far\n";
+
+int test_rebase() {
+	char dir[] = "/tmp/asm-test-XXXXXX";
+	if (!mkdtemp(dir)) {
+		printf("failed rebase: could not make a directory\n");
+		return 1;
+	}
+	char image[64], table[64], moved[64], want[64];
+	snprintf(image, sizeof image, "%s/image", dir);
+	snprintf(table, sizeof table, "%s/table", dir);
+	snprintf(moved, sizeof moved, "%s/moved", dir);
+	snprintf(want, sizeof want, "%s/want", dir);
+	layout_options lo = {
+		.text_vaddr = 0x400000,
+		.data_vaddr = 0x10010000,
+		.elf = {
+			.build_id = 1,
+			.text_align = 0x1000,
+		},
+	};
+	if (test_rebase_assemble(rebase_src, &lo, image, table)) {
+		printf("failed rebase: could not assemble\n");
+		return 1;
+	}
+
+	// moved, the image is what assembling at the new vaddrs would give,
+	// build id and all
+	lo.text_vaddr = 0x800000;
+	lo.data_vaddr = 0x20020000;
+	rebase_options ro = {
+		.text_vaddr = lo.text_vaddr,
+		.data_vaddr = lo.data_vaddr,
+	};
+	char *err = rebase(image, table, moved, &ro);
+	if (err || test_rebase_assemble(rebase_src, &lo, want, NULL) || !test_rebase_same(moved, want)) {
+		printf("failed rebase: expect the same image as assembling at the new vaddrs, got %s\n", err ? err : "a different one");
+		return 1;
+	}
+	// .data's file offset goes with its vaddr, and a .word can't hold
+	// more than 32 bits, and either leaves the output alone
+	unlink(moved);
+	ro.data_vaddr = 0x20020010;
+	err = rebase(image, table, moved, &ro);
+	if (!err || strcmp(err, ".data can only move by whole pages, since its file offset goes with its vaddr") || !access(moved, F_OK)) {
+		printf("failed rebase: expect .data not to move by part of a page, got %s\n", err ? err : "none");
+		return 1;
+	}
+	ro.data_vaddr = 0x20020000;
+	ro.text_vaddr = 0x100000000;
+	err = rebase(image, table, moved, &ro);
+	if (!err || strcmp(err, "an address in a .word doesn't fit at the new vaddrs") || !access(moved, F_OK)) {
+		printf("failed rebase: expect _start not to fit in a .word, got %s\n", err ? err : "none");
+		return 1;
+	}
+
+	// in place, with .data after .text, and a jump between them
+	lo.text_vaddr = 0x400000;
+	lo.auto_layout = 1;
+	if (test_rebase_assemble(rebase_auto_src, &lo, image, table)) {
+		printf("failed rebase: could not assemble\n");
+		return 1;
+	}
+	lo.text_vaddr = 0x10000000;
+	ro = (rebase_options) {
+		.text_vaddr = lo.text_vaddr,
+		.auto_layout = 1,
+	};
+	err = rebase(image, table, image, &ro);
+	if (err || test_rebase_assemble(rebase_auto_src, &lo, want, NULL) || !test_rebase_same(image, want)) {
+		printf("failed rebase: expect the same image as assembling with an automatic layout, got %s\n", err ? err : "a different one");
+		return 1;
+	}
+	// the table follows the image when it's moved in place
+	lo.text_vaddr = 0x400000;
+	ro.text_vaddr = lo.text_vaddr;
+	err = rebase(image, table, image, &ro);
+	if (err || test_rebase_assemble(rebase_auto_src, &lo, want, NULL) || !test_rebase_same(image, want)) {
+		printf("failed rebase: expect the image to move back, got %s\n", err ? err : "a different one");
+		return 1;
+	}
+
+	unlink(image);
+	unlink(table);
+	unlink(want);
+	rmdir(dir);
+	return 0;
+}
+
+// assembles src into em, which may already have a prelude, and writes the ELF
+// to path
+int test_prelude_elf(emitter *em, const char *src, const char *path) {
+	layout_options lo = {
+		.text_vaddr = 0x400000,
+		.data_vaddr = 0x10010000,
+		.elf = {
+			.build_id = 1,
+			.text_align = 0x1000,
+		},
+	};
+	char *copy = strdup(src);
+	long line = 1;
+	output o;
+	int changed;
+	int failed = (
+		!copy
+		|| assemble_chunk(copy, copy + strlen(copy), em, "prelude.s", &line, stdout)
+		|| layout_and_finish(em, &lo, "prelude.s", stdout)
+		|| output_open(&o, path, 0)
+		|| emitter_output_elf(em, &o, &lo.elf)
+		|| output_close(&o, &changed)
+	);
+	free(copy);
+	return failed;
+}
+
+int test_prelude() {
+	char dir[] = "/tmp/asm-test-XXXXXX";
+	if (!mkdtemp(dir)) {
+		printf("failed prelude: could not make a directory\n");
+		return 1;
+	}
+	char pch[64], image[64], want[64];
+	snprintf(pch, sizeof pch, "%s/prelude.pch", dir);
+	snprintf(image, sizeof image, "%s/image", dir);
+	snprintf(want, sizeof want, "%s/want", dir);
+	// enough .text that some of it has been flushed to the file buffer,
+	// and references both ways between the prelude and the input
+	const char *head = ".data\nmsg:\n.byte 104, 105, 10\n.text\nhelper:\njal x0, later\n";
+	const char *body = "addi x10, x10, 1\n";
+	const char *tail = "jalr x0, x1, 0\n";
+	const char *main_src = "_start:\njal x1, helper\nlater:\necall\n.data\nptr:\n.word msg\n.dword later\n";
+	size_t n_body = 2000;
+	char *prelude_src = malloc(strlen(head) + n_body * strlen(body) + strlen(tail) + 1);
+	char *both = malloc(strlen(head) + n_body * strlen(body) + strlen(tail) + strlen(main_src) + 1);
+	if (!prelude_src || !both)
+		return 1;
+	strcpy(prelude_src, head);
+	for (size_t i = 0; i < n_body; i++)
+		strcat(prelude_src, body);
+	strcat(prelude_src, tail);
+	strcpy(both, prelude_src);
+	strcat(both, main_src);
+
+	emitter *em = emitter_new(NULL);
+	if (!em)
+		return 1;
+	char *copy = strdup(prelude_src);
+	long line = 1;
+	output o;
+	int changed;
+	if (
+		!copy
+		|| assemble_chunk(copy, copy + strlen(copy), em, "prelude.s", &line, stdout)
+		|| output_open(&o, pch, 0)
+		|| prelude_write(em, &o)
+		|| output_close(&o, &changed)
+	) {
+		printf("failed prelude: could not write it\n");
+		return 1;
+	}
+	free(copy);
+
+	// started from the prelude, the image is what assembling the
+	// prelude's source along with the input gives, build id and all
+	emitter_reset(em);
+	char *err = prelude_load(em, pch);
+	if (err || test_prelude_elf(em, main_src, image)) {
+		printf("failed prelude: could not assemble from it, got %s\n", err ? err : "an error");
+		return 1;
+	}
+	emitter_reset(em);
+	if (test_prelude_elf(em, both, want) || !test_rebase_same(image, want)) {
+		printf("failed prelude: expect the same image as assembling both\n");
+		return 1;
+	}
+
+	// once something is assembled, it's too late for a prelude, and an
+	// image isn't one
+	err = prelude_load(em, pch);
+	if (!err || strcmp(err, "a prelude has to come before anything else")) {
+		printf("failed prelude: expect it not to load after assembling, got %s\n", err ? err : "none");
+		return 1;
+	}
+	emitter_reset(em);
+	err = prelude_load(em, image);
+	if (!err || strcmp(err, "not a prelude")) {
+		printf("failed prelude: expect an ELF not to load, got %s\n", err ? err : "none");
+		return 1;
+	}
+	emitter_reset(em);
+	em->relocatable = 1;
+	err = prelude_load(em, pch);
+	if (!err || strcmp(err, "the prelude was made without -c")) {
+		printf("failed prelude: expect it not to start an object, got %s\n", err ? err : "none");
+		return 1;
+	}
+
+	// a waiter patching past the end of its section is caught before
+	// anything is patched
+	em->relocatable = 0;
+	emitter_reset(em);
+	prelude_header h;
+	int fd = open(pch, O_RDWR);
+	int64_t past = 1 << 20;
+	if (
+		fd == -1
+		|| pread(fd, &h, sizeof h, 0) != sizeof h
+		|| h.n_waiters == 0
+		|| pwrite(fd, &past, sizeof past, h.waiters + offsetof(prelude_waiter, fix_idx)) != sizeof past
+	) {
+		printf("failed prelude: could not corrupt it\n");
+		return 1;
+	}
+	close(fd);
+	err = prelude_load(em, pch);
+	if (!err || strcmp(err, "the prelude is corrupt")) {
+		printf("failed prelude: expect a waiter past its section to be caught, got %s\n", err ? err : "none");
+		return 1;
+	}
+
+	emitter_free(em);
+	free(prelude_src);
+	free(both);
+	unlink(pch);
+	unlink(image);
+	unlink(want);
+	rmdir(dir);
+	return 0;
+}
+
+// appends body to f as a message, with its header
+void test_lsp_message(FILE *f, const char *body) {
+	fprintf(f, "Content-Length: %zu\r\n\r\n%s", strlen(body), body);
+}
+
+int test_lsp() {
+	char *in_buf, *out_buf;
+	size_t in_len, out_len;
+	FILE *in = open_memstream(&in_buf, &in_len);
+	if (!in)
+		return 1;
+	test_lsp_message(in, "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"initialize\",\"params\":{}}");
+	test_lsp_message(in,
+		"{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":{\"textDocument\":{"
+		"\"uri\":\"file:///a.s\",\"text\":\"_start:\\njal x1, helper\\nbeq x10, x0, nowhere\\nhelper:\\naddi x10, x10\\n\"}}}"
+	);
+	// fixing the addi, and replacing nowhere with _start, in one change
+	// spanning both lines
+	test_lsp_message(in,
+		"{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\",\"params\":{\"textDocument\":{\"uri\":\"file:///a.s\"},"
+		"\"contentChanges\":[{\"range\":{\"start\":{\"line\":4,\"character\":13},\"end\":{\"line\":4,\"character\":13}},\"text\":\", 1\"},"
+		"{\"range\":{\"start\":{\"line\":2,\"character\":13},\"end\":{\"line\":2,\"character\":20}},\"text\":\"_start\"}]}}"
+	);
+	test_lsp_message(in,
+		"{\"jsonrpc\":\"2.0\",\"id\":2,\"method\":\"textDocument/definition\",\"params\":{"
+		"\"textDocument\":{\"uri\":\"file:///a.s\"},\"position\":{\"line\":1,\"character\":10}}}"
+	);
+	test_lsp_message(in,
+		"{\"jsonrpc\":\"2.0\",\"id\":3,\"method\":\"textDocument/references\",\"params\":{"
+		"\"textDocument\":{\"uri\":\"file:///a.s\"},\"position\":{\"line\":0,\"character\":2},"
+		"\"context\":{\"includeDeclaration\":false}}}"
+	);
+	// lines go on in the section the one before left, so the first .size
+	// is fine, and the second measures across sections until the .data
+	// becomes a .text, and the third is fixed by a label added before it
+	test_lsp_message(in,
+		"{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":{\"textDocument\":{"
+		"\"uri\":\"file:///b.s\",\"text\":\"_start:\\necall\\n.size _start, .-_start\\n.data\\ntable:\\n.word 1\\n.size table, .-_start\\n.size table, .-start2\\n\"}}}"
+	);
+	test_lsp_message(in,
+		"{\"jsonrpc\":\"2.0\",\"id\":5,\"method\":\"textDocument/definition\",\"params\":{"
+		"\"textDocument\":{\"uri\":\"file:///b.s\"},\"position\":{\"line\":2,\"character\":17}}}"
+	);
+	test_lsp_message(in,
+		"{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\",\"params\":{\"textDocument\":{\"uri\":\"file:///b.s\"},"
+		"\"contentChanges\":[{\"range\":{\"start\":{\"line\":3,\"character\":1},\"end\":{\"line\":3,\"character\":5}},\"text\":\"text\"}]}}"
+	);
+	test_lsp_message(in,
+		"{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\",\"params\":{\"textDocument\":{\"uri\":\"file:///b.s\"},"
+		"\"contentChanges\":[{\"range\":{\"start\":{\"line\":0,\"character\":0},\"end\":{\"line\":0,\"character\":0}},\"text\":\"start2:\\n\"}]}}"
+	);
+	test_lsp_message(in, "{\"jsonrpc\":\"2.0\",\"id\":4,\"method\":\"shutdown\"}");
+	test_lsp_message(in, "{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}");
+	fclose(in);
+
+	in = fmemopen(in_buf, in_len, "r");
+	FILE *out = open_memstream(&out_buf, &out_len);
+	if (!in || !out)
+		return 1;
+	int status = lsp_serve(in, out);
+	fclose(in);
+	fclose(out);
+	const char *want[] = {
+		"\"definitionProvider\":true",
+		// the errors as opened, and none once fixed
+		"{\"range\":{\"start\":{\"line\":4,\"character\":0},\"end\":{\"line\":4,\"character\":13}},\"severity\":1,\"source\":\"asm\","
+		"\"message\":\"could not parse register, register, immediate required for this operation\"}",
+		"{\"range\":{\"start\":{\"line\":2,\"character\":13},\"end\":{\"line\":2,\"character\":20}},\"severity\":1,\"source\":\"asm\","
+		"\"message\":\"undefined label nowhere\"}",
+		"\"diagnostics\":[]",
+		"{\"jsonrpc\":\"2.0\",\"id\":2,\"result\":{\"uri\":\"file:///a.s\",\"range\":{\"start\":{\"line\":3,\"character\":0},\"end\":{\"line\":3,\"character\":6}}}}",
+		"{\"jsonrpc\":\"2.0\",\"id\":3,\"result\":[{\"uri\":\"file:///a.s\",\"range\":{\"start\":{\"line\":2,\"character\":13},\"end\":{\"line\":2,\"character\":19}}}]}",
+		"\"uri\":\"file:///b.s\",\"diagnostics\":[{\"range\":{\"start\":{\"line\":6,\"character\":0},\"end\":{\"line\":6,\"character\":21}},"
+		"\"severity\":1,\"source\":\"asm\",\"message\":\"size must be measured from a label defined earlier in this section\"},{\"range\":{\"start\":{\"line\":7,",
+		"\"uri\":\"file:///b.s\",\"diagnostics\":[{\"range\":{\"start\":{\"line\":7,\"character\":0},\"end\":{\"line\":7,\"character\":21}},"
+		"\"severity\":1,\"source\":\"asm\",\"message\":\"size must be measured from a label defined earlier in this section\"}]",
+		"{\"jsonrpc\":\"2.0\",\"id\":5,\"result\":{\"uri\":\"file:///b.s\",\"range\":{\"start\":{\"line\":0,\"character\":0},\"end\":{\"line\":0,\"character\":6}}}}",
+		"\"uri\":\"file:///b.s\",\"diagnostics\":[]",
+		"{\"jsonrpc\":\"2.0\",\"id\":4,\"result\":null}",
+	};
+	for (size_t i = 0; i < sizeof want / sizeof *want; i++) {
+		if (!strstr(out_buf, want[i])) {
+			printf("failed lsp: expect %s in the replies, got %s\n", want[i], out_buf);
+			return 1;
+		}
+	}
+	if (status != 0) {
+		printf("failed lsp: expect status 0 after a shutdown, got %d\n", status);
+		return 1;
+	}
+	free(in_buf);
+	free(out_buf);
+	return 0;
+}
+
 int main() {
 	int fails = 0;
 	fails += test_parse_reg();
 	fails += test_parse_line();
+	fails += test_input_stream();
+	fails += test_input_stream_backslash();
+	fails += test_input_strategies();
+	fails += test_large_sections();
+	fails += test_symbols();
+	fails += test_debug_line();
+	fails += test_build_id();
+	fails += test_cross_section();
+	fails += test_relocatable();
+	fails += test_save_restore();
+	fails += test_catch_up();
+	fails += test_link();
+	fails += test_link_reach();
+	fails += test_jobserver();
+	fails += test_batch();
+	fails += test_watch();
+	fails += test_server();
+	fails += test_write_if_changed();
+	fails += test_cache();
+	fails += test_remote();
+	fails += test_libasm();
+	fails += test_formats();
+	fails += test_builder();
+	fails += test_stencil();
+	fails += test_jit();
+	fails += test_rebase();
+	fails += test_prelude();
+	fails += test_lsp();
 	return fails;
 }